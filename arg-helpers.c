@@ -1,11 +1,22 @@
 #include <stdio.h>
+#include <ctype.h>
+#include <limits.h>
 #include "samlib.h"
 
-/* Returns duration in seconds. Supports fractional values. */
-unsigned long get_duration(const char *str)
+/* Returns 0 and the duration in seconds, or EINVAL or ERANGE.
+ * Supports fractional values.
+ */
+int _get_duration(const char *str, unsigned long *duration)
 {
 	char *e;
-	double t = strtod(str, &e);
+	double t;
+
+	errno = 0;
+	t = strtod(str, &e);
+	if (e == str || !(t >= 0)) /* and nan */
+		return EINVAL;
+	if (errno)
+		return errno;
 
 	switch (*e) {
 	case 'd':
@@ -22,19 +33,62 @@ unsigned long get_duration(const char *str)
 		/* fall thru */
 	case 's':
 	case 'S':
+		++e;
+		/* fall thru */
 	case 0:
-		return (unsigned long)t;
+		break;
 	default:
-		fprintf(stderr, "Invalid size %s\n", e);
+		return EINVAL;
+	}
+
+	if (*e)
+		return EINVAL;
+	if (t >= (double)ULONG_MAX)
+		return ERANGE;
+	*duration = (unsigned long)t;
+	return 0;
+}
+
+/* Returns duration in seconds. Supports fractional values. */
+unsigned long get_duration(const char *str)
+{
+	unsigned long duration;
+
+	if (_get_duration(str, &duration)) {
+		fprintf(stderr, "Invalid duration %s\n", str);
 		exit(1);
 	}
+	return duration;
 }
 
-char *nice_duration(unsigned long duration, char *str, int len)
+/* Returns the length of str. str must be at least 32 bytes. */
+int _nice_duration(unsigned long duration, char *str)
 {
 	static const char fmt[3] = { 'd', 'h', 'm' };
 	static const unsigned long check[3] = { ONE_DAY, ONE_HOUR, ONE_MINUTE };
-	int d, i, n = 0;
+	unsigned long d;
+	char *p = str;
+	int i;
+
+	for (i = 0; i < 3; ++i)
+		if (duration >= check[i]) {
+			d = duration / check[i];
+			duration -= d * check[i];
+			p = _uint2str(d, p);
+			*p++ = fmt[i];
+		}
+	if (duration || p == str) {
+		p = _uint2str(duration, p);
+		*p++ = 's';
+	}
+	*p = 0;
+
+	return p - str;
+}
+
+char *nice_duration(unsigned long duration, char *str, int len)
+{
+	char tmp[32];
 
 	if (str == NULL) {
 		if (len == 0)
@@ -44,49 +98,77 @@ char *nice_duration(unsigned long duration, char *str, int len)
 			return NULL;
 	}
 
-	for (i = 0; i < 3; ++i)
-		if (duration >= check[i]) {
-			d = duration / check[i];
-			duration -= d * check[i];
-			n += strfmt(str + n, len - n, "%d%c", d, fmt[i]);
-		}
-	if (duration || n == 0)
-		n += strfmt(str + n, len - n, "%lus", duration);
-
+	_nice_duration(duration, tmp);
+	safecpy(str, tmp, len);
 	return str;
 }
 
-/* Returns memory length in bytes. */
-uint64_t get_mem_len(const char *str)
+/* Returns 0 and the memory length in bytes, or EINVAL or ERANGE. */
+int _get_mem_len(const char *str, uint64_t *len)
 {
+	uint64_t val;
+	int shift;
 	char *e;
-	uint64_t len = strtoul(str, &e, 0);
+
+	while (isspace(*str))
+		++str;
+	if (*str == '-')
+		return EINVAL;
+
+	errno = 0;
+	val = strtoull(str, &e, 0);
+	if (e == str)
+		return EINVAL;
+	if (errno)
+		return errno;
 
 	switch (*e) {
 	case 't':
 	case 'T':
-		len *= 1024;
-		/* fall thru */
+		shift = 40;
+		break;
 	case 'g':
 	case 'G':
-		len *= 1024;
-		/* fall thru */
+		shift = 30;
+		break;
 	case 'm':
 	case 'M':
-		len *= 1024;
-		/* fall thru */
+		shift = 20;
+		break;
 	case 'k':
 	case 'K':
-		len *= 1024;
-		/* fall thru */
+		shift = 10;
+		break;
 	case 'b':
 	case 'B':
 	case 0:
-		return len;
+		shift = 0;
+		break;
 	default:
-		fprintf(stderr, "Invalid size %s\n", e);
+		return EINVAL;
+	}
+
+	/* 10MB and 4kB mean the same as 10M and 4k */
+	if (shift && (e[1] == 'b' || e[1] == 'B'))
+		++e;
+	if (*e && e[1])
+		return EINVAL;
+	if (val > (UINT64_MAX >> shift))
+		return ERANGE;
+	*len = val << shift;
+	return 0;
+}
+
+/* Returns memory length in bytes. */
+uint64_t get_mem_len(const char *str)
+{
+	uint64_t len;
+
+	if (_get_mem_len(str, &len)) {
+		fprintf(stderr, "Invalid size %s\n", str);
 		exit(1);
 	}
+	return len;
 }
 
 unsigned nice_mem_len(uint64_t size, char *ch)
@@ -111,55 +193,87 @@ unsigned nice_mem_len(uint64_t size, char *ch)
 	return size;
 }
 
+/* Returns the length of str. str must be at least 32 bytes. Same
+ * output as the old snprintf("%.1f") version, rounding half to even.
+ */
+int _nicer_mem_len(uint64_t size, char *str)
+{
+	static const char suffix[] = { 0, 'K', 'M', 'G' };
+	uint64_t whole, rem, tenths;
+	int i, shift;
+	char *p;
+
+	if (size >= (1ul << 30))
+		i = 3;
+	else if (size >= (1ul << 20))
+		i = 2;
+	else if (size >= (1ul << 10))
+		i = 1;
+	else
+		i = 0;
+	shift = i * 10;
+
+	whole = size >> shift;
+	rem = size & ((1ULL << shift) - 1);
+	p = _uint2str(whole, str);
+	if (rem) {
+		uint64_t r;
+
+		/* rem * 10 cannot overflow since rem < 2^30 */
+		tenths = (rem * 10) >> shift;
+		r = (rem * 10) & ((1ULL << shift) - 1);
+		if (r > (1ULL << (shift - 1)) ||
+			(r == (1ULL << (shift - 1)) && (tenths & 1)))
+			++tenths;
+		if (tenths == 10) {
+			/* 1.95K -> 2.0K */
+			p = _uint2str(whole + 1, str);
+			tenths = 0;
+		}
+		*p++ = '.';
+		*p++ = tenths + '0';
+	}
+	if (suffix[i])
+		*p++ = suffix[i];
+	*p = 0;
+
+	return p - str;
+}
+
 char *nicer_mem_len(uint64_t size, char *str, int len)
 {
-	if (size >= (1ul << 30)) {
-		if ((size & ((1UL << 30) - 1)) == 0)
-			snprintf(str, len, "%luG", size >> 30);
-		else
-			snprintf(str, len, "%.1fG", (double)size / (double)(1ul << 30));
-	} else if (size >= (1ul << 20)) {
-		if ((size & ((1UL << 20) - 1)) == 0)
-			snprintf(str, len, "%luM", size >> 20);
-		else
-			snprintf(str, len, "%.1fM", (double)size / (double)(1ul << 20));
-	} else if (size >= (1ul << 10)) {
-		if ((size & ((1UL << 10) - 1)) == 0)
-			snprintf(str, len, "%luK", size >> 10);
-		else
-			snprintf(str, len, "%.1fK", (double)size / (double)(1ul << 10));
-	} else
-		snprintf(str, len, "%lu", size);
+	char tmp[32];
+
+	_nicer_mem_len(size, tmp);
+	safecpy(str, tmp, len);
 	return str;
 }
 
-/* Adds commas. Not thread safe */
-char *nice_number(long number)
+/* Adds commas. str must be at least 32 bytes. Returns str. */
+char *nice_number_r(long number, char *str)
 {   /* largest 64 bit decimal, with commas, is 26 + 1 */
-	static char str[32], *p;
-	int i, neg;
-
-	if (number == 0)
-		return strcpy(str, "0");
+	unsigned long n = number < 0 ? -(unsigned long)number : number;
+	char digits[24], *p = str;
+	int i, len;
 
-	neg = number < 0;
-	if (neg)
-		number = -number;
+	if (number < 0)
+		*p++ = '-';
 
-	p = str + 31;
+	len = _uint2str(n, digits) - digits;
+	for (i = 0; i < len; ++i) {
+		if (i && (len - i) % 3 == 0)
+			*p++ = ',';
+		*p++ = digits[i];
+	}
 	*p = 0;
 
-	for (i = 0; number; i++) {
-		if ((i & 3) == 3) {
-			*(--p) = ',';
-			++i;
-		}
-		*(--p) = (number % 10) + '0';
-		number /= 10;
-	}
+	return str;
+}
 
-	if (neg)
-		*(--p) = '-';
+/* Adds commas. Not thread safe */
+char *nice_number(long number)
+{
+	static char str[32];
 
-	return p;
+	return nice_number_r(number, str);
 }
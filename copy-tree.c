@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "samlib.h"
+
+/* Copy a directory tree. The main thread walks the tree, creating the
+ * directories and symlinks as it goes, and queues the files for the
+ * workers to copy. If the queue is full the main thread copies a file
+ * itself. The directory modes and times are set at the end since
+ * copying the files changes them.
+ *
+ * Files with more than one link are remembered by device and inode.
+ * The first one is copied, the others are linked to its copy.
+ */
+
+/* \cond skip */
+#define COPY_QUEUE_SIZE 1024
+
+struct copy_job {
+	char *from, *to;
+	struct stat sbuf;
+};
+
+struct copy_dir {
+	char *to;
+	struct stat sbuf;
+};
+
+struct copy_inode {
+	dev_t dev;
+	ino_t ino;
+	char *to; /* NULL for an empty slot */
+};
+
+struct copy_state {
+	struct copy_tree_struct *ct;
+	const char *from, *to;
+	int flen, tlen;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct copy_job queue[COPY_QUEUE_SIZE];
+	unsigned head, tail;
+	int walk_done;
+
+	struct copy_dir *dirs;
+	int ndirs, dirs_size;
+
+	/* Open addressing, only touched by the walk */
+	struct copy_inode *inodes;
+	int ninodes, inodes_size;
+
+	struct timeval start, last;
+	unsigned calls;
+};
+
+/* walkfiles() gives the file_func no context, so copy_walk() finds
+ * the state of the copy_tree() running on this thread here.
+ */
+static __thread struct copy_state *cur;
+
+static void copy_error(struct copy_state *cs, const char *path)
+{
+	perror(path);
+	__sync_add_and_fetch(&cs->ct->errors, 1);
+}
+
+static void set_times(struct timespec *ts, struct stat *sbuf)
+{
+#ifdef __linux__
+	ts[0] = sbuf->st_atim;
+	ts[1] = sbuf->st_mtim;
+#else
+	ts[0].tv_sec = sbuf->st_atime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = sbuf->st_mtime;
+	ts[1].tv_nsec = 0;
+#endif
+}
+
+static void copy_one(struct copy_state *cs, struct copy_job *job)
+{
+	struct timespec ts[2];
+	struct timeval start;
+	long n = -1;
+	int in, out;
+
+	gettimeofday(&start, NULL);
+
+	in = open(job->from, O_RDONLY | O_BINARY);
+	if (in < 0) {
+		copy_error(cs, job->from);
+		goto done;
+	}
+
+	/* Not the real mode until the copy is done */
+	out = open(job->to, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+	if (out < 0) {
+		copy_error(cs, job->to);
+		close(in);
+		goto done;
+	}
+
+	set_times(ts, &job->sbuf);
+	n = _copy_fd(in, out, job->sbuf.st_size);
+	if (n < 0 ||
+		fchmod(out, job->sbuf.st_mode & 07777) ||
+		futimens(out, ts)) {
+		copy_error(cs, job->to);
+		n = -1;
+	}
+
+	close(in);
+	if (close(out) && n >= 0) {
+		copy_error(cs, job->to);
+		n = -1;
+	}
+
+	if (n >= 0) {
+		__sync_add_and_fetch(&cs->ct->files, 1);
+		__sync_add_and_fetch(&cs->ct->bytes, n);
+	}
+
+done:
+	if (cs->ct->file_done)
+		cs->ct->file_done(job->from, job->to, n, delta_timeval_now(&start));
+	free(job->from);
+	free(job->to);
+}
+
+static int queue_push(struct copy_state *cs, struct copy_job *job)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&cs->lock);
+	if (cs->tail - cs->head < COPY_QUEUE_SIZE) {
+		cs->queue[cs->tail++ % COPY_QUEUE_SIZE] = *job;
+		pthread_cond_signal(&cs->work);
+		rc = 1;
+	}
+	pthread_mutex_unlock(&cs->lock);
+	return rc;
+}
+
+/* If wait is set, sleep until there is a job or the walk is done */
+static int queue_pop(struct copy_state *cs, struct copy_job *job, int wait)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&cs->lock);
+	while (wait && cs->head == cs->tail && !cs->walk_done)
+		pthread_cond_wait(&cs->work, &cs->lock);
+	if (cs->head != cs->tail) {
+		*job = cs->queue[cs->head++ % COPY_QUEUE_SIZE];
+		rc = 1;
+	}
+	pthread_mutex_unlock(&cs->lock);
+	return rc;
+}
+
+static void copy_progress(struct copy_state *cs, int force)
+{
+	if (!cs->ct->progress)
+		return;
+	if (force || delta_timeval_now(&cs->last) >= 1000000) {
+		gettimeofday(&cs->last, NULL);
+		cs->ct->progress(cs->ct, delta_timeval_now(&cs->start));
+	}
+}
+
+static void *copy_worker(void *arg)
+{
+	struct copy_state *cs = arg;
+	struct copy_job job;
+
+	while (queue_pop(cs, &job, 1))
+		copy_one(cs, &job);
+
+	return NULL;
+}
+
+static char *to_path(struct copy_state *cs, const char *path)
+{
+	int len = cs->tlen + strlen(path + cs->flen) + 1;
+	char *to = must_alloc(len);
+
+	strconcat(to, len, cs->to, path + cs->flen, NULL);
+	return to;
+}
+
+static void add_dir(struct copy_state *cs, char *to, struct stat *sbuf)
+{
+	if (cs->ndirs == cs->dirs_size) {
+		cs->dirs_size += 256;
+		cs->dirs = must_realloc(cs->dirs, cs->dirs_size * sizeof(struct copy_dir));
+	}
+	cs->dirs[cs->ndirs].to = to;
+	cs->dirs[cs->ndirs].sbuf = *sbuf;
+	++cs->ndirs;
+}
+
+static struct copy_inode *inode_find(struct copy_state *cs, dev_t dev, ino_t ino)
+{
+	unsigned mask = cs->inodes_size - 1;
+	unsigned i = ((unsigned)ino * 0x9e3779b1u ^ (unsigned)dev) & mask;
+
+	while (cs->inodes[i].to && (cs->inodes[i].ino != ino || cs->inodes[i].dev != dev))
+		i = (i + 1) & mask;
+	return &cs->inodes[i];
+}
+
+static void inode_grow(struct copy_state *cs)
+{
+	struct copy_inode *old = cs->inodes;
+	int i, size = cs->inodes_size;
+
+	cs->inodes_size = size ? size * 2 : 256;
+	cs->inodes = must_calloc(cs->inodes_size, sizeof(struct copy_inode));
+	for (i = 0; i < size; ++i)
+		if (old[i].to)
+			*inode_find(cs, old[i].dev, old[i].ino) = old[i];
+	free(old);
+}
+
+/* For files with more than one link. Returns 1 if to was linked to
+ * the copy of an earlier link, 0 if this is the first one and it
+ * needs to be copied.
+ */
+static int copy_hardlink(struct copy_state *cs, const char *to, struct stat *sbuf)
+{
+	struct copy_inode *inode;
+	int fd;
+
+	if (cs->ninodes * 2 >= cs->inodes_size)
+		inode_grow(cs);
+
+	inode = inode_find(cs, sbuf->st_dev, sbuf->st_ino);
+	if (inode->to) {
+		if (link(inode->to, to) && (errno != EEXIST || unlink(to) || link(inode->to, to)))
+			copy_error(cs, to);
+		else
+			++cs->ct->hardlinks;
+		return 1;
+	}
+
+	inode->dev = sbuf->st_dev;
+	inode->ino = sbuf->st_ino;
+	inode->to = must_strdup(to);
+	++cs->ninodes;
+
+	/* Create it now so the next link does not wait for the copy */
+	fd = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0600);
+	if (fd >= 0)
+		close(fd);
+	return 0;
+}
+
+static int copy_link(struct copy_state *cs, const char *path, char *to, struct stat *sbuf)
+{
+	char target[PATH_MAX + 1];
+	struct timespec ts[2];
+	int n = readlink(path, target, sizeof(target) - 1);
+
+	if (n < 0) {
+		copy_error(cs, path);
+		return 1;
+	}
+	target[n] = 0;
+
+	if (symlink(target, to) && (errno != EEXIST || unlink(to) || symlink(target, to))) {
+		copy_error(cs, to);
+		return 1;
+	}
+
+	set_times(ts, sbuf);
+	utimensat(AT_FDCWD, to, ts, AT_SYMLINK_NOFOLLOW);
+	++cs->ct->links;
+	return 0;
+}
+
+static int copy_walk(const char *path, struct stat *sbuf)
+{
+	struct copy_state *cs = cur;
+	struct copy_job job;
+	char *to = to_path(cs, path);
+
+	if ((++cs->calls & 0xff) == 0)
+		copy_progress(cs, 0);
+
+	switch (sbuf->st_mode & S_IFMT) {
+	case S_IFDIR:
+		if (mkdir_p(to, 0700)) {
+			copy_error(cs, to);
+			free(to);
+			return 1;
+		}
+		++cs->ct->dirs;
+		add_dir(cs, to, sbuf);
+		return 0;
+	case S_IFLNK:
+		copy_link(cs, path, to, sbuf);
+		free(to);
+		return 0;
+	case S_IFREG:
+		if (sbuf->st_nlink > 1 && copy_hardlink(cs, to, sbuf)) {
+			free(to);
+			return 0;
+		}
+		break;
+	default:
+		free(to);
+		return 0;
+	}
+
+	job.from = must_strdup(path);
+	job.to = to;
+	job.sbuf = *sbuf;
+	while (!queue_push(cs, &job)) {
+		struct copy_job help;
+
+		if (queue_pop(cs, &help, 0))
+			copy_one(cs, &help);
+	}
+
+	return 0;
+}
+
+/* Is to the tree from or somewhere under it? The copy would walk into
+ * itself. The to dir may not exist yet, so the part of it that does is
+ * resolved.
+ */
+static int copy_inside(const char *from, const char *to)
+{
+	char rfrom[PATH_MAX], rto[PATH_MAX], path[PATH_MAX], *p;
+	int saved = errno, n, inside = 0;
+
+	if (!realpath(from, rfrom))
+		goto done;
+
+	safecpy(path, to, sizeof(path));
+	while (!realpath(path, rto)) {
+		if (errno != ENOENT)
+			goto done;
+		p = strrchr(path, '/');
+		if (p == NULL)
+			strcpy(path, ".");
+		else if (p == path)
+			path[1] = 0;
+		else
+			*p = 0;
+	}
+
+	n = strlen(rfrom);
+	if (n == 1) /* / */
+		inside = 1;
+	else
+		inside = strncmp(rto, rfrom, n) == 0 && (rto[n] == 0 || rto[n] == '/');
+
+done:
+	errno = saved;
+	return inside;
+}
+/* \endcond */
+
+/* Copy the tree from to the directory to, like cp -a. Regular files,
+ * directories, and symlinks are copied preserving their modes and
+ * times. Hard links within the tree are preserved. Ownership is not
+ * preserved. Other file types are skipped.
+ *
+ * If ct is not NULL it sets the number of threads, the callbacks,
+ * and gets the stats. The file_done() callback is called from the
+ * copying thread after every file, with bytes < 0 on error. The
+ * progress() callback is called about once a second and at the end.
+ *
+ * Returns 0 on success or -1 if anything could not be copied. A to
+ * inside from, e.g. copy_tree("a", "a/b"), fails with EINVAL. This
+ * is in libsamthread. The workers are pthreads. It is reentrant, but
+ * must be called from a pthread, not a samthread.
+ */
+int copy_tree(const char *from, const char *to, struct copy_tree_struct *ct)
+{
+	struct copy_tree_struct local;
+	struct walkfile_struct walk;
+	struct copy_state *cs, *saved;
+	struct stat sbuf;
+	pthread_t *tids;
+	int *started;
+	char *fromdir;
+	int i, nthreads, rc;
+
+	if (!ct) {
+		memset(&local, 0, sizeof(local));
+		ct = &local;
+	}
+
+	cs = must_calloc(1, sizeof(struct copy_state));
+	cs->ct = ct;
+	errno = 0;
+
+	/* Strip trailing slashes so we can build the to paths */
+	fromdir = must_strdup(from);
+	for (i = strlen(fromdir) - 1; i > 0 && fromdir[i] == '/'; --i)
+		fromdir[i] = 0;
+	cs->from = fromdir;
+	cs->flen = strlen(fromdir);
+	cs->to = to;
+	cs->tlen = strlen(to);
+
+	if (stat(fromdir, &sbuf) == 0) {
+		if (!S_ISDIR(sbuf.st_mode))
+			errno = ENOTDIR;
+		else if (copy_inside(fromdir, to))
+			errno = EINVAL;
+	}
+	if (errno) {
+		perror(fromdir);
+		free(fromdir);
+		free(cs);
+		return -1;
+	}
+	if (mkdir_p(to, 0700)) {
+		perror(to);
+		free(fromdir);
+		free(cs);
+		return -1;
+	}
+	add_dir(cs, must_strdup(to), &sbuf);
+
+	nthreads = ct->nthreads > 0 ? ct->nthreads : 8;
+	gettimeofday(&cs->start, NULL);
+	cs->last = cs->start;
+
+	pthread_mutex_init(&cs->lock, NULL);
+	pthread_cond_init(&cs->work, NULL);
+	tids = must_calloc(nthreads, sizeof(pthread_t));
+	started = must_calloc(nthreads, sizeof(int));
+	for (i = 0; i < nthreads; ++i)
+		started[i] = pthread_create(&tids[i], NULL, copy_worker, cs) == 0;
+
+	saved = cur;
+	cur = cs;
+	memset(&walk, 0, sizeof(walk));
+	rc = walkfiles(&walk, fromdir, copy_walk,
+				   WALK_DOTFILES | WALK_INCLUDE_DIRS | S_IFLNK);
+	cur = saved;
+
+	/* Wake the workers and help drain the queue */
+	pthread_mutex_lock(&cs->lock);
+	cs->walk_done = 1;
+	pthread_cond_broadcast(&cs->work);
+	pthread_mutex_unlock(&cs->lock);
+	copy_worker(cs);
+	for (i = 0; i < nthreads; ++i)
+		if (started[i])
+			pthread_join(tids[i], NULL);
+	free(tids);
+	free(started);
+	pthread_mutex_destroy(&cs->lock);
+	pthread_cond_destroy(&cs->work);
+
+	/* Deepest first so a read only parent does not stop us */
+	for (i = cs->ndirs - 1; i >= 0; --i) {
+		struct timespec ts[2];
+
+		set_times(ts, &cs->dirs[i].sbuf);
+		if (chmod(cs->dirs[i].to, cs->dirs[i].sbuf.st_mode & 07777) ||
+			utimensat(AT_FDCWD, cs->dirs[i].to, ts, 0))
+			copy_error(cs, cs->dirs[i].to);
+		free(cs->dirs[i].to);
+	}
+	free(cs->dirs);
+	for (i = 0; i < cs->inodes_size; ++i)
+		free(cs->inodes[i].to);
+	free(cs->inodes);
+	free(fromdir);
+
+	copy_progress(cs, 1);
+	free(cs);
+
+	return rc || ct->errors ? -1 : 0;
+}
@@ -1,16 +1,195 @@
 #ifdef __linux__
+#define _GNU_SOURCE /* SEEK_DATA and O_DIRECT */
 #define USE_SENDFILE
 #endif
 
+#include <stdlib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #ifdef USE_SENDFILE
+#include <sys/ioctl.h>
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
 #endif
 #include "samlib.h"
 
-/* Copy a file. Uses sendfile by default.
- * Returns number of bytes copied or < 0 on error:
+/* \cond skip */
+#define COPY_RANGE		0
+#define COPY_SENDFILE	1
+#define COPY_RW			2
+
+/* For copy_file_hash() */
+#define COPY_BUFSIZE	(1024 * 1024)
+#define COPY_ALIGN		4096
+
+/* Keep each call well under the 2G sendfile limit */
+#define COPY_CHUNK (1L << 30)
+
+#ifdef WIN32
+#define pread(fd, buf, n, off) (lseek(fd, off, SEEK_SET) < 0 ? -1 : read(fd, buf, n))
+#define pwrite(fd, buf, n, off) (lseek(fd, off, SEEK_SET) < 0 ? -1 : write(fd, buf, n))
+#endif
+
+/* Returns the bytes copied, short if the file shrunk, or -1 */
+static off_t copy_rw(int in, int out, off_t off, off_t len)
+{
+	char buf[64 * 1024];
+	off_t start = off;
+	int n, w, wrote;
+
+	while (len > 0) {
+		n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break; /* file shrunk */
+
+		for (wrote = 0; wrote < n; wrote += w) {
+			w = pwrite(out, buf + wrote, n - wrote, off + wrote);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+
+		off += n;
+		len -= n;
+	}
+
+	return off - start;
+}
+
+/* Copy len bytes at off in in to the same offset in out. Method is
+ * downgraded when the kernel or filesystem does not support it.
+ * Returns the same as copy_rw().
+ */
+static off_t copy_range(int in, int out, off_t off, off_t len, int *method)
+{
+#ifdef USE_SENDFILE
+	off_t start = off, n;
+
+	while (len > 0) {
+		off_t in_off = off, out_off = off;
+		long chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+
+		if (*method == COPY_RANGE) {
+#ifdef SYS_copy_file_range
+			n = syscall(SYS_copy_file_range, in, &in_off, out, &out_off, chunk, 0);
+#else
+			n = -1;
+			errno = ENOSYS;
+#endif
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+					errno != EOPNOTSUPP && errno != EBADF)
+					return -1;
+				*method = COPY_SENDFILE;
+				continue;
+			}
+		} else if (*method == COPY_SENDFILE) {
+			if (lseek(out, off, SEEK_SET) < 0)
+				return -1;
+			n = sendfile(out, in, &in_off, chunk);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EINVAL && errno != ENOSYS)
+					return -1;
+				*method = COPY_RW;
+				continue;
+			}
+		} else {
+			n = copy_rw(in, out, off, len);
+			if (n < 0)
+				return -1;
+			return off + n - start;
+		}
+
+		if (n == 0)
+			break; /* file shrunk */
+		off += n;
+		len -= n;
+	}
+
+	return off - start;
+#else
+	return copy_rw(in, out, off, len);
+#endif
+}
+/* \endcond */
+
+/* Copy size bytes from in to out. out should be empty. Tries a
+ * reflink (instant on btrfs/xfs), then copy_file_range (server side
+ * on NFS), then sendfile, then read/write. Holes are preserved.
+ * Returns the bytes copied, less than size if in shrunk, or -1 on
+ * error with errno set.
+ */
+off_t _copy_fd(int in, int out, off_t size)
+{
+	int method = COPY_RANGE;
+	off_t data = 0, hole, end = 0, n;
+
+#ifdef FICLONE
+	if (ioctl(out, FICLONE, in) == 0)
+		return lseek(out, 0, SEEK_END);
+#endif
+
+	while (data < size) {
+#ifdef SEEK_DATA
+		off_t next = lseek(in, data, SEEK_DATA);
+		if (next < 0) {
+			if (errno == ENXIO) {
+				/* Trailing hole, unless the file shrunk */
+				n = lseek(in, 0, SEEK_END);
+				if (n < 0)
+					return -1;
+				if (n < size)
+					size = n;
+				break;
+			}
+			/* Not supported, treat the rest as data */
+			hole = size;
+		} else {
+			data = next;
+			hole = lseek(in, data, SEEK_HOLE);
+			if (hole < 0 || hole > size)
+				hole = size;
+		}
+#else
+		hole = size;
+#endif
+
+		n = copy_range(in, out, data, hole - data, &method);
+		if (n < 0)
+			return -1;
+		if (n < hole - data) {
+			/* File shrunk, stop at the new end */
+			size = data + n;
+			if (n)
+				end = size;
+			break;
+		}
+		data = end = hole;
+	}
+
+	/* Extend any trailing hole */
+	if (end < size && ftruncate(out, size))
+		return -1;
+	return size;
+}
+
+/* Copy a file. Uses _copy_fd().
+ * Returns number of bytes copied, which is short if from shrunk
+ * during the copy, or < 0 on error:
  *    -1 = I/O error
  *    -2 = error on from
  *    -3 = error on to
@@ -33,25 +212,117 @@ long copy_file(const char *from, const char *to)
 		return -3;
 	}
 
-#ifdef USE_SENDFILE
-	long n = sendfile(out, in, NULL, sbuf.st_size);
-#else
-	char buf[4096];
-	long n = 0;
-	int r;
-	while ((r = read(in, buf, sizeof(buf))) > 0) {
-		int wrote = write(out, buf, r);
-		if (wrote == r)
-			n += r;
-		else {
-			n = -1;
+	long n = _copy_fd(in, out, sbuf.st_size);
+
+	close(in);
+	/* NFS can report write errors on close */
+	if (close(out))
+		n = -1;
+
+	return n;
+}
+
+/* Copy a file, calculating the md5 or sha256 of the data as we go.
+ * The digest must be big enough for the hash selected in flags. With
+ * COPY_DIRECT the source is read with O_DIRECT, or dropped from the
+ * page cache as we go if O_DIRECT is not supported.
+ * Returns the same as copy_file().
+ */
+long copy_file_hash(const char *from, const char *to, int flags, uint8_t *digest)
+{
+	sha256ctx sha;
+	md5ctx md5;
+	struct stat sbuf;
+	char *buf;
+	long total = 0;
+	int in, out, n, w, wrote, direct = 0;
+
+	if (!(flags & (COPY_MD5 | COPY_SHA256)) ||
+		(flags & (COPY_MD5 | COPY_SHA256)) == (COPY_MD5 | COPY_SHA256)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef O_DIRECT
+	if (flags & COPY_DIRECT) {
+		in = open(from, O_RDONLY | O_DIRECT);
+		if (in >= 0)
+			direct = 1;
+		else if (errno == EINVAL) /* e.g. tmpfs */
+			in = open(from, O_RDONLY | O_BINARY);
+	} else
+#endif
+		in = open(from, O_RDONLY | O_BINARY);
+	if (in < 0)
+		return -2;
+
+	if (fstat(in, &sbuf)) {
+		close(in);
+		return -2;
+	}
+
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, sbuf.st_mode);
+	if (out < 0) {
+		close(in);
+		return -3;
+	}
+
+	/* O_DIRECT needs an aligned buffer */
+	if (posix_memalign((void **)&buf, COPY_ALIGN, COPY_BUFSIZE)) {
+		close(in);
+		close(out);
+		return -1;
+	}
+
+	if (flags & COPY_SHA256)
+		sha256_init(&sha);
+	else
+		md5_init(&md5);
+
+	while ((n = read(in, buf, COPY_BUFSIZE)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			total = -1;
 			break;
 		}
-	}
+
+		for (wrote = 0; wrote < n; wrote += w) {
+			w = write(out, buf + wrote, n - wrote);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				total = -1;
+				goto done;
+			}
+		}
+
+		if (flags & COPY_SHA256)
+			sha256_update(&sha, (uint8_t *)buf, n);
+		else
+			md5_update(&md5, buf, n);
+
+#ifdef POSIX_FADV_DONTNEED
+		if ((flags & COPY_DIRECT) && !direct)
+			posix_fadvise(in, total, n, POSIX_FADV_DONTNEED);
 #endif
+		total += n;
+	}
 
+done:
+	if (total >= 0) {
+		if (flags & COPY_SHA256)
+			sha256_final(&sha, digest);
+		else
+			md5_final(&md5, digest);
+	}
+
+	free(buf);
 	close(in);
-	close(out);
+	if (close(out))
+		total = -1;
 
-	return n;
+	return total;
 }
@@ -0,0 +1,160 @@
+#include "samlib.h"
+
+/* CRC-32C (Castagnoli), the one iSCSI, ext4, and btrfs use. Uses the
+ * SSE 4.2 crc32 instruction if the cpu has it, else slicing by 8.
+ */
+
+/* \cond skip */
+#define CRC32C_POLY 0x82f63b78 /* reversed */
+
+/* crc32q has a latency of 3 but can start every cycle, so the
+ * hardware version runs three streams of CRC_SHORT bytes and joins
+ * them with crc_short.
+ */
+#define CRC_SHORT 256
+
+static uint32_t crc_table[8][256];
+static uint32_t crc_short[4][256]; /* appends CRC_SHORT zero bytes */
+static int crc_init;
+
+static void crc32c_init(void);
+
+#if defined(__x86_64__) && !defined(WIN32)
+static int hw_crc = -1;
+
+static int cpu_supports_crc(void)
+{
+	if (hw_crc == -1) {
+		uint32_t regs[4];
+		cpuid(1, regs);
+		hw_crc = !!(regs[2] & (1 << 20)); /* bit 20 is sse4.2 */
+	}
+
+	return hw_crc;
+}
+
+static uint32_t crc32c_shift(uint32_t crc)
+{
+	return crc_short[0][crc & 0xff] ^ crc_short[1][(crc >> 8) & 0xff] ^
+		crc_short[2][(crc >> 16) & 0xff] ^ crc_short[3][crc >> 24];
+}
+
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64, crc1, crc2, w;
+	const uint8_t *end;
+
+	for (; len > 0 && ((uintptr_t)p & 7); ++p, --len)
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+
+	crc64 = crc;
+	if (len >= 3 * CRC_SHORT &&
+		!__atomic_load_n(&crc_init, __ATOMIC_ACQUIRE))
+		crc32c_init();
+	for (; len >= 3 * CRC_SHORT; p += 2 * CRC_SHORT, len -= 3 * CRC_SHORT) {
+		crc1 = crc2 = 0;
+		for (end = p + CRC_SHORT; p < end; p += 8) {
+			memcpy(&w, p, 8);
+			asm("crc32q %1, %0" : "+r" (crc64) : "rm" (w));
+			memcpy(&w, p + CRC_SHORT, 8);
+			asm("crc32q %1, %0" : "+r" (crc1) : "rm" (w));
+			memcpy(&w, p + 2 * CRC_SHORT, 8);
+			asm("crc32q %1, %0" : "+r" (crc2) : "rm" (w));
+		}
+		crc64 = crc32c_shift(crc32c_shift(crc64) ^ crc1) ^ crc2;
+	}
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		asm("crc32q %1, %0" : "+r" (crc64) : "rm" (w));
+	}
+	crc = crc64;
+
+	for (; len > 0; ++p, --len)
+		asm("crc32b %1, %0" : "+r" (crc) : "rm" (*p));
+
+	return crc;
+}
+#endif
+
+/* Threads can race to build the tables. Each entry is worked out in
+ * locals and stored once, so a racing thread stores the same value,
+ * and crc_init is only set when the tables are complete.
+ */
+static void crc32c_init(void)
+{
+	uint32_t crc, sum, row[8], bit[32];
+	int i, j, k;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i) {
+		row[0] = crc_table[0][i];
+		for (j = 1; j < 8; ++j) {
+			row[j] = (row[j - 1] >> 8) ^ crc_table[0][row[j - 1] & 0xff];
+			crc_table[j][i] = row[j];
+		}
+	}
+
+	/* Zeros are linear, so shift each bit and xor them together */
+	for (i = 0; i < 32; ++i) {
+		crc = 1u << i;
+		for (j = 0; j < CRC_SHORT; ++j)
+			crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+		bit[i] = crc;
+	}
+	for (j = 0; j < 4; ++j)
+		for (i = 0; i < 256; ++i) {
+			for (sum = 0, k = 0; k < 8; ++k)
+				if (i & (1 << k))
+					sum ^= bit[j * 8 + k];
+			crc_short[j][i] = sum;
+		}
+
+	__atomic_store_n(&crc_init, 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	if (!__atomic_load_n(&crc_init, __ATOMIC_ACQUIRE))
+		crc32c_init();
+
+	for (; len > 0 && ((uintptr_t)p & 7); ++p, --len)
+		crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; p += 8, len -= 8) {
+		lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+		hi = p[4] | p[5] << 8 | p[6] << 16 | (uint32_t)p[7] << 24;
+		crc = crc_table[7][lo & 0xff] ^
+			crc_table[6][(lo >> 8) & 0xff] ^
+			crc_table[5][(lo >> 16) & 0xff] ^
+			crc_table[4][lo >> 24] ^
+			crc_table[3][hi & 0xff] ^
+			crc_table[2][(hi >> 8) & 0xff] ^
+			crc_table[1][(hi >> 16) & 0xff] ^
+			crc_table[0][hi >> 24];
+	}
+
+	for (; len > 0; ++p, --len)
+		crc = crc_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+/* \endcond */
+
+/* Start with crc 0. Pass the last return to continue, so
+ * crc32c(crc32c(0, a, alen), b, blen) is the crc of a then b.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#if defined(__x86_64__) && !defined(WIN32)
+	if (cpu_supports_crc())
+		return ~crc32c_hw(~crc, buf, len);
+#endif
+	return ~crc32c_sw(~crc, buf, len);
+}
@@ -0,0 +1,470 @@
+/*
+ * Bloom filter of the keys in a btree, so a get or delete of a key that
+ * is not there can return without a search.
+ *
+ * The filter is blocked: the hash picks one 64 byte block and all k bits
+ * are set in that block, so a lookup reads one cache line.  Keys are
+ * added on put.  Deletes cannot clear bits, they are only counted.  The
+ * filter is kept in fname-bloom along with the size and mtime the file
+ * had when it was saved.  If the file changed since, or the filter is
+ * too full, it is rebuilt from the leaves.  Mtimes are only as fine as
+ * the clock tick, so a filter saved in the tick the file was last
+ * written is not trusted either.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "btree.h"
+#include "samlib.h"
+
+#define	BLOOMMAGIC	0x424c4f4d	/* "BLOM" */
+#define	BLOOMVERSION	1
+#define	BLOOM_MIN	1024		/* smallest capacity in keys */
+
+/* Saved at the start of fname-bloom, the blocks follow. */
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nblocks;
+	uint32_t k;
+	uint64_t nkeys;
+	uint64_t ndel;
+	uint64_t cap;
+	uint64_t dbsize;		/* file size at save */
+	uint64_t dbmtime;		/* file mtime at save, ns */
+} BLOOMHDR;
+
+struct _bloom {
+	uint64_t *bits;			/* nblocks of 8 words */
+	void	*base;			/* unaligned bits, to free */
+	uint32_t nblocks;
+	uint32_t k;			/* bits set per key */
+	uint32_t bitsper;		/* bits per key at build */
+	uint64_t nkeys;			/* keys added */
+	uint64_t ndel;			/* deletes since the build */
+	uint64_t cap;			/* keys it was sized for */
+	int	 dirty;			/* not the same as the file */
+	char	 fname[];
+};
+
+#ifdef __linux__
+#define	ST_MTIME_NS(s)	((uint64_t)(s)->st_mtim.tv_sec * 1000000000ULL + \
+			    (s)->st_mtim.tv_nsec)
+#else
+#define	ST_MTIME_NS(s)	((uint64_t)(s)->st_mtime * 1000000000ULL)
+#endif
+
+static int	 bloom_alloc(BLOOM *, uint64_t);
+static int	 bloom_build(BTREE *, BLOOM *);
+static uint64_t	 bloom_hash(const void *, size_t);
+static void	 bloom_set(BLOOM *, uint64_t);
+static int	 bloom_load(BTREE *, BLOOM *);
+
+/*
+ * __BLOOM_OPEN -- Attach a filter to the tree.
+ *
+ * Parameters:
+ *	t:	tree
+ *	fname:	file name, NULL for an in-memory tree
+ *	bitsper: bits per key, 0 for the default of 10
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__bloom_open(t, fname, bitsper)
+	BTREE *t;
+	const char *fname;
+	u_int bitsper;
+{
+	BLOOM *bf;
+	size_t len;
+
+	if (bitsper == 0)
+		bitsper = 10;
+	if (bitsper > 64) {
+		errno = EINVAL;
+		return (RET_ERROR);
+	}
+
+	len = fname ? strlen(fname) + sizeof("-bloom") : 1;
+	if ((bf = calloc(1, sizeof(BLOOM) + len)) == NULL)
+		return (RET_ERROR);
+	if (fname) {
+		strcpy(bf->fname, fname);
+		strcat(bf->fname, "-bloom");
+	}
+	bf->bitsper = bitsper;
+
+	if ((fname == NULL || bloom_load(t, bf) == RET_ERROR) &&
+	    bloom_build(t, bf) == RET_ERROR) {
+		free(bf->base);
+		free(bf);
+		return (RET_ERROR);
+	}
+	t->bt_bloom = bf;
+	return (RET_SUCCESS);
+}
+
+/*
+ * __BLOOM_MAYBE -- Could the key be in the tree?
+ *
+ * Returns:
+ *	0 if the key is not in the tree, 1 if it might be.
+ */
+int
+__bloom_maybe(bf, key)
+	const BLOOM *bf;
+	const DBT *key;
+{
+	uint64_t h, *blk;
+	uint32_t h1, h2, b, i;
+
+	h = bloom_hash(key->data, key->size);
+	blk = bf->bits + 8 * (((h >> 32) * bf->nblocks) >> 32);
+	h1 = h;
+	h2 = (h * 0x9e3779b97f4a7c15ULL) >> 32 | 1;
+	for (i = 0; i < bf->k; ++i) {
+		b = (h1 + i * h2) & 511;
+		if (!(blk[b >> 6] & (1ULL << (b & 63))))
+			return (0);
+	}
+	return (1);
+}
+
+/*
+ * __BLOOM_ADD -- Add a key that was put.  Rebuilds the filter when it
+ * is over capacity.  If the rebuild fails the old filter is kept, it
+ * still has every key.
+ */
+void
+__bloom_add(t, key)
+	BTREE *t;
+	const DBT *key;
+{
+	BLOOM *bf, *nbf;
+
+	bf = t->bt_bloom;
+	bloom_set(bf, bloom_hash(key->data, key->size));
+	bf->dirty = 1;
+	if (++bf->nkeys <= bf->cap)
+		return;
+
+	if ((nbf = malloc(sizeof(BLOOM) + strlen(bf->fname) + 1)) == NULL)
+		return;
+	memcpy(nbf, bf, sizeof(BLOOM) + strlen(bf->fname) + 1);
+	nbf->base = NULL;
+	if (bloom_build(t, nbf) == RET_ERROR) {
+		free(nbf);
+		return;
+	}
+	__bloom_free(t);
+	t->bt_bloom = nbf;
+}
+
+/*
+ * __BLOOM_DEL -- Count a delete.  The bits stay set.
+ */
+void
+__bloom_del(t)
+	BTREE *t;
+{
+	++t->bt_bloom->ndel;
+	t->bt_bloom->dirty = 1;
+}
+
+/*
+ * __BLOOM_SAVE -- Write the filter to its file if it changed.  Called
+ * when nothing more will be written to the tree file.  Written to a
+ * temporary and renamed, so a crash leaves the old filter, which no
+ * longer matches the file and is rebuilt.
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__bloom_save(t)
+	BTREE *t;
+{
+	BLOOM *bf;
+	BLOOMHDR hdr;
+	struct stat sb;
+	char *tmp;
+	size_t len;
+	int fd, rc;
+
+	bf = t->bt_bloom;
+	if (!bf->dirty || bf->fname[0] == '\0')
+		return (RET_SUCCESS);
+	if (fstat(t->bt_fd, &sb))
+		return (RET_ERROR);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = BLOOMMAGIC;
+	hdr.version = BLOOMVERSION;
+	hdr.nblocks = bf->nblocks;
+	hdr.k = bf->k;
+	hdr.nkeys = bf->nkeys;
+	hdr.ndel = bf->ndel;
+	hdr.cap = bf->cap;
+	hdr.dbsize = sb.st_size;
+	hdr.dbmtime = ST_MTIME_NS(&sb);
+
+	if ((tmp = malloc(strlen(bf->fname) + sizeof(".tmp"))) == NULL)
+		return (RET_ERROR);
+	strcpy(tmp, bf->fname);
+	strcat(tmp, ".tmp");
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+	    0664)) < 0) {
+		free(tmp);
+		return (RET_ERROR);
+	}
+	len = (size_t)bf->nblocks * 64;
+	rc = write(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    write(fd, bf->bits, len) != len || fsync(fd);
+	if (close(fd))
+		rc = 1;
+	if (rc == 0)
+		rc = rename(tmp, bf->fname);
+	if (rc)
+		(void)unlink(tmp);
+	free(tmp);
+	if (rc)
+		return (RET_ERROR);
+	bf->dirty = 0;
+	return (RET_SUCCESS);
+}
+
+void
+__bloom_free(t)
+	BTREE *t;
+{
+	if (t->bt_bloom) {
+		free(t->bt_bloom->base);
+		free(t->bt_bloom);
+		t->bt_bloom = NULL;
+	}
+}
+
+/*
+ * BLOOM_LOAD -- Read the saved filter, if it is still good.
+ */
+static int
+bloom_load(t, bf)
+	BTREE *t;
+	BLOOM *bf;
+{
+	BLOOMHDR hdr;
+	struct stat sb, fsb;
+	size_t len;
+	int fd, rc;
+
+	if (fstat(t->bt_fd, &sb))
+		return (RET_ERROR);
+	if ((fd = open(bf->fname, O_RDONLY | O_BINARY)) < 0)
+		return (RET_ERROR);
+
+	rc = RET_ERROR;
+	if (fstat(fd, &fsb) || ST_MTIME_NS(&fsb) <= ST_MTIME_NS(&sb) ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != BLOOMMAGIC || hdr.version != BLOOMVERSION ||
+	    hdr.dbsize != (uint64_t)sb.st_size || hdr.dbmtime != ST_MTIME_NS(&sb) ||
+	    hdr.k == 0 || hdr.k > 64 || hdr.nblocks == 0 ||
+	    hdr.ndel * 2 > hdr.nkeys)
+		goto done;
+
+	bf->cap = hdr.cap;
+	if (bloom_alloc(bf, hdr.nblocks) == RET_ERROR)
+		goto done;
+	len = (size_t)hdr.nblocks * 64;
+	if (read(fd, bf->bits, len) != len) {
+		free(bf->base);
+		bf->base = NULL;
+		goto done;
+	}
+	bf->k = hdr.k;
+	bf->nkeys = hdr.nkeys;
+	bf->ndel = hdr.ndel;
+	bf->dirty = 0;
+	rc = RET_SUCCESS;
+
+done:	(void)close(fd);
+	return (rc);
+}
+
+/*
+ * BLOOM_BUILD -- Size the filter for the keys in the tree and add them.
+ * Walks the leaves, it does not use the cursor.
+ */
+static int
+bloom_build(t, bf)
+	BTREE *t;
+	BLOOM *bf;
+{
+	BLEAF *bl;
+	PAGE *h;
+	pgno_t pg;
+	indx_t i;
+	uint64_t *hashes, *nh, n, max;
+	size_t ksize, bufsize;
+	void *buf;
+	uint32_t k;
+
+	hashes = NULL;
+	buf = NULL;
+	bufsize = 0;
+	n = max = 0;
+
+	/* Down the left side of the tree. */
+	for (pg = P_ROOT;;) {
+		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
+			return (RET_ERROR);
+		if (h->flags & (P_BLEAF | P_RLEAF) || NEXTINDEX(h) == 0)
+			break;
+		pg = GETBINTERNAL(h, 0)->pgno;
+		mpool_put(t->bt_mp, h, 0);
+	}
+
+	for (;;) {
+		for (i = 0; i < NEXTINDEX(h); ++i) {
+			if (n == max) {
+				max = max ? max * 2 : 4096;
+				if ((nh = realloc(hashes,
+				    max * sizeof(uint64_t))) == NULL)
+					goto err;
+				hashes = nh;
+			}
+			bl = GETBLEAF(h, i);
+			if (bl->flags & P_BIGKEY) {
+				if (__ovfl_get(t, bl->bytes,
+				    &ksize, &buf, &bufsize))
+					goto err;
+				hashes[n++] = bloom_hash(buf, ksize);
+			} else if (PFXLEN(h) != 0) {
+				if (__bt_pfxkey(t, h, bl, &ksize, &buf, &bufsize))
+					goto err;
+				hashes[n++] = bloom_hash(buf, ksize);
+			} else
+				hashes[n++] = bloom_hash(bl->bytes, bl->ksize);
+		}
+		pg = h->nextpg;
+		mpool_put(t->bt_mp, h, 0);
+		if (pg == P_INVALID)
+			break;
+		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL) {
+			h = NULL;
+			goto err;
+		}
+	}
+	free(buf);
+
+	/* Room for half as many again before the next build. */
+	bf->cap = n + n / 2;
+	if (bf->cap < BLOOM_MIN)
+		bf->cap = BLOOM_MIN;
+	if (bloom_alloc(bf, (bf->cap * bf->bitsper + 511) / 512) ==
+	    RET_ERROR) {
+		free(hashes);
+		return (RET_ERROR);
+	}
+	/* k = ln 2 * bits per key is best */
+	k = (bf->bitsper * 69 + 50) / 100;
+	bf->k = k < 1 ? 1 : k > 16 ? 16 : k;
+	bf->nkeys = n;
+	while (n > 0)
+		bloom_set(bf, hashes[--n]);
+	free(hashes);
+	bf->ndel = 0;
+	bf->dirty = 1;
+	return (RET_SUCCESS);
+
+err:	if (h)
+		mpool_put(t->bt_mp, h, 0);
+	free(hashes);
+	free(buf);
+	return (RET_ERROR);
+}
+
+static int
+bloom_alloc(bf, nblocks)
+	BLOOM *bf;
+	uint64_t nblocks;
+{
+	if (nblocks == 0)
+		nblocks = 1;
+	if (nblocks > 0xffffffffULL) {
+		errno = EINVAL;
+		return (RET_ERROR);
+	}
+	/* Blocks on cache lines */
+	if ((bf->base = calloc(nblocks * 64 + 63, 1)) == NULL)
+		return (RET_ERROR);
+	bf->bits = (uint64_t *)(((uintptr_t)bf->base + 63) & ~(uintptr_t)63);
+	bf->nblocks = nblocks;
+	return (RET_SUCCESS);
+}
+
+static void
+bloom_set(bf, h)
+	BLOOM *bf;
+	uint64_t h;
+{
+	uint64_t *blk;
+	uint32_t h1, h2, b, i;
+
+	blk = bf->bits + 8 * (((h >> 32) * bf->nblocks) >> 32);
+	h1 = h;
+	h2 = (h * 0x9e3779b97f4a7c15ULL) >> 32 | 1;
+	for (i = 0; i < bf->k; ++i) {
+		b = (h1 + i * h2) & 511;
+		blk[b >> 6] |= 1ULL << (b & 63);
+	}
+}
+
+/*
+ * BLOOM_HASH -- MurmurHash64A.  Keys are often short strings with a
+ * common prefix, so every byte has to reach every bit.
+ */
+static uint64_t
+bloom_hash(key, len)
+	const void *key;
+	size_t len;
+{
+	const uint64_t m = 0xc6a4a7935bd1e995ULL;
+	const unsigned char *p = key;
+	uint64_t h, w;
+
+	h = 0x5bd1e995 ^ (len * m);
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		w *= m;
+		w ^= w >> 47;
+		w *= m;
+		h ^= w;
+		h *= m;
+	}
+	switch (len) {
+	case 7: h ^= (uint64_t)p[6] << 48; /* FALLTHROUGH */
+	case 6: h ^= (uint64_t)p[5] << 40; /* FALLTHROUGH */
+	case 5: h ^= (uint64_t)p[4] << 32; /* FALLTHROUGH */
+	case 4: h ^= (uint64_t)p[3] << 24; /* FALLTHROUGH */
+	case 3: h ^= (uint64_t)p[2] << 16; /* FALLTHROUGH */
+	case 2: h ^= (uint64_t)p[1] << 8; /* FALLTHROUGH */
+	case 1: h ^= (uint64_t)p[0];
+		h *= m;
+	}
+	h ^= h >> 47;
+	h *= m;
+	h ^= h >> 47;
+	return (h);
+}
@@ -0,0 +1,435 @@
+/*
+ * Bottom up btree build from sorted keys.
+ *
+ * The leaves are filled left to right and each level keeps one page
+ * being filled.  When a page is full it is written and its first key
+ * is added to the page above it, which may fill that page, and so on.
+ * The first page on each level does not get a page number until it is
+ * written, so the one page left on the top level becomes the root at
+ * P_ROOT.  The result is a normal btree file.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+
+#define	BULK_LEVELS	20
+
+/* The page being filled on each level. */
+typedef struct _blevel {
+	PAGE	*buf;			/* page being filled */
+	PAGE	*h;			/* pinned target, NULL if not assigned */
+	pgno_t	 pgno;			/* page number of h */
+	char	*sep;			/* first key on buf, for the parent */
+	uint32_t sepsize;
+	uint32_t sepmax;
+	u_char	 sepflags;
+} BLEVEL;
+
+struct _bulk {
+	BTREE	*t;
+	uint32_t limit;			/* bytes to fill on each page */
+	int	 nlevels;
+	BLEVEL	 level[BULK_LEVELS];
+	DBT	 last;			/* last key added */
+	uint32_t lastmax;
+	int	 error;
+};
+
+static int bulk_room(BULK *, int, uint32_t);
+static int bulk_internal(BULK *, int, const void *, uint32_t, u_char, pgno_t);
+static int bulk_flush(BULK *, int, int);
+static int bulk_preserve(BTREE *, pgno_t);
+static int bulk_save(char **, uint32_t *, const void *, uint32_t);
+
+/*
+ * DBBULK -- Start a bulk build of an empty btree.
+ *
+ * Parameters:
+ *	dbp:	empty btree opened for writing
+ *	fill:	percent of each page to fill, 0 for all of it
+ *
+ * Returns:
+ *	The bulk handle, NULL on error.  Nothing else may be done with
+ *	dbp until dbbulk_close().
+ */
+BULK *
+dbbulk(dbp, fill)
+	DB *dbp;
+	int fill;
+{
+	BULK *b;
+	BTREE *t;
+
+	if (dbp->type != DB_BTREE || fill < 0 || fill > 100) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	t = dbp->internal;
+	if (F_ISSET(t, B_RDONLY)) {
+		errno = EPERM;
+		return (NULL);
+	}
+	/* Only the meta page and an empty root, no filter to keep. */
+	if (t->bt_mp->npages != P_ROOT + 1 || F_ISSET(t, B_MODIFIED) ||
+	    t->bt_bloom != NULL) {
+		errno = EINVAL;
+		return (NULL);
+	}
+
+	if ((b = calloc(1, sizeof(BULK))) == NULL)
+		return (NULL);
+	b->t = t;
+	if (fill == 0)
+		fill = 100;
+	b->limit = (t->bt_psize - BTDATAOFF) * fill / 100;
+	return (b);
+}
+
+/*
+ * DBBULK_PUT -- Add the next key/data pair.
+ *
+ * Parameters:
+ *	b:	bulk handle
+ *	key:	key, must be greater than the last key
+ *	data:	data
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS.  A key out of order is EINVAL and can
+ *	be skipped, any other error stops the build.
+ */
+int
+dbbulk_put(b, key, data)
+	BULK *b;
+	const DBT *key, *data;
+{
+	BTREE *t;
+	BLEVEL *l;
+	DBT tkey, tdata, skey;
+	pgno_t pg;
+	uint32_t nbytes;
+	int dflags, status;
+	char *dest, db[NOVFLSIZE], kb[NOVFLSIZE];
+
+	t = b->t;
+	if (b->error) {
+		errno = b->error;
+		return (RET_ERROR);
+	}
+	if (b->nlevels > 0 && (*t->bt_cmp)(key, &b->last) <= 0) {
+		errno = EINVAL;
+		return (RET_ERROR);
+	}
+
+	/* Overflow the same way as __bt_put(). */
+	dflags = 0;
+	tkey = *key;
+	tdata = *data;
+	if (tkey.size + tdata.size > t->bt_ovflsize) {
+		if (tkey.size > t->bt_ovflsize) {
+storekey:		if (__ovfl_put(t, key, &pg) == RET_ERROR)
+				goto err;
+			memmove(kb, &pg, sizeof(pgno_t));
+			memmove(kb + sizeof(pgno_t),
+			    &key->size, sizeof(uint32_t));
+			tkey.data = kb;
+			tkey.size = NOVFLSIZE;
+			dflags |= P_BIGKEY;
+		}
+		if (tkey.size + tdata.size > t->bt_ovflsize) {
+			if (__ovfl_put(t, data, &pg) == RET_ERROR)
+				goto err;
+			memmove(db, &pg, sizeof(pgno_t));
+			memmove(db + sizeof(pgno_t),
+			    &data->size, sizeof(uint32_t));
+			tdata.data = db;
+			tdata.size = NOVFLSIZE;
+			dflags |= P_BIGDATA;
+		}
+		if (tkey.size + tdata.size > t->bt_ovflsize)
+			goto storekey;
+	}
+
+	/* A key without the page's prefix may start the next page. */
+	if (F_ISSET(t, B_PREFIX) && !(dflags & P_BIGKEY)) {
+		if (b->nlevels == 0 && bulk_room(b, 0, 0) == RET_ERROR)
+			goto err;
+		status = __bt_pfxput(t, b->level[0].buf,
+		    key, tdata.size, b->limit, &skey);
+		if (status == RET_SPECIAL && bulk_flush(b, 0, 0) == RET_SUCCESS)
+			status = __bt_pfxput(t, b->level[0].buf,
+			    key, tdata.size, b->limit, &skey);
+		if (status != RET_SUCCESS)
+			goto err;
+		nbytes = NBLEAFDBT(skey.size, tdata.size);
+	} else {
+		nbytes = NBLEAFDBT(tkey.size, tdata.size);
+		if (bulk_room(b, 0, nbytes) == RET_ERROR)
+			goto err;
+	}
+	l = &b->level[0];
+
+	/*
+	 * Save the parent's key for a new page.  It only needs enough to
+	 * tell it from the last key on the page to the left.  Big keys are
+	 * used as is, so their pages must never be deleted.
+	 */
+	if (NEXTINDEX(l->buf) == 0 && l->h != NULL) {
+		if (dflags & P_BIGKEY) {
+			memmove(&pg, kb, sizeof(pgno_t));
+			if (bulk_preserve(t, pg) == RET_ERROR)
+				goto err;
+			l->sepsize = NOVFLSIZE;
+			l->sepflags = P_BIGKEY;
+		} else {
+			l->sepsize = key->size;
+			if (t->bt_pfx != NULL)
+				l->sepsize = MIN(key->size,
+				    (*t->bt_pfx)(&b->last, key));
+			l->sepflags = 0;
+		}
+		if (bulk_save(&l->sep, &l->sepmax,
+		    tkey.data, l->sepsize) == RET_ERROR)
+			goto err;
+	}
+
+	if (bulk_save((char **)&b->last.data, &b->lastmax,
+	    key->data, key->size) == RET_ERROR)
+		goto err;
+	b->last.size = key->size;
+
+	/* WR_BLEAF() needs them called key and data. */
+	if (F_ISSET(t, B_PREFIX) && !(dflags & P_BIGKEY))
+		tkey = skey;
+	key = &tkey;
+	data = &tdata;
+	l->buf->linp[NEXTINDEX(l->buf)] = l->buf->upper -= nbytes;
+	l->buf->lower += sizeof(indx_t);
+	dest = (char *)l->buf + l->buf->upper;
+	WR_BLEAF(dest, key, data, dflags);
+	return (RET_SUCCESS);
+
+err:	b->error = errno ? errno : EIO;
+	return (RET_ERROR);
+}
+
+/*
+ * DBBULK_CLOSE -- Write the last pages and free the bulk handle.
+ *
+ * Parameters:
+ *	b:	bulk handle
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS.  The DB still has to be closed.
+ */
+int
+dbbulk_close(b)
+	BULK *b;
+{
+	BLEVEL *l;
+	int i, status;
+
+	/* Flushing a level can add the level above it. */
+	status = b->error ? RET_ERROR : RET_SUCCESS;
+	for (i = 0; status == RET_SUCCESS && i < b->nlevels; ++i)
+		if (bulk_flush(b, i, 1) == RET_ERROR) {
+			b->error = errno ? errno : EIO;
+			status = RET_ERROR;
+		}
+
+	if (status == RET_SUCCESS)
+		F_SET(b->t, B_MODIFIED);
+
+	for (i = 0; i < BULK_LEVELS; ++i) {
+		l = &b->level[i];
+		if (l->h != NULL)
+			mpool_put(b->t->bt_mp, l->h, 0);
+		free(l->buf);
+		free(l->sep);
+	}
+	free(b->last.data);
+	if (status == RET_ERROR)
+		errno = b->error;
+	free(b);
+	return (status);
+}
+
+/*
+ * Make room for an nbytes entry on the page for lvl, adding the level
+ * or writing a full page as needed.
+ */
+static int
+bulk_room(b, lvl, nbytes)
+	BULK *b;
+	int lvl;
+	uint32_t nbytes;
+{
+	BTREE *t;
+	PAGE *h;
+	uint32_t used;
+
+	t = b->t;
+	if (lvl == b->nlevels) {
+		if (lvl == BULK_LEVELS) {
+			errno = EFBIG;
+			return (RET_ERROR);
+		}
+		if ((h = malloc(t->bt_psize)) == NULL)
+			return (RET_ERROR);
+		h->prevpg = h->nextpg = P_INVALID;
+		h->flags = lvl ? P_BINTERNAL : P_BLEAF;
+		h->lower = BTDATAOFF;
+		h->upper = t->bt_psize;
+		b->level[lvl].buf = h;
+		b->level[lvl].pgno = P_INVALID;
+		++b->nlevels;
+		return (RET_SUCCESS);
+	}
+
+	/* Always at least one entry per page. */
+	h = b->level[lvl].buf;
+	if (NEXTINDEX(h) == 0)
+		return (RET_SUCCESS);
+	used = h->lower - BTDATAOFF + t->bt_psize - h->upper;
+	if (h->upper - h->lower < nbytes + sizeof(indx_t) ||
+	    used + nbytes + sizeof(indx_t) > b->limit)
+		return (bulk_flush(b, lvl, 0));
+	return (RET_SUCCESS);
+}
+
+/*
+ * Add an internal entry for the child page pgno to the page for lvl.
+ */
+static int
+bulk_internal(b, lvl, key, ksize, flags, pgno)
+	BULK *b;
+	int lvl;
+	const void *key;
+	uint32_t ksize;
+	u_char flags;
+	pgno_t pgno;
+{
+	BLEVEL *l;
+	uint32_t nbytes;
+	char *dest;
+
+	nbytes = NBINTERNAL(ksize);
+	if (bulk_room(b, lvl, nbytes) == RET_ERROR)
+		return (RET_ERROR);
+	l = &b->level[lvl];
+
+	/* The first key on a new page is the parent's key. */
+	if (NEXTINDEX(l->buf) == 0 && l->h != NULL) {
+		if (bulk_save(&l->sep, &l->sepmax, key, ksize) == RET_ERROR)
+			return (RET_ERROR);
+		l->sepsize = ksize;
+		l->sepflags = flags;
+	}
+
+	l->buf->linp[NEXTINDEX(l->buf)] = l->buf->upper -= nbytes;
+	l->buf->lower += sizeof(indx_t);
+	dest = (char *)l->buf + l->buf->upper;
+	WR_BINTERNAL(dest, ksize, pgno, flags);
+	memmove(dest, key, ksize);
+	return (RET_SUCCESS);
+}
+
+/*
+ * Write the page for lvl and add it to the level above.  If last is
+ * not set, start the next page on the level.  The only page on the
+ * top level is the root.
+ */
+static int
+bulk_flush(b, lvl, last)
+	BULK *b;
+	int lvl, last;
+{
+	BTREE *t;
+	BLEVEL *l;
+	PAGE *h, *next;
+	pgno_t npgno;
+
+	t = b->t;
+	l = &b->level[lvl];
+	h = l->buf;
+
+	if (last && l->h == NULL && lvl == b->nlevels - 1) {
+		if ((next = mpool_get(t->bt_mp, P_ROOT, 0)) == NULL)
+			return (RET_ERROR);
+		memmove(next, h, t->bt_psize);
+		next->pgno = P_ROOT;
+		return (mpool_put(t->bt_mp, next, MPOOL_DIRTY));
+	}
+
+	if (l->h == NULL && (l->h = __bt_new(t, &l->pgno)) == NULL)
+		return (RET_ERROR);
+	next = NULL;
+	npgno = P_INVALID;
+	if (!last && (next = __bt_new(t, &npgno)) == NULL)
+		return (RET_ERROR);
+
+	h->pgno = l->pgno;
+	h->nextpg = npgno;
+	memmove(l->h, h, t->bt_psize);
+	if (mpool_put(t->bt_mp, l->h, MPOOL_DIRTY) == RET_ERROR) {
+		l->h = next;
+		return (RET_ERROR);
+	}
+	l->h = next;
+
+	/* The left most key at each level is never looked at. */
+	if (bulk_internal(b, lvl + 1, l->sep,
+	    h->prevpg == P_INVALID ? 0 : l->sepsize,
+	    h->prevpg == P_INVALID ? 0 : l->sepflags, l->pgno) == RET_ERROR)
+		return (RET_ERROR);
+
+	if (!last) {
+		h->prevpg = l->pgno;
+		h->nextpg = P_INVALID;
+		h->flags &= ~P_PFXMASK;
+		h->lower = BTDATAOFF;
+		h->upper = t->bt_psize;
+		l->pgno = npgno;
+	}
+	return (RET_SUCCESS);
+}
+
+/*
+ * Mark an overflow key used by an internal page, as bt_preserve().
+ */
+static int
+bulk_preserve(t, pg)
+	BTREE *t;
+	pgno_t pg;
+{
+	PAGE *h;
+
+	if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
+		return (RET_ERROR);
+	h->flags |= P_PRESERVE;
+	return (mpool_put(t->bt_mp, h, MPOOL_DIRTY));
+}
+
+static int
+bulk_save(buf, max, data, size)
+	char **buf;
+	uint32_t *max;
+	const void *data;
+	uint32_t size;
+{
+	char *p;
+
+	if (size > *max) {
+		if ((p = realloc(*buf, size)) == NULL)
+			return (RET_ERROR);
+		*buf = p;
+		*max = size;
+	}
+	if (size)
+		memmove(*buf, data, size);
+	return (RET_SUCCESS);
+}
@@ -81,7 +81,14 @@ __bt_close(dbp)
 	if (mpool_close(t->bt_mp) == RET_ERROR)
 		return (RET_ERROR);
 
+	/* After the pool, a log checkpoint changes the file. Best effort. */
+	if (t->bt_bloom != NULL) {
+		(void)__bloom_save(t);
+		__bloom_free(t);
+	}
+
 	/* Free random memory. */
+	__ovfl_cache_free(t);
 	if (t->bt_cursor.key.data != NULL) {
 		free(t->bt_cursor.key.data);
 		t->bt_cursor.key.size = 0;
@@ -168,8 +175,8 @@ bt_meta(t)
 
 	/* Fill in metadata. */
 	m.magic = BTREEMAGIC;
-	m.version = BTREEVERSION;
-	m.psize = t->bt_psize;
+	m.version = F_ISSET(t, B_PREFIX) ? BTREEPFXVERSION : BTREEVERSION;
+	m.psize = t->bt_mp->pagesize;
 	m.free = t->bt_free;
 	m.nrecs = t->bt_nrecs;
 	m.flags = F_ISSET(t, SAVEMETA);
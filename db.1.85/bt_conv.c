@@ -38,30 +38,74 @@
 static char sccsid[] = "@(#)bt_conv.c	8.5 (Berkeley) 8/17/94";
 #endif /* LIBC_SCCS and not lint */
 
+#include <errno.h>
 #include <stdlib.h>
 
+#include "samlib.h"
 #include "btree.h"
 
 static void mswap(PAGE *);
+static uint32_t pgsum(BTREE *, void *);
+
+/* The checksum is little endian, whatever the tree's byte order. */
+#define	P_32_GETLE(p)							\
+	((p)[0] | (p)[1] << 8 | (p)[2] << 16 | (uint32_t)(p)[3] << 24)
+#define	P_32_PUTLE(p, v) {						\
+	(p)[0] = (v);							\
+	(p)[1] = (v) >> 8;						\
+	(p)[2] = (v) >> 16;						\
+	(p)[3] = (v) >> 24;						\
+}
+
+/*
+ * The data reference of a big data item, p is just past the flags or
+ * the big key reference.  Format 3 files always skip 4 bytes, which is
+ * only right after a big key, and have been written that way.
+ */
+#define	BIGDATA(t, p, ksize, flags)					\
+	(F_ISSET(((BTREE *)(t)), B_PREFIX) && !((flags) & P_BIGKEY) ?	\
+	    (p) + (ksize) : (p) + sizeof(uint32_t))
 
 /*
  * __BT_BPGIN, __BT_BPGOUT --
  *	Convert host-specific number layout to/from the host-independent
- *	format stored on disk.
+ *	format stored on disk.  With B_CRC, pages going out get a checksum
+ *	and pages coming in are checked.  __bt_pgundo converts a page
+ *	that mpool just wrote back without checking the sum, since the
+ *	page in memory is known good.
  *
  * Parameters:
  *	t:	tree
  *	pg:	page number
  *	h:	page to convert
+ *
+ * Returns:
+ *	__bt_pgin returns RET_ERROR with errno EIO for a bad checksum.
  */
-void
+int
 __bt_pgin(t, pg, pp)
 	void *t;
 	pgno_t pg;
 	void *pp;
+{
+	if (F_ISSET(((BTREE *)t), B_CRC) &&
+	    pgsum(t, pp) != P_32_GETLE((u_char *)pp + ((BTREE *)t)->bt_psize)) {
+		errno = EIO;
+		return (RET_ERROR);
+	}
+	__bt_pgundo(t, pg, pp);
+	return (RET_SUCCESS);
+}
+
+void
+__bt_pgundo(t, pg, pp)
+	void *t;
+	pgno_t pg;
+	void *pp;
 {
 	PAGE *h;
 	indx_t i, top;
+	uint32_t ksize;
 	u_char flags;
 	char *p;
 
@@ -101,6 +145,7 @@ __bt_pgin(t, pg, pp)
 			M_16_SWAP(h->linp[i]);
 			p = (char *)GETBLEAF(h, i);
 			P_32_SWAP(p);
+			ksize = GETBLEAF(h, i)->ksize;
 			p += sizeof(uint32_t);
 			P_32_SWAP(p);
 			p += sizeof(uint32_t);
@@ -113,7 +158,7 @@ __bt_pgin(t, pg, pp)
 					P_32_SWAP(p);
 				}
 				if (flags & P_BIGDATA) {
-					p += sizeof(uint32_t);
+					p = BIGDATA(t, p, ksize, flags);
 					P_32_SWAP(p);
 					p += sizeof(pgno_t);
 					P_32_SWAP(p);
@@ -130,14 +175,15 @@ __bt_pgout(t, pg, pp)
 {
 	PAGE *h;
 	indx_t i, top;
+	uint32_t ksize;
 	u_char flags;
 	char *p;
 
 	if (!F_ISSET(((BTREE *)t), B_NEEDSWAP))
-		return;
+		goto sum;
 	if (pg == P_META) {
 		mswap(pp);
-		return;
+		goto sum;
 	}
 
 	h = pp;
@@ -160,6 +206,7 @@ __bt_pgout(t, pg, pp)
 	else if ((h->flags & P_TYPE) == P_BLEAF)
 		for (i = 0; i < top; i++) {
 			p = (char *)GETBLEAF(h, i);
+			ksize = GETBLEAF(h, i)->ksize;
 			P_32_SWAP(p);
 			p += sizeof(uint32_t);
 			P_32_SWAP(p);
@@ -173,7 +220,7 @@ __bt_pgout(t, pg, pp)
 					P_32_SWAP(p);
 				}
 				if (flags & P_BIGDATA) {
-					p += sizeof(uint32_t);
+					p = BIGDATA(t, p, ksize, flags);
 					P_32_SWAP(p);
 					p += sizeof(pgno_t);
 					P_32_SWAP(p);
@@ -188,6 +235,22 @@ __bt_pgout(t, pg, pp)
 	M_32_SWAP(h->flags);
 	M_16_SWAP(h->lower);
 	M_16_SWAP(h->upper);
+
+sum:	if (F_ISSET(((BTREE *)t), B_CRC)) {
+		u_char *s = (u_char *)pp + ((BTREE *)t)->bt_psize;
+		uint32_t sum = pgsum(t, pp);
+
+		P_32_PUTLE(s, sum);
+	}
+}
+
+/* The checksum of a page as stored, in the bytes after bt_psize. */
+static uint32_t
+pgsum(t, pp)
+	BTREE *t;
+	void *pp;
+{
+	return (crc32c(0, pp, t->bt_psize));
 }
 
 /*
@@ -84,6 +84,8 @@ __bt_delete(dbp, key, flags)
 
 	switch (flags) {
 	case 0:
+		if (t->bt_bloom != NULL && !__bloom_maybe(t->bt_bloom, key))
+			return (RET_SPECIAL);
 		status = __bt_bdelete(t, key);
 		break;
 	case R_CURSOR:
@@ -121,8 +123,11 @@ __bt_delete(dbp, key, flags)
 		errno = EINVAL;
 		return (RET_ERROR);
 	}
-	if (status == RET_SUCCESS)
+	if (status == RET_SUCCESS) {
 		F_SET(t, B_MODIFIED);
+		if (t->bt_bloom != NULL)
+			__bloom_del(t);
+	}
 	return (status);
 }
 
@@ -70,6 +70,29 @@ __bt_get(dbp, key, data, flags)
 
 	t = dbp->internal;
 
+	/* Most misses never get to the tree. */
+	if (t->bt_bloom != NULL && !__bloom_maybe(t->bt_bloom, key))
+		return (RET_SPECIAL);
+
+	/*
+	 * Mapped trees search with a local EPG and pin nothing, so
+	 * concurrent gets are safe.  If data comes with a buffer, big
+	 * data is copied into it rather than kept until close.
+	 */
+	if (F_ISSET(t, B_MMAP)) {
+		EPG me;
+
+		if (flags) {
+			errno = EINVAL;
+			return (RET_ERROR);
+		}
+		if (__bt_msearch(t, key, &exact, &me) == NULL)
+			return (RET_ERROR);
+		if (!exact)
+			return (RET_SPECIAL);
+		return (__bt_ret(t, &me, NULL, NULL, data, NULL, 0));
+	}
+
 	/* Toss any page pinned across calls. */
 	if (t->bt_pinned != NULL) {
 		mpool_put(t->bt_mp, t->bt_pinned, 0);
@@ -98,10 +98,12 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 	BTREEINFO b;
 	DB *dbp;
 	pgno_t ncache;
-	int nr;
+	int nr, logfd;
 	int machine_lorder;
+	char *logname;
 
 	t = NULL;
+	logfd = -1;
 
 	/*
 	 * Intention is to make sure all of the user's selections are okay
@@ -144,6 +146,11 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 
 		if (b.lorder == 0)
 			b.lorder = machine_lorder;
+
+		/* Format of a new tree, the default is the old one. */
+		if (b.version != 0 && b.version != BTREEVERSION &&
+		    b.version != BTREEPFXVERSION)
+			goto einval;
 	} else {
 		b.compare = __bt_defcmp;
 		b.cachesize = 0;
@@ -152,6 +159,8 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 		b.minkeypage = DEFMINKEYPAGE;
 		b.prefix = __bt_defpfx;
 		b.psize = 0;
+		b.bloombits = 0;
+		b.version = 0;
 	}
 
 	/* Check for the ubiquitous PDP-11. */
@@ -223,6 +232,33 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 		goto err;
 #endif
 
+	/*
+	 * The write ahead log is fname-wal.  Replay it before the meta data
+	 * is read, a crash may have left the file half written.
+	 */
+	if (dflags & DB_WAL) {
+		if (F_ISSET(t, B_INMEM | B_RDONLY) || (dflags & DB_MMAP))
+			goto einval;
+		if ((logname = malloc(strlen(fname) + 5)) == NULL)
+			goto err;
+		strcpy(logname, fname);
+		strcat(logname, "-wal");
+		logfd = open(logname, O_RDWR | O_CREAT | O_BINARY, mode);
+		free(logname);
+		if (logfd < 0)
+			goto err;
+#ifndef WIN32
+		if (fcntl(logfd, F_SETFD, 1) == -1)
+			goto err;
+#endif
+		/* A truncated tree has nothing to replay the log into. */
+		if (flags & O_TRUNC) {
+			if (ftruncate(logfd, 0))
+				goto err;
+		} else if (mpool_recover(t->bt_fd, logfd) == RET_ERROR)
+			goto err;
+	}
+
 	if (fstat(t->bt_fd, &sb))
 		goto err;
 	if (sb.st_size) {
@@ -250,7 +286,8 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 			M_32_SWAP(m.nrecs);
 			M_32_SWAP(m.flags);
 		}
-		if (m.magic != BTREEMAGIC || m.version != BTREEVERSION)
+		if (m.magic != BTREEMAGIC || (m.version != BTREEVERSION &&
+		    m.version != BTREEPFXVERSION))
 			goto eftype;
 		if (m.psize < MINPSIZE || m.psize > MAX_PAGE_OFFSET + 1 ||
 			(m.psize & (sizeof(indx_t) - 1)))
@@ -259,6 +296,8 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 			goto eftype;
 		b.psize = m.psize;
 		F_SET(t, m.flags);
+		if (m.version == BTREEPFXVERSION)
+			F_SET(t, B_PREFIX | B_CRC);
 		t->bt_free = m.free;
 		t->bt_nrecs = m.nrecs;
 	} else {
@@ -283,12 +322,26 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 		if (!(b.flags & R_DUP))
 			F_SET(t, B_NODUPS);
 
+		/* An in-memory tree has nothing to check sums for. */
+		if (b.version == BTREEPFXVERSION) {
+			F_SET(t, B_PREFIX);
+			if (!F_ISSET(t, B_INMEM))
+				F_SET(t, B_CRC);
+		}
+
 		t->bt_free = P_INVALID;
 		t->bt_nrecs = 0;
 		F_SET(t, B_METADIRTY);
 	}
 
+	/* Prefixes are cut from keys in memcmp() order. */
+	if (F_ISSET(t, B_PREFIX) && t->bt_cmp != __bt_defcmp)
+		goto einval;
+
+	/* The checksum is in the last bytes of each page. */
 	t->bt_psize = b.psize;
+	if (F_ISSET(t, B_CRC))
+		t->bt_psize -= sizeof(uint32_t);
 
 	/* Set the cache size; must be a multiple of the page size. */
 	if (b.cachesize && (b.cachesize & (b.psize - 1)))
@@ -297,7 +350,7 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 		b.cachesize = b.psize * MINCACHE;
 
 	/* Calculate number of pages to cache. */
-	ncache = (b.cachesize + t->bt_psize - 1) / t->bt_psize;
+	ncache = (b.cachesize + b.psize - 1) / b.psize;
 
 	/*
 	 * The btree data structure requires that at least two keys can fit on
@@ -312,16 +365,25 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 	 */
 	t->bt_ovflsize = (t->bt_psize - BTDATAOFF) / b.minkeypage -
 		(sizeof(indx_t) + NBLEAFDBT(0, 0));
+	/* Leave room for a prefix split's rounding, see __bt_pfxsplit(). */
+	if (F_ISSET(t, B_PREFIX))
+		t->bt_ovflsize -= sizeof(uint32_t);
 	if (t->bt_ovflsize < NBLEAFDBT(NOVFLSIZE, NOVFLSIZE) + sizeof(indx_t))
 		t->bt_ovflsize =
 			NBLEAFDBT(NOVFLSIZE, NOVFLSIZE) + sizeof(indx_t);
 
 	/* Initialize the buffer pool. */
 	if ((t->bt_mp =
-		mpool_open(NULL, t->bt_fd, t->bt_psize, ncache)) == NULL)
+		mpool_open(NULL, t->bt_fd, b.psize, ncache)) == NULL)
 		goto err;
 	if (!F_ISSET(t, B_INMEM))
-		mpool_filter(t->bt_mp, __bt_pgin, __bt_pgout, t);
+		mpool_filter(t->bt_mp,
+		    __bt_pgin, __bt_pgout, __bt_pgundo, t);
+	if (logfd != -1) {
+		if (mpool_wal(t->bt_mp, logfd) == RET_ERROR)
+			goto err;
+		logfd = -1;
+	}
 
 	/* Create a root page if new tree. */
 	if (nroot(t) == RET_ERROR)
@@ -331,6 +393,28 @@ __bt_open(fname, flags, mode, openinfo, dflags)
 	if (dflags & DB_LOCK)
 		F_SET(t, B_DB_LOCK);
 
+	/*
+	 * Map the file and use the pages in place.  Only for read only
+	 * trees in our byte order, since the pages cannot be changed.
+	 */
+	if (dflags & DB_MMAP) {
+		if (!F_ISSET(t, B_RDONLY) || F_ISSET(t, B_NEEDSWAP | B_INMEM))
+			goto einval;
+		if (mpool_mmap(t->bt_mp) == RET_ERROR)
+			goto err;
+		/* The pages never move, so there is nothing to copy. */
+		F_CLR(t, B_DB_LOCK);
+		F_SET(t, B_MMAP);
+		if ((t->bt_ovcache =
+		    calloc(OVCACHE_HASH, sizeof(OVCACHE *))) == NULL)
+			goto err;
+		t->bt_ovmax = MAX(b.cachesize, OVCACHE_MIN);
+	}
+
+	if ((dflags & DB_BLOOM) &&
+	    __bloom_open(t, fname, b.bloombits) == RET_ERROR)
+		goto err;
+
 	return (dbp);
 
 einval:	errno = EINVAL;
@@ -339,11 +423,16 @@ einval:	errno = EINVAL;
 eftype:	errno = EFTYPE;
 	goto err;
 
-err:	if (t) {
+err:	if (logfd != -1)
+		(void)close(logfd);
+	if (t) {
+		if (t->bt_mp)
+			mpool_close(t->bt_mp);
 		if (t->bt_dbp)
 			free(t->bt_dbp);
 		if (t->bt_fd != -1)
 			(void)close(t->bt_fd);
+		__ovfl_cache_free(t);
 		free(t);
 	}
 	return (NULL);
@@ -496,3 +585,38 @@ __bt_fd(dbp)
 	}
 	return (t->bt_fd);
 }
+
+/*
+ * __BT_STAT -- Get the buffer pool statistics.
+ *
+ * Parameters:
+ *	dbp:	pointer to access method
+ *	st:	statistics to fill in
+ *
+ * Returns:
+ *	RET_SUCCESS
+ */
+int
+__bt_stat(dbp, st)
+	const DB *dbp;
+	DBSTAT *st;
+{
+	MPOOL *mp;
+
+	mp = ((BTREE *)dbp->internal)->bt_mp;
+
+	st->psize = mp->pagesize;
+	st->npages = mp->npages;
+	st->curcache = mp->curcache;
+	st->maxcache = mp->maxcache;
+	st->cachehit = mp->cachehit;
+	st->cachemiss = mp->cachemiss;
+	st->pageget = mp->pageget;
+	st->pageput = mp->pageput;
+	st->pagenew = mp->pagenew;
+	st->pagealloc = mp->pagealloc;
+	st->pageflush = mp->pageflush;
+	st->pageread = mp->pageread;
+	st->pagewrite = mp->pagewrite;
+	return (RET_SUCCESS);
+}
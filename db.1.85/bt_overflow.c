@@ -38,6 +38,8 @@
 static char sccsid[] = "@(#)bt_overflow.c	8.5 (Berkeley) 7/16/94";
 #endif /* LIBC_SCCS and not lint */
 
+#include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -120,6 +122,199 @@ __ovfl_get(t, p, ssz, buf, bufsz)
 	return (RET_SUCCESS);
 }
 
+/*
+ * __OVFL_COPY -- Copy an overflow key/data item into the caller's
+ *	buffer.  At most bufsz bytes are copied but ssz gets the full size.
+ *
+ * Parameters:
+ *	t:	tree
+ *	p:	pointer to { pgno_t, uint32_t }
+ *	buf:	the caller's buffer
+ *	bufsz:	its size
+ *	ssz:	pointer to the item size
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__ovfl_copy(t, p, buf, bufsz, ssz)
+	BTREE *t;
+	void *p;
+	void *buf;
+	size_t bufsz;
+	size_t *ssz;
+{
+	PAGE *h;
+	pgno_t pg;
+	size_t len, nb, plen;
+	uint32_t sz;
+	char *p1;
+
+	memmove(&pg, p, sizeof(pgno_t));
+	memmove(&sz, (char *)p + sizeof(pgno_t), sizeof(uint32_t));
+	*ssz = sz;
+
+	plen = t->bt_psize - BTDATAOFF;
+	len = MIN(sz, bufsz);
+	for (p1 = buf; len > 0; p1 += nb, len -= nb, pg = h->nextpg) {
+		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
+			return (RET_ERROR);
+		nb = MIN(len, plen);
+		memmove(p1, (char *)h + BTDATAOFF, nb);
+		mpool_put(t->bt_mp, h, 0);
+	}
+	return (RET_SUCCESS);
+}
+
+/*
+ * __OVFL_CMP -- Compare a key with an overflow key in place.  Only for
+ *	__bt_defcmp() on a B_MMAP tree, where the pages are in the mapping
+ *	and are never pinned, so nothing is copied or locked.
+ *
+ * Parameters:
+ *	t:	tree
+ *	k1:	key to compare
+ *	p:	pointer to { pgno_t, uint32_t }
+ *	cmp:	pointer to the result, as for __bt_defcmp()
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__ovfl_cmp(t, k1, p, cmp)
+	BTREE *t;
+	const DBT *k1;
+	void *p;
+	int *cmp;
+{
+	PAGE *h;
+	pgno_t pg;
+	size_t len, nb, plen;
+	uint32_t sz;
+	char *p1;
+
+	memmove(&pg, p, sizeof(pgno_t));
+	memmove(&sz, (char *)p + sizeof(pgno_t), sizeof(uint32_t));
+
+	plen = t->bt_psize - BTDATAOFF;
+	len = MIN(k1->size, sz);
+	for (p1 = k1->data; len > 0; p1 += nb, len -= nb, pg = h->nextpg) {
+		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
+			return (RET_ERROR);
+		nb = MIN(len, plen);
+		if ((*cmp = memcmp(p1, (char *)h + BTDATAOFF, nb)) != 0)
+			return (RET_SUCCESS);
+	}
+	*cmp = (int)k1->size - (int)sz;
+	return (RET_SUCCESS);
+}
+
+/*
+ * __OVFL_GET_CACHED -- Get an overflow key/data item that stays valid
+ *	until close.  Safe to call from many threads.  Fails with ENOBUFS
+ *	once the copies would go over bt_ovmax bytes.
+ *
+ * Parameters:
+ *	t:	tree
+ *	p:	pointer to { pgno_t, uint32_t }
+ *	ssz:	pointer to the item size
+ *	data:	pointer to the item
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__ovfl_get_cached(t, p, ssz, data)
+	BTREE *t;
+	void *p;
+	size_t *ssz;
+	void **data;
+{
+	OVCACHE *oc, **head;
+	void *buf;
+	size_t sz, bufsz;
+	uint32_t sz32;
+	pgno_t pg;
+	int status;
+
+	memmove(&pg, p, sizeof(pgno_t));
+	head = &t->bt_ovcache[pg % OVCACHE_HASH];
+
+	/*
+	 * A copy is published at the head of its bucket and never
+	 * changed or freed until close, so a hit takes no lock.
+	 */
+	for (oc = __atomic_load_n(head, __ATOMIC_ACQUIRE); oc; oc = oc->next)
+		if (oc->pgno == pg)
+			goto hit;
+
+	while (__sync_lock_test_and_set(&t->bt_ovlock, 1))
+		sched_yield();
+
+	/* Someone may have beaten us to it */
+	status = RET_ERROR;
+	for (oc = *head; oc; oc = oc->next)
+		if (oc->pgno == pg)
+			goto found;
+
+	memmove(&sz32, (char *)p + sizeof(pgno_t), sizeof(uint32_t));
+	if (t->bt_ovbytes + sz32 > t->bt_ovmax) {
+		errno = ENOBUFS;
+		goto done;
+	}
+
+	buf = NULL;
+	bufsz = 0;
+	if (__ovfl_get(t, p, &sz, &buf, &bufsz) == RET_ERROR) {
+		free(buf);
+		goto done;
+	}
+	if ((oc = malloc(sizeof(OVCACHE) + sz)) == NULL) {
+		free(buf);
+		goto done;
+	}
+	memcpy(oc->data, buf, sz);
+	free(buf);
+	oc->pgno = pg;
+	oc->size = sz;
+	oc->next = *head;
+	__atomic_store_n(head, oc, __ATOMIC_RELEASE);
+	t->bt_ovbytes += sz;
+
+found:	status = RET_SUCCESS;
+done:	__sync_lock_release(&t->bt_ovlock);
+	if (status != RET_SUCCESS)
+		return (status);
+hit:	*ssz = oc->size;
+	*data = oc->data;
+	return (RET_SUCCESS);
+}
+
+/*
+ * __OVFL_CACHE_FREE -- Free the overflow copies.
+ *
+ * Parameters:
+ *	t:	tree
+ */
+void
+__ovfl_cache_free(t)
+	BTREE *t;
+{
+	OVCACHE *oc, *next;
+	int i;
+
+	if (t->bt_ovcache == NULL)
+		return;
+	for (i = 0; i < OVCACHE_HASH; ++i)
+		for (oc = t->bt_ovcache[i]; oc; oc = next) {
+			next = oc->next;
+			free(oc);
+		}
+	free(t->bt_ovcache);
+	t->bt_ovcache = NULL;
+	t->bt_ovbytes = 0;
+}
+
 /*
  * __OVFL_PUT -- Store an overflow key/data item.
  *
@@ -0,0 +1,489 @@
+/*
+ * Prefix compressed leaf pages for B_PREFIX trees.
+ *
+ * The keys on a leaf page are stored without the prefix they all share.
+ * The prefix is kept at the top of the page, above the items, with its
+ * length in the high bits of the page flags, so a page with no prefix is
+ * an ordinary leaf page.  Big keys are stored whole and do not count.
+ *
+ * Keys are in memcmp() order, so a key without the page's prefix sorts
+ * before or after every key on the page.  Puts only ever cut a prefix
+ * back, to the part the new key shares; splits give each half the
+ * longest prefix of its keys.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+
+/* An item on its way to a page, with the prefix it was stored without. */
+typedef struct {
+	const char *pfx;		/* first plen bytes of the key */
+	const char *key;		/* rest of the key, ksize bytes */
+	const char *data;
+	uint32_t plen;
+	uint32_t ksize;
+	uint32_t dsize;
+	u_char	 flags;
+} PFXITEM;
+
+#define	ITEMBYTE(it, j)							\
+	((j) < (it)->plen ? (it)->pfx[j] : (it)->key[(j) - (it)->plen])
+
+static uint32_t	 item_lcp(const PFXITEM *, const PFXITEM *);
+static void	 item_get(BTREE *, PAGE *, indx_t, PFXITEM *);
+static uint32_t	 item_size(const PFXITEM *, uint32_t);
+static void	 item_write(BTREE *, PAGE *, indx_t, const PFXITEM *, uint32_t);
+static void	 pfx_init(BTREE *, PAGE *, const PFXITEM *, uint32_t);
+static void	 pfx_item(BTREE *, PAGE *, indx_t, const PFXITEM *, indx_t,
+		    PFXITEM *);
+static uint32_t	 pfx_choose(BTREE *, PAGE *, indx_t, const PFXITEM *,
+		    indx_t, indx_t, uint32_t, PFXITEM *);
+
+/*
+ * __BT_PFXKEY -- Put the whole key of a leaf item together.
+ *
+ * Parameters:
+ *	t:	tree
+ *	h:	page the item is on
+ *	bl:	item, not a big key
+ *	ssz:	pointer to the key size
+ *	buf:	pointer to the buffer, grown as needed
+ *	bufsz:	pointer to the buffer size
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__bt_pfxkey(t, h, bl, ssz, buf, bufsz)
+	BTREE *t;
+	PAGE *h;
+	BLEAF *bl;
+	size_t *ssz;
+	void **buf;
+	size_t *bufsz;
+{
+	size_t plen, sz;
+	void *p;
+
+	plen = PFXLEN(h);
+	sz = plen + bl->ksize;
+	if (*bufsz < sz) {
+		if ((p = realloc(*buf, sz)) == NULL)
+			return (RET_ERROR);
+		*buf = p;
+		*bufsz = sz;
+	}
+	memmove(*buf, PFXKEY(t, h), plen);
+	memmove((char *)*buf + plen, bl->bytes, bl->ksize);
+	*ssz = sz;
+	return (RET_SUCCESS);
+}
+
+/*
+ * __BT_PFXPUT -- Get a leaf page ready for a key.
+ *
+ * An empty page takes the whole key as its prefix.  If the key does not
+ * have the page's prefix, the items are rewritten with the part the key
+ * does have.
+ *
+ * Parameters:
+ *	t:	tree
+ *	h:	page
+ *	key:	key to put, not a big key
+ *	dsize:	size of its data
+ *	limit:	most bytes of the page to use, not counting the header
+ *	skey:	set to the part of the key to store
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS, or RET_SPECIAL if it does not fit in limit
+ *	and the page is unchanged.
+ */
+int
+__bt_pfxput(t, h, key, dsize, limit, skey)
+	BTREE *t;
+	PAGE *h;
+	const DBT *key;
+	uint32_t dsize, limit;
+	DBT *skey;
+{
+	PAGE *tp;
+	PFXITEM it;
+	const char *pfx;
+	uint32_t m, plen, used;
+	indx_t i, top;
+
+	top = NEXTINDEX(h);
+	if (top == 0) {
+		memset(&it, 0, sizeof(it));
+		it.key = key->data;
+		it.ksize = key->size;
+		pfx_init(t, h, &it, key->size);
+		m = key->size;
+	} else {
+		plen = PFXLEN(h);
+		pfx = PFXKEY(t, h);
+		for (m = 0; m < plen && m < key->size &&
+		    pfx[m] == ((char *)key->data)[m]; ++m)
+			;
+		if (m == plen) {
+			used = h->lower - BTDATAOFF + t->bt_psize - h->upper;
+			if (used + NBLEAFDBT(key->size - m, dsize) +
+			    sizeof(indx_t) > limit)
+				return (RET_SPECIAL);
+		} else {
+			/* Cut the prefix back to m, if everything fits. */
+			used = LALIGN(m) + (top + 1) * sizeof(indx_t) +
+			    NBLEAFDBT(key->size - m, dsize);
+			for (i = 0; i < top; ++i) {
+				item_get(t, h, i, &it);
+				used += item_size(&it, m);
+			}
+			if (used > limit)
+				return (RET_SPECIAL);
+
+			if ((tp = malloc(t->bt_psize)) == NULL)
+				return (RET_ERROR);
+			memmove(tp, h, t->bt_psize);
+			item_get(t, tp, 0, &it);
+			it.pfx = PFXKEY(t, tp);
+			it.plen = plen;
+			pfx_init(t, h, &it, m);
+			for (i = 0; i < top; ++i) {
+				item_get(t, tp, i, &it);
+				item_write(t, h, i, &it, m);
+			}
+			h->lower = BTDATAOFF + top * sizeof(indx_t);
+			free(tp);
+		}
+	}
+
+	skey->data = (char *)key->data + m;
+	skey->size = key->size - m;
+	return (RET_SUCCESS);
+}
+
+/*
+ * __BT_PFXSPLIT -- Split a prefix compressed leaf page, as bt_psplit().
+ *
+ * Sizes are worked out with the prefix each half is sure to have: the
+ * old page's, or for the half getting a key without it, the part the
+ * key shares.  Such a key sorts before or after all the prefixed keys,
+ * so that half is filled from its end to half a page first.  Then each
+ * half gets the longest prefix of its keys, unless the alignment makes
+ * that bigger.
+ *
+ * Parameters:
+ *	t:	tree
+ *	h:	page to be split
+ *	l:	page to put lower half of data
+ *	r:	page to put upper half of data
+ *	pskip:	pointer to index to leave open
+ *	key:	key to insert
+ *	data:	data to insert
+ *	flags:	BIGKEY/BIGDATA flags
+ *
+ * Returns:
+ *	Pointer to page in which to insert.
+ */
+PAGE *
+__bt_pfxsplit(t, h, l, r, pskip, key, data, flags)
+	BTREE *t;
+	PAGE *h, *l, *r;
+	indx_t *pskip;
+	const DBT *key, *data;
+	int flags;
+{
+	CURSOR *c;
+	PAGE *rval;
+	PFXITEM it, nit, lfirst, rfirst;
+	const char *pfx;
+	uint32_t half, m, plen, lbase, rbase, lplen, rplen, used;
+	indx_t i, n, s, skip, top;
+
+	skip = *pskip;
+	top = NEXTINDEX(h);
+	n = top + 1;
+
+	nit.pfx = NULL;
+	nit.plen = 0;
+	nit.key = key->data;
+	nit.ksize = key->size;
+	nit.data = data->data;
+	nit.dsize = data->size;
+	nit.flags = flags;
+
+	plen = PFXLEN(h);
+	pfx = PFXKEY(t, h);
+	m = plen;
+	if (!(flags & P_BIGKEY))
+		for (m = 0; m < plen && m < key->size &&
+		    pfx[m] == ((char *)key->data)[m]; ++m)
+			;
+
+	/* S is the first item on the right page. */
+	half = (t->bt_psize - BTDATAOFF) / 2;
+	if (m == plen) {
+		lbase = rbase = plen;
+		used = LALIGN(lbase);
+		for (s = 0;;) {
+			pfx_item(t, h, skip, &nit, s, &it);
+			used += item_size(&it, lbase) + sizeof(indx_t);
+			if (++s == n - 1 || used >= half)
+				break;
+		}
+	} else if (m == key->size ||
+	    (u_char)pfx[m] > ((u_char *)key->data)[m]) {
+		/*
+		 * The key sorts before the prefixed keys, after any big keys
+		 * in front of them.  Fill the left page up to and including
+		 * it, or if that is too much, start the right page with it.
+		 */
+		lbase = m;
+		rbase = plen;
+		used = LALIGN(lbase);
+		for (s = 0;;) {
+			pfx_item(t, h, skip, &nit, s, &it);
+			used += item_size(&it, lbase) + sizeof(indx_t);
+			if (++s == n - 1 || (s > skip && used >= half))
+				break;
+		}
+		if (s <= skip ||
+		    (skip > 0 && used > t->bt_psize - BTDATAOFF)) {
+			s = skip;
+			lbase = plen;
+			rbase = m;
+		}
+	} else {
+		/* The same, the other way, for a key after the prefixed keys. */
+		lbase = plen;
+		rbase = m;
+		used = LALIGN(rbase);
+		for (s = n - 1;; --s) {
+			pfx_item(t, h, skip, &nit, s, &it);
+			used += item_size(&it, rbase) + sizeof(indx_t);
+			if (s == 1 || (s <= skip && used >= half))
+				break;
+		}
+		if (s > skip ||
+		    (skip < n - 1 && used > t->bt_psize - BTDATAOFF)) {
+			s = skip + 1;
+			lbase = m;
+			rbase = plen;
+		}
+	}
+
+	lplen = pfx_choose(t, h, skip, &nit, 0, s, lbase, &lfirst);
+	rplen = pfx_choose(t, h, skip, &nit, s, n, rbase, &rfirst);
+
+	pfx_init(t, l, &lfirst, lplen);
+	for (i = 0; i < s; ++i)
+		if (i != skip) {
+			pfx_item(t, h, skip, &nit, i, &it);
+			item_write(t, l, i, &it, lplen);
+		}
+	l->lower = BTDATAOFF + s * sizeof(indx_t);
+
+	pfx_init(t, r, &rfirst, rplen);
+	for (i = s; i < n; ++i)
+		if (i != skip) {
+			pfx_item(t, h, skip, &nit, i, &it);
+			item_write(t, r, i - s, &it, rplen);
+		}
+	r->lower = BTDATAOFF + (n - s) * sizeof(indx_t);
+
+	/* The cursor index is on the old page, the split ones include skip. */
+	c = &t->bt_cursor;
+	if (F_ISSET(c, CURS_INIT) && c->pg.pgno == h->pgno) {
+		if (c->pg.index >= skip)
+			++c->pg.index;
+		if (c->pg.index < s)
+			c->pg.pgno = l->pgno;
+		else {
+			c->pg.pgno = r->pgno;
+			c->pg.index -= s;
+		}
+	}
+
+	if (skip < s)
+		rval = l;
+	else {
+		rval = r;
+		*pskip = skip - s;
+	}
+	return (rval);
+}
+
+/* Item i of the page being split, where the new item nit is at skip. */
+static void
+pfx_item(t, h, skip, nit, i, it)
+	BTREE *t;
+	PAGE *h;
+	indx_t skip;
+	const PFXITEM *nit;
+	indx_t i;
+	PFXITEM *it;
+{
+	if (i == skip)
+		*it = *nit;
+	else
+		item_get(t, h, i < skip ? i : i - 1, it);
+}
+
+/*
+ * The prefix for items from to to of a split: the longest the keys
+ * share, or base if that takes less room.  First is set to the first
+ * item with a prefix, for pfx_init().
+ */
+static uint32_t
+pfx_choose(t, h, skip, nit, from, to, base, first)
+	BTREE *t;
+	PAGE *h;
+	indx_t skip;
+	const PFXITEM *nit;
+	indx_t from, to;
+	uint32_t base;
+	PFXITEM *first;
+{
+	PFXITEM it;
+	uint32_t best, len, bsize, lsize;
+	indx_t i, j;
+
+	for (i = from; i < to; ++i) {
+		pfx_item(t, h, skip, nit, i, first);
+		if (!(first->flags & P_BIGKEY))
+			break;
+	}
+	if (i == to)
+		return (0);
+	for (j = to - 1; j > i; --j) {
+		pfx_item(t, h, skip, nit, j, &it);
+		if (!(it.flags & P_BIGKEY))
+			break;
+	}
+	/* In order, so the first and last keys share the least. */
+	best = j > i ? item_lcp(first, &it) : first->plen + first->ksize;
+	if (best == base)
+		return (best);
+
+	bsize = LALIGN(base);
+	lsize = LALIGN(best);
+	for (i = from; i < to; ++i) {
+		pfx_item(t, h, skip, nit, i, &it);
+		bsize += item_size(&it, base);
+		lsize += item_size(&it, best);
+	}
+	len = lsize <= bsize ? best : base;
+	return (len);
+}
+
+/* Length of the prefix two items share. */
+static uint32_t
+item_lcp(a, b)
+	const PFXITEM *a, *b;
+{
+	uint32_t j, n;
+
+	n = MIN(a->plen + a->ksize, b->plen + b->ksize);
+	j = 0;
+	if (a->pfx == b->pfx)
+		j = MIN(a->plen, b->plen);
+	for (; j < n && ITEMBYTE(a, j) == ITEMBYTE(b, j); ++j)
+		;
+	return (j);
+}
+
+static void
+item_get(t, h, i, it)
+	BTREE *t;
+	PAGE *h;
+	indx_t i;
+	PFXITEM *it;
+{
+	BLEAF *bl;
+
+	bl = GETBLEAF(h, i);
+	it->flags = bl->flags;
+	it->key = bl->bytes;
+	it->ksize = bl->ksize;
+	it->data = bl->bytes + bl->ksize;
+	it->dsize = bl->dsize;
+	if (bl->flags & P_BIGKEY) {
+		it->pfx = NULL;
+		it->plen = 0;
+	} else {
+		it->pfx = PFXKEY(t, h);
+		it->plen = PFXLEN(h);
+	}
+}
+
+/* Bytes the item takes on a page with a plen prefix. */
+static uint32_t
+item_size(it, plen)
+	const PFXITEM *it;
+	uint32_t plen;
+{
+	if (it->flags & P_BIGKEY)
+		return (NBLEAFDBT(it->ksize, it->dsize));
+	return (NBLEAFDBT(it->plen + it->ksize - plen, it->dsize));
+}
+
+/* Write the item at index i of a page with a plen prefix. */
+static void
+item_write(t, h, i, it, plen)
+	BTREE *t;
+	PAGE *h;
+	indx_t i;
+	const PFXITEM *it;
+	uint32_t plen;
+{
+	uint32_t ksize;
+	char *dest;
+
+	if (it->flags & P_BIGKEY)
+		ksize = it->ksize;
+	else
+		ksize = it->plen + it->ksize - plen;
+
+	h->linp[i] = h->upper -= item_size(it, plen);
+	dest = (char *)h + h->upper;
+	*(uint32_t *)dest = ksize;
+	dest += sizeof(uint32_t);
+	*(uint32_t *)dest = it->dsize;
+	dest += sizeof(uint32_t);
+	*(u_char *)dest = it->flags;
+	dest += sizeof(u_char);
+	if (it->flags & P_BIGKEY || plen >= it->plen)
+		memmove(dest, it->key + it->ksize - ksize, ksize);
+	else {
+		memmove(dest, it->pfx + plen, it->plen - plen);
+		memmove(dest + it->plen - plen, it->key, it->ksize);
+	}
+	memmove(dest + ksize, it->data, it->dsize);
+}
+
+/* Empty the page and give it the first plen bytes of the item's key. */
+static void
+pfx_init(t, h, it, plen)
+	BTREE *t;
+	PAGE *h;
+	const PFXITEM *it;
+	uint32_t plen;
+{
+	char *dest;
+
+	h->flags = (h->flags & ~P_PFXMASK) | plen << P_PFXSHIFT;
+	h->lower = BTDATAOFF;
+	h->upper = t->bt_psize - LALIGN(plen);
+	dest = PFXKEY(t, h);
+	if (plen <= it->plen)
+		memmove(dest, it->pfx, plen);
+	else {
+		memmove(dest, it->pfx, it->plen);
+		memmove(dest + it->plen, it->key, plen - it->plen);
+	}
+}
@@ -46,7 +46,7 @@ static char sccsid[] = "@(#)bt_put.c	8.8 (Berkeley) 7/26/94";
 
 #include "btree.h"
 
-static EPG *bt_fast(BTREE *, const DBT *, const DBT *, int *);
+static EPG *bt_fast(BTREE *, const DBT *, uint32_t, int *);
 
 /*
  * __BT_PUT -- Add a btree item to the tree.
@@ -69,7 +69,7 @@ __bt_put(dbp, key, data, flags)
 	u_int flags;
 {
 	BTREE *t;
-	DBT tkey, tdata;
+	DBT *ukey, tkey, tdata, pkey;
 	EPG *e = NULL;
 	PAGE *h;
 	indx_t index, nxtindex;
@@ -118,7 +118,11 @@ __bt_put(dbp, key, data, flags)
 	 *
 	 * XXX
 	 * If the insert fails later on, the overflow pages aren't recovered.
+	 *
+	 * A big key is stored as a reference to its overflow pages, but the
+	 * search must still use the user's key.
 	 */
+	ukey = key;
 	dflags = 0;
 	if (key->size + data->size > t->bt_ovflsize) {
 		if (key->size > t->bt_ovflsize) {
@@ -152,6 +156,7 @@ storekey:		if (__ovfl_put(t, key, &pg) == RET_ERROR)
 		if ((h = mpool_get(t->bt_mp, t->bt_cursor.pg.pgno, 0)) == NULL)
 			return (RET_ERROR);
 		index = t->bt_cursor.pg.index;
+		exact = 1;
 		goto delete;
 	}
 
@@ -159,8 +164,9 @@ storekey:		if (__ovfl_put(t, key, &pg) == RET_ERROR)
 	 * Find the key to delete, or, the location at which to insert.
 	 * Bt_fast and __bt_search both pin the returned page.
 	 */
-	if (t->bt_order == NOT || (e = bt_fast(t, key, data, &exact)) == NULL)
-		if ((e = __bt_search(t, key, &exact)) == NULL)
+	if (t->bt_order == NOT || (e = bt_fast(t, ukey,
+	    NBLEAFDBT(key->size, data->size), &exact)) == NULL)
+		if ((e = __bt_search(t, ukey, &exact)) == NULL)
 			return (RET_ERROR);
 	h = e->page;
 	index = e->index;
@@ -185,7 +191,7 @@ storekey:		if (__ovfl_put(t, key, &pg) == RET_ERROR)
 		 * Note, the delete may empty the page, so we need to put a
 		 * new entry into the page immediately.
 		 */
-delete:		if (__bt_dleaf(t, key, h, index) == RET_ERROR) {
+delete:		if (__bt_dleaf(t, ukey, h, index) == RET_ERROR) {
 			mpool_put(t->bt_mp, h, 0);
 			return (RET_ERROR);
 		}
@@ -197,9 +203,25 @@ delete:		if (__bt_dleaf(t, key, h, index) == RET_ERROR) {
 	 * keys permitted in the page, split the page.  The split code will
 	 * insert the key and data and unpin the current page.  If inserting
 	 * into the offset array, shift the pointers up.
+	 *
+	 * A prefix compressed page stores the key without its prefix.  A key
+	 * without all of it cuts the prefix back, or splits if the page no
+	 * longer fits.
 	 */
+	status = RET_SUCCESS;
 	nbytes = NBLEAFDBT(key->size, data->size);
-	if (h->upper - h->lower < nbytes + sizeof(indx_t)) {
+	if (F_ISSET(t, B_PREFIX) && !(dflags & P_BIGKEY)) {
+		status = __bt_pfxput(t, h, key, data->size,
+		    t->bt_psize - BTDATAOFF, &pkey);
+		if (status == RET_ERROR) {
+			mpool_put(t->bt_mp, h, 0);
+			return (RET_ERROR);
+		}
+		if (status == RET_SUCCESS)
+			nbytes = NBLEAFDBT(pkey.size, data->size);
+	}
+	if (status == RET_SPECIAL ||
+	    h->upper - h->lower < nbytes + sizeof(indx_t)) {
 		if ((status = __bt_split(t, h, key,
 			data, dflags, nbytes, index)) != RET_SUCCESS)
 			return (status);
@@ -211,6 +233,8 @@ delete:		if (__bt_dleaf(t, key, h, index) == RET_ERROR) {
 			(nxtindex - index) * sizeof(indx_t));
 	h->lower += sizeof(indx_t);
 
+	if (F_ISSET(t, B_PREFIX) && !(dflags & P_BIGKEY))
+		key = &pkey;
 	h->linp[index] = h->upper -= nbytes;
 	dest = (char *)h + h->upper;
 	WR_BLEAF(dest, key, data, dflags);
@@ -243,6 +267,9 @@ success:
 	if (flags == R_SETCURSOR)
 		__bt_setcur(t, e->page->pgno, e->index);
 
+	if (t->bt_bloom != NULL && !exact)
+		__bloom_add(t, ukey);
+
 	F_SET(t, B_MODIFIED);
 	return (RET_SUCCESS);
 }
@@ -257,18 +284,19 @@ u_long bt_cache_hit, bt_cache_miss;
  * Parameters:
  *	t:	tree
  *	key:	key to insert
+ *	nbytes:	size of the leaf entry
  *
  * Returns:
  * 	EPG for new record or NULL if not found.
  */
 static EPG *
-bt_fast(t, key, data, exactp)
+bt_fast(t, key, nbytes, exactp)
 	BTREE *t;
-	const DBT *key, *data;
+	const DBT *key;
+	uint32_t nbytes;
 	int *exactp;
 {
 	PAGE *h;
-	uint32_t nbytes;
 	int cmp;
 
 	if ((h = mpool_get(t->bt_mp, t->bt_last.pgno, 0)) == NULL) {
@@ -282,10 +310,14 @@ bt_fast(t, key, data, exactp)
 	 * If won't fit in this page or have too many keys in this page,
 	 * have to search to get split stack.
 	 */
-	nbytes = NBLEAFDBT(key->size, data->size);
 	if (h->upper - h->lower < nbytes + sizeof(indx_t))
 		goto miss;
 
+	/* Cutting back the prefix might not fit, and a split needs the stack. */
+	if (PFXLEN(h) != 0 && (key->size < PFXLEN(h) ||
+	    memcmp(key->data, PFXKEY(t, h), PFXLEN(h)) != 0))
+		goto miss;
+
 	if (t->bt_order == FORWARD) {
 		if (t->bt_cur.page->nextpg != P_INVALID)
 			goto miss;
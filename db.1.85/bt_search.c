@@ -43,8 +43,9 @@ static char sccsid[] = "@(#)bt_search.c	8.8 (Berkeley) 7/31/94";
 #include "samlib.h"
 #include "btree.h"
 
-static int __bt_snext(BTREE *, PAGE *, const DBT *, int *);
-static int __bt_sprev(BTREE *, PAGE *, const DBT *, int *);
+static EPG *search(BTREE *, const DBT *, int *, EPG *, int);
+static int __bt_snext(BTREE *, PAGE *, const DBT *, int *, EPG *);
+static int __bt_sprev(BTREE *, PAGE *, const DBT *, int *, EPG *);
 
 /*
  * __bt_search --
@@ -65,25 +66,62 @@ __bt_search(t, key, exactp)
 	BTREE *t;
 	const DBT *key;
 	int *exactp;
+{
+	return (search(t, key, exactp, &t->bt_cur, 1));
+}
+
+/*
+ * __bt_msearch --
+ *	Search a mapped btree for a key without touching the tree.
+ *
+ * Parameters:
+ *	t:	tree to search
+ *	key:	key to find
+ *	exactp:	pointer to exact match flag
+ *	cur:	where to put the EPG
+ *
+ * Returns:
+ *	Same as __bt_search, except the EPG is entered into cur and the
+ *	parent stack is not kept.  Mapped pages are never pinned, so more
+ *	than one thread may search at a time.
+ */
+EPG *
+__bt_msearch(t, key, exactp, cur)
+	BTREE *t;
+	const DBT *key;
+	int *exactp;
+	EPG *cur;
+{
+	return (search(t, key, exactp, cur, 0));
+}
+
+static EPG *
+search(t, key, exactp, cur, stack)
+	BTREE *t;
+	const DBT *key;
+	int *exactp;
+	EPG *cur;
+	int stack;
 {
 	PAGE *h;
 	indx_t base, index, lim;
 	pgno_t pg;
 	int cmp;
 
-	BT_CLR(t);
+	if (stack)
+		BT_CLR(t);
 	for (pg = P_ROOT;;) {
 		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
 			return (NULL);
 
 		/* Do a binary search on the current page. */
-		t->bt_cur.page = h;
+		cur->page = h;
 		for (base = 0, lim = NEXTINDEX(h); lim; lim >>= 1) {
-			t->bt_cur.index = index = base + (lim >> 1);
-			if ((cmp = __bt_cmp(t, key, &t->bt_cur)) == 0) {
+			cur->index = index = base + (lim >> 1);
+			if ((cmp = __bt_cmp(t, key, cur)) == 0) {
 				if (h->flags & P_BLEAF) {
 					*exactp = 1;
-					return (&t->bt_cur);
+					return (cur);
 				}
 				goto next;
 			}
@@ -105,16 +143,16 @@ __bt_search(t, key, exactp)
 			if (!F_ISSET(t, B_NODUPS)) {
 				if (base == 0 &&
 				    h->prevpg != P_INVALID &&
-				    __bt_sprev(t, h, key, exactp))
-					return (&t->bt_cur);
+				    __bt_sprev(t, h, key, exactp, cur))
+					return (cur);
 				if (base == NEXTINDEX(h) &&
 				    h->nextpg != P_INVALID &&
-				    __bt_snext(t, h, key, exactp))
-					return (&t->bt_cur);
+				    __bt_snext(t, h, key, exactp, cur))
+					return (cur);
 			}
 			*exactp = 0;
-			t->bt_cur.index = base;
-			return (&t->bt_cur);
+			cur->index = base;
+			return (cur);
 		}
 
 		/*
@@ -126,7 +164,8 @@ __bt_search(t, key, exactp)
 		 */
 		index = base ? base - 1 : base;
 
-next:		BT_PUSH(t, h->pgno, index);
+next:		if (stack)
+			BT_PUSH(t, h->pgno, index);
 		pg = GETBINTERNAL(h, index)->pgno;
 		mpool_put(t->bt_mp, h, 0);
 	}
@@ -141,16 +180,18 @@ next:		BT_PUSH(t, h->pgno, index);
  *	h:	current page
  *	key:	key
  *	exactp:	pointer to exact match flag
+ *	cur:	where to put the EPG of a match
  *
  * Returns:
  *	If an exact match found.
  */
 static int
-__bt_snext(t, h, key, exactp)
+__bt_snext(t, h, key, exactp, cur)
 	BTREE *t;
 	PAGE *h;
 	const DBT *key;
 	int *exactp;
+	EPG *cur;
 {
 	EPG e;
 
@@ -163,7 +204,7 @@ __bt_snext(t, h, key, exactp)
 	e.index = 0;
 	if (__bt_cmp(t, key, &e) == 0) {
 		mpool_put(t->bt_mp, h, 0);
-		t->bt_cur = e;
+		*cur = e;
 		*exactp = 1;
 		return (1);
 	}
@@ -180,16 +221,18 @@ __bt_snext(t, h, key, exactp)
  *	h:	current page
  *	key:	key
  *	exactp:	pointer to exact match flag
+ *	cur:	where to put the EPG of a match
  *
  * Returns:
  *	If an exact match found.
  */
 static int
-__bt_sprev(t, h, key, exactp)
+__bt_sprev(t, h, key, exactp, cur)
 	BTREE *t;
 	PAGE *h;
 	const DBT *key;
 	int *exactp;
+	EPG *cur;
 {
 	EPG e;
 
@@ -202,7 +245,7 @@ __bt_sprev(t, h, key, exactp)
 	e.index = NEXTINDEX(e.page) - 1;
 	if (__bt_cmp(t, key, &e) == 0) {
 		mpool_put(t->bt_mp, h, 0);
-		t->bt_cur = e;
+		*cur = e;
 		*exactp = 1;
 		return (1);
 	}
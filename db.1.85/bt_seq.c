@@ -356,7 +356,7 @@ __bt_first(t, key, erval, exactp)
 	 * page) and return it.
 	 */
 	if ((ep = __bt_search(t, key, exactp)) == NULL)
-		return (0);
+		return (RET_ERROR);
 	if (*exactp) {
 		if (F_ISSET(t, B_NODUPS)) {
 			*erval = *ep;
@@ -428,6 +428,78 @@ __bt_first(t, key, erval, exactp)
 	return (RET_SUCCESS);
 }
 
+/*
+ * __bt_count --
+ *	Count the keys in a range without returning them.
+ *
+ * Parameters:
+ *	dbp:	pointer to access method
+ *	start:	first key in the range, NULL for the first key in the tree
+ *	end:	key past the range, NULL for the end of the tree
+ *	countp:	return count
+ *
+ * Whole leaf pages are counted from NEXTINDEX, only the page holding
+ * end is searched.  The cursor is not moved.
+ *
+ * Returns:
+ *	RET_ERROR, RET_SUCCESS
+ */
+int
+__bt_count(dbp, start, end, countp)
+	const DB *dbp;
+	const DBT *start, *end;
+	unsigned long *countp;
+{
+	BTREE *t;
+	EPG e;
+	PAGE *h;
+	pgno_t pg;
+	indx_t base, first, lim, top;
+	int exact, status;
+
+	t = dbp->internal;
+	*countp = 0;
+
+	if (start != NULL && start->size != 0)
+		status = __bt_first(t, start, &e, &exact);
+	else
+		status = __bt_seqset(t, &e, NULL, R_FIRST);
+	if (status == RET_SPECIAL)
+		return (RET_SUCCESS);
+	if (status != RET_SUCCESS)
+		return (status);
+
+	for (h = e.page, base = e.index;;) {
+		top = NEXTINDEX(h);
+		if (end != NULL && top > base) {
+			e.page = h;
+			e.index = top - 1;
+			if (__bt_cmp(t, end, &e) <= 0) {
+				/* Find the first key >= end */
+				for (first = base, lim = top - 1; base < lim;) {
+					e.index = base + (lim - base) / 2;
+					if (__bt_cmp(t, end, &e) > 0)
+						base = e.index + 1;
+					else
+						lim = e.index;
+				}
+				*countp += base - first;
+				break;
+			}
+		}
+		*countp += top - base;
+		pg = h->nextpg;
+		mpool_put(t->bt_mp, h, 0);
+		if (pg == P_INVALID)
+			return (RET_SUCCESS);
+		if ((h = mpool_get(t->bt_mp, pg, 0)) == NULL)
+			return (RET_ERROR);
+		base = 0;
+	}
+	mpool_put(t->bt_mp, h, 0);
+	return (RET_SUCCESS);
+}
+
 /*
  * __bt_setcur --
  *	Set the cursor to an entry in the tree.
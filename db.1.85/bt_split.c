@@ -47,13 +47,14 @@ static char sccsid[] = "@(#)bt_split.c	8.9 (Berkeley) 7/26/94";
 #include "btree.h"
 
 static int	 bt_broot(BTREE *, PAGE *, PAGE *, PAGE *);
-static PAGE	*bt_page
-		   (BTREE *, PAGE *, PAGE **, PAGE **, indx_t *, size_t);
+static int	 bt_leafkey(BTREE *, PAGE *, indx_t, DBT *, void **, size_t *);
+static PAGE	*bt_page(BTREE *, PAGE *, PAGE **, PAGE **, indx_t *, size_t,
+		    const DBT *, const DBT *, int);
 static int	 bt_preserve(BTREE *, pgno_t);
-static PAGE	*bt_psplit
-		   (BTREE *, PAGE *, PAGE *, PAGE *, indx_t *, size_t);
-static PAGE	*bt_root
-		   (BTREE *, PAGE *, PAGE **, PAGE **, indx_t *, size_t);
+static PAGE	*bt_psplit(BTREE *, PAGE *, PAGE *, PAGE *, indx_t *, size_t,
+		    const DBT *, const DBT *, int);
+static PAGE	*bt_root(BTREE *, PAGE *, PAGE **, PAGE **, indx_t *, size_t,
+		    const DBT *, const DBT *, int);
 static int	 bt_rroot(BTREE *, PAGE *, PAGE *, PAGE *);
 static recno_t	 rec_total(PAGE *);
 
@@ -87,7 +88,7 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 {
 	BINTERNAL *bi = NULL;
 	BLEAF *bl = NULL, *tbl;
-	DBT a, b;
+	DBT a, b, pkey;
 	EPGNO *parent;
 	PAGE *h, *l, *r, *lchild, *rchild;
 	indx_t nxtindex;
@@ -95,6 +96,8 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 	uint32_t n, nbytes, nksize = 0;
 	int parentsplit;
 	char *dest;
+	void *abuf = NULL, *bbuf = NULL;
+	size_t abufsz = 0, bbufsz = 0;
 
 	/*
 	 * Split the page into two pages, l and r.  The split routines return
@@ -104,11 +107,20 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 	 */
 	skip = argskip;
 	h = sp->pgno == P_ROOT ?
-		bt_root(t, sp, &l, &r, &skip, ilen) :
-		bt_page(t, sp, &l, &r, &skip, ilen);
+		bt_root(t, sp, &l, &r, &skip, ilen, key, data, flags) :
+		bt_page(t, sp, &l, &r, &skip, ilen, key, data, flags);
 	if (h == NULL)
 		return (RET_ERROR);
 
+	/* Store the key without the prefix of the page it went to. */
+	if (F_ISSET(t, B_PREFIX) && !(flags & P_BIGKEY) &&
+	    (h->flags & P_TYPE) == P_BLEAF) {
+		pkey.data = (char *)key->data + PFXLEN(h);
+		pkey.size = key->size - PFXLEN(h);
+		key = &pkey;
+		ilen = NBLEAFDBT(key->size, data->size);
+	}
+
 	/*
 	 * Insert the new key/data pair into the leaf page.  (Key inserts
 	 * always cause a leaf page to split first.)
@@ -184,14 +196,23 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 			break;
 		case P_BLEAF:
 			bl = GETBLEAF(rchild, 0);
-			nbytes = NBINTERNAL(bl->ksize);
+			if (bt_leafkey(t, rchild, 0, &b, &bbuf, &bbufsz)) {
+				mpool_put(t->bt_mp, h, 0);
+				goto err2;
+			}
+			nbytes = NBINTERNAL(b.size);
+			nksize = 0;
 			if (t->bt_pfx && !(bl->flags & P_BIGKEY) &&
 				(h->prevpg != P_INVALID || skip > 1)) {
 				tbl = GETBLEAF(lchild, NEXTINDEX(lchild) - 1);
-				a.size = tbl->ksize;
-				a.data = tbl->bytes;
-				b.size = bl->ksize;
-				b.data = bl->bytes;
+				/* A big key is only a reference to its pages. */
+				if (tbl->flags & P_BIGKEY)
+					break;
+				if (bt_leafkey(t, lchild, NEXTINDEX(lchild) - 1,
+				    &a, &abuf, &abufsz)) {
+					mpool_put(t->bt_mp, h, 0);
+					goto err2;
+				}
 				nksize = t->bt_pfx(&a, &b);
 				n = NBINTERNAL(nksize);
 				if (n < nbytes) {
@@ -201,8 +222,7 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 					nbytes = n;
 				} else
 					nksize = 0;
-			} else
-				nksize = 0;
+			}
 			break;
 		case P_RINTERNAL:
 		case P_RLEAF:
@@ -216,8 +236,10 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 		if (h->upper - h->lower < nbytes + sizeof(indx_t)) {
 			sp = h;
 			h = h->pgno == P_ROOT ?
-				bt_root(t, h, &l, &r, &skip, nbytes) :
-				bt_page(t, h, &l, &r, &skip, nbytes);
+				bt_root(t, h, &l, &r, &skip, nbytes,
+				    NULL, NULL, 0) :
+				bt_page(t, h, &l, &r, &skip, nbytes,
+				    NULL, NULL, 0);
 			if (h == NULL)
 				goto err1;
 			parentsplit = 1;
@@ -240,9 +262,9 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 		case P_BLEAF:
 			h->linp[skip] = h->upper -= nbytes;
 			dest = (char *)h + h->linp[skip];
-			WR_BINTERNAL(dest, nksize ? nksize : bl->ksize,
+			WR_BINTERNAL(dest, nksize ? nksize : b.size,
 				rchild->pgno, bl->flags & P_BIGKEY);
-			memmove(dest, bl->bytes, nksize ? nksize : bl->ksize);
+			memmove(dest, b.data, nksize ? nksize : b.size);
 			if (bl->flags & P_BIGKEY) {
 				pgno_t *pgno = (pgno_t *)bl->bytes;
 				if (bt_preserve(t, *pgno) == RET_ERROR)
@@ -308,6 +330,8 @@ __bt_split(t, sp, key, data, flags, ilen, argskip)
 	/* Unpin the held pages. */
 	mpool_put(t->bt_mp, l, MPOOL_DIRTY);
 	mpool_put(t->bt_mp, r, MPOOL_DIRTY);
+	free(abuf);
+	free(bbuf);
 
 	/* Clear any pages left on the stack. */
 	return (RET_SUCCESS);
@@ -322,6 +346,8 @@ err1:	mpool_put(t->bt_mp, lchild, MPOOL_DIRTY);
 
 err2:	mpool_put(t->bt_mp, l, 0);
 	mpool_put(t->bt_mp, r, 0);
+	free(abuf);
+	free(bbuf);
 	__dbpanic(t->bt_dbp);
 	return (RET_ERROR);
 }
@@ -336,17 +362,23 @@ err2:	mpool_put(t->bt_mp, l, 0);
  *	rp:	pointer to right page pointer
  *	skip:	pointer to index to leave open
  *	ilen:	insert length
+ *	key:	key to insert into a leaf, else NULL
+ *	data:	data to insert into a leaf
+ *	flags:	BIGKEY/BIGDATA flags
  *
  * Returns:
  *	Pointer to page in which to insert or NULL on error.
  */
 static PAGE *
-bt_page(t, h, lp, rp, skip, ilen)
+bt_page(t, h, lp, rp, skip, ilen, key, data, flags)
 	BTREE *t;
 	PAGE *h, **lp, **rp;
 	indx_t *skip;
 	size_t ilen;
+	const DBT *key, *data;
+	int flags;
 {
+	DBT pkey;
 	PAGE *l, *r, *tp;
 	pgno_t npg;
 
@@ -378,6 +410,10 @@ bt_page(t, h, lp, rp, skip, ilen)
 		++bt_sortsplit;
 #endif
 		h->nextpg = r->pgno;
+		/* The new key is all of the prefix. */
+		if (key != NULL && F_ISSET(t, B_PREFIX) && !(flags & P_BIGKEY))
+			(void)__bt_pfxput(t, r, key, data->size,
+			    t->bt_psize - BTDATAOFF, &pkey);
 		r->lower = BTDATAOFF + sizeof(indx_t);
 		*skip = 0;
 		*lp = h;
@@ -418,7 +454,7 @@ bt_page(t, h, lp, rp, skip, ilen)
 	 * the left page in place.  Since the left page can't change, we have
 	 * to swap the original and the allocated left page after the split.
 	 */
-	tp = bt_psplit(t, h, l, r, skip, ilen);
+	tp = bt_psplit(t, h, l, r, skip, ilen, key, data, flags);
 
 	/* Move the new left page onto the old left page. */
 	memmove(h, l, t->bt_psize);
@@ -441,16 +477,21 @@ bt_page(t, h, lp, rp, skip, ilen)
  *	rp:	pointer to right page pointer
  *	skip:	pointer to index to leave open
  *	ilen:	insert length
+ *	key:	key to insert into a leaf, else NULL
+ *	data:	data to insert into a leaf
+ *	flags:	BIGKEY/BIGDATA flags
  *
  * Returns:
  *	Pointer to page in which to insert or NULL on error.
  */
 static PAGE *
-bt_root(t, h, lp, rp, skip, ilen)
+bt_root(t, h, lp, rp, skip, ilen, key, data, flags)
 	BTREE *t;
 	PAGE *h, **lp, **rp;
 	indx_t *skip;
 	size_t ilen;
+	const DBT *key, *data;
+	int flags;
 {
 	PAGE *l, *r, *tp;
 	pgno_t lnpg, rnpg;
@@ -473,7 +514,7 @@ bt_root(t, h, lp, rp, skip, ilen)
 	l->flags = r->flags = h->flags & P_TYPE;
 
 	/* Split the root page. */
-	tp = bt_psplit(t, h, l, r, skip, ilen);
+	tp = bt_psplit(t, h, l, r, skip, ilen, key, data, flags);
 
 	*lp = l;
 	*rp = r;
@@ -539,8 +580,11 @@ bt_broot(t, h, l, r)
 {
 	BINTERNAL *bi;
 	BLEAF *bl;
+	DBT b;
 	uint32_t nbytes;
 	char *dest;
+	void *buf = NULL;
+	size_t bufsz = 0;
 
 	/*
 	 * If the root page was a leaf page, change it into an internal page.
@@ -558,11 +602,14 @@ bt_broot(t, h, l, r)
 	switch (h->flags & P_TYPE) {
 	case P_BLEAF:
 		bl = GETBLEAF(r, 0);
-		nbytes = NBINTERNAL(bl->ksize);
+		if (bt_leafkey(t, r, 0, &b, &buf, &bufsz))
+			return (RET_ERROR);
+		nbytes = NBINTERNAL(b.size);
 		h->linp[1] = h->upper -= nbytes;
 		dest = (char *)h + h->upper;
-		WR_BINTERNAL(dest, bl->ksize, r->pgno, 0);
-		memmove(dest, bl->bytes, bl->ksize);
+		WR_BINTERNAL(dest, b.size, r->pgno, bl->flags & P_BIGKEY);
+		memmove(dest, b.data, b.size);
+		free(buf);
 
 		/*
 		 * If the key is on an overflow page, mark the overflow chain
@@ -590,7 +637,7 @@ bt_broot(t, h, l, r)
 	h->lower = BTDATAOFF + 2 * sizeof(indx_t);
 
 	/* Unpin the root page, set to btree internal page. */
-	h->flags &= ~P_TYPE;
+	h->flags &= ~(P_TYPE | P_PFXMASK);
 	h->flags |= P_BINTERNAL;
 	mpool_put(t->bt_mp, h, MPOOL_DIRTY);
 
@@ -607,16 +654,21 @@ bt_broot(t, h, l, r)
  *	r:	page to put upper half of data
  *	pskip:	pointer to index to leave open
  *	ilen:	insert length
+ *	key:	key to insert into a leaf, else NULL
+ *	data:	data to insert into a leaf
+ *	flags:	BIGKEY/BIGDATA flags
  *
  * Returns:
  *	Pointer to page in which to insert.
  */
 static PAGE *
-bt_psplit(t, h, l, r, pskip, ilen)
+bt_psplit(t, h, l, r, pskip, ilen, key, data, flags)
 	BTREE *t;
 	PAGE *h, *l, *r;
 	indx_t *pskip;
 	size_t ilen;
+	const DBT *key, *data;
+	int flags;
 {
 	BINTERNAL *bi;
 	BLEAF *bl;
@@ -628,6 +680,10 @@ bt_psplit(t, h, l, r, pskip, ilen)
 	uint32_t nbytes;
 	int bigkeycnt, isbigkey;
 
+	if (key != NULL && F_ISSET(t, B_PREFIX) &&
+	    (h->flags & P_TYPE) == P_BLEAF)
+		return (__bt_pfxsplit(t, h, l, r, pskip, key, data, flags));
+
 	/*
 	 * Split the data to the left and right pages.  Leave the skip index
 	 * open.  Additionally, make some effort not to split on an overflow
@@ -675,7 +731,8 @@ bt_psplit(t, h, l, r, pskip, ilen)
 		 * where we decide to try and copy too much onto the left page.
 		 * Make sure that doesn't happen.
 		 */
-		if (skip <= off && used + nbytes >= full) {
+		if ((skip <= off && used + nbytes + sizeof(indx_t) >= full) ||
+		    nxt == top - 1) {
 			--off;
 			break;
 		}
@@ -688,7 +745,7 @@ bt_psplit(t, h, l, r, pskip, ilen)
 			memmove((char *)l + l->upper, src, nbytes);
 		}
 
-		used += nbytes;
+		used += nbytes + sizeof(indx_t);
 		if (used >= half) {
 			if (!isbigkey || bigkeycnt == 3)
 				break;
@@ -728,7 +785,7 @@ bt_psplit(t, h, l, r, pskip, ilen)
 	 * the right page.
 	 */
 	if (skip <= off) {
-		skip = 0;
+		skip = MAX_PAGE_OFFSET;
 		rval = l;
 	} else {
 		rval = r;
@@ -738,7 +795,7 @@ bt_psplit(t, h, l, r, pskip, ilen)
 	for (off = 0; nxt < top; ++off) {
 		if (skip == nxt) {
 			++off;
-			skip = 0;
+			skip = MAX_PAGE_OFFSET;
 		}
 		switch (h->flags & P_TYPE) {
 		case P_BINTERNAL:
@@ -773,6 +830,43 @@ bt_psplit(t, h, l, r, pskip, ilen)
 	return (rval);
 }
 
+/*
+ * BT_LEAFKEY -- Get the key of a leaf item for an internal page.
+ *
+ * Parameters:
+ *	t:	tree
+ *	h:	leaf page
+ *	indx:	item
+ *	key:	set to the key, or to the overflow reference
+ *	buf:	buffer for a key put back together with its page's prefix
+ *	bufsz:	pointer to the buffer size
+ *
+ * Returns:
+ *	RET_SUCCESS, RET_ERROR.
+ */
+static int
+bt_leafkey(t, h, indx, key, buf, bufsz)
+	BTREE *t;
+	PAGE *h;
+	indx_t indx;
+	DBT *key;
+	void **buf;
+	size_t *bufsz;
+{
+	BLEAF *bl;
+
+	bl = GETBLEAF(h, indx);
+	if (PFXLEN(h) == 0 || bl->flags & P_BIGKEY) {
+		key->data = bl->bytes;
+		key->size = bl->ksize;
+		return (RET_SUCCESS);
+	}
+	if (__bt_pfxkey(t, h, bl, &key->size, buf, bufsz) == RET_ERROR)
+		return (RET_ERROR);
+	key->data = *buf;
+	return (RET_SUCCESS);
+}
+
 /*
  * BT_PRESERVE -- Mark a chain of pages as used by an internal node.
  *
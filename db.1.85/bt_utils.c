@@ -84,6 +84,12 @@ __bt_ret(t, e, key, rkey, data, rdata, copy)
 		    &key->size, &rkey->data, &rkey->size))
 			return (RET_ERROR);
 		key->data = rkey->data;
+	} else if (PFXLEN(e->page) != 0) {
+		/* The key is in two pieces. */
+		if (__bt_pfxkey(t, e->page, bl,
+		    &key->size, &rkey->data, &rkey->size))
+			return (RET_ERROR);
+		key->data = rkey->data;
 	} else if (copy || F_ISSET(t, B_DB_LOCK)) {
 		if (bl->ksize > rkey->size) {
 			p = (void *)(rkey->data == NULL ?
@@ -105,7 +111,16 @@ dataonly:
 	if (data == NULL)
 		return (RET_SUCCESS);
 
-	if (bl->flags & P_BIGDATA) {
+	if ((bl->flags & P_BIGDATA) && F_ISSET(t, B_MMAP) && !copy) {
+		if (rdata == NULL && data->data != NULL) {
+			/* A mapped get into the caller's buffer. */
+			if (__ovfl_copy(t, bl->bytes + bl->ksize,
+			    data->data, data->size, &data->size))
+				return (RET_ERROR);
+		} else if (__ovfl_get_cached(t, bl->bytes + bl->ksize,
+		    &data->size, &data->data))
+			return (RET_ERROR);
+	} else if (bl->flags & P_BIGDATA) {
 		if (__ovfl_get(t, bl->bytes + bl->ksize,
 		    &data->size, &rdata->data, &rdata->size))
 			return (RET_ERROR);
@@ -153,9 +168,11 @@ __bt_cmp(t, k1, e)
 {
 	BINTERNAL *bi;
 	BLEAF *bl;
-	DBT k2;
+	DBT k1s, k2;
 	PAGE *h;
 	void *bigkey;
+	size_t plen;
+	int cmp;
 
 	/*
 	 * The left-most key on internal pages, at any level of the tree, is
@@ -173,7 +190,19 @@ __bt_cmp(t, k1, e)
 		bl = GETBLEAF(h, e->index);
 		if (bl->flags & P_BIGKEY)
 			bigkey = bl->bytes;
-		else {
+		else if ((plen = PFXLEN(h)) != 0) {
+			/* Only with __bt_defcmp(), so compare the prefix first. */
+			if ((cmp = memcmp(k1->data, PFXKEY(t, h),
+			    MIN(k1->size, plen))) != 0)
+				return (cmp);
+			if (k1->size < plen)
+				return (-1);
+			k1s.data = (char *)k1->data + plen;
+			k1s.size = k1->size - plen;
+			k2.data = bl->bytes;
+			k2.size = bl->ksize;
+			return (__bt_defcmp(&k1s, &k2));
+		} else {
 			k2.data = bl->bytes;
 			k2.size = bl->ksize;
 		}
@@ -187,7 +216,22 @@ __bt_cmp(t, k1, e)
 		}
 	}
 
-	if (bigkey) {
+	if (bigkey && F_ISSET(t, B_MMAP) && t->bt_cmp == __bt_defcmp) {
+		if (__ovfl_cmp(t, k1, bigkey, &cmp))
+			return (RET_ERROR);
+		return (cmp);
+	} else if (bigkey && F_ISSET(t, B_MMAP)) {
+		/* A private copy, since other threads may be comparing. */
+		k2.data = NULL;
+		plen = 0;
+		if (__ovfl_get(t, bigkey, &k2.size, &k2.data, &plen)) {
+			free(k2.data);
+			return (RET_ERROR);
+		}
+		cmp = (*t->bt_cmp)(k1, &k2);
+		free(k2.data);
+		return (cmp);
+	} else if (bigkey) {
 		if (__ovfl_get(t, bigkey,
 		    &k2.size, &t->bt_rdata.data, &t->bt_rdata.size))
 			return (RET_ERROR);
@@ -78,6 +78,8 @@ typedef struct _page {
 #define	P_RLEAF		0x10		/* leaf page */
 #define P_TYPE		0x1f		/* type mask */
 #define	P_PRESERVE	0x20		/* never delete this chain of pages */
+#define	P_PFXSHIFT	16		/* B_PREFIX leaf: prefix length */
+#define	P_PFXMASK	0xffff0000
 	uint32_t flags;
 
 	indx_t	lower;			/* lower bound of free space on page */
@@ -182,6 +184,14 @@ typedef struct _bleaf {
 #define	GETBLEAF(pg, indx)						\
 	((BLEAF *)((char *)(pg) + (pg)->linp[indx]))
 
+/*
+ * On B_PREFIX leaf pages the keys are stored without the prefix they
+ * share, which is kept above the items at the end of the page.  Big keys
+ * are stored whole.
+ */
+#define	PFXLEN(pg)	((pg)->flags >> P_PFXSHIFT)
+#define	PFXKEY(t, pg)	((char *)(pg) + (t)->bt_psize - PFXLEN(pg))
+
 /* Get the number of bytes in the entry. */
 #define NBLEAF(p)	NBLEAFDBT((p)->ksize, (p)->dsize)
 
@@ -329,7 +339,7 @@ typedef struct _btree {
 	int	  bt_fd;		/* tree file descriptor */
 
 	pgno_t	  bt_free;		/* next free page */
-	uint32_t bt_psize;		/* page size */
+	uint32_t bt_psize;		/* page size, less any checksum */
 	indx_t	  bt_ovflsize;		/* cut-off for key/data overflow */
 	int	  bt_lorder;		/* byte order */
 					/* sorted order */
@@ -355,6 +365,12 @@ typedef struct _btree {
 	size_t	  bt_reclen;		/* R: fixed record length */
 	u_char	  bt_bval;		/* R: delimiting byte/pad character */
 
+	struct _ovcache **bt_ovcache;	/* B_MMAP overflow copies */
+	int	  bt_ovlock;		/* B_MMAP overflow copies lock */
+	size_t	  bt_ovbytes;		/* B_MMAP overflow copies size */
+	size_t	  bt_ovmax;		/* B_MMAP overflow copies limit */
+	struct _bloom *bt_bloom;	/* DB_BLOOM key filter */
+
 /*
  * NB:
  * B_NODUPS and R_RECNO are stored on disk, and may not be changed.
@@ -377,18 +393,53 @@ typedef struct _btree {
 #define	R_RDONLY	0x02000		/* read-only file */
 
 #define	B_DB_LOCK	0x04000		/* DB_LOCK specified. */
+#define	B_MMAP		0x08000		/* read only, file is mapped */
+#define	B_PREFIX	0x10000		/* prefix compressed leaf keys */
+#define	B_CRC		0x20000		/* page checksums */
 	uint32_t flags;
 } BTREE;
 
 #ifndef MIN
 #define MIN(a, b) ((a) <= (b) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a, b) ((a) >= (b) ? (a) : (b))
+#endif
 
 #ifndef BIG_ENDIAN
 #define BIG_ENDIAN 4321
 #define LITTLE_ENDIAN 1234
 #endif
 
+/*
+ * With B_MMAP returned data points into the mapping and is valid until
+ * close.  Overflow items are not contiguous, so they are copied once
+ * and kept here until close.  Gets on a mapped tree do not touch the
+ * shared search state, so many threads can get at once.  The copies
+ * are the only thing they share: lookups are lock free since a copy is
+ * never changed once it is published, bt_ovlock only serializes adding
+ * them.  Big key compares do not use the copies at all.  The copies
+ * are limited to bt_ovmax bytes, the cachesize since the mapped tree
+ * has no other use for it, but at least OVCACHE_MIN.
+ */
+typedef struct _ovcache {
+	struct _ovcache *next;
+	pgno_t	 pgno;			/* first overflow page */
+	size_t	 size;
+	char	 data[];
+} OVCACHE;
+#define	OVCACHE_HASH	64
+#define	OVCACHE_MIN	(16 * 1024 * 1024)
+
+typedef struct _bloom BLOOM;
+
+int	 __bloom_open(BTREE *, const char *, u_int);
+int	 __bloom_maybe(const BLOOM *, const DBT *);
+void	 __bloom_add(BTREE *, const DBT *);
+void	 __bloom_del(BTREE *);
+int	 __bloom_save(BTREE *);
+void	 __bloom_free(BTREE *);
+
 int	 __bt_close(DB *);
 int	 __bt_cmp(BTREE *, const DBT *, EPG *);
 int	 __bt_crsrdel(BTREE *, EPGNO *);
@@ -400,12 +451,18 @@ int	 __bt_fd(const DB *);
 int	 __bt_free(BTREE *, PAGE *);
 int	 __bt_get(const DB *, const DBT *, DBT *, u_int);
 PAGE	*__bt_new(BTREE *, pgno_t *);
-void	 __bt_pgin(void *, pgno_t, void *);
+PAGE	*__bt_pfxsplit(BTREE *, PAGE *, PAGE *, PAGE *, indx_t *,
+	    const DBT *, const DBT *, int);
+int	 __bt_pfxkey(BTREE *, PAGE *, BLEAF *, size_t *, void **, size_t *);
+int	 __bt_pfxput(BTREE *, PAGE *, const DBT *, uint32_t, uint32_t, DBT *);
+int	 __bt_pgin(void *, pgno_t, void *);
+void	 __bt_pgundo(void *, pgno_t, void *);
 void	 __bt_pgout(void *, pgno_t, void *);
 int	 __bt_push(BTREE *, pgno_t, int);
 int	 __bt_put(const DB *dbp, DBT *, const DBT *, u_int);
 int	 __bt_ret(BTREE *, EPG *, DBT *, DBT *, DBT *, DBT *, int);
 EPG	*__bt_search(BTREE *, const DBT *, int *);
+EPG	*__bt_msearch(BTREE *, const DBT *, int *, EPG *);
 int	 __bt_seq(const DB *, DBT *, DBT *, u_int);
 void	 __bt_setcur(BTREE *, pgno_t, u_int);
 int	 __bt_split(BTREE *, PAGE *, const DBT *, const DBT *, int, size_t, uint32_t);
@@ -413,4 +470,8 @@ int	 __bt_sync(const DB *, u_int);
 
 int	 __ovfl_delete(BTREE *, void *);
 int	 __ovfl_get(BTREE *, void *, size_t *, void **, size_t *);
+int	 __ovfl_cmp(BTREE *, const DBT *, void *, int *);
+int	 __ovfl_copy(BTREE *, void *, void *, size_t, size_t *);
+int	 __ovfl_get_cached(BTREE *, void *, size_t *, void **);
+void	 __ovfl_cache_free(BTREE *);
 int	 __ovfl_put(BTREE *, const DBT *, pgno_t *);
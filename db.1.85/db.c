@@ -68,11 +68,13 @@ dbopen(fname, flags, mode, type, openinfo)
 	(O_CREAT | O_EXCL | O_EXLOCK | O_NONBLOCK | O_RDONLY |		\
 	 O_RDWR | O_SHLOCK | O_TRUNC)
 
-	if ((flags & ~(USE_OPEN_FLAGS | DB_LOCK)) == 0)
+#define	USE_DB_FLAGS	(DB_LOCK | DB_MMAP | DB_WAL | DB_BLOOM)
+
+	if ((flags & ~(USE_OPEN_FLAGS | USE_DB_FLAGS)) == 0)
 		switch (type) {
 		case DB_BTREE:
 			return (__bt_open(fname, flags & USE_OPEN_FLAGS,
-				mode, openinfo, flags & DB_LOCK));
+				mode, openinfo, flags & USE_DB_FLAGS));
 		default: /* compiler shutup */
 			break;
 		}
@@ -80,6 +82,37 @@ dbopen(fname, flags, mode, type, openinfo)
 	return (NULL);
 }
 
+int
+dbstat(dbp, st)
+	const DB *dbp;
+	DBSTAT *st;
+{
+	switch (dbp->type) {
+	case DB_BTREE:
+		return (__bt_stat(dbp, st));
+	default: /* compiler shutup */
+		break;
+	}
+	errno = EINVAL;
+	return (RET_ERROR);
+}
+
+int
+dbcount(dbp, start, end, countp)
+	const DB *dbp;
+	const DBT *start, *end;
+	unsigned long *countp;
+{
+	switch (dbp->type) {
+	case DB_BTREE:
+		return (__bt_count(dbp, start, end, countp));
+	default: /* compiler shutup */
+		break;
+	}
+	errno = EINVAL;
+	return (RET_ERROR);
+}
+
 static int
 __dberr()
 {
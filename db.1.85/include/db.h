@@ -103,6 +103,7 @@ typedef struct __db {
 
 #define	BTREEMAGIC	0x053162
 #define	BTREEVERSION	3
+#define	BTREEPFXVERSION	4	/* prefix compressed keys, page checksums */
 
 /* Structure used to pass parameters to the btree routines. */
 typedef struct {
@@ -117,8 +118,27 @@ typedef struct {
 	size_t	(*prefix)	/* prefix function */
 	   (const DBT *, const DBT *);
 	int	lorder;		/* byte order */
+	u_int	bloombits;	/* DB_BLOOM bits per key */
+	u_int	version;	/* file format of a new tree */
 } BTREEINFO;
 
+/* Buffer pool statistics returned by dbstat(). */
+typedef struct {
+	u_long	psize;		/* page size */
+	u_long	npages;		/* pages in the file */
+	u_long	curcache;	/* pages in the cache */
+	u_long	maxcache;	/* max pages to cache */
+	u_long	cachehit;	/* page found in the cache */
+	u_long	cachemiss;	/* page not in the cache */
+	u_long	pageget;
+	u_long	pageput;
+	u_long	pagenew;
+	u_long	pagealloc;	/* cache buffers allocated */
+	u_long	pageflush;	/* cache buffers reused */
+	u_long	pageread;	/* pages read from the file */
+	u_long	pagewrite;	/* pages written to the file */
+} DBSTAT;
+
 #define	HASHMAGIC	0x061561
 #define	HASHVERSION	2
 
@@ -198,9 +218,19 @@ typedef struct {
 #endif
 
 DB *dbopen(const char *, int, int, DBTYPE, const void *);
+int dbstat(const DB *, DBSTAT *);
+int dbcount(const DB *, const DBT *, const DBT *, unsigned long *);
+
+/* Bottom up build of an empty btree from sorted keys. */
+typedef struct _bulk BULK;
+BULK *dbbulk(DB *, int);
+int dbbulk_put(BULK *, const DBT *, const DBT *);
+int dbbulk_close(BULK *);
 
 #ifdef __DBINTERFACE_PRIVATE
 DB	*__bt_open(const char *, int, int, const BTREEINFO *, int);
+int	 __bt_stat(const DB *, DBSTAT *);
+int	 __bt_count(const DB *, const DBT *, const DBT *, unsigned long *);
 DB	*__hash_open(const char *, int, int, const HASHINFO *, int);
 DB	*__rec_open(const char *, int, int, const RECNOINFO *, int);
 void __dbpanic(DB *dbp);
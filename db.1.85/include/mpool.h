@@ -33,46 +33,59 @@
  *	@(#)mpool.h	8.2 (Berkeley) 7/14/94
  */
 
-/* Some systems, e.g. FreeBSD, do not have the circular queue functions. */
-#include "queue.h"
-
 /*
  * The memory pool scheme is a simple one.  Each in-memory page is referenced
- * by a bucket which is threaded in up to two of three ways.  All active pages
- * are threaded on a hash chain (hashed by page number) and an lru chain.
- * Inactive pages are threaded on a free chain.  Each reference to a memory
- * pool is handed an opaque MPOOL cookie which stores all of this information.
+ * by a bucket.  All the buckets are kept in an array that the CLOCK
+ * eviction hand sweeps.  Cached pages are also in an open addressing
+ * page table, hashed by page number, which grows as the cache grows.
+ * Each reference to a memory pool is handed an opaque MPOOL cookie which
+ * stores all of this information.
  */
-#define	HASHSIZE	128
-#define	HASHKEY(pgno)	((pgno - 1) % HASHSIZE)
 
 /* The BKT structures are the elements of the queues. */
 typedef struct _bkt {
-	CIRCLEQ_ENTRY(_bkt) hq;		/* hash queue */
-	CIRCLEQ_ENTRY(_bkt) q;		/* lru queue */
 	void    *page;			/* page */
 	pgno_t   pgno;			/* page number */
 
 #define	MPOOL_DIRTY	0x01		/* page needs to be written */
 #define	MPOOL_PINNED	0x02		/* page is pinned into memory */
+#define	MPOOL_REF	0x04		/* page used since the hand passed */
+#define	MPOOL_INUSE	0x08		/* page is in the page table */
+#define	MPOOL_LOGGED	0x10		/* page is in the log, not the file */
 	uint8_t flags;			/* flags */
 } BKT;
 
+/* Page table entry, the pgno is here so probes do not touch the BKT. */
+typedef struct _mpent {
+	pgno_t	 pgno;
+	BKT	*bp;			/* NULL if empty */
+} MPENT;
+
 typedef struct MPOOL {
-	CIRCLEQ_HEAD(_lqh, _bkt) lqh;	/* lru queue head */
-					/* hash queue array */
-	CIRCLEQ_HEAD(_hqh, _bkt) hqh[HASHSIZE];
+	BKT	**clock;		/* all the buckets */
+	pgno_t	hand;			/* next bucket to look at */
+	MPENT	*table;			/* page table */
+	pgno_t	tsize;			/* page table size, power of 2 */
+	pgno_t	tcount;			/* entries in the page table */
 	pgno_t	curcache;		/* current number of cached pages */
 	pgno_t	maxcache;		/* max number of cached pages */
+	pgno_t	basecache;		/* maxcache asked for, see mpool_bkt */
 	pgno_t	npages;			/* number of pages in the file */
 	u_long	pagesize;		/* file page size */
 	int	fd;			/* file descriptor */
 					/* page in conversion routine */
-	void    (*pgin)(void *, pgno_t, void *);
+	int     (*pgin)(void *, pgno_t, void *);
 					/* page out conversion routine */
 	void    (*pgout)(void *, pgno_t, void *);
+					/* undo page out after a write */
+	void    (*pgundo)(void *, pgno_t, void *);
 	void	*pgcookie;		/* cookie for page in/out routines */
-#ifdef STATISTICS
+	char	*map;			/* read only mapping of the file */
+	size_t	 maplen;
+	int	logfd;			/* write ahead log, -1 for none */
+	off_t	logsize;		/* bytes in the log */
+	uint32_t loggen;		/* log generation */
+	/* Statistics, always kept since they are cheap */
 	u_long	cachehit;
 	u_long	cachemiss;
 	u_long	pagealloc;
@@ -82,17 +95,20 @@ typedef struct MPOOL {
 	u_long	pageput;
 	u_long	pageread;
 	u_long	pagewrite;
-#endif
 } MPOOL;
 
 MPOOL	*mpool_open(void *, int, pgno_t, pgno_t);
-void	 mpool_filter(MPOOL *, void (*)(void *, pgno_t, void *),
+void	 mpool_filter(MPOOL *, int (*)(void *, pgno_t, void *),
+		void (*)(void *, pgno_t, void *),
 		void (*)(void *, pgno_t, void *), void *);
 void	*mpool_new(MPOOL *, pgno_t *);
 void	*mpool_get(MPOOL *, pgno_t, u_int);
 int	 mpool_put(MPOOL *, void *, u_int);
 int	 mpool_sync(MPOOL *);
 int	 mpool_close(MPOOL *);
+int	 mpool_mmap(MPOOL *);
+int	 mpool_wal(MPOOL *, int);
+int	 mpool_recover(int, int);
 #ifdef STATISTICS
 void	 mpool_stat(MPOOL *);
 #endif
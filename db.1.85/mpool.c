@@ -42,6 +42,8 @@ static char sccsid[] = "@(#)mpool.c	8.5 (Berkeley) 7/26/94";
 #include <string.h>
 #ifndef WIN32
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #endif
 
 #include "include/db.h"
@@ -52,6 +54,49 @@ static char sccsid[] = "@(#)mpool.c	8.5 (Berkeley) 7/26/94";
 static BKT *mpool_bkt(MPOOL *);
 static BKT *mpool_look(MPOOL *, pgno_t);
 static int  mpool_write(MPOOL *, BKT *);
+static int  mpool_writerun(MPOOL *, BKT **, int);
+static int  mpool_bktcmp(const void *, const void *);
+static int  mpool_log(MPOOL *, BKT **, pgno_t);
+static int  mpool_checkpoint(MPOOL *, int);
+static uint64_t mpool_sum(uint64_t, const void *, size_t);
+static int  mpool_insert(MPOOL *, BKT *);
+static void mpool_remove(MPOOL *, BKT *);
+
+#ifdef WIN32
+#define pread(fd, buf, n, off) (lseek(fd, off, SEEK_SET) != (off) ? -1 : read(fd, buf, n))
+#define pwrite(fd, buf, n, off) (lseek(fd, off, SEEK_SET) != (off) ? -1 : write(fd, buf, n))
+#endif
+#if defined(WIN32) || defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+/* Most adjacent dirty pages written at once by mpool_sync() */
+#define	MPOOL_RUN	64
+
+/*
+ * Write ahead log records.  A commit is the images of the dirty pages,
+ * as they will be in the file, then a commit record with the number of
+ * pages and the sum of the page records.  The log is only appended to
+ * until a checkpoint writes the pages in place.  Then it is written
+ * again from the start, so the syncs do not have to grow the file, and
+ * the generation in each record tells the new records from the old.
+ */
+#define	WAL_PAGE	0x57414c50	/* "WALP" */
+#define	WAL_COMMIT	0x57414c43	/* "WALC" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t pgno;			/* number of pages for a commit */
+	uint32_t psize;
+	uint32_t gen;			/* bumped at each checkpoint */
+	uint64_t sum;			/* commit only */
+} WALREC;
+
+/* Checkpoint when the log gets this big */
+#define	MPOOL_LOGMAX	(16 << 20)
+
+/* Fibonacci hashing, sequential pages spread out */
+#define	MPHASH(mp, pgno)	(((pgno) * 2654435761u) & ((mp)->tsize - 1))
 
 /*
  * mpool_open --
@@ -65,7 +110,6 @@ mpool_open(key, fd, pagesize, maxcache)
 {
 	struct stat sb;
 	MPOOL *mp;
-	int entry;
 
 	/*
 	 * Get information about the file.
@@ -83,32 +127,150 @@ mpool_open(key, fd, pagesize, maxcache)
 	/* Allocate and initialize the MPOOL cookie. */
 	if ((mp = (MPOOL *)calloc(1, sizeof(MPOOL))) == NULL)
 		return (NULL);
-	CIRCLEQ_INIT(&mp->lqh);
-	for (entry = 0; entry < HASHSIZE; ++entry)
-		CIRCLEQ_INIT(&mp->hqh[entry]);
-	mp->maxcache = maxcache;
+	mp->maxcache = mp->basecache = maxcache;
 	mp->npages = sb.st_size / pagesize;
 	mp->pagesize = pagesize;
 	mp->fd = fd;
+	mp->logfd = -1;
 	return (mp);
 }
 
 /*
  * mpool_filter --
- *	Initialize input/output filters.
+ *	Initialize input/output filters.  Written pages stay cached, so
+ *	pgundo reverses pgout on them; unlike pgin it does no checking.
  */
 void
-mpool_filter(mp, pgin, pgout, pgcookie)
+mpool_filter(mp, pgin, pgout, pgundo, pgcookie)
 	MPOOL *mp;
-	void (*pgin)(void *, pgno_t, void *);
+	int (*pgin)(void *, pgno_t, void *);
 	void (*pgout)(void *, pgno_t, void *);
+	void (*pgundo)(void *, pgno_t, void *);
 	void *pgcookie;
 {
 	mp->pgin = pgin;
 	mp->pgout = pgout;
+	mp->pgundo = pgundo;
 	mp->pgcookie = pgcookie;
 }
 	
+/*
+ * mpool_mmap --
+ *	Map the whole file read only. Pages are then used in place and
+ *	never copied, so there must not be a page in filter that
+ *	changes them.
+ */
+int
+mpool_mmap(mp)
+	MPOOL *mp;
+{
+#ifdef WIN32
+	errno = EINVAL;
+	return (RET_ERROR);
+#else
+	void *map;
+
+	if (mp->npages == 0) {
+		errno = EFTYPE;
+		return (RET_ERROR);
+	}
+	mp->maplen = (size_t)mp->npages * mp->pagesize;
+	map = mmap(NULL, mp->maplen, PROT_READ, MAP_SHARED, mp->fd, 0);
+	if (map == MAP_FAILED)
+		return (RET_ERROR);
+	mp->map = map;
+	return (RET_SUCCESS);
+#endif
+}
+
+/*
+ * mpool_wal --
+ *	Log every sync to logfd before any page is written in place.
+ *	Dirty pages are not evicted until they are logged, so the file
+ *	only ever holds pages from a commit.  Run mpool_recover() on
+ *	the file and the log first.  The pool owns logfd.
+ */
+int
+mpool_wal(mp, logfd)
+	MPOOL *mp;
+	int logfd;
+{
+	off_t size;
+
+	if ((size = lseek(logfd, 0, SEEK_END)) < 0)
+		return (RET_ERROR);
+	mp->logfd = logfd;
+	mp->logsize = size;
+	return (RET_SUCCESS);
+}
+
+/*
+ * mpool_recover --
+ *	Write the pages of every whole commit in the log to the file, then
+ *	empty the log.  A torn commit at the end is dropped.  Replaying a
+ *	commit twice is harmless, so a crash here is too.
+ */
+int
+mpool_recover(fd, logfd)
+	int fd, logfd;
+{
+	WALREC r;
+	char *buf = NULL;
+	off_t off = 0, group = 0, p;
+	uint64_t sum = 0;
+	uint32_t psize = 0, npages = 0, gen = 0;
+	int applied = 0;
+
+	while (pread(logfd, &r, sizeof(r), off) == sizeof(r)) {
+		if (off == 0)
+			gen = r.gen;
+		else if (r.gen != gen)
+			break;
+		if (r.magic == WAL_PAGE) {
+			if (psize == 0) {
+				if (r.psize == 0 || r.psize > 64 * 1024)
+					break;
+				psize = r.psize;
+				if ((buf = malloc(psize)) == NULL)
+					return (RET_ERROR);
+			}
+			if (r.psize != psize || pread(logfd, buf, psize,
+			    off + sizeof(r)) != psize)
+				break;
+			sum = mpool_sum(sum, &r, sizeof(r));
+			sum = mpool_sum(sum, buf, psize);
+			off += sizeof(r) + psize;
+			++npages;
+			continue;
+		}
+		if (r.magic != WAL_COMMIT || r.pgno != npages || r.sum != sum)
+			break;
+
+		/* The commit is whole, write it */
+		for (p = group; p < off; p += sizeof(r) + psize) {
+			if (pread(logfd, &r, sizeof(r), p) != sizeof(r) ||
+			    pread(logfd, buf, psize, p + sizeof(r)) != psize ||
+			    pwrite(fd, buf, psize,
+			    (off_t)psize * r.pgno) != psize) {
+				free(buf);
+				return (RET_ERROR);
+			}
+		}
+		off += sizeof(r);
+		group = off;
+		npages = 0;
+		sum = 0;
+		applied = 1;
+	}
+	free(buf);
+
+	if (applied && fsync(fd))
+		return (RET_ERROR);
+	if (ftruncate(logfd, 0))
+		return (RET_ERROR);
+	return (RET_SUCCESS);
+}
+
 /*
  * mpool_new --
  *	Get a new page of memory.
@@ -118,27 +280,26 @@ mpool_new(mp, pgnoaddr)
 	MPOOL *mp;
 	pgno_t *pgnoaddr;
 {
-	struct _hqh *head;
 	BKT *bp;
 
 	if (mp->npages == MAX_PAGE_NUMBER)
 		return NULL;
-#ifdef STATISTICS
+	if (mp->map) {
+		errno = EPERM;
+		return (NULL);
+	}
 	++mp->pagenew;
-#endif
 	/*
-	 * Get a BKT from the cache.  Assign a new page number, attach
-	 * it to the head of the hash chain, the tail of the lru chain,
-	 * and return.
+	 * Get a BKT from the cache.  Assign a new page number, add it to
+	 * the page table and return.
 	 */
 	if ((bp = mpool_bkt(mp)) == NULL)
 		return (NULL);
-	*pgnoaddr = bp->pgno = mp->npages++;
-	bp->flags = MPOOL_PINNED;
-
-	head = &mp->hqh[HASHKEY(bp->pgno)];
-	CIRCLEQ_INSERT_HEAD(head, bp, hq);
-	CIRCLEQ_INSERT_TAIL(&mp->lqh, bp, q);
+	bp->pgno = mp->npages;
+	bp->flags = MPOOL_PINNED | MPOOL_REF;
+	if (mpool_insert(mp, bp) == RET_ERROR)
+		return (NULL);
+	*pgnoaddr = mp->npages++;
 	return (bp->page);
 }
 
@@ -152,7 +313,6 @@ mpool_get(mp, pgno, flags)
 	pgno_t pgno;
 	u_int flags;				/* XXX not used? */
 {
-	struct _hqh *head;
 	BKT *bp;
 	off_t off;
 	int nr;
@@ -163,9 +323,14 @@ mpool_get(mp, pgno, flags)
 		return (NULL);
 	}
 
-#ifdef STATISTICS
+	/*
+	 * Mapped pages are always there and never pinned.  Nothing is
+	 * written, not even the counters, so readers can share the pool.
+	 */
+	if (mp->map)
+		return (mp->map + (size_t)pgno * mp->pagesize);
+
 	++mp->pageget;
-#endif
 
 	/* Check for a page that is cached. */
 	if ((bp = mpool_look(mp, pgno)) != NULL) {
@@ -176,18 +341,8 @@ mpool_get(mp, pgno, flags)
 			abort();
 		}
 #endif
-		/*
-		 * Move the page to the head of the hash chain and the tail
-		 * of the lru chain.
-		 */
-		head = &mp->hqh[HASHKEY(bp->pgno)];
-		CIRCLEQ_REMOVE(head, bp, hq);
-		CIRCLEQ_INSERT_HEAD(head, bp, hq);
-		CIRCLEQ_REMOVE(&mp->lqh, bp, q);
-		CIRCLEQ_INSERT_TAIL(&mp->lqh, bp, q);
-
-		/* Return a pinned page. */
-		bp->flags |= MPOOL_PINNED;
+		/* Return a pinned page. No lists to move it on. */
+		bp->flags |= MPOOL_PINNED | MPOOL_REF;
 		return (bp->page);
 	}
 
@@ -196,33 +351,27 @@ mpool_get(mp, pgno, flags)
 		return (NULL);
 
 	/* Read in the contents. */
-#ifdef STATISTICS
 	++mp->pageread;
-#endif
 	off = mp->pagesize * pgno;
-	if (lseek(mp->fd, off, SEEK_SET) != off)
-		return (NULL);
-	if ((nr = read(mp->fd, bp->page, mp->pagesize)) != mp->pagesize) {
+	if ((nr = pread(mp->fd, bp->page, mp->pagesize, off)) != mp->pagesize) {
 		if (nr >= 0)
 			errno = EFTYPE;
 		return (NULL);
 	}
 
-	/* Set the page number, pin the page. */
-	bp->pgno = pgno;
-	bp->flags = MPOOL_PINNED;
-
 	/*
-	 * Add the page to the head of the hash chain and the tail
-	 * of the lru chain.
+	 * Run through the user's filter, which can reject the page.  The
+	 * bucket is not in the table yet, so it is simply reused.
 	 */
-	head = &mp->hqh[HASHKEY(bp->pgno)];
-	CIRCLEQ_INSERT_HEAD(head, bp, hq);
-	CIRCLEQ_INSERT_TAIL(&mp->lqh, bp, q);
+	bp->pgno = pgno;
+	if (mp->pgin != NULL &&
+	    (mp->pgin)(mp->pgcookie, bp->pgno, bp->page) == RET_ERROR)
+		return (NULL);
 
-	/* Run through the user's filter. */
-	if (mp->pgin != NULL)
-		(mp->pgin)(mp->pgcookie, bp->pgno, bp->page);
+	/* Pin the page. */
+	bp->flags = MPOOL_PINNED | MPOOL_REF;
+	if (mpool_insert(mp, bp) == RET_ERROR)
+		return (NULL);
 
 	return (bp->page);
 }
@@ -239,9 +388,10 @@ mpool_put(mp, page, flags)
 {
 	BKT *bp;
 
-#ifdef STATISTICS
+	/* Like mpool_get(), touch nothing shared for a mapped pool. */
+	if (mp->map)
+		return (RET_SUCCESS);
 	++mp->pageput;
-#endif
 	bp = (BKT *)((char *)page - sizeof(BKT));
 #ifdef DEBUG
 	if (!(bp->flags & MPOOL_PINNED)) {
@@ -263,13 +413,23 @@ int
 mpool_close(mp)
 	MPOOL *mp;
 {
-	BKT *bp;
+	pgno_t i;
 
-	/* Free up any space allocated to the lru pages. */
-	while ((bp = mp->lqh.cqh_first) != (void *)&mp->lqh) {
-		CIRCLEQ_REMOVE(&mp->lqh, mp->lqh.cqh_first, q);
-		free(bp);
-	}
+	/* Leave an empty log, if the checkpoint fails it is replayed. */
+	if (mp->logsize)
+		(void)mpool_checkpoint(mp, 1);
+
+	/* Free up any space allocated to the pages. */
+	for (i = 0; i < mp->curcache; ++i)
+		free(mp->clock[i]);
+	free(mp->clock);
+	free(mp->table);
+#ifndef WIN32
+	if (mp->map)
+		munmap(mp->map, mp->maplen);
+#endif
+	if (mp->logfd != -1)
+		(void)close(mp->logfd);
 
 	/* Free the MPOOL cookie. */
 	free(mp);
@@ -284,19 +444,222 @@ int
 mpool_sync(mp)
 	MPOOL *mp;
 {
-	BKT *bp;
+	BKT **dirty;
+	pgno_t i, n, run;
 
-	/* Walk the lru chain, flushing any dirty pages to disk. */
-	for (bp = mp->lqh.cqh_first;
-	    bp != (void *)&mp->lqh; bp = bp->q.cqe_next)
-		if (bp->flags & MPOOL_DIRTY &&
-		    mpool_write(mp, bp) == RET_ERROR)
+	/*
+	 * Flush any dirty pages to disk in page order, so runs of
+	 * adjacent pages go out in one write.
+	 */
+	if ((dirty = malloc((mp->curcache + 1) * sizeof(BKT *))) == NULL)
+		return (RET_ERROR);
+	for (n = i = 0; i < mp->curcache; ++i)
+		if (mp->clock[i]->flags & MPOOL_DIRTY)
+			dirty[n++] = mp->clock[i];
+	qsort(dirty, n, sizeof(BKT *), mpool_bktcmp);
+
+	/* The commit is the log write, the pages go in place later. */
+	if (mp->logfd != -1) {
+		i = mpool_log(mp, dirty, n);
+		free(dirty);
+		if (i == RET_ERROR)
+			return (i);
+		/* Logged pages can be evicted again */
+		mp->maxcache = mp->basecache;
+		if (mp->logsize >= MPOOL_LOGMAX)
+			i = mpool_checkpoint(mp, 0);
+		return (i);
+	}
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && run < MPOOL_RUN &&
+		    dirty[i + run]->pgno == dirty[i]->pgno + run; ++run)
+			;
+		if (mpool_writerun(mp, dirty + i, run) == RET_ERROR) {
+			free(dirty);
 			return (RET_ERROR);
+		}
+	}
+	free(dirty);
 
 	/* Sync the file descriptor. */
 	return (fsync(mp->fd) ? RET_ERROR : RET_SUCCESS);
 }
 
+/*
+ * mpool_log
+ *	Append the n dirty pages and a commit record to the log and sync
+ *	it.  The pages are then marked logged, not dirty.
+ */
+static int
+mpool_log(mp, bps, n)
+	MPOOL *mp;
+	BKT **bps;
+	pgno_t n;
+{
+	struct iovec iov[2 * MPOOL_RUN + 1];
+	WALREC recs[MPOOL_RUN + 1];
+	uint64_t sum = 0;
+	off_t start = mp->logsize;
+	ssize_t len, nw;
+	pgno_t i, j, run;
+	int cnt;
+
+	if (n == 0)
+		return (RET_SUCCESS);
+
+	for (i = 0; i < n; i += run) {
+		run = n - i < MPOOL_RUN ? n - i : MPOOL_RUN;
+		for (cnt = 0, j = 0; j < run; ++j) {
+			BKT *bp = bps[i + j];
+
+			if (mp->pgout)
+				(mp->pgout)(mp->pgcookie, bp->pgno, bp->page);
+			memset(&recs[j], 0, sizeof(WALREC));
+			recs[j].magic = WAL_PAGE;
+			recs[j].pgno = bp->pgno;
+			recs[j].psize = mp->pagesize;
+			recs[j].gen = mp->loggen;
+			sum = mpool_sum(sum, &recs[j], sizeof(WALREC));
+			sum = mpool_sum(sum, bp->page, mp->pagesize);
+			iov[cnt].iov_base = &recs[j];
+			iov[cnt++].iov_len = sizeof(WALREC);
+			iov[cnt].iov_base = bp->page;
+			iov[cnt++].iov_len = mp->pagesize;
+		}
+		len = run * (sizeof(WALREC) + mp->pagesize);
+		if (i + run == n) {
+			memset(&recs[run], 0, sizeof(WALREC));
+			recs[run].magic = WAL_COMMIT;
+			recs[run].pgno = n;
+			recs[run].gen = mp->loggen;
+			recs[run].sum = sum;
+			iov[cnt].iov_base = &recs[run];
+			iov[cnt++].iov_len = sizeof(WALREC);
+			len += sizeof(WALREC);
+		}
+
+#ifdef WIN32
+		for (nw = 0, j = 0; j < cnt; ++j) {
+			if (pwrite(mp->logfd, iov[j].iov_base, iov[j].iov_len,
+			    mp->logsize + nw) != iov[j].iov_len)
+				break;
+			nw += iov[j].iov_len;
+		}
+#else
+		nw = pwritev(mp->logfd, iov, cnt, mp->logsize);
+#endif
+
+		for (j = 0; j < run; ++j)
+			if (mp->pgundo)
+				(mp->pgundo)(mp->pgcookie, bps[i + j]->pgno,
+				    bps[i + j]->page);
+		if (nw != len) {
+			/* The next commit writes over the pieces */
+			mp->logsize = start;
+			return (RET_ERROR);
+		}
+		mp->logsize += len;
+	}
+
+	if (fdatasync(mp->logfd)) {
+		mp->logsize = start;
+		return (RET_ERROR);
+	}
+
+	for (i = 0; i < n; ++i)
+		bps[i]->flags = (bps[i]->flags & ~MPOOL_DIRTY) | MPOOL_LOGGED;
+	return (RET_SUCCESS);
+}
+
+/*
+ * mpool_checkpoint
+ *	Write the logged pages in place, sync the file, and start the log
+ *	over.  Not if a logged page has changed since, the file would lose
+ *	the logged image.  With trunc the log is emptied too.
+ */
+static int
+mpool_checkpoint(mp, trunc)
+	MPOOL *mp;
+	int trunc;
+{
+	BKT **logged;
+	WALREC r;
+	pgno_t i, n, run;
+
+	if ((logged = malloc((mp->curcache + 1) * sizeof(BKT *))) == NULL)
+		return (RET_ERROR);
+	for (n = i = 0; i < mp->curcache; ++i) {
+		if ((mp->clock[i]->flags & (MPOOL_DIRTY | MPOOL_LOGGED)) ==
+		    (MPOOL_DIRTY | MPOOL_LOGGED)) {
+			free(logged);
+			return (RET_SUCCESS);
+		}
+		if (mp->clock[i]->flags & MPOOL_LOGGED)
+			logged[n++] = mp->clock[i];
+	}
+	qsort(logged, n, sizeof(BKT *), mpool_bktcmp);
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && run < MPOOL_RUN &&
+		    logged[i + run]->pgno == logged[i]->pgno + run; ++run)
+			;
+		if (mpool_writerun(mp, logged + i, run) == RET_ERROR) {
+			free(logged);
+			return (RET_ERROR);
+		}
+	}
+	free(logged);
+
+	/* Evicted logged pages were written without a sync, this covers them. */
+	if (fsync(mp->fd))
+		return (RET_ERROR);
+
+	/*
+	 * Kill the first record before the log is reused.  Otherwise a torn
+	 * write could leave some of the old generation to replay over newer
+	 * pages.
+	 */
+	if (trunc) {
+		if (ftruncate(mp->logfd, 0))
+			return (RET_ERROR);
+	} else {
+		memset(&r, 0, sizeof(r));
+		if (pwrite(mp->logfd, &r, sizeof(r), 0) != sizeof(r) ||
+		    fdatasync(mp->logfd))
+			return (RET_ERROR);
+	}
+	++mp->loggen;
+	mp->logsize = 0;
+	return (RET_SUCCESS);
+}
+
+/*
+ * mpool_sum
+ *	Fletcher style sum of the log records, it only has to catch a
+ *	torn write.
+ */
+static uint64_t
+mpool_sum(sum, p, len)
+	uint64_t sum;
+	const void *p;
+	size_t len;
+{
+	const unsigned char *c = p;
+	uint32_t a = sum, b = sum >> 32, w;
+
+	for (; len >= sizeof(w); c += sizeof(w), len -= sizeof(w)) {
+		memcpy(&w, c, sizeof(w));
+		a += w;
+		b += a;
+	}
+	for (; len; --len) {
+		a += *c++;
+		b += a;
+	}
+	return ((uint64_t)b << 32 | a);
+}
+
 /*
  * mpool_bkt
  *	Get a page from the cache (or create one).
@@ -305,53 +668,75 @@ static BKT *
 mpool_bkt(mp)
 	MPOOL *mp;
 {
-	struct _hqh *head;
-	BKT *bp;
+	BKT *bp, **clock;
+	pgno_t n;
 
 	/* If under the max cached, always create a new page. */
 	if (mp->curcache < mp->maxcache)
 		goto new;
 
 	/*
-	 * If the cache is max'd out, walk the lru list for a buffer we
-	 * can flush.  If we find one, write it (if necessary) and take it
-	 * off any lists.  If we don't find anything we grow the cache anyway.
+	 * If the cache is max'd out, sweep the CLOCK hand for a buffer
+	 * that is not pinned and has not been used since the last sweep.
+	 * Two passes clear all the reference bits, so if we don't find
+	 * anything everything is pinned and we grow the cache anyway.
 	 * The cache never shrinks.
 	 */
-	for (bp = mp->lqh.cqh_first;
-	    bp != (void *)&mp->lqh; bp = bp->q.cqe_next)
-		if (!(bp->flags & MPOOL_PINNED)) {
-			/* Flush if dirty. */
-			if (bp->flags & MPOOL_DIRTY &&
-			    mpool_write(mp, bp) == RET_ERROR)
-				return (NULL);
-#ifdef STATISTICS
-			++mp->pageflush;
-#endif
-			/* Remove from the hash and lru queues. */
-			head = &mp->hqh[HASHKEY(bp->pgno)];
-			CIRCLEQ_REMOVE(head, bp, hq);
-			CIRCLEQ_REMOVE(&mp->lqh, bp, q);
+	for (n = 0; n < 2 * mp->curcache; ++n) {
+		bp = mp->clock[mp->hand];
+		if (++mp->hand == mp->curcache)
+			mp->hand = 0;
+		if (bp->flags & MPOOL_PINNED)
+			continue;
+		/* With a log, dirty pages wait for the commit. */
+		if ((bp->flags & MPOOL_DIRTY) && mp->logfd != -1)
+			continue;
+		if (bp->flags & MPOOL_REF) {
+			bp->flags &= ~MPOOL_REF;
+			continue;
+		}
+
+		/* Flush if dirty or only in the log. */
+		if (bp->flags & (MPOOL_DIRTY | MPOOL_LOGGED) &&
+		    mpool_write(mp, bp) == RET_ERROR)
+			return (NULL);
+		++mp->pageflush;
+
+		/* Remove from the page table. */
+		mpool_remove(mp, bp);
 #ifdef DEBUG
-			{ void *spage;
-				spage = bp->page;
-				memset(bp, 0xff, sizeof(BKT) + mp->pagesize);
-				bp->page = spage;
-			}
-#endif
-			return (bp);
+		{ void *spage;
+			spage = bp->page;
+			memset(bp, 0xff, sizeof(BKT) + mp->pagesize);
+			bp->page = spage;
 		}
+#endif
+		bp->flags = 0;
+		return (bp);
+	}
 
-new:	if ((bp = (BKT *)calloc(1, sizeof(BKT) + mp->pagesize)) == NULL)
+	/*
+	 * Nothing to evict.  Raise the max by a quarter so the next pages
+	 * do not sweep the whole cache again.  The commit puts it back.
+	 */
+	mp->maxcache = mp->curcache + mp->curcache / 4 + 1;
+
+new:	if ((mp->curcache & (mp->curcache - 1)) == 0) {
+		/* Grow the clock array by powers of 2 */
+		n = mp->curcache ? mp->curcache * 2 : 16;
+		if ((clock = realloc(mp->clock, n * sizeof(BKT *))) == NULL)
+			return (NULL);
+		mp->clock = clock;
+	}
+	if ((bp = (BKT *)calloc(1, sizeof(BKT) + mp->pagesize)) == NULL)
 		return (NULL);
-#ifdef STATISTICS
 	++mp->pagealloc;
-#endif
 #if defined(DEBUG) || defined(PURIFY)
 	memset(bp, 0xff, sizeof(BKT) + mp->pagesize);
+	bp->flags = 0;
 #endif
 	bp->page = (char *)bp + sizeof(BKT);
-	++mp->curcache;
+	mp->clock[mp->curcache++] = bp;
 	return (bp);
 }
 
@@ -366,22 +751,78 @@ mpool_write(mp, bp)
 {
 	off_t off;
 
-#ifdef STATISTICS
 	++mp->pagewrite;
-#endif
 
 	/* Run through the user's filter. */
 	if (mp->pgout)
 		(mp->pgout)(mp->pgcookie, bp->pgno, bp->page);
 
 	off = mp->pagesize * bp->pgno;
-	if (lseek(mp->fd, off, SEEK_SET) != off)
+	if (pwrite(mp->fd, bp->page, mp->pagesize, off) != mp->pagesize)
 		return (RET_ERROR);
-	if (write(mp->fd, bp->page, mp->pagesize) != mp->pagesize)
+
+	/* The page stays cached, so undo the filter. */
+	if (mp->pgundo)
+		(mp->pgundo)(mp->pgcookie, bp->pgno, bp->page);
+
+	bp->flags &= ~(MPOOL_DIRTY | MPOOL_LOGGED);
+	return (RET_SUCCESS);
+}
+
+/*
+ * mpool_writerun
+ *	Write n dirty pages with adjacent page numbers.
+ */
+static int
+mpool_writerun(mp, bps, n)
+	MPOOL *mp;
+	BKT **bps;
+	int n;
+{
+#ifdef WIN32
+	int i;
+
+	for (i = 0; i < n; ++i)
+		if (mpool_write(mp, bps[i]) == RET_ERROR)
+			return (RET_ERROR);
+	return (RET_SUCCESS);
+#else
+	struct iovec iov[MPOOL_RUN];
+	ssize_t nw;
+	int i;
+
+	if (n == 1)
+		return (mpool_write(mp, bps[0]));
+
+	for (i = 0; i < n; ++i) {
+		if (mp->pgout)
+			(mp->pgout)(mp->pgcookie, bps[i]->pgno, bps[i]->page);
+		iov[i].iov_base = bps[i]->page;
+		iov[i].iov_len = mp->pagesize;
+	}
+
+	nw = pwritev(mp->fd, iov, n, mp->pagesize * bps[0]->pgno);
+
+	for (i = 0; i < n; ++i)
+		if (mp->pgundo)
+			(mp->pgundo)(mp->pgcookie, bps[i]->pgno, bps[i]->page);
+	if (nw != n * mp->pagesize)
 		return (RET_ERROR);
 
-	bp->flags &= ~MPOOL_DIRTY;
+	mp->pagewrite += n;
+	for (i = 0; i < n; ++i)
+		bps[i]->flags &= ~(MPOOL_DIRTY | MPOOL_LOGGED);
 	return (RET_SUCCESS);
+#endif
+}
+
+static int
+mpool_bktcmp(a, b)
+	const void *a, *b;
+{
+	pgno_t pa = (*(BKT **)a)->pgno, pb = (*(BKT **)b)->pgno;
+
+	return (pa < pb ? -1 : pa > pb);
 }
 
 /*
@@ -393,23 +834,97 @@ mpool_look(mp, pgno)
 	MPOOL *mp;
 	pgno_t pgno;
 {
-	struct _hqh *head;
-	BKT *bp;
-
-	head = &mp->hqh[HASHKEY(pgno)];
-	for (bp = head->cqh_first; bp != (void *)head; bp = bp->hq.cqe_next)
-		if (bp->pgno == pgno) {
-#ifdef STATISTICS
-			++mp->cachehit;
-#endif
-			return (bp);
-		}
-#ifdef STATISTICS
+	MPENT *ent;
+	pgno_t i;
+
+	if (mp->tsize)
+		for (i = MPHASH(mp, pgno); (ent = &mp->table[i])->bp;
+		    i = (i + 1) & (mp->tsize - 1))
+			if (ent->pgno == pgno) {
+				++mp->cachehit;
+				return (ent->bp);
+			}
 	++mp->cachemiss;
-#endif
 	return (NULL);
 }
 
+/*
+ * mpool_insert
+ *	Add a page to the page table, growing it to keep it under half
+ *	full.
+ */
+static int
+mpool_insert(mp, bp)
+	MPOOL *mp;
+	BKT *bp;
+{
+	MPENT *old, *table;
+	pgno_t i, j, osize;
+
+	if (mp->tcount >= mp->tsize / 2) {
+		osize = mp->tsize;
+		old = mp->table;
+		mp->tsize = osize ? osize * 2 : 64;
+		if ((table = calloc(mp->tsize, sizeof(MPENT))) == NULL) {
+			mp->tsize = osize;
+			return (RET_ERROR);
+		}
+		mp->table = table;
+		for (j = 0; j < osize; ++j)
+			if (old[j].bp) {
+				for (i = MPHASH(mp, old[j].pgno); table[i].bp;
+				    i = (i + 1) & (mp->tsize - 1))
+					;
+				table[i] = old[j];
+			}
+		free(old);
+	}
+
+	for (i = MPHASH(mp, bp->pgno); mp->table[i].bp;
+	    i = (i + 1) & (mp->tsize - 1))
+		;
+	mp->table[i].pgno = bp->pgno;
+	mp->table[i].bp = bp;
+	bp->flags |= MPOOL_INUSE;
+	++mp->tcount;
+	return (RET_SUCCESS);
+}
+
+/*
+ * mpool_remove
+ *	Remove a page from the page table. Linear probing, so shift
+ *	back any entries that probed past the hole.
+ */
+static void
+mpool_remove(mp, bp)
+	MPOOL *mp;
+	BKT *bp;
+{
+	pgno_t i, j, k, mask;
+
+	if (!(bp->flags & MPOOL_INUSE))
+		return;
+
+	mask = mp->tsize - 1;
+	for (i = MPHASH(mp, bp->pgno); mp->table[i].bp != bp; i = (i + 1) & mask)
+		;
+
+	for (j = i; ; ) {
+		mp->table[i].bp = NULL;
+		do {
+			j = (j + 1) & mask;
+			if (mp->table[j].bp == NULL) {
+				--mp->tcount;
+				return;
+			}
+			k = MPHASH(mp, mp->table[j].pgno);
+			/* Can j move to i? Only if k is not in (i, j] */
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		mp->table[i] = mp->table[j];
+		i = j;
+	}
+}
+
 #ifdef STATISTICS
 /*
  * mpool_stat
@@ -422,10 +937,11 @@ mpool_stat(mp)
 	BKT *bp;
 	int cnt;
 	char *sep;
+	pgno_t i;
 
-	(void)fprintf(stderr, "%lu pages in the file\n", mp->npages);
+	(void)fprintf(stderr, "%u pages in the file\n", mp->npages);
 	(void)fprintf(stderr,
-	    "page size %lu, cacheing %lu pages of %lu page max cache\n",
+	    "page size %lu, cacheing %u pages of %u page max cache\n",
 	    mp->pagesize, mp->curcache, mp->maxcache);
 	(void)fprintf(stderr, "%lu page puts, %lu page gets, %lu page new\n",
 	    mp->pageput, mp->pageget, mp->pagenew);
@@ -441,8 +957,10 @@ mpool_stat(mp)
 
 	sep = "";
 	cnt = 0;
-	for (bp = mp->lqh.cqh_first;
-	    bp != (void *)&mp->lqh; bp = bp->q.cqe_next) {
+	for (i = 0; i < mp->curcache; ++i) {
+		bp = mp->clock[i];
+		if (!(bp->flags & MPOOL_INUSE))
+			continue;
 		(void)fprintf(stderr, "%s%d", sep, bp->pgno);
 		if (bp->flags & MPOOL_DIRTY)
 			(void)fprintf(stderr, "d");
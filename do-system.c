@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #ifndef WIN32
+#include <spawn.h>
 #include <sys/wait.h>
 #endif
 #include "samlib.h"
@@ -28,3 +29,31 @@ int do_system(const char *fmt, ...)
 
 	return rc;
 }
+
+#ifndef WIN32
+extern char **environ;
+
+/* The same as do_system() but runs argv directly with no shell and no
+ * 1k limit. Returns < 0 on error or the exit status.
+ */
+int do_system_argv(char *const argv[])
+{
+	pid_t pid;
+	int rc, status;
+
+	if (!argv || !argv[0])
+		return -EINVAL;
+
+	rc = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+	if (rc)
+		return -rc;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -errno;
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return status;
+}
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* for pipe2 and F_SETPIPE_SZ */
 #define _WITH_GETLINE /* for FreeBSD */
 #include <stdio.h>
 #include <stdlib.h>
@@ -5,6 +6,12 @@
 #include <string.h>
 #include <errno.h>
 #ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #endif
 
@@ -66,3 +73,362 @@ int readcmd(int (*line_func)(char *line, void *data), void *data, const char *fm
 
 	return rc;
 }
+
+#ifndef WIN32
+/* Start with a large read buffer. It grows if a line does not fit. */
+#define READCMD_BUFSIZE (64 * 1024)
+/* Enough to keep the child from blocking on most outputs. Do not go
+ * crazy here: once a user passes pipe-user-pages-soft, new pipes are
+ * limited to one page.
+ */
+#define READCMD_PIPESIZE (256 * 1024)
+
+extern char **environ;
+
+struct readcmd_buf {
+	char *buf;
+	int size;
+	int len;
+};
+
+/* Spawn argv[0] with stdout going to a pipe. No shell is involved.
+ * posix_spawn uses vfork semantics under glibc so this is much
+ * cheaper than popen(). Returns the pid and the read side of the pipe
+ * in *fd, or -1 on error.
+ */
+static pid_t readcmd_spawn(char *const argv[], int *fd)
+{
+	posix_spawn_file_actions_t actions;
+	int pfd[2], rc;
+	pid_t pid;
+
+	if (!argv || !argv[0] || !fd) {
+		errno = EINVAL;
+		return -1;
+	}
+
+#ifdef __linux__
+	if (pipe2(pfd, O_CLOEXEC))
+		return -1;
+#else
+	if (pipe(pfd))
+		return -1;
+	fcntl(pfd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pfd[1], F_SETFD, FD_CLOEXEC);
+#endif
+
+#ifdef F_SETPIPE_SZ
+	/* Not fatal if this fails */
+	fcntl(pfd[1], F_SETPIPE_SZ, READCMD_PIPESIZE);
+#endif
+
+	/* dup2 clears the close-on-exec flag for stdout */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pfd[1], 1);
+
+	rc = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+
+	posix_spawn_file_actions_destroy(&actions);
+	close(pfd[1]);
+
+	if (rc) {
+		close(pfd[0]);
+		errno = rc;
+		return -1;
+	}
+
+	*fd = pfd[0];
+	return pid;
+}
+
+/* Returns the exit status, or the raw wait status if the child did
+ * not exit normally, or -1 on error.
+ */
+static int readcmd_wait(pid_t pid)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return status;
+}
+
+/* Read as much as is available from fd and pass any complete lines
+ * to line_func(). On EOF, a trailing line with no NL is also passed.
+ * Returns > 0 if data was read, 0 on EOF, -1 on error, or -2 if
+ * line_func() returned non-zero.
+ */
+static int readcmd_lines(struct readcmd_buf *rb, int fd,
+						 int (*line_func)(char *line, int len, void *data), void *data)
+{
+	char *p, *e;
+	int n;
+
+	if (rb->size - rb->len < 2) {
+		int size = rb->size ? rb->size * 2 : READCMD_BUFSIZE;
+		char *buf = realloc(rb->buf, size);
+		if (!buf)
+			return -1;
+		rb->buf = buf;
+		rb->size = size;
+	}
+
+	do
+		n = read(fd, rb->buf + rb->len, rb->size - rb->len - 1);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+
+	if (n == 0) {
+		/* Last line with no NL */
+		if (rb->len) {
+			rb->buf[rb->len] = 0;
+			n = rb->len;
+			rb->len = 0;
+			if (line_func(rb->buf, n, data))
+				return -2;
+		}
+		return 0;
+	}
+
+	p = rb->buf;
+	e = rb->buf + rb->len + n;
+	while (p < e) {
+		char *nl = memchr(p, '\n', e - p);
+		if (!nl)
+			break;
+		*nl = 0;
+		if (line_func(p, nl - p, data)) {
+			rb->len = 0;
+			return -2;
+		}
+		p = nl + 1;
+	}
+
+	rb->len = e - p;
+	if (rb->len && p != rb->buf)
+		memmove(rb->buf, p, rb->len);
+
+	return n;
+}
+
+/* The same as readcmd() but runs argv directly with no shell and no
+ * 1k limit. The line is NULL terminated and len does not include the
+ * NL.
+ */
+int readcmd_argv(int (*line_func)(char *line, int len, void *data), void *data,
+				 char *const argv[])
+{
+	struct readcmd_buf rb = { NULL, 0, 0 };
+	int fd, n, status;
+
+	if (!line_func) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pid_t pid = readcmd_spawn(argv, &fd);
+	if (pid < 0)
+		return -1;
+
+	while ((n = readcmd_lines(&rb, fd, line_func, data)) > 0) ;
+
+	free(rb.buf);
+	close(fd);
+
+	status = readcmd_wait(pid);
+	if (n == -2) {
+		errno = EINTR;
+		return -1;
+	}
+	if (n < 0)
+		return -1;
+
+	return status;
+}
+#endif
+
+#ifndef WIN32
+/* \cond skip */
+struct readcmd_slot {
+	struct readcmd_job *job;
+	pid_t pid;
+	struct readcmd_buf rb;
+};
+
+/* Each running job holds a pipe and needs both ends to start, so
+ * only half the fds left under RLIMIT_NOFILE can be used.
+ */
+static int readcmd_max_running(void)
+{
+	struct rlimit rl;
+	long room, nopen = 3;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur == RLIM_INFINITY ||
+		rl.rlim_cur > INT_MAX)
+		return INT_MAX;
+
+#ifdef __linux__
+	DIR *dir = opendir("/proc/self/fd");
+	if (dir) {
+		for (nopen = -3; readdir(dir); ++nopen) ; /* ., .., and dir */
+		closedir(dir);
+	}
+#endif
+
+	room = ((long)rl.rlim_cur - nopen) / 2;
+	return room > 1 ? room : 1;
+}
+
+static void readcmd_done(struct readcmd_slot *slot, struct pollfd *pfd, int n)
+{
+	struct readcmd_job *job = slot->job;
+	int saved = errno;
+
+	close(pfd->fd);
+	pfd->fd = -1;
+
+	job->status = readcmd_wait(slot->pid);
+	if (n == -2) {
+		job->status = -1;
+		job->err = EINTR;
+	} else if (n < 0) {
+		job->status = -1;
+		job->err = saved;
+	}
+
+	slot->job = NULL;
+}
+/* \endcond */
+
+/* Run njobs commands with at most max_running at once (0 means all of
+ * them). The stdout pipes are multiplexed with poll() and lines are
+ * delivered to each job's line_func() as they arrive. Returns when all
+ * the commands have exited. max_running is cut to fit the fds left
+ * under RLIMIT_NOFILE, and a job that runs out of fds waits for a
+ * running one to finish.
+ *
+ * Returns 0 on success or -1 with errno set if the args are invalid
+ * or poll() fails. Per job results are in the status field: same as
+ * readcmd_argv(). On error the status is -1 and err is the errno. If
+ * poll() fails, every job not yet done fails with its errno.
+ */
+int readcmd_multi(struct readcmd_job *jobs, int njobs, int max_running)
+{
+	struct readcmd_slot *slots;
+	struct pollfd *pfds;
+	int i, n, next = 0, running = 0, err = 0;
+
+	if (!jobs || njobs < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < njobs; ++i)
+		if (!jobs[i].line_func) {
+			errno = EINVAL;
+			return -1;
+		}
+
+	if (max_running <= 0 || max_running > njobs)
+		max_running = njobs;
+	if (max_running == 0)
+		return 0;
+	n = readcmd_max_running();
+	if (max_running > n)
+		max_running = n;
+
+	slots = calloc(max_running, sizeof(struct readcmd_slot));
+	pfds = calloc(max_running, sizeof(struct pollfd));
+	if (!slots || !pfds) {
+		free(slots);
+		free(pfds);
+		return -1;
+	}
+	for (i = 0; i < max_running; ++i)
+		pfds[i].fd = -1;
+
+	while (next < njobs || running > 0) {
+		/* Fill any empty slots */
+		for (i = 0; i < max_running && next < njobs; ++i) {
+			if (slots[i].job)
+				continue;
+
+			struct readcmd_job *job = &jobs[next++];
+			job->status = 0;
+			job->err = 0;
+
+			slots[i].pid = readcmd_spawn(job->argv, &pfds[i].fd);
+			if (slots[i].pid < 0 && (errno == EMFILE || errno == ENFILE) &&
+				running > 0) {
+				/* Out of fds, try again when a job finishes */
+				pfds[i].fd = -1;
+				--next;
+				break;
+			}
+			if (slots[i].pid < 0) {
+				job->status = -1;
+				job->err = errno;
+				pfds[i].fd = -1;
+				--i; /* retry the slot with the next job */
+				continue;
+			}
+
+			slots[i].job = job;
+			slots[i].rb.len = 0;
+			pfds[i].events = POLLIN;
+			++running;
+		}
+
+		if (running == 0)
+			break;
+
+		n = poll(pfds, max_running, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+
+		for (i = 0; i < max_running && n > 0; ++i) {
+			if (pfds[i].fd < 0 || pfds[i].revents == 0)
+				continue;
+			--n;
+
+			struct readcmd_slot *slot = &slots[i];
+			int rc = readcmd_lines(&slot->rb, pfds[i].fd,
+								   slot->job->line_func, slot->job->data);
+			if (rc <= 0) {
+				readcmd_done(slot, &pfds[i], rc);
+				--running;
+			}
+		}
+	}
+
+	/* Only on a poll error: fail the running jobs and the rest */
+	for (i = 0; i < max_running; ++i)
+		if (slots[i].job) {
+			errno = err;
+			readcmd_done(&slots[i], &pfds[i], -1);
+		}
+	for (; next < njobs; ++next) {
+		jobs[next].status = -1;
+		jobs[next].err = err;
+	}
+
+	for (i = 0; i < max_running; ++i)
+		free(slots[i].rb.buf);
+	free(slots);
+	free(pfds);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <fcntl.h>
 /* Hardcoded to make sure we get the right file */
 #undef __DBINTERFACE_PRIVATE
 #include "db.1.85/include/db.h"
@@ -24,14 +25,26 @@ static void db_close_global(void)
 	}
 }
 
-int db_open(const char *dbname, uint32_t flags, void **dbh)
+int db_open_info(const char *dbname, uint32_t flags, const struct db_info *info, void **dbh)
 {
+	BTREEINFO bt, *btp = NULL;
 	DB *db;
 
 	if (!dbh && global_db)
 		return -EBUSY;
 
-	db = dbopen(dbname, flags, 0664, DB_BTREE, NULL);
+	if (info) {
+		memset(&bt, 0, sizeof(bt));
+		bt.cachesize = info->cachesize;
+		bt.psize = info->psize;
+		bt.minkeypage = info->minkeypage;
+		bt.lorder = info->lorder;
+		bt.bloombits = info->bloombits;
+		bt.version = info->version;
+		btp = &bt;
+	}
+
+	db = dbopen(dbname, flags, 0664, DB_BTREE, btp);
 	if (!db)
 		return errno;
 
@@ -44,6 +57,11 @@ int db_open(const char *dbname, uint32_t flags, void **dbh)
 	return 0;
 }
 
+int db_open(const char *dbname, uint32_t flags, void **dbh)
+{
+	return db_open_info(dbname, flags, NULL, dbh);
+}
+
 #define GET_DB(dbh)							\
 	DB *db = (dbh) ? (dbh) : global_db;			\
 	if (!db)									\
@@ -114,11 +132,34 @@ int db_get_raw(void *dbh, const void *key, int klen, void *val, int len)
 	if (len > data_dbt.size)
 		len = data_dbt.size;
 
-	memcpy(val, data_dbt.data, len);
+	/* DB_MMAP copies big values straight into val */
+	if (data_dbt.data != val)
+		memcpy(val, data_dbt.data, len);
 
 	return len;
 }
 
+/* Returns val len on success and points val at the value. No copy. */
+int db_get_ptr(void *dbh, const void *key, int klen, const void **val)
+{
+	int rc;
+	DBT key_dbt, data_dbt;
+	GET_DB(dbh);
+
+	memset(&key_dbt, 0, sizeof(key_dbt));
+	memset(&data_dbt, 0, sizeof(data_dbt));
+
+	key_dbt.data = (void *)key;
+	key_dbt.size = klen;
+
+	rc = db->get(db, &key_dbt, &data_dbt, 0);
+	if (rc)
+		return rc < 0 ? rc : -rc;
+
+	*val = data_dbt.data;
+	return data_dbt.size;
+}
+
 int db_get(void *dbh, const char *keystr, void *val, int len)
 {
 	return db_get_raw(dbh, keystr, strlen(keystr) + 1, val, len);
@@ -189,3 +230,429 @@ int db_walk(void *dbh, int (*walk_func)(const char *key, void *data, int len))
 
 	return rc;
 }
+
+/* \cond skip */
+/* Same order as the default btree compare */
+static int key_cmp(const void *a, int alen, const void *b, int blen)
+{
+	int rc = memcmp(a, b, alen < blen ? alen : blen);
+
+	return rc ? rc : alen - blen;
+}
+/* \endcond */
+
+int db_sync(void *dbh)
+{
+	GET_DB(dbh);
+
+	if (db->sync(db, 0))
+		return errno;
+	return 0;
+}
+
+/* \cond skip */
+struct db_batch_op {
+	const char *key; /* set at commit, the arena moves */
+	size_t off;
+	int klen, len;   /* len < 0 for a del */
+	int seq;
+};
+
+struct db_batch {
+	DB *db;
+	char *arena;
+	size_t used, size;
+	struct db_batch_op *ops;
+	int nops, maxops;
+};
+
+static int batch_add(struct db_batch *b, const void *key, int klen, const void *val, int len)
+{
+	size_t need = klen + (len > 0 ? len : 0);
+
+	if (b->nops == b->maxops) {
+		int max = b->maxops ? b->maxops * 2 : 1024;
+		void *ops = realloc(b->ops, max * sizeof(struct db_batch_op));
+		if (!ops)
+			return ENOMEM;
+		b->ops = ops;
+		b->maxops = max;
+	}
+	if (b->used + need > b->size) {
+		size_t size = b->size ? b->size * 2 : 64 * 1024;
+		char *arena;
+
+		while (size < b->used + need)
+			size *= 2;
+		arena = realloc(b->arena, size);
+		if (!arena)
+			return ENOMEM;
+		b->arena = arena;
+		b->size = size;
+	}
+
+	struct db_batch_op *op = &b->ops[b->nops];
+	op->off = b->used;
+	op->klen = klen;
+	op->len = len;
+	op->seq = b->nops++;
+	memcpy(b->arena + b->used, key, klen);
+	if (len > 0)
+		memcpy(b->arena + b->used + klen, val, len);
+	b->used += need;
+	return 0;
+}
+
+/* Then the order added */
+static int batch_cmp(const void *a, const void *b)
+{
+	const struct db_batch_op *x = a, *y = b;
+	int rc = key_cmp(x->key, x->klen, y->key, y->klen);
+
+	return rc ? rc : x->seq - y->seq;
+}
+/* \endcond */
+
+int db_batch_begin(void *dbh, void **batch)
+{
+	struct db_batch *b;
+	GET_DB(dbh);
+
+	b = calloc(1, sizeof(struct db_batch));
+	if (!b)
+		return ENOMEM;
+	b->db = db;
+	*batch = b;
+	return 0;
+}
+
+int db_batch_put(void *batch, const void *key, int klen, const void *val, int len)
+{
+	if (len < 0)
+		return EINVAL;
+	return batch_add(batch, key, klen, val, len);
+}
+
+int db_batch_del(void *batch, const void *key, int klen)
+{
+	return batch_add(batch, key, klen, NULL, -1);
+}
+
+int db_batch_commit(void *batch)
+{
+	struct db_batch *b = batch;
+	DB *db = b->db;
+	DBT key, data;
+	int i, rc = 0;
+
+	for (i = 0; i < b->nops; ++i)
+		b->ops[i].key = b->arena + b->ops[i].off;
+	qsort(b->ops, b->nops, sizeof(struct db_batch_op), batch_cmp);
+
+	memset(&key, 0, sizeof(key));
+	memset(&data, 0, sizeof(data));
+	for (i = 0; i < b->nops && rc == 0; ++i) {
+		struct db_batch_op *op = &b->ops[i];
+
+		/* Only the last op on a key matters */
+		if (i + 1 < b->nops && op->klen == op[1].klen &&
+			memcmp(op->key, op[1].key, op->klen) == 0)
+			continue;
+
+		key.data = (void *)op->key;
+		key.size = op->klen;
+		if (op->len < 0) {
+			if (db->del(db, &key, 0) < 0)
+				rc = errno;
+		} else {
+			data.data = (void *)(op->key + op->klen);
+			data.size = op->len;
+			if (db->put(db, &key, &data, 0))
+				rc = errno;
+		}
+	}
+
+	/* Sync even after an error, the applied ops are written */
+	if (db->sync(db, 0) && rc == 0)
+		rc = errno;
+
+	db_batch_abort(b);
+	return rc;
+}
+
+void db_batch_abort(void *batch)
+{
+	struct db_batch *b = batch;
+
+	free(b->arena);
+	free(b->ops);
+	free(b);
+}
+
+/* \cond skip */
+struct db_cursor {
+	DB *db;
+	unsigned flags;
+	int state;  /* 0 = not started, 1 = scanning, 2 = done */
+	DBT start, end;
+	char buf[];
+};
+
+/* Sets the end of the prefix range, size 0 if there is none */
+static void prefix_end(DBT *end)
+{
+	unsigned char *p = end->data;
+
+	while (end->size > 0 && p[end->size - 1] == 0xff)
+		--end->size;
+	if (end->size > 0)
+		++p[end->size - 1];
+}
+
+static int cursor_range(struct db_cursor *c, const void *start, int slen,
+						const void *end, int elen)
+{
+	if (slen < 0 || elen < 0)
+		return EINVAL;
+
+	c->start.data = c->buf;
+	c->start.size = start ? slen : 0;
+	memcpy(c->start.data, start, c->start.size);
+	c->end.data = c->buf + c->start.size;
+	c->end.size = end ? elen : 0;
+	memcpy(c->end.data, end, c->end.size);
+
+	if ((c->flags & DB_CURSOR_PREFIX) && c->end.size)
+		prefix_end(&c->end);
+	return 0;
+}
+
+/* Move the tree cursor to the first key in the range */
+static int cursor_first(struct db_cursor *c, DBT *key, DBT *data)
+{
+	DB *db = c->db;
+	int rc;
+
+	if (!(c->flags & DB_CURSOR_PREV)) {
+		if (c->start.size == 0)
+			return db->seq(db, key, data, R_FIRST);
+		*key = c->start;
+		return db->seq(db, key, data, R_CURSOR);
+	}
+
+	/* Backwards we start at the key before end */
+	if (c->end.size) {
+		*key = c->end;
+		rc = db->seq(db, key, NULL, R_CURSOR);
+		if (rc == 0)
+			return db->seq(db, key, data, R_PREV);
+		if (rc < 0)
+			return rc;
+	}
+	return db->seq(db, key, data, R_LAST);
+}
+/* \endcond */
+
+/* Open a cursor on the keys in [start, end). A NULL start or end is
+ * the first or last key in the db. The flags are:
+ *
+ *   DB_CURSOR_PREV    walk the range backwards
+ *   DB_CURSOR_PREFIX  the range is every key that starts with start,
+ *                     end is ignored
+ *
+ * Keys are in memcmp() order, shorter first. The db_put() keys include
+ * the null so use strlen() for a prefix. A dbh has one btree cursor so
+ * only one cursor (or db_walk()) can be used at a time. Not thread
+ * safe. Returns 0 or an errno.
+ */
+int db_cursor_open(void *dbh, const void *start, int slen, const void *end, int elen,
+				   unsigned flags, void **cursor)
+{
+	struct db_cursor *c;
+	int rc;
+	GET_DB(dbh);
+
+	if (flags & DB_CURSOR_PREFIX) {
+		end = start;
+		elen = slen;
+	}
+
+	c = calloc(1, sizeof(struct db_cursor) + (start ? slen : 0) + (end ? elen : 0));
+	if (!c)
+		return ENOMEM;
+	c->db = db;
+	c->flags = flags;
+	if ((rc = cursor_range(c, start, slen, end, elen))) {
+		free(c);
+		return rc;
+	}
+
+	*cursor = c;
+	return 0;
+}
+
+/* Get the next key in the cursor range. If val is NULL the value is
+ * not read, which saves the copy of a big value. The key and val
+ * point into the db and are valid until the next call with the dbh.
+ * With DB_MMAP big values are cached until db_close().
+ * Returns 1 for a key, 0 at the end of the range, or < 0 on error.
+ */
+int db_cursor_next(void *cursor, const void **key, int *klen, const void **val, int *len)
+{
+	struct db_cursor *c = cursor;
+	DB *db = c->db;
+	DBT k, d;
+	int rc;
+
+	if (c->state == 2)
+		return 0;
+
+	memset(&k, 0, sizeof(k));
+	memset(&d, 0, sizeof(d));
+	if (c->state == 0) {
+		rc = cursor_first(c, &k, val ? &d : NULL);
+		c->state = 1;
+	} else
+		rc = db->seq(db, &k, val ? &d : NULL,
+					 (c->flags & DB_CURSOR_PREV) ? R_PREV : R_NEXT);
+	if (rc < 0)
+		return -errno;
+	if (rc)
+		goto done;
+
+	if (c->flags & DB_CURSOR_PREV) {
+		if (c->start.size && key_cmp(k.data, k.size, c->start.data, c->start.size) < 0)
+			goto done;
+	} else if (c->end.size && key_cmp(k.data, k.size, c->end.data, c->end.size) >= 0)
+		goto done;
+
+	if (key)
+		*key = k.data;
+	if (klen)
+		*klen = k.size;
+	if (val)
+		*val = d.data;
+	if (len)
+		*len = d.size;
+	return 1;
+
+done:
+	c->state = 2;
+	return 0;
+}
+
+void db_cursor_close(void *cursor)
+{
+	free(cursor);
+}
+
+/* Count the keys in [start, end) without reading the values. Only
+ * DB_CURSOR_PREFIX is used from flags. Whole leaf pages are counted
+ * without looking at the keys. Returns 0 or an errno.
+ */
+int db_count_range(void *dbh, const void *start, int slen, const void *end, int elen,
+				   unsigned flags, unsigned long *count)
+{
+	struct db_cursor *c;
+	int rc;
+
+	*count = 0;
+	rc = db_cursor_open(dbh, start, slen, end, elen, flags & DB_CURSOR_PREFIX, (void **)&c);
+	if (rc)
+		return rc;
+
+	/* A prefix of all 0xff has no end */
+	if (dbcount(c->db, &c->start, c->end.size ? &c->end : NULL, count))
+		rc = errno;
+
+	db_cursor_close(c);
+	return rc;
+}
+
+struct db_bulk {
+	DB *db;
+	BULK *bulk;
+};
+
+int db_bulk_open(const char *dbname, const struct db_info *info, int fill, void **bh)
+{
+	struct db_bulk *b;
+	void *dbh;
+	int rc;
+
+	if (fill < 0 || fill > 100)
+		return EINVAL;
+
+	b = calloc(1, sizeof(struct db_bulk));
+	if (!b)
+		return ENOMEM;
+
+	rc = db_open_info(dbname, DB_CREATE | O_TRUNC, info, &dbh);
+	if (rc) {
+		free(b);
+		return rc;
+	}
+
+	b->db = dbh;
+	b->bulk = dbbulk(b->db, fill);
+	if (!b->bulk) {
+		rc = errno;
+		dbclose(b->db);
+		free(b);
+		return rc;
+	}
+
+	*bh = b;
+	return 0;
+}
+
+int db_bulk_put(void *bh, const void *key, int klen, const void *val, int len)
+{
+	struct db_bulk *b = bh;
+	DBT key_dbt, data_dbt;
+
+	memset(&key_dbt, 0, sizeof(key_dbt));
+	memset(&data_dbt, 0, sizeof(data_dbt));
+
+	key_dbt.data = (void *)key;
+	key_dbt.size = klen;
+	data_dbt.data = (void *)val;
+	data_dbt.size = len;
+
+	if (dbbulk_put(b->bulk, &key_dbt, &data_dbt))
+		return errno;
+	return 0;
+}
+
+int db_bulk_close(void *bh)
+{
+	struct db_bulk *b = bh;
+	int rc = 0;
+
+	if (dbbulk_close(b->bulk))
+		rc = errno;
+	if (b->db->close(b->db) && rc == 0)
+		rc = errno;
+	free(b);
+	return rc;
+}
+
+int db_stats(void *dbh, struct db_stats *stats)
+{
+	DBSTAT st;
+	GET_DB(dbh);
+
+	if (dbstat(db, &st))
+		return errno;
+
+	stats->psize = st.psize;
+	stats->npages = st.npages;
+	stats->curcache = st.curcache;
+	stats->maxcache = st.maxcache;
+	stats->cachehit = st.cachehit;
+	stats->cachemiss = st.cachemiss;
+	stats->pageread = st.pageread;
+	stats->pagewrite = st.pagewrite;
+	stats->pageflush = st.pageflush;
+	return 0;
+}
@@ -52,7 +52,7 @@ unsigned long get_duration(const char *str);
 
 char *nice_duration(unsigned long duration, char *str, int len);
 
-/* Returns memory length in bytes. Suffix: gmkb.
+/* Returns memory length in bytes. Suffix: tgmkb.
  * Warning: exits on error.
  */
 uint64_t get_mem_len(const char *str);
@@ -63,6 +63,17 @@ char *nicer_mem_len(uint64_t size, char *str, int len);
 /* Adds commas. Not thread safe */
 char *nice_number(long number);
 
+/* Reentrant versions that do not allocate or exit. The _get_*
+ * functions return 0 or EINVAL or ERANGE. The others need a 32 byte
+ * str; the _nice* functions return the length. Use %s to send them
+ * to a strbuf.
+ */
+int _get_duration(const char *str, unsigned long *duration);
+int _get_mem_len(const char *str, uint64_t *len);
+int _nice_duration(unsigned long duration, char *str);
+int _nicer_mem_len(uint64_t size, char *str);
+char *nice_number_r(long number, char *str);
+
 /* Read a file line at a time calling line_func() for each
  * line. Removes the NL from the line. If line_func() returns
  * non-zero, it will stop reading the file and return 1.
@@ -88,14 +99,73 @@ int readfile(int (*line_func)(char *line, void *data), void *data,
  */
 int readcmd(int (*line_func)(char *line, void *data), void *data, const char *fmt, ...);
 
-/* Copy a file.
- * Returns number of bytes copied or < 0 on error:
+/* The same as readcmd() but runs argv[0] directly with posix_spawnp()
+ * rather than going through popen() and the shell. The output is read
+ * in large chunks and len is the length of the line without the NL.
+ */
+int readcmd_argv(int (*line_func)(char *line, int len, void *data), void *data,
+				 char *const argv[]);
+
+struct readcmd_job {
+	char *const *argv;
+	int (*line_func)(char *line, int len, void *data);
+	void *data;
+	int status; /* set by readcmd_multi() */
+	int err;    /* errno if status is -1 */
+};
+
+/* Run njobs commands concurrently, at most max_running at a time (0
+ * for no limit). Lines are passed to each job's line_func() as they
+ * arrive. Returns 0 when all the commands are done, or -1 if the args
+ * are invalid or poll() failed, which fails the unfinished jobs.
+ * Check each job's status: it is the same as the return from
+ * readcmd_argv().
+ */
+int readcmd_multi(struct readcmd_job *jobs, int njobs, int max_running);
+
+/* Copy a file. Uses reflinks or server side copies where possible
+ * and preserves holes.
+ * Returns number of bytes copied, short if from shrunk, or < 0 on
+ * error:
  *    -1 = I/O error
  *    -2 = error on from
  *    -3 = error on to
  */
 long copy_file(const char *from, const char *to);
 
+/* Lower level copy_file(). Copies size bytes from in to out, which
+ * should be empty. Returns the bytes copied, short if in shrunk, or
+ * -1 on error.
+ */
+off_t _copy_fd(int in, int out, off_t size);
+
+/* Copy a file and return the md5 or sha256 of the contents in one
+ * pass. Returns the same as copy_file().
+ */
+long copy_file_hash(const char *from, const char *to, int flags, uint8_t *digest);
+#define COPY_MD5    1
+#define COPY_SHA256 2
+/* Try not to fill the page cache with the source */
+#define COPY_DIRECT 4
+
+/* Options and stats for copy_tree() */
+struct copy_tree_struct {
+	int nthreads; /* 0 for the default of 8 */
+	void (*file_done)(const char *from, const char *to, long bytes, unsigned long usecs);
+	void (*progress)(struct copy_tree_struct *ct, unsigned long usecs);
+	/* stats */
+	unsigned long files, dirs, links, errors;
+	uint64_t bytes;
+	unsigned long hardlinks; /* files linked rather than copied */
+};
+
+/* Copy a directory tree like cp -a, copying the files on a pool of
+ * pthreads. Hard links within the tree are preserved. ct can be
+ * NULL. Reentrant, but must not be called from a samthread. This is
+ * in libsamthread.
+ */
+int copy_tree(const char *from, const char *to, struct copy_tree_struct *ct);
+
 /* Create a file of set length and mode. If mode is 0, a reasonable default is chosen. */
 int create_file(const char *fname, off_t length, mode_t mode);
 
@@ -111,6 +181,8 @@ char *tmpfilename(const char *fname);
 int mkdir_p(const char *dir, mode_t mode);
 
 int do_system(const char *fmt, ...);
+/* No shell version of do_system() */
+int do_system_argv(char *const argv[]);
 
 /* The traditional binary dump with hex on left and chars on right. */
 void binary_dump(const uint8_t *buf, int len);
@@ -172,6 +244,7 @@ struct walkfile_struct {
 	void *ignores;
 	void *filters;
 	int flags;
+	void *batch; /* private to walkfiles.c */
 };
 
 /* Main function. Path can be a directory or a file. The file_func()
@@ -188,6 +261,52 @@ int walkfiles(struct walkfile_struct *walk, const char *path,
 			  int (*file_func)(const char *path, struct stat *sbuf),
 			  int flags);
 
+/* Parallel walkfiles() with nthreads workers (0 for one per cpu). The
+ * file_func() is called concurrently from the workers, each with its
+ * own copy of walk. For network filesystems you probably want more
+ * threads than cpus. The workers are pthreads. This is in
+ * libsamthread.
+ */
+int walkfiles_mt(struct walkfile_struct *walk, const char *path,
+				 int (*file_func)(const char *path, struct stat *sbuf),
+				 int flags, int nthreads);
+
+/* Incremental walkfiles() that keeps an index of the files in a
+ * samdb and only calls change_func() for files that were added,
+ * changed, or deleted since the last walk. See walkindex.c.
+ */
+int walkindex(struct walkfile_struct *walk, const char *path, const char *dbname,
+			  int (*change_func)(const char *path, struct stat *sbuf,
+								 const uint8_t *digest, int what),
+			  int flags);
+
+/* The what in change_func() */
+#define WALKINDEX_ADDED   1
+#define WALKINDEX_CHANGED 2
+#define WALKINDEX_DELETED 3
+
+/* Store an md5 or sha256 of every file. A file is only reported as
+ * changed if the digest changed.
+ */
+#define WALKINDEX_MD5       0x100000
+#define WALKINDEX_SHA256    0x200000
+/* Trust the files in directories whose mtime and ctime did not
+ * change. Only safe if files are never modified in place, e.g. they
+ * are always replaced by a rename. Subdirectories are still checked.
+ */
+#define WALKINDEX_DIR_MTIME 0x400000
+
+/* Lower level functions used by walkfiles() and walkfiles_mt(). The
+ * dir_func() is called for every subdirectory to descend into.
+ */
+struct walkfile_struct *_walkfiles_init(struct walkfile_struct *walk, const char *path,
+										struct stat *sbuf,
+										int (*file_func)(const char *path, struct stat *sbuf),
+										int flags);
+int _walkdir(struct walkfile_struct *walk, const char *dname, struct stat *dbuf,
+			 int (*dir_func)(struct walkfile_struct *walk, const char *path, struct stat *sbuf));
+void _walkfiles_done(struct walkfile_struct *walk);
+
 /* For backwards compatibility */
 #define WALK_LINKS S_IFLNK
 
@@ -207,6 +326,21 @@ int walkfiles(struct walkfile_struct *walk, const char *path,
 
 #define WALK_INCLUDE_DIRS	0x20
 
+/* If the file_func() only needs the path, this skips the stat when
+ * the directory entry gives us the file type. Only st_mode is valid
+ * in the stat buffer passed to file_func(). Filesystems that do not
+ * support d_type still get a full stat.
+ */
+#define WALK_NO_STAT	0x40
+
+/* Submit the stats for a directory as a batch, and open the
+ * subdirectories as a batch before walking them. Uses one io_uring
+ * per walk; without io_uring statx and openat (Linux 5.6) the walk is
+ * the same as without the flag. Files are passed to file_func() in
+ * the order the stats complete. Linux only.
+ */
+#define WALK_BATCH_STAT	0x80
+
 /* Adds a regular expression of paths to ignore. */
 void add_ignore(struct walkfile_struct *walk, const char *str);
 
@@ -226,6 +360,12 @@ void add_filter_re(struct walkfile_struct *walk, const char *regex);
 /* Check if the file name matches a filter */
 int check_filters(struct walkfile_struct *walk, const char *fname);
 
+/* The ignores and filters are compiled on first use. Patterns that
+ * are literals, optionally anchored, such as "*.o", "lib*" or "\.o$",
+ * are matched in time proportional to the path length regardless of
+ * how many there are. Other patterns are checked one at a time.
+ */
+
 /* Example of ignores vs filtering. If you only want to process text
  * files, you might use a filter of "*.txt". If you want to ignore all
  * text files, you could use an ignore of "\.txt$".
@@ -334,6 +474,8 @@ int base64_decoded_len(int len);
 
 /* Mainly for IP header checksums */
 uint16_t chksum16(const void *buf, int count);
+/* CRC-32C, hardware assisted on x86_64 */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
 
 /* IP functions */
 
@@ -369,6 +511,53 @@ void free_interfaces(char **ifnames, int n);
 int db_open(const char *dbname, uint32_t flags, void **dbh);
 #define DB_CREATE (O_CREAT | O_RDWR)
 #define DB_LOCK 0x10000000
+/* Read only, the file is mmapped and searched in place. Use with
+ * O_RDONLY. The db must be in the host byte order. Any number of
+ * threads can db_get*() and db_peek() on the handle at once. db_walk()
+ * is still one thread at a time. The file must not be written while it
+ * is mapped, writers should build a new file and rename it over.
+ */
+#define DB_MMAP 0x20000000
+/* Write ahead log in dbname-wal. Every db_sync(), batch commit, and
+ * close appends the dirty pages to the log with one fdatasync() and
+ * that is the commit. The pages are written in place at a checkpoint,
+ * when the log passes 16M or at close. An open with DB_WAL replays the
+ * log, so a crash leaves the db as of the last commit. Needs O_RDWR.
+ * Dirty pages stay cached until the commit, so sync big loads now and
+ * then. Delete the -wal file with the db.
+ */
+#define DB_WAL 0x40000000
+/* Bloom filter of the keys in dbname-bloom, so most gets, peeks, and
+ * deletes of missing keys do not search the tree. Deletes leave their
+ * bits set. It is rebuilt on open if the db changed without it and as
+ * puts fill it. The false positive rate is set by bloombits in
+ * db_info: 8 bits per key is about 3%, 10 (the default) about 1%, 16
+ * about 0.1%. Works with DB_MMAP. Delete the -bloom file with the db.
+ */
+#define DB_BLOOM 0x08000000
+
+/* Tuning for db_open_info(). Zero gets the default. The psize,
+ * lorder, and version only apply when the db is created. The default
+ * cachesize is only 10 pages, set it to hold the working set of the
+ * tree.
+ *
+ * Version 4 stores the keys on each leaf page without the prefix they
+ * share, which packs keys like paths or URLs into far fewer pages, and
+ * keeps a CRC-32C of each page in its last 4 bytes. A page that fails
+ * the check is an EIO. DB_MMAP pages are not checked. The default is
+ * version 3, which older samlib can read.
+ */
+struct db_info {
+	unsigned cachesize; /* bytes */
+	unsigned psize;     /* page size, default st_blksize */
+	int minkeypage;     /* default 2 */
+	int lorder;         /* DB_BIG_ENDIAN or DB_LITTLE_ENDIAN */
+	unsigned bloombits; /* DB_BLOOM bits per key, default 10 */
+	unsigned version;   /* file format, 3 or 4 */
+};
+#define DB_LITTLE_ENDIAN 1234
+#define DB_BIG_ENDIAN    4321
+int db_open_info(const char *dbname, uint32_t flags, const struct db_info *info, void **dbh);
 int db_close(void *dbh);
 int db_put(void *dbh, const char *keystr, const void *val, int len);
 int db_put_str(void *dbh, const char *keystr, const char *valstr);
@@ -377,9 +566,67 @@ int db_put_raw(void *dbh, const void *key, int klen, const void *val, int len, u
 int db_get(void *dbh, const char *keystr, void *val, int len);
 int db_get_str(void *dbh, const char *keystr, char *valstr, int len);
 int db_get_raw(void *dbh, const void *key, int klen, void *val, int len);
+/* Zero copy get. With DB_MMAP the value is valid until db_close(),
+ * otherwise until the next call with this dbh. Do not write to it.
+ * With DB_MMAP, values too big for a page are copied out once and the
+ * copies kept until db_close(). The copies are limited to the
+ * cachesize or 16M, whichever is larger. After that a big value that
+ * was not copied yet returns -1 with errno ENOBUFS. db_get_raw()
+ * copies big values straight into val and keeps nothing.
+ */
+int db_get_ptr(void *dbh, const void *key, int klen, const void **val);
 int db_peek(void *dbh, const char *keystr);
 int db_del(void *dbh, const char *keystr);
 int db_walk(void *dbh, int (*walk_func)(const char *key, void *data, int len));
+/* Range and prefix cursors, see db_cursor_open() */
+#define DB_CURSOR_PREV   1
+#define DB_CURSOR_PREFIX 2
+int db_cursor_open(void *dbh, const void *start, int slen, const void *end, int elen,
+				   unsigned flags, void **cursor);
+int db_cursor_next(void *cursor, const void **key, int *klen, const void **val, int *len);
+void db_cursor_close(void *cursor);
+int db_count_range(void *dbh, const void *start, int slen, const void *end, int elen,
+				   unsigned flags, unsigned long *count);
+/* Write the dirty pages and fsync. Returns 0 or an errno. */
+int db_sync(void *dbh);
+
+/* Write batches. The puts and dels are saved until db_batch_commit(),
+ * which applies them in key order, then writes all the dirty pages and
+ * syncs once. The last op on a key wins. A batch is not a transaction,
+ * if an op fails the ones before it stay applied. Commit and abort
+ * free the batch. All return 0 or an errno.
+ */
+int db_batch_begin(void *dbh, void **batch);
+int db_batch_put(void *batch, const void *key, int klen, const void *val, int len);
+int db_batch_del(void *batch, const void *key, int klen);
+int db_batch_commit(void *batch);
+void db_batch_abort(void *batch);
+
+/* Build a new db from keys in sorted order, writing the pages bottom
+ * up. The fill is the percent of each page to use, 0 for all of it.
+ * Full pages are best for a db that is mostly read, leave room if
+ * there will be a lot of puts. Keys must be strictly increasing in
+ * memcmp() order, a key out of order gets EINVAL and is skipped. Any
+ * existing dbname is replaced. All return 0 or an errno.
+ */
+int db_bulk_open(const char *dbname, const struct db_info *info, int fill, void **bh);
+int db_bulk_put(void *bh, const void *key, int klen, const void *val, int len);
+int db_bulk_close(void *bh);
+
+/* Buffer pool stats. The counters start at open. */
+struct db_stats {
+	unsigned long psize;     /* page size */
+	unsigned long npages;    /* pages in the file */
+	unsigned long curcache;  /* pages in the cache */
+	unsigned long maxcache;  /* max pages in the cache */
+	unsigned long cachehit;
+	unsigned long cachemiss;
+	unsigned long pageread;  /* pages read from disk */
+	unsigned long pagewrite; /* pages written to disk */
+	unsigned long pageflush; /* pages evicted */
+};
+/* Returns 0 or an errno */
+int db_stats(void *dbh, struct db_stats *stats);
 
 /* Advantages of xorshift128plus() over random().
  *     1. It is faster. (~7x)
@@ -432,9 +679,52 @@ char *hex2str(unsigned long val, char *out);
 char *_int2str(long val, char *out);
 char *_uint2str(unsigned long val, char *out);
 char *_hex2str(unsigned long val, char *out);
+/* Shortest string that reads back as the same double. out must be at
+ * least 32 bytes. Needs WANT_FLOATS.
+ */
+char *double2str(double val, char *out);
+char *_double2str(double val, char *out);
 int strfmt(char *str, int len, const char *fmt, ...);
 int strfmt_ap(char *str, int len, const char *fmt, va_list ap);
 
+/* Output sink for strbuf_fmt(). With fd < 0, str grows as needed and
+ * len is the string length. Set len = 0 and *str = 0 to reuse it.
+ * With an fd, str buffers the pending output.
+ */
+struct strbuf {
+	char *str;
+	int len;
+	int size;
+	int fd;
+	int error;
+};
+
+void strbuf_init(struct strbuf *sb, int fd);
+int strbuf_fmt(struct strbuf *sb, const char *fmt, ...);
+int strbuf_fmt_ap(struct strbuf *sb, const char *fmt, va_list ap);
+int strbuf_flush(struct strbuf *sb);
+void strbuf_free(struct strbuf *sb);
+char *strfmt_alloc(const char *fmt, ...);
+
+/* Compiled formats. Free with free(). */
+struct strfmt_compiled;
+
+/* One argument for strbuf_exec_v() */
+union strfmt_arg {
+	long l;
+	unsigned long u;
+	double d;
+	const char *s;
+	int c;
+};
+
+struct strfmt_compiled *strfmt_compile(const char *fmt);
+int strfmt_exec(char *str, int len, const struct strfmt_compiled *cf, ...);
+int strfmt_exec_ap(char *str, int len, const struct strfmt_compiled *cf, va_list ap);
+int strbuf_exec(struct strbuf *sb, const struct strfmt_compiled *cf, ...);
+int strbuf_exec_v(struct strbuf *sb, const struct strfmt_compiled *cf,
+				  const union strfmt_arg *args, int count);
+
 int init_seed(void);
 void finish_seed(void);
 uint64_t rand128(void);
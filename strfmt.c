@@ -1,5 +1,8 @@
 #include <stdarg.h>
 #include <ctype.h>
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
 #ifndef BUFFERED
 #include "samlib.h"
 #endif
@@ -16,7 +19,19 @@ struct outbuff {
 	char *str;
 	int len;
 	int n;
+	struct strbuf *sb; /* NULL for a fixed string */
+};
+
+#ifdef BUFFERED
+/* From samlib.h, which the embedded build does not include */
+union strfmt_arg {
+	long l;
+	unsigned long u;
+	double d;
+	const char *s;
+	int c;
 };
+#endif
 
 const char tohex[] = {
 	'0', '1', '2', '3', '4', '5', '6', '7',
@@ -73,35 +88,86 @@ char *octal2str(long val, char *out)
 	return out;
 }
 
-/** Integer to ascii.
+/* \cond skip */
+/* Two digits at a time */
+static const char digits2[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+static inline int count_digits(unsigned long val)
+{
+	int n = 1;
+
+	while (1) {
+		if (val < 10) return n;
+		if (val < 100) return n + 1;
+		if (val < 1000) return n + 2;
+		if (val < 10000) return n + 3;
+		val /= 10000;
+		n += 4;
+	}
+}
+/* \endcond */
+
+/** Unsigned integer to ascii.
  * @param val The integer to convert.
  * @param out The output string.
  * @return A pointer to the end of the string.
  */
-char *_int2str(long val, char *out)
+char *_uint2str(unsigned long val, char *out)
 {
-	char *p = out;
+	char *end = out + count_digits(val);
+	char *p = end;
 
-	if (val == 0) {
-		*p++ = '0';
-		*p = 0;
-	} else {
-		int neg = val < 0;
+	*p = 0;
+	/* Work backwards so we do not need to reverse */
+	while (val >= 100) {
+		unsigned i = (val % 100) * 2;
+		val /= 100;
+		*--p = digits2[i + 1];
+		*--p = digits2[i];
+	}
+	if (val >= 10) {
+		*--p = digits2[val * 2 + 1];
+		*--p = digits2[val * 2];
+	} else
+		*--p = val + '0';
 
-		if (neg)
-			val = -val;
+	return end;
+}
 
-		while (val > 0) {
-			*p++ = (val % 10) + '0';
-			val /= 10;
-		}
-		if (neg) *p++ = '-';
-		*p = 0;
+/** Unsigned integer to ascii.
+ * @param val The integer to convert.
+ * @param out The output string.
+ * @return A pointer to out.
+ */
+char *uint2str(unsigned long val, char *out)
+{
+	_uint2str(val, out);
+	return out;
+}
 
-		reverse_string(out, p);
+/** Integer to ascii.
+ * @param val The integer to convert.
+ * @param out The output string.
+ * @return A pointer to the end of the string.
+ */
+char *_int2str(long val, char *out)
+{
+	if (val < 0) {
+		*out++ = '-';
+		/* works for LONG_MIN */
+		return _uint2str(0UL - (unsigned long)val, out);
 	}
-
-	return p;
+	return _uint2str(val, out);
 }
 
 /** Integer to ascii.
@@ -115,89 +181,674 @@ char *int2str(long val, char *out)
 	return out;
 }
 
-/** Unsigned integer to ascii.
+/** Hex to ascii.
  * @param val The integer to convert.
  * @param out The output string.
  * @return A pointer to the end of the string.
  */
-char *_uint2str(unsigned long val, char *out)
+char *_hex2str(unsigned long val, char *out)
 {
-	char *p = out;
+#ifdef __GNUC__
+	/* val | 1 so 0 is one digit */
+	int len = (sizeof(long) * 8 - __builtin_clzl(val | 1) + 3) / 4;
+#else
+	unsigned long tmp = val >> 4;
+	int len = 1;
 
-	if (val == 0) {
-		*p++ = '0';
-		*p = 0;
-	} else {
-		while (val > 0) {
-			*p++ = (val % 10) + '0';
-			val /= 10;
-		}
-		*p = 0;
+	for (; tmp; tmp >>= 4)
+		++len;
+#endif
+	char *end = out + len;
+	char *p = end;
 
-		reverse_string(out, p);
+	*p = 0;
+	while (p > out) {
+		*--p = tohex[val & 0xf];
+		val >>= 4;
 	}
-	return p;
+
+	return end;
 }
 
-/** Unsigned integer to ascii.
+/** Hex to ascii.
  * @param val The integer to convert.
  * @param out The output string.
  * @return A pointer to out.
  */
-char *uint2str(unsigned long val, char *out)
+char *hex2str(unsigned long val, char *out)
 {
-	_uint2str(val, out);
+	_hex2str(val, out);
 	return out;
 }
 
-/** Hex to ascii.
- * @param val The integer to convert.
- * @param out The output string.
- * @return A pointer to the end of the string.
+#ifdef WANT_FLOATS
+/* Floats are converted exactly using bignums (Steele & White, Burger
+ * & Dybvig). Shortest mode generates the fewest digits that read
+ * back as the same double. The fixed modes generate a set number of
+ * digits and round half to even like glibc. There is a faster path
+ * for %f of ordinary sized numbers using 128 bit math.
  */
-char *_hex2str(unsigned long val, char *out)
+
+/* The largest scaled value is about 2^1140 */
+#define BIG_WORDS 40
+
+/* 309 integer digits + '.' + precision + round up + null */
+#define FLOAT_MAX_PREC 400
+#define FLOAT_BUFSIZE (309 + FLOAT_MAX_PREC + 4)
+
+#define FLOAT_SHORTEST	0
+#define FLOAT_FIXED		1 /* precision digits after the decimal point */
+#define FLOAT_EXP		2 /* precision + 1 significant digits */
+
+struct bignum {
+	int n;
+	uint32_t w[BIG_WORDS];
+};
+
+static const uint32_t pow10_32[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static void big_set(struct bignum *b, uint64_t val)
 {
-	char *p = out;
+	b->w[0] = (uint32_t)val;
+	b->w[1] = val >> 32;
+	b->n = b->w[1] ? 2 : (b->w[0] ? 1 : 0);
+}
 
-	if (val == 0) {
-		*p++ = '0';
-		*p = 0;
+static void big_mul(struct bignum *b, uint32_t m)
+{
+	uint64_t carry = 0;
+
+	for (int i = 0; i < b->n; ++i) {
+		carry += (uint64_t)b->w[i] * m;
+		b->w[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	if (carry)
+		b->w[b->n++] = (uint32_t)carry;
+}
+
+static void big_pow10(struct bignum *b, int k)
+{
+	for (; k >= 9; k -= 9)
+		big_mul(b, 1000000000);
+	if (k > 0)
+		big_mul(b, pow10_32[k]);
+}
+
+static void big_shl(struct bignum *b, int shift)
+{
+	int words = shift / 32, bits = shift % 32;
+
+	if (b->n == 0)
+		return;
+
+	if (bits) {
+		uint32_t carry = 0;
+
+		for (int i = 0; i < b->n; ++i) {
+			uint32_t w = b->w[i];
+			b->w[i] = (w << bits) | carry;
+			carry = w >> (32 - bits);
+		}
+		if (carry)
+			b->w[b->n++] = carry;
+	}
+
+	if (words) {
+		memmove(b->w + words, b->w, b->n * sizeof(uint32_t));
+		memset(b->w, 0, words * sizeof(uint32_t));
+		b->n += words;
+	}
+}
+
+static int big_cmp(const struct bignum *a, const struct bignum *b)
+{
+	if (a->n != b->n)
+		return a->n < b->n ? -1 : 1;
+	for (int i = a->n - 1; i >= 0; --i)
+		if (a->w[i] != b->w[i])
+			return a->w[i] < b->w[i] ? -1 : 1;
+	return 0;
+}
+
+/* Compare a + b to c */
+static int big_cmp_sum(const struct bignum *a, const struct bignum *b, const struct bignum *c)
+{
+	struct bignum sum;
+	uint64_t carry = 0;
+	int i, n = a->n > b->n ? a->n : b->n;
+
+	for (i = 0; i < n; ++i) {
+		carry += (uint64_t)(i < a->n ? a->w[i] : 0) + (i < b->n ? b->w[i] : 0);
+		sum.w[i] = (uint32_t)carry;
+		carry >>= 32;
+	}
+	sum.n = n;
+	if (carry)
+		sum.w[sum.n++] = (uint32_t)carry;
+
+	return big_cmp(&sum, c);
+}
+
+/* a -= b where a >= b */
+static void big_sub(struct bignum *a, const struct bignum *b)
+{
+	int64_t borrow = 0;
+
+	for (int i = 0; i < a->n; ++i) {
+		borrow += (int64_t)a->w[i] - (i < b->n ? b->w[i] : 0);
+		a->w[i] = (uint32_t)borrow;
+		borrow >>= 32;
+	}
+	while (a->n > 0 && a->w[a->n - 1] == 0)
+		--a->n;
+}
+
+/* r < 10 * s. Returns r / s and leaves r % s in r. */
+static int big_digit(struct bignum *r, const struct bignum *s)
+{
+	int d = 0;
+
+	while (big_cmp(r, s) >= 0) {
+		big_sub(r, s);
+		++d;
+	}
+	return d;
+}
+
+/* Round the digits up. Returns the new length if it carried out. */
+static int round_digits(char *digits, int n)
+{
+	int i;
+
+	for (i = n - 1; i >= 0; --i)
+		if (digits[i] == '9')
+			digits[i] = '0';
+		else {
+			++digits[i];
+			return n;
+		}
+
+	digits[0] = '1';
+	digits[n] = '0';
+	return n + 1;
+}
+
+/* val must be positive and finite. Returns the number of digits and
+ * the value is 0.digits * 10^exp10.
+ */
+static int float_digits(double val, int mode, int prec, char *digits, int *exp10)
+{
+	union { double d; uint64_t u; } bits = { .d = val };
+	uint64_t f = bits.u & ((1ULL << 52) - 1);
+	int be = (bits.u >> 52) & 0x7ff;
+	struct bignum r, s, mp, mm;
+	int e, k, n, d, c, lg, even, unequal, low, high;
+
+	if (be) {
+		f |= 1ULL << 52;
+		e = be - 1075;
+	} else
+		e = -1074;
+	even = (f & 1) == 0;
+	unequal = f == (1ULL << 52) && be > 1;
+
+	/* val = r / s and the gaps to the next doubles are mp / s and mm / s */
+	big_set(&r, f);
+	if (e >= 0) {
+		big_shl(&r, e + 1 + unequal);
+		big_set(&s, 2 << unequal);
+		big_set(&mp, 1);
+		big_shl(&mp, e + unequal);
+		big_set(&mm, 1);
+		big_shl(&mm, e);
 	} else {
-		while (val > 0) {
-			*p++ = tohex[val & 0xf];
-			val >>= 4;
+		big_shl(&r, 1 + unequal);
+		big_set(&s, 1);
+		big_shl(&s, 1 + unequal - e);
+		big_set(&mp, 1 << unequal);
+		big_set(&mm, 1);
+	}
+
+	/* Estimate k, it may be one low */
+	for (lg = e, n = 63; !(f & (1ULL << n)); --n) ;
+	lg += n;
+	k = ((lg * 78913) >> 18) + 1; /* floor(lg * log10(2)) + 1 */
+
+	if (k >= 0)
+		big_pow10(&s, k);
+	else {
+		big_pow10(&r, -k);
+		big_pow10(&mp, -k);
+		big_pow10(&mm, -k);
+	}
+
+	if (mode == FLOAT_SHORTEST)
+		c = big_cmp_sum(&r, &mp, &s) >= (even ? 0 : 1);
+	else
+		c = big_cmp(&r, &s) >= 0;
+	if (c) {
+		big_mul(&s, 10);
+		++k;
+	}
+	*exp10 = k;
+
+	if (mode == FLOAT_SHORTEST) {
+		for (n = 0; ; ++n) {
+			big_mul(&r, 10);
+			big_mul(&mp, 10);
+			big_mul(&mm, 10);
+			d = big_digit(&r, &s);
+
+			c = big_cmp(&r, &mm);
+			low = even ? c <= 0 : c < 0;
+			c = big_cmp_sum(&r, &mp, &s);
+			high = even ? c >= 0 : c > 0;
+			if (low || high)
+				break;
+			digits[n] = d + '0';
 		}
+
+		if (high && low) {
+			/* Closest, ties to even */
+			big_mul(&r, 2);
+			c = big_cmp(&r, &s);
+			if (c > 0 || (c == 0 && (d & 1)))
+				++d;
+		} else if (high)
+			++d;
+		digits[n++] = d + '0';
+		return n;
+	}
+
+	n = mode == FLOAT_FIXED ? k + prec : prec + 1;
+	if (n < 0)
+		return 0;
+
+	for (int i = 0; i < n; ++i) {
+		big_mul(&r, 10);
+		digits[i] = big_digit(&r, &s) + '0';
+	}
+
+	/* Round half to even */
+	big_mul(&r, 2);
+	c = big_cmp(&r, &s);
+	if (c > 0 || (c == 0 && n > 0 && (digits[n - 1] & 1))) {
+		if (n == 0) {
+			digits[0] = '1';
+			*exp10 = k + 1;
+			return 1;
+		}
+		if (round_digits(digits, n) > n) {
+			*exp10 = k + 1;
+			if (mode == FLOAT_FIXED)
+				++n;
+		}
+	}
+
+	return n;
+}
+
+static char *emit_fixed(const char *digits, int n, int k, int prec, char *p)
+{
+	int i;
+
+	if (k <= 0)
+		*p++ = '0';
+	else
+		for (i = 0; i < k; ++i)
+			*p++ = i < n ? digits[i] : '0';
+
+	if (prec > 0) {
+		*p++ = '.';
+		for (i = k; i < k + prec; ++i)
+			*p++ = i >= 0 && i < n ? digits[i] : '0';
+	}
+
+	return p;
+}
+
+static char *emit_exp(const char *digits, int n, int exp10, char *p)
+{
+	*p++ = digits[0];
+	if (n > 1) {
+		*p++ = '.';
+		memcpy(p, digits + 1, n - 1);
+		p += n - 1;
+	}
+
+	*p++ = 'e';
+	if (exp10 < 0) {
+		*p++ = '-';
+		exp10 = -exp10;
+	} else
+		*p++ = '+';
+	if (exp10 < 10)
+		*p++ = '0';
+
+	return _uint2str(exp10, p);
+}
+
+#ifdef __SIZEOF_INT128__
+/* %f when val < 2^64 and the fraction fits in 64 bits */
+static char *fixed_fast(uint64_t f, int e, int prec, char *out)
+{
+	unsigned __int128 frac = 0, one;
+	uint64_t integer;
+	char *p, *start = out;
+	int q = 0;
+
+	if (e >= 0)
+		integer = f << e;
+	else {
+		q = -e;
+		integer = q < 64 ? f >> q : 0;
+		frac = f & (((unsigned __int128)1 << q) - 1);
+	}
+	one = (unsigned __int128)1 << q;
+
+	p = _uint2str(integer, out);
+	if (prec > 0) {
+		*p++ = '.';
+		for (int i = 0; i < prec; ++i) {
+			frac *= 10;
+			*p++ = (int)(frac >> q) + '0';
+			frac &= one - 1;
+		}
+	}
+
+	/* Round half to even, '0' is even */
+	frac *= 2;
+	if (frac > one || (frac == one && (p[-1] & 1))) {
+		char *d = p;
+
+		while (--d >= start)
+			if (*d == '9')
+				*d = '0';
+			else if (*d != '.') {
+				++*d;
+				break;
+			}
+		if (d < start) {
+			memmove(start + 1, start, p - start);
+			*start = '1';
+			++p;
+		}
+	}
+
+	*p = 0;
+	return p;
+}
+
+/* The %e digits for the same values as fixed_fast(). Returns the same
+ * as float_digits().
+ */
+static int exp_fast(uint64_t f, int e, int prec, char *digits, int *exp10)
+{
+	unsigned __int128 frac = 0, one;
+	uint64_t integer;
+	char tmp[24], *t;
+	int q = 0, n = prec + 1, i = 0, k, up;
+
+	if (e >= 0)
+		integer = f << e;
+	else {
+		q = -e;
+		integer = q < 64 ? f >> q : 0;
+		frac = f & (((unsigned __int128)1 << q) - 1);
+	}
+	one = (unsigned __int128)1 << q;
+
+	if (integer) {
+		k = _uint2str(integer, tmp) - tmp;
+		for (; i < n && i < k; ++i)
+			digits[i] = tmp[i];
+		if (k > n) {
+			/* Round on the integer digits left over */
+			for (t = tmp + n + 1; t < tmp + k && *t == '0'; ++t) ;
+			up = tmp[n] > '5' || (tmp[n] == '5' &&
+				(t < tmp + k || frac || (digits[n - 1] & 1)));
+			goto round;
+		}
+	} else
+		/* Skip the leading zeros */
+		for (k = 0; frac * 10 < one; --k)
+			frac *= 10;
+
+	for (; i < n; ++i) {
+		frac *= 10;
+		digits[i] = (int)(frac >> q) + '0';
+		frac &= one - 1;
+	}
+
+	/* Round half to even */
+	frac *= 2;
+	up = frac > one || (frac == one && (digits[n - 1] & 1));
+
+round:
+	*exp10 = k;
+	if (up && round_digits(digits, n) > n)
+		*exp10 = k + 1;
+	return n;
+}
+#endif
+
+/* out must be FLOAT_BUFSIZE except for FLOAT_SHORTEST */
+static char *_float2str(double val, int mode, int prec, char *out)
+{
+	union { double d; uint64_t u; } bits = { .d = val };
+	char digits[FLOAT_BUFSIZE];
+	char *p = out;
+	int n, k;
+
+	if (bits.u >> 63) {
+		*p++ = '-';
+		val = -val;
+		bits.u &= ~(1ULL << 63);
+	}
+
+	if ((bits.u >> 52) == 0x7ff) {
+		strcpy(p, (bits.u << 12) ? "nan" : "inf");
+		return p + 3;
+	}
+
+	if (prec > FLOAT_MAX_PREC)
+		prec = FLOAT_MAX_PREC;
+
+	if (val == 0) {
+		digits[0] = '0';
+		if (mode == FLOAT_EXP) {
+			memset(digits + 1, '0', prec);
+			p = emit_exp(digits, prec + 1, 0, p);
+		} else if (mode == FLOAT_FIXED)
+			p = emit_fixed(digits, 1, 1, prec, p);
+		else
+			*p++ = '0';
 		*p = 0;
+		return p;
+	}
 
-		reverse_string(out, p);
+#ifdef __SIZEOF_INT128__
+	if (mode != FLOAT_SHORTEST) {
+		uint64_t f = (bits.u & ((1ULL << 52) - 1)) | (1ULL << 52);
+		int e = (int)(bits.u >> 52) - 1075;
+
+		if (e >= -64 && e <= 11 && (bits.u >> 52)) {
+			if (mode == FLOAT_FIXED)
+				return fixed_fast(f, e, prec, p);
+			n = exp_fast(f, e, prec, digits, &k);
+			p = emit_exp(digits, n, k - 1, p);
+			*p = 0;
+			return p;
+		}
 	}
+#endif
+
+	n = float_digits(val, mode, prec, digits, &k);
+	if (mode == FLOAT_FIXED)
+		p = emit_fixed(digits, n, k, prec, p);
+	else if (mode == FLOAT_EXP)
+		p = emit_exp(digits, n, k - 1, p);
+	else if (k > -5 && k <= 17)
+		p = emit_fixed(digits, n, k, n > k ? n - k : 0, p);
+	else
+		p = emit_exp(digits, n, k - 1, p);
+
+	*p = 0;
 	return p;
 }
+/* \endcond */
 
-/** Hex to ascii.
- * @param val The integer to convert.
- * @param out The output string.
+/** Double to ascii using the fewest digits that read back as the
+ * same double.
+ * @param val The double to convert.
+ * @param out The output string, at least 32 bytes.
+ * @return A pointer to the end of the string.
+ */
+char *_double2str(double val, char *out)
+{
+	/* Never more than 25 bytes in shortest mode */
+	return _float2str(val, FLOAT_SHORTEST, 0, out);
+}
+
+/** Double to ascii using the fewest digits that read back as the
+ * same double.
+ * @param val The double to convert.
+ * @param out The output string, at least 32 bytes.
  * @return A pointer to out.
  */
-char *hex2str(unsigned long val, char *out)
+char *double2str(double val, char *out)
 {
-	_hex2str(val, out);
+	_double2str(val, out);
 	return out;
 }
+#endif
 
 /* \cond skip */
 
+#ifndef BUFFERED
+#define STRBUF_MEMSIZE	256
+#define STRBUF_FDSIZE	(64 * 1024)
+
+/* Write all of iov, two entries at most */
+static int write_iov(int fd, struct iovec *iov, int cnt)
+{
+	while (cnt > 0) {
+#ifdef WIN32
+		int n = write(fd, iov->iov_base, iov->iov_len);
+#else
+		int n = writev(fd, iov, cnt);
+#endif
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt > 0 && n >= iov->iov_len) {
+			n -= iov->iov_len;
+			++iov;
+			--cnt;
+		}
+		if (cnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* Write the pending fd output plus str, if any, and empty the buffer.
+ * After an error the output is dropped.
+ */
+static void outflush(struct outbuff *out, const char *str, int size)
+{
+	struct strbuf *sb = out->sb;
+	struct iovec iov[2];
+	int cnt = 0;
+
+	if (out->str > sb->str) {
+		iov[cnt].iov_base = sb->str;
+		iov[cnt++].iov_len = out->str - sb->str;
+	}
+	if (size > 0) {
+		iov[cnt].iov_base = (char *)str;
+		iov[cnt++].iov_len = size;
+	}
+	if (sb->error == 0 && write_iov(sb->fd, iov, cnt))
+		sb->error = errno;
+
+	out->str = sb->str;
+	out->len = sb->size - 1;
+}
+
+/* Out of room in a sink. Grow the buffer or flush to the fd. Returns
+ * the room available, which for an fd may be less than size.
+ */
+static int outroom(struct outbuff *out, int size)
+{
+	struct strbuf *sb = out->sb;
+	int used = out->str - sb->str;
+
+	if (sb->fd >= 0) {
+		outflush(out, NULL, 0);
+		return out->len;
+	}
+
+	sb->size = sb->size * 2 > used + size + 1 ? sb->size * 2 : used + size + 1;
+	sb->str = must_realloc(sb->str, sb->size);
+	out->str = sb->str + used;
+	out->len = sb->size - used - 1;
+	return out->len;
+}
+
+/* For an fd sink, write the pending output and str without a copy. */
+static int outdirect(struct outbuff *out, const char *str, int size)
+{
+	if (out->sb->fd < 0)
+		return 0;
+	outflush(out, str, size);
+	return 1;
+}
+#else
+/* No strbuf sinks in the embedded build, out->sb is always NULL */
+static inline int outroom(struct outbuff *out, int size)
+{
+	return out->len;
+}
+
+static inline int outdirect(struct outbuff *out, const char *str, int size)
+{
+	return 0;
+}
+
+static void outbuffered(struct outbuff *out, const char *str, char c, int size)
+{
+	for (int i = 0; i < size; ++i)
+		binsert(out->buff, str ? str[i] : c);
+}
+#endif
+
 static void outmemset(struct outbuff *out, char c, int size)
 {
 	if (size > 0) {
 		out->n += size;
 #ifdef BUFFERED
 		if (out->buff) {
-			for (int i = 0; i < size; ++i)
-				binsert(out->buff, c);
+			outbuffered(out, NULL, c, size);
 			return;
 		}
 #endif
+		while (size > out->len && out->sb) {
+			int n = out->len;
+
+			memset(out->str, c, n);
+			out->str += n;
+			out->len = 0;
+			size -= n;
+			outroom(out, size);
+		}
 		if (size > out->len)
 			size = out->len;
 		if (size > 0) {
@@ -214,11 +865,15 @@ static void outmemcpy(struct outbuff *out, const char *str, int size)
 		out->n += size;
 #ifdef BUFFERED
 		if (out->buff) {
-			for (int i = 0; i < size; ++i)
-				binsert(out->buff, str[i]);
+			outbuffered(out, str, 0, size);
 			return;
 		}
 #endif
+		if (size > out->len && out->sb) {
+			if (outdirect(out, str, size))
+				return;
+			outroom(out, size);
+		}
 		if (size > out->len)
 			size = out->len;
 		if (size > 0) {
@@ -238,15 +893,17 @@ static void outchar(struct outbuff *out, char ch)
 		return;
 	}
 #endif
+	if (out->len == 0 && out->sb)
+		outroom(out, 1);
 	if (out->len > 0) {
 		*out->str++ = ch;
 		--out->len;
 	}
 }
 
-static void outstr(struct outbuff *out, const char *s, unsigned flags)
+static void outstr(struct outbuff *out, const char *s, unsigned flags, int prec)
 {
-	int slen = strlen(s);
+	int slen = prec < 0 ? strlen(s) : strnlen(s, prec);
 	int len = flags & WIDTH_MASK;
 	int pad = len - slen;
 
@@ -261,117 +918,170 @@ static void outstr(struct outbuff *out, const char *s, unsigned flags)
 static void outnum(struct outbuff *out, const char *s, unsigned flags)
 {
 	int slen = strlen(s);
-	int len = flags & WIDTH_MASK;
-
-	if (len)
-		outmemset(out, (flags & SAW_ZERO) ? '0' : ' ', len - slen);
+	int pad = (flags & WIDTH_MASK) - slen;
 
-	outmemcpy(out, s, slen);
+	if (flags & SAW_NEG) {
+		outmemcpy(out, s, slen);
+		outmemset(out, ' ', pad);
+	} else if (flags & SAW_ZERO) {
+		/* The zeros go after the sign */
+		if (*s == '-') {
+			outchar(out, '-');
+			++s;
+			--slen;
+		}
+		outmemset(out, '0', pad);
+		outmemcpy(out, s, slen);
+	} else {
+		outmemset(out, ' ', pad);
+		outmemcpy(out, s, slen);
+	}
 }
 
 #ifdef WANT_FLOATS
-#define FIXED_SIZE 20
-#define FIXED_MASK ((1 << FIXED_SIZE) - 1)
+static void outfloat(struct outbuff *out, double val, int mode, int prec, unsigned flags)
+{
+	char tmp[FLOAT_BUFSIZE];
 
-static int double2fixed(double val, int *f)
+	_float2str(val, mode, prec < 0 ? 6 : prec, tmp);
+	if (!isdigit(tmp[*tmp == '-']))
+		flags &= ~SAW_ZERO; /* inf and nan */
+	outnum(out, tmp, flags);
+}
+#endif
+
+/* Parse the flags, width, precision, and conversion after a %. Returns
+ * the conversion with *fmtp pointing at it, or 0 if not valid.
+ */
+static int parse_spec(const char **fmtp, unsigned *flagsp, int *precp)
 {
-	unsigned long result = 0;
-	unsigned long bit_val = 5000000ul;
-	int neg = 0;
+	const char *fmt = *fmtp;
+	unsigned flags = 0, width = 0;
+	int prec = -1;
 
-	if (val < 0) {
-		neg = 1;
-		val = -val;
+	if (*fmt == '-') {
+		++fmt;
+		flags |= SAW_NEG;
+	}
+	if (*fmt == '0')
+		flags |= SAW_ZERO;
+	while (isdigit(*fmt)) {
+		width = width * 10 + *fmt - '0';
+		++fmt;
+	}
+	flags |= width & WIDTH_MASK;
+	if (*fmt == '.') {
+		++fmt;
+		for (prec = 0; isdigit(*fmt); ++fmt)
+			prec = prec * 10 + *fmt - '0';
+	}
+	if (*fmt == 'l') {
+		++fmt;
+		flags |= SAW_LONG;
 	}
 
-	long l = (long)((val * (1 << FIXED_SIZE)) + 0.5);
-	int frac = l & FIXED_MASK;
+	switch (*fmt) {
+	case 's': case 'c': case 'd': case 'o': case 'u': case 'x':
+#ifdef WANT_FLOATS
+	case 'f': case 'e':
+#endif
+		*fmtp = fmt;
+		*flagsp = flags;
+		*precp = prec;
+		return *fmt;
+	default:
+		return 0;
+	}
+}
 
-	for (int i = FIXED_SIZE - 1; i >= 0; --i) {
-		if (frac & (1 << i))
-			result += bit_val;
-		bit_val >>= 1;
+/* va_list is passed by pointer so the caller sees the va_arg()s */
+static void fetch_arg(int conv, unsigned flags, va_list *ap, union strfmt_arg *arg)
+{
+	switch (conv) {
+	case 's':
+		arg->s = va_arg(*ap, char *);
+		break;
+	case 'c': /* char is promoted to int in ... */
+		arg->c = va_arg(*ap, int);
+		break;
+	case 'd':
+	case 'o':
+		arg->l = flags & SAW_LONG ? va_arg(*ap, long) : va_arg(*ap, int);
+		break;
+	case 'u':
+	case 'x':
+		arg->u = flags & SAW_LONG ? va_arg(*ap, unsigned long) : va_arg(*ap, unsigned);
+		break;
+#ifdef WANT_FLOATS
+	case 'f':
+	case 'e':
+		arg->d = va_arg(*ap, double);
+		break;
+#endif
 	}
+}
 
-	*f = (result + 5) / 10;
-	l >>= FIXED_SIZE;
+static void outarg(struct outbuff *out, int conv, unsigned flags, int prec,
+				   const union strfmt_arg *arg)
+{
+	char tmp[22];
 
-	return neg ? -l : l;
-}
+	switch (conv) {
+	case 's':
+		outstr(out, arg->s, flags, prec);
+		break;
+	case 'c':
+		outchar(out, arg->c);
+		break;
+	case 'd':
+		outnum(out, int2str(arg->l, tmp), flags);
+		break;
+	case 'o':
+		outnum(out, octal2str(arg->l, tmp), flags);
+		break;
+	case 'u':
+		outnum(out, uint2str(arg->u, tmp), flags);
+		break;
+	case 'x':
+		outnum(out, hex2str(arg->u, tmp), flags);
+		break;
+#ifdef WANT_FLOATS
+	case 'f':
+		outfloat(out, arg->d, FLOAT_FIXED, prec, flags);
+		break;
+	case 'e':
+		outfloat(out, arg->d, FLOAT_EXP, prec, flags);
+		break;
 #endif
+	}
+}
+
+static int outend(struct outbuff *out)
+{
+	/* We leave room for the NULL */
+	if (out->str)
+		*out->str = 0;
+
+	return out->n;
+}
 
 static int __strfmt(struct outbuff *out, const char *fmt, va_list ap)
 {
-	char tmp[22];
+	union strfmt_arg arg;
+	unsigned flags;
+	int conv, prec;
+	va_list aq;
 
+	va_copy(aq, ap);
 	while (*fmt) {
 		if (*fmt == '%') {
 			const char *save = fmt++;
-			unsigned flags = 0, width = 0;
 
-			if (*fmt == '-') {
-				++fmt;
-				flags |= SAW_NEG;
-			}
-			if (*fmt == '0')
-				flags |= SAW_ZERO;
-			while (isdigit(*fmt)) {
-				width = width * 10 + *fmt - '0';
-				++fmt;
-			}
-			flags |= width & WIDTH_MASK;
-			if (*fmt == 'l') {
-				++fmt;
-				flags |= SAW_LONG;
-			}
-			switch (*fmt) {
-			case 's':
-				outstr(out, va_arg(ap, char *), flags);
-				break;
-			case 'c':
-				// char is promoted to int in ...
-				outchar(out, va_arg(ap, int));
-				break;
-			case 'd':
-				if (flags & SAW_LONG)
-					int2str(va_arg(ap, long), tmp);
-				else
-					int2str(va_arg(ap, int), tmp);
-				outnum(out, tmp, flags);
-				break;
-			case 'o':
-				if (flags & SAW_LONG)
-					octal2str(va_arg(ap, long), tmp);
-				else
-					octal2str(va_arg(ap, int), tmp);
-				outnum(out, tmp, flags);
-				break;
-			case 'u':
-				if (flags & SAW_LONG)
-					uint2str(va_arg(ap, unsigned long), tmp);
-				else
-					uint2str(va_arg(ap, unsigned), tmp);
-				outnum(out, tmp, flags);
-				break;
-			case 'x':
-				if (flags & SAW_LONG)
-					hex2str(va_arg(ap, unsigned long), tmp);
-				else
-					hex2str(va_arg(ap, unsigned), tmp);
-				outnum(out, tmp, flags);
-				break;
-#ifdef WANT_FLOATS
-			case 'f': ;
-				int frac;
-				int integer = double2fixed(va_arg(ap, double), &frac);
-				int2str(integer, tmp);
-				outnum(out, tmp, flags);
-				outchar(out, '.');
-				int2str(frac, tmp);
-				outnum(out, tmp, flags);
-				break;
-#endif
-			default:
+			conv = parse_spec(&fmt, &flags, &prec);
+			if (conv) {
+				fetch_arg(conv, flags, &aq, &arg);
+				outarg(out, conv, flags, prec, &arg);
+			} else {
 				outchar(out, '%');
 				fmt = save;
 			}
@@ -379,14 +1089,10 @@ static int __strfmt(struct outbuff *out, const char *fmt, va_list ap)
 			outchar(out, *fmt);
 		++fmt;
 	}
+	va_end(aq);
 
-	/* We leave room for the NULL */
-	if (out->str)
-		*out->str = 0;
-
-	return out->n;
+	return outend(out);
 }
-/* \endcond */
 
 /** Lower level interface to strfmt() when you already have the va_list.
  * @param str The output string.
@@ -405,11 +1111,306 @@ int strfmt_ap(char *str, int len, const char *fmt, va_list ap)
 	return __strfmt(&out, fmt, ap);
 }
 
+#ifndef BUFFERED
+/* A compiled format is a list of ops, each a literal followed by an
+ * optional conversion. The literals point into our copy of the format.
+ */
+struct strfmt_op {
+	const char *lit;
+	int litlen;
+	int conv; /* 0 for the trailing literal */
+	unsigned flags;
+	int prec;
+};
+
+struct strfmt_compiled {
+	int nops;
+	int nargs;
+	char *fmt;
+	struct strfmt_op ops[];
+};
+
+/* Takes the args from ap if args is NULL */
+static int exec_ops(struct outbuff *out, const struct strfmt_compiled *cf,
+					va_list *ap, const union strfmt_arg *args)
+{
+	const struct strfmt_op *op = cf->ops, *end = cf->ops + cf->nops;
+	union strfmt_arg arg;
+
+	for (; op < end; ++op) {
+		if (op->litlen == 1)
+			outchar(out, *op->lit);
+		else
+			outmemcpy(out, op->lit, op->litlen);
+		if (op->conv) {
+			if (args)
+				arg = *args++;
+			else
+				fetch_arg(op->conv, op->flags, ap, &arg);
+			outarg(out, op->conv, op->flags, op->prec, &arg);
+		}
+	}
+
+	return outend(out);
+}
+/* \endcond */
+
+/** Compile a format for strfmt_exec() and friends.
+ *
+ * The format is parsed once into a list of ops so the executors do
+ * not reparse it on every call. The output is the same as strfmt()
+ * with the same format. The format is copied.
+ *
+ * @param fmt The output format.
+ * @return The compiled format. The caller must free() it.
+ */
+struct strfmt_compiled *strfmt_compile(const char *fmt)
+{
+	struct strfmt_compiled *cf;
+	const char *p, *lit;
+	unsigned flags;
+	int n, conv, prec, len = strlen(fmt);
+
+	/* At most one op per % plus the trailing literal */
+	n = 1;
+	for (p = fmt; *p; ++p)
+		if (*p == '%')
+			++n;
+
+	cf = must_alloc(sizeof(*cf) + n * sizeof(struct strfmt_op) + len + 1);
+	cf->fmt = (char *)&cf->ops[n];
+	memcpy(cf->fmt, fmt, len + 1);
+	cf->nops = cf->nargs = 0;
+
+	for (lit = p = cf->fmt; *p; ++p)
+		if (*p == '%') {
+			const char *spec = p + 1;
+
+			conv = parse_spec(&spec, &flags, &prec);
+			if (conv) {
+				struct strfmt_op *op = &cf->ops[cf->nops++];
+
+				op->lit = lit;
+				op->litlen = p - lit;
+				op->conv = conv;
+				op->flags = flags;
+				op->prec = prec;
+				++cf->nargs;
+				p = spec;
+				lit = p + 1;
+			}
+			/* else the % is part of the literal */
+		}
+
+	if (p > lit) {
+		struct strfmt_op *op = &cf->ops[cf->nops++];
+
+		op->lit = lit;
+		op->litlen = p - lit;
+		op->conv = 0;
+	}
+
+	return cf;
+}
+
+/** Lower level interface to strfmt_exec() when you already have the va_list.
+ * @param str The output string.
+ * @param len The length of the output string.
+ * @param cf The compiled format.
+ * @param ap The va_list.
+ * @return The number of bytes in the source string (like snprintf).
+ */
+int strfmt_exec_ap(char *str, int len, const struct strfmt_compiled *cf, va_list ap)
+{
+	struct outbuff out = { .str = str, .len = len - 1, .n = 0 };
+	va_list aq;
+	int n;
+
+	if (len < 1)
+		return 0;
+
+	va_copy(aq, ap);
+	n = exec_ops(&out, cf, &aq, NULL);
+	va_end(aq);
+	return n;
+}
+
+/** strfmt() with a compiled format.
+ * @param str The output string.
+ * @param len The length of the output string.
+ * @param cf The format from strfmt_compile().
+ * @param ... The zero or more arguments.
+ * @return The number of bytes in the source (like snprintf).
+ */
+int strfmt_exec(char *str, int len, const struct strfmt_compiled *cf, ...)
+{
+	va_list ap;
+	va_start(ap, cf);
+	int n = strfmt_exec_ap(str, len, cf, ap);
+	va_end(ap);
+
+	return n;
+}
+
+/** strbuf_fmt() with a compiled format.
+ * @param sb The strbuf.
+ * @param cf The format from strfmt_compile().
+ * @param ... The zero or more arguments.
+ * @return The number of bytes formatted or -1 on a write error.
+ */
+int strbuf_exec(struct strbuf *sb, const struct strfmt_compiled *cf, ...)
+{
+	struct outbuff out = {
+		.str = sb->str + sb->len, .len = sb->size - sb->len - 1, .sb = sb
+	};
+	va_list ap;
+	int n;
+
+	va_start(ap, cf);
+	n = exec_ops(&out, cf, &ap, NULL);
+	va_end(ap);
+
+	sb->len = out.str - sb->str;
+	return sb->error ? -1 : n;
+}
+
+/** Format count records with the same compiled format.
+ *
+ * The args are the arguments for each record in order, so args must
+ * have count times the number of conversions in the format. Use l
+ * for %d and %o, u for %u and %x, s for %s, c for %c, and d for %f
+ * and %e. The l modifier in the format is ignored.
+ *
+ * @param sb The strbuf.
+ * @param cf The format from strfmt_compile().
+ * @param args The arguments.
+ * @param count The number of records.
+ * @return The number of bytes formatted or -1 on a write error.
+ */
+int strbuf_exec_v(struct strbuf *sb, const struct strfmt_compiled *cf,
+				  const union strfmt_arg *args, int count)
+{
+	struct outbuff out = {
+		.str = sb->str + sb->len, .len = sb->size - sb->len - 1, .sb = sb
+	};
+
+	for (int i = 0; i < count; ++i, args += cf->nargs)
+		exec_ops(&out, cf, NULL, args);
+
+	sb->len = out.str - sb->str;
+	return sb->error ? -1 : out.n;
+}
+
+/** Setup a strbuf for strbuf_fmt().
+ * @param sb The strbuf.
+ * @param fd The file descriptor to write to, or -1 for a string that
+ * grows as needed.
+ */
+void strbuf_init(struct strbuf *sb, int fd)
+{
+	memset(sb, 0, sizeof(*sb));
+	sb->fd = fd;
+	sb->size = fd >= 0 ? STRBUF_FDSIZE : STRBUF_MEMSIZE;
+	sb->str = must_alloc(sb->size);
+	*sb->str = 0;
+}
+
+/** Lower level interface to strbuf_fmt() when you already have the va_list.
+ * @param sb The strbuf.
+ * @param fmt The output format.
+ * @param ap The va_list.
+ * @return The number of bytes formatted or -1 on a write error.
+ */
+int strbuf_fmt_ap(struct strbuf *sb, const char *fmt, va_list ap)
+{
+	struct outbuff out = {
+		.str = sb->str + sb->len, .len = sb->size - sb->len - 1, .sb = sb
+	};
+	int n = __strfmt(&out, fmt, ap);
+
+	sb->len = out.str - sb->str;
+	return sb->error ? -1 : n;
+}
+
+/** strfmt() to a strbuf.
+ *
+ * Appends to the strbuf. For a string, sb->str is always NUL
+ * terminated and sb->len is the length. For a file descriptor, the
+ * output is written in large chunks with writev() when the buffer
+ * fills. Strings too big for the buffer are written directly
+ * without a copy. Call strbuf_flush() when done.
+ *
+ * @param sb The strbuf.
+ * @param fmt The output format.
+ * @param ... The zero or more arguments.
+ * @return The number of bytes formatted or -1 on a write error.
+ */
+int strbuf_fmt(struct strbuf *sb, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	int n = strbuf_fmt_ap(sb, fmt, ap);
+	va_end(ap);
+
+	return n;
+}
+
+/** Write any buffered output to the file descriptor.
+ * @param sb The strbuf.
+ * @return 0 on success or -1 on error. The errno is the first error.
+ */
+int strbuf_flush(struct strbuf *sb)
+{
+	struct outbuff out = { .str = sb->str + sb->len, .sb = sb };
+
+	if (sb->fd >= 0) {
+		outflush(&out, NULL, 0);
+		sb->len = 0;
+	}
+	if (sb->error) {
+		errno = sb->error;
+		return -1;
+	}
+	return 0;
+}
+
+/** Free the strbuf memory. Does not flush or close the fd.
+ * @param sb The strbuf.
+ */
+void strbuf_free(struct strbuf *sb)
+{
+	free(sb->str);
+	sb->str = NULL;
+	sb->len = sb->size = 0;
+}
+
+/** strfmt() to an allocated string.
+ * @param fmt The output format.
+ * @param ... The zero or more arguments.
+ * @return The string. The caller must free() it.
+ */
+char *strfmt_alloc(const char *fmt, ...)
+{
+	struct strbuf sb;
+	va_list ap;
+
+	strbuf_init(&sb, -1);
+	va_start(ap, fmt);
+	strbuf_fmt_ap(&sb, fmt, ap);
+	va_end(ap);
+
+	return sb.str;
+}
+
+#endif
+
 /** Poor man's snprintf.
  *
  * Supports a subset of printf: %s, %c, %d, %u, %x, %l[dux]. Format can
  * contain a width and a minus (-) for left justify. Numbers starting
- * with 0 and a width are zero padded.
+ * with 0 and a width are zero padded. A precision is supported for
+ * %s and, if built with WANT_FLOATS, %f and %e (default 6, max 400).
+ * Floats are exact and rounded like glibc.
  *
  * @param str The output string.
  * @param len The length of the output string.
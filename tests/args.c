@@ -1,7 +1,115 @@
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
 #include "../samlib.h"
 
+/* The old snprintf version */
+static void old_nicer_mem_len(uint64_t size, char *str, int len)
+{
+	if (size >= (1ul << 30)) {
+		if ((size & ((1UL << 30) - 1)) == 0)
+			snprintf(str, len, "%luG", size >> 30);
+		else
+			snprintf(str, len, "%.1fG", (double)size / (double)(1ul << 30));
+	} else if (size >= (1ul << 20)) {
+		if ((size & ((1UL << 20) - 1)) == 0)
+			snprintf(str, len, "%luM", size >> 20);
+		else
+			snprintf(str, len, "%.1fM", (double)size / (double)(1ul << 20));
+	} else if (size >= (1ul << 10)) {
+		if ((size & ((1UL << 10) - 1)) == 0)
+			snprintf(str, len, "%luK", size >> 10);
+		else
+			snprintf(str, len, "%.1fK", (double)size / (double)(1ul << 10));
+	} else
+		snprintf(str, len, "%lu", size);
+}
+
+static int test_reentrant(void)
+{
+	static const struct {
+		const char *str;
+		int rc;
+		uint64_t len;
+	} mem[] = {
+		{ "0", 0, 0 }, { "4k", 0, 4096 }, { "0x10M", 0, 16 << 20 },
+		{ "16777215T", 0, 16777215ULL << 40 }, { "16777216T", ERANGE, 0 },
+		{ "", EINVAL, 0 }, { "k", EINVAL, 0 }, { "-1", EINVAL, 0 },
+		{ "12q", EINVAL, 0 }, { "12kb", 0, 12 << 10 }, { "10MB", 0, 10 << 20 },
+		{ "4kB", 0, 4096 }, { "12kbb", EINVAL, 0 }, { "12bb", EINVAL, 0 },
+		{ "99999999999999999999", ERANGE, 0 },
+	};
+	static const struct {
+		const char *str;
+		int rc;
+		unsigned long secs;
+	} dur[] = {
+		{ "90", 0, 90 }, { "1.5m", 0, 90 }, { "2d", 0, 172800 }, { "10s", 0, 10 },
+		{ "", EINVAL, 0 }, { "-5", EINVAL, 0 }, { "5x", EINVAL, 0 },
+		{ "5hm", EINVAL, 0 }, { "nan", EINVAL, 0 }, { "1e30", ERANGE, 0 },
+	};
+	char str[32], old[32];
+	unsigned long secs;
+	uint64_t len;
+	int i, rc = 0;
+
+	for (i = 0; i < sizeof(mem) / sizeof(mem[0]); ++i) {
+		len = 0;
+		if (_get_mem_len(mem[i].str, &len) != mem[i].rc || len != mem[i].len) {
+			printf("_get_mem_len(%s) bad\n", mem[i].str);
+			rc = 1;
+		}
+	}
+
+	for (i = 0; i < sizeof(dur) / sizeof(dur[0]); ++i) {
+		secs = 0;
+		if (_get_duration(dur[i].str, &secs) != dur[i].rc || secs != dur[i].secs) {
+			printf("_get_duration(%s) bad\n", dur[i].str);
+			rc = 1;
+		}
+	}
+
+	if (_nice_duration(0, str) != 2 || strcmp(str, "0s") ||
+		_nice_duration(ONE_DAY + 61, str) != 6 || strcmp(str, "1d1m1s")) {
+		printf("_nice_duration %s\n", str);
+		rc = 1;
+	}
+
+	if (strcmp(nice_number_r(0, str), "0") ||
+		strcmp(nice_number_r(999, str), "999") ||
+		strcmp(nice_number_r(123456, str), "123,456") ||
+		strcmp(nice_number_r(1234567, str), "1,234,567") ||
+		strcmp(nice_number_r(-1000, str), "-1,000") ||
+		strcmp(nice_number_r(LONG_MIN, str), "-9,223,372,036,854,775,808")) {
+		printf("nice_number_r %s\n", str);
+		rc = 1;
+	}
+
+	/* Includes the .x5 ties and 1023.95K */
+	for (len = 0; len < 3 << 20; len += len < 4096 ? 1 : 97) {
+		_nicer_mem_len(len, str);
+		old_nicer_mem_len(len, old, sizeof(old));
+		if (strcmp(str, old)) {
+			printf("_nicer_mem_len(%lu) %s != %s\n", len, str, old);
+			rc = 1;
+			break;
+		}
+	}
+	/* Past 2^53 the double in the old version is not exact */
+	for (i = 0; i < 100000; ++i) {
+		len = xorshift128plus() >> (i % 40 + 11);
+		_nicer_mem_len(len, str);
+		old_nicer_mem_len(len, old, sizeof(old));
+		if (strcmp(str, old)) {
+			printf("_nicer_mem_len(%lu) %s != %s\n", len, str, old);
+			rc = 1;
+			break;
+		}
+	}
+
+	return rc;
+}
+
 #ifdef TESTALL
 static int args_main(void)
 #else
@@ -45,5 +153,7 @@ int main(int argc, char *argv[])
 		rc = 1;
 	}
 
+	rc |= test_reentrant();
+
 	return rc;
 }
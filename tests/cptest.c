@@ -71,6 +71,284 @@ static int test_tmpfilename(void)
 	return rc;
 }
 
+static int test_hash(const char *from, const char *to)
+{
+	uint8_t digest[32], expect[32];
+	int rc = 0;
+	long n;
+
+	md5(buf, len, expect);
+	n = copy_file_hash(from, to, COPY_MD5, digest);
+	if (n != len || memcmp(digest, expect, MD5_DIGEST_LEN)) {
+		printf("copy_file_hash md5 failed: %ld\n", n);
+		rc = 1;
+	}
+
+	sha256(buf, len, expect);
+	n = copy_file_hash(from, to, COPY_SHA256 | COPY_DIRECT, digest);
+	if (n != len || memcmp(digest, expect, 32)) {
+		printf("copy_file_hash sha256 failed: %ld\n", n);
+		rc = 1;
+	}
+
+	md5(buf, len, expect);
+	if (md5sum(to, digest) || memcmp(digest, expect, MD5_DIGEST_LEN)) {
+		printf("copy_file_hash: bad copy\n");
+		rc = 1;
+	}
+
+	return rc;
+}
+
+#ifndef TESTALL
+/* Drop a file from the page cache, as if it had never been read */
+static void uncache(const char *fname)
+{
+#ifdef POSIX_FADV_DONTNEED
+	int fd = open(fname, O_RDONLY);
+
+	if (fd >= 0) {
+		fdatasync(fd);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+#endif
+}
+
+/* Copy then md5sum vs copy_file_hash on a 64M file, with the source
+ * cached, not cached, and not cached with COPY_DIRECT.
+ */
+static void benchmark(const char *from, const char *to)
+{
+	static const char *what[] = { "warm", "cold", "direct" };
+	unsigned long t1, t2;
+	struct timeval start;
+	uint8_t digest[16];
+	int i;
+
+	if (create_file(from, 0, 0644))
+		return;
+	for (i = 0; i < 64; ++i)
+		do_system("head -c 1048576 /dev/urandom >> %s", from);
+
+	for (i = 0; i < 3; ++i) {
+		if (i)
+			uncache(from);
+		gettimeofday(&start, NULL);
+		copy_file(from, to);
+		md5sum(to, digest);
+		t1 = delta_timeval_now(&start);
+
+		unlink(to);
+		if (i)
+			uncache(from);
+		gettimeofday(&start, NULL);
+		copy_file_hash(from, to, COPY_MD5 | (i == 2 ? COPY_DIRECT : 0), digest);
+		t2 = delta_timeval_now(&start);
+		unlink(to);
+
+		printf("%-6s copy + md5sum %6luus copy_file_hash %6luus\n", what[i], t1, t2);
+	}
+
+	unlink(from);
+}
+#endif
+
+/* _copy_fd() told a size bigger than from, as if from shrunk */
+static int test_shrunk(const char *from, const char *to, off_t size, off_t expect)
+{
+	struct stat sbuf;
+	int in, out;
+	off_t n;
+
+	in = open(from, O_RDONLY | O_BINARY);
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (in < 0 || out < 0) {
+		perror("shrunk");
+		return 1;
+	}
+	n = _copy_fd(in, out, size);
+	close(in);
+	close(out);
+
+	if (n != expect || stat(to, &sbuf) || sbuf.st_size != expect) {
+		printf("_copy_fd shrunk: %ld size %ld expected %ld\n",
+			   (long)n, (long)sbuf.st_size, (long)expect);
+		return 1;
+	}
+	return 0;
+}
+
+/* Data, a 1M hole, data, and a trailing hole */
+static int test_sparse(const char *from, const char *to)
+{
+	struct stat sbuf;
+	int fd, rc = 0;
+	long n;
+
+	memset(buf, 'a', 4096);
+	fd = open(from, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd < 0) {
+		perror(from);
+		return 1;
+	}
+	if (write(fd, buf, 4096) != 4096 ||
+		pwrite(fd, buf, 4096, 1024 * 1024) != 4096 ||
+		ftruncate(fd, 2 * 1024 * 1024)) {
+		perror("sparse");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	n = copy_file(from, to);
+	if (n != 2 * 1024 * 1024) {
+		printf("copy_file sparse: %ld\n", n);
+		return 1;
+	}
+
+	fd = open(to, O_RDONLY | O_BINARY);
+	if (fd < 0 || fstat(fd, &sbuf)) {
+		perror(to);
+		return 1;
+	}
+	if (pread(fd, buf2, 4096, 1024 * 1024) != 4096 || memcmp(buf, buf2, 4096) ||
+		pread(fd, buf2, 4096, 4096) != 4096 || buf2[0] || buf2[511]) {
+		printf("copy_file sparse: bad data\n");
+		rc = 1;
+	}
+	close(fd);
+
+	/* Only if the filesystem supports holes */
+	stat(from, &sbuf);
+	if (sbuf.st_blocks * 512 < 1024 * 1024) {
+		stat(to, &sbuf);
+		if (sbuf.st_blocks * 512 >= 1024 * 1024) {
+			printf("copy_file sparse: holes not preserved %ld\n", (long)sbuf.st_blocks);
+			rc = 1;
+		}
+	}
+
+	/* Shrunk into the trailing hole, then into the data */
+	rc |= test_shrunk(from, to, 3 * 1024 * 1024, 2 * 1024 * 1024);
+	if (truncate(from, 1024 * 1024 + 2048) == 0)
+		rc |= test_shrunk(from, to, 2 * 1024 * 1024, 1024 * 1024 + 2048);
+
+	unlink(from);
+	unlink(to);
+	return rc;
+}
+
+static int tree_check(const char *from, const char *to, const char *name)
+{
+	char path[256], path2[256];
+	struct stat s1, s2;
+
+	strfmt(path, sizeof(path), "%s/%s", from, name);
+	strfmt(path2, sizeof(path2), "%s/%s", to, name);
+	if (lstat(path, &s1) || lstat(path2, &s2)) {
+		perror(name);
+		return 1;
+	}
+	if (s1.st_mode != s2.st_mode || s1.st_size != s2.st_size ||
+		s1.st_mtime != s2.st_mtime) {
+		printf("copy_tree %s: mode 0%o 0%o size %ld %ld\n", name,
+			   s1.st_mode, s2.st_mode, (long)s1.st_size, (long)s2.st_size);
+		return 1;
+	}
+	return 0;
+}
+
+static int test_copy_tree(void)
+{
+	struct copy_tree_struct ct;
+	char *from = tmpfilename("cptree");
+	char *to = tmpfilename("cptree.out");
+	char path[256], path2[256];
+	struct stat s1, s2;
+	int i, rc = 0;
+
+	do_system("rm -rf %s %s", from, to);
+	for (i = 0; i < 100; ++i) {
+		strfmt(path, sizeof(path), "%s/d%d/file%d", from, i % 10, i);
+		if (create_file(path, i * 100, 0644)) {
+			/* create_file does not make the dirs */
+			strfmt(path, sizeof(path), "%s/d%d", from, i % 10);
+			mkdir_p(path, 0755);
+			strfmt(path, sizeof(path), "%s/d%d/file%d", from, i % 10, i);
+			if (create_file(path, i * 100, 0644)) {
+				perror(path);
+				return 1;
+			}
+		}
+	}
+	strfmt(path, sizeof(path), "%s/.hidden", from);
+	create_file(path, 10, 0600);
+	strfmt(path, sizeof(path), "%s/d1/exec", from);
+	create_file(path, 10, 0755);
+	strfmt(path, sizeof(path), "%s/link", from);
+	if (symlink("d1/exec", path))
+		perror(path);
+	strfmt(path, sizeof(path), "%s/d1/file1", from);
+	strfmt(path2, sizeof(path2), "%s/d4/hard", from);
+	if (link(path, path2))
+		perror(path2);
+	strfmt(path, sizeof(path), "%s/d2", from);
+	chmod(path, 0555);
+	do_system("touch -d 2001-01-01 %s/d1/file1 %s/d3", from, from);
+
+	memset(&ct, 0, sizeof(ct));
+	ct.nthreads = 4;
+	if (copy_tree(from, to, &ct)) {
+		printf("copy_tree failed\n");
+		rc = 1;
+	} else if (ct.files != 102 || ct.dirs != 10 || ct.links != 1 ||
+			   ct.hardlinks != 1 || ct.errors) {
+		printf("copy_tree: files %lu dirs %lu links %lu hardlinks %lu errors %lu\n",
+			   ct.files, ct.dirs, ct.links, ct.hardlinks, ct.errors);
+		rc = 1;
+	} else {
+		rc |= tree_check(from, to, ".hidden");
+		rc |= tree_check(from, to, "d1/exec");
+		rc |= tree_check(from, to, "d1/file1");
+		rc |= tree_check(from, to, "d9/file99");
+		rc |= tree_check(from, to, "link");
+		rc |= tree_check(from, to, "d2");
+		rc |= tree_check(from, to, "d3");
+		rc |= tree_check(from, to, "d4/hard");
+		strfmt(path, sizeof(path), "%s/d1/file1", to);
+		strfmt(path2, sizeof(path2), "%s/d4/hard", to);
+		if (stat(path, &s1) || stat(path2, &s2) || s1.st_ino != s2.st_ino) {
+			printf("copy_tree: hard link not preserved\n");
+			rc = 1;
+		}
+		if (do_system("diff -r %s %s", from, to))
+			rc = 1;
+	}
+
+	/* Copying into itself never ends */
+	strfmt(path, sizeof(path), "%s/new/sub", from);
+	if (copy_tree(from, path, NULL) == 0 || errno != EINVAL) {
+		printf("copy_tree: copied into itself\n");
+		rc = 1;
+	}
+	strfmt(path, sizeof(path), "%s/new", from);
+	if (access(path, F_OK) == 0) {
+		printf("copy_tree: %s created\n", path);
+		rc = 1;
+	}
+	strfmt(path, sizeof(path), "%s/d1/..", from);
+	if (copy_tree(from, path, NULL) == 0 || errno != EINVAL) {
+		printf("copy_tree: copied onto itself\n");
+		rc = 1;
+	}
+
+	do_system("chmod -R u+w %s %s; rm -rf %s %s", from, to, from, to);
+	free(from);
+	free(to);
+	return rc;
+}
+
 #ifdef TESTALL
 static int cptest_main(void)
 #else
@@ -113,9 +391,22 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+	if (test_hash(filename, toname))
+		return 1;
+
 	unlink(filename);
 	unlink(toname);
 
+	if (test_sparse(filename, toname))
+		return 1;
+
+	if (test_copy_tree())
+		return 1;
+
+#ifndef TESTALL
+	benchmark(filename, toname);
+#endif
+
 	free(filename);
 	free(toname);
 
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "../samlib.h"
 
 /* GCOV CFLAGS=-coverage make D=1
@@ -35,9 +36,61 @@ static struct ref {
 };
 #define N_REFS (sizeof(refs) / sizeof(struct ref))
 
+/* The first crc32c() calls race to build the tables */
+#define CRC_THREADS 16
+static uint8_t crc_page[4096];
+static uint32_t crc_sums[CRC_THREADS];
+static int crc_go;
+
+static void *crc_thread(void *arg)
+{
+	long i = (long)arg;
+
+	while (!__atomic_load_n(&crc_go, __ATOMIC_ACQUIRE)) ;
+	crc_sums[i] = crc32c(0, crc_page, sizeof(crc_page));
+	return NULL;
+}
+
+static int test_crc_threads(void)
+{
+	pthread_t threads[CRC_THREADS];
+	uint32_t crc;
+	long i, n;
+	int rc = 0;
+
+	for (i = 0; i < sizeof(crc_page); ++i)
+		crc_page[i] = i * 13 + 5;
+	for (n = 0; n < CRC_THREADS; ++n)
+		if (pthread_create(&threads[n], NULL, crc_thread, (void *)n))
+			break;
+	__atomic_store_n(&crc_go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n; ++i)
+		pthread_join(threads[i], NULL);
+
+	/* Bit at a time, no tables */
+	crc = ~0;
+	for (i = 0; i < sizeof(crc_page); ++i) {
+		crc ^= crc_page[i];
+		for (int j = 0; j < 8; ++j)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+	}
+	crc = ~crc;
+
+	/* Bad tables would stay bad, so check a later sum too */
+	for (i = 0; i < n; ++i)
+		if (crc_sums[i] != crc)
+			rc = 1;
+	if (crc32c(0, crc_page, sizeof(crc_page)) != crc)
+		rc = 1;
+	if (rc)
+		printf("PROBLEMS: crc32c from %ld threads\n", n);
+	return rc;
+}
+
 #ifndef TESTALL
 // #define LARGE_BUFFERS
 #include "../crc16.c"
+#include "../crc32c.c"
 
 int main(int argc, char *argv[])
 #else
@@ -75,5 +128,31 @@ static int crc16_main(void)
 	}
 #endif
 
+	rc |= test_crc_threads();
+
+	/* The CRC-32C check value, whole and in pieces */
+	if (crc32c(0, "123456789", 9) != 0xe3069283 ||
+		crc32c(crc32c(0, "1234", 4), "56789", 5) != 0xe3069283) {
+		printf("PROBLEMS: crc32c %x != e3069283\n", crc32c(0, "123456789", 9));
+		rc = 1;
+	}
+
+#ifndef TESTALL
+	/* Hardware and table at every alignment and length, past the
+	 * three streams of the hardware version
+	 */
+	uint8_t bytes[8 + 2048];
+	int off, len;
+
+	for (i = 0; i < sizeof(bytes); ++i)
+		bytes[i] = i * 7 + 3;
+	for (off = 0; off < 8; ++off)
+		for (len = 0; len <= 2048; ++len)
+			if (crc32c(0, bytes + off, len) != ~crc32c_sw(~0, bytes + off, len)) {
+				printf("PROBLEMS: crc32c off %d len %d\n", off, len);
+				rc = 1;
+			}
+#endif
+
 	return rc;
 }
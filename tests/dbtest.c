@@ -1,8 +1,10 @@
+#include "../samthread.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
@@ -23,6 +25,1561 @@ static int db_walk_strings(const char *key, void *data, int len)
 	return 0;
 }
 
+static int test_info(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	char key[32], str[32];
+	void *dbh;
+	int i, rc = 0;
+
+	unlink(tmpfile);
+
+	memset(&info, 0, sizeof(info));
+	info.psize = 100; /* too small */
+	if (db_open_info(tmpfile, DB_CREATE, &info, &dbh) != EINVAL) {
+		puts("db_open_info: bad psize accepted");
+		rc = 1;
+	}
+
+	info.psize = 1024;
+	info.cachesize = 64 * 1024;
+	info.lorder = DB_BIG_ENDIAN;
+	if (db_open_info(tmpfile, DB_CREATE, &info, &dbh)) {
+		puts("db_open_info failed");
+		return 1;
+	}
+	for (i = 0; i < 5000; ++i) {
+		strfmt(key, sizeof(key), "key%d", i);
+		rc |= db_put_str(dbh, key, key + 3);
+	}
+	if (db_stats(dbh, &stats) || stats.psize != 1024 || stats.maxcache != 64 ||
+		stats.npages < 20 || stats.cachehit == 0) {
+		printf("db_stats: psize %lu maxcache %lu npages %lu hits %lu\n",
+			   stats.psize, stats.maxcache, stats.npages, stats.cachehit);
+		rc = 1;
+	}
+	db_close(dbh);
+
+	/* Reopen with defaults, the page size and byte order come from the file */
+	if (db_open(tmpfile, DB_CREATE, &dbh)) {
+		puts("reopen failed");
+		return 1;
+	}
+	for (i = 0; i < 5000; i += 7) {
+		strfmt(key, sizeof(key), "key%d", i);
+		if (db_get_str(dbh, key, str, sizeof(str)) <= 0 || strcmp(str, key + 3)) {
+			printf("get %s failed\n", key);
+			rc = 1;
+			break;
+		}
+	}
+	if (db_stats(dbh, &stats) || stats.psize != 1024 || stats.pageread == 0) {
+		printf("db_stats reopen: psize %lu reads %lu\n", stats.psize, stats.pageread);
+		rc = 1;
+	}
+	db_close(dbh);
+
+	unlink(tmpfile);
+	return rc;
+}
+
+/* A tiny cache so pages are evicted dirty and read back constantly */
+static int test_evict(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	char key[32], str[32];
+	void *dbh;
+	int i, rc = 0, n = 20000;
+
+	unlink(tmpfile);
+	memset(&info, 0, sizeof(info));
+	info.psize = 512;
+	if (db_open_info(tmpfile, DB_CREATE, &info, &dbh)) {
+		puts("evict: open failed");
+		return 1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		strfmt(key, sizeof(key), "%x", (unsigned)(i * 2654435761u));
+		rc |= db_put_str(dbh, key, key);
+	}
+	for (i = 0; i < n; i += 2) {
+		strfmt(key, sizeof(key), "%x", (unsigned)(i * 2654435761u));
+		rc |= db_del(dbh, key);
+	}
+	for (i = 0; i < n && rc == 0; ++i) {
+		strfmt(key, sizeof(key), "%x", (unsigned)(i * 2654435761u));
+		if (i & 1) {
+			if (db_get_str(dbh, key, str, sizeof(str)) <= 0 || strcmp(str, key)) {
+				printf("evict: get %s failed\n", key);
+				rc = 1;
+			}
+		} else if (db_peek(dbh, key) != 1) {
+			printf("evict: %s not deleted\n", key);
+			rc = 1;
+		}
+	}
+
+	if (db_stats(dbh, &stats) || stats.curcache > 20 || stats.pageflush == 0) {
+		printf("evict: %lu cached %lu flushed\n", stats.curcache, stats.pageflush);
+		rc = 1;
+	}
+	db_close(dbh);
+	unlink(tmpfile);
+
+	return rc;
+}
+
+static int check_val(const char *key, const char *val, int len)
+{
+	int i, want = key[3] == 'b' ? 3000 : 20;
+
+	if (len != want) {
+		printf("mmap: %s len %d != %d\n", key, len, want);
+		return 1;
+	}
+	for (i = 0; i < len; ++i)
+		if (val[i] != key[4]) {
+			printf("mmap: %s bad value\n", key);
+			return 1;
+		}
+	return 0;
+}
+
+static int test_mmap(const char *tmpfile)
+{
+	const void *vals[1000];
+	char key[32], big[3000];
+	void *dbh;
+	int i, len, rc = 0;
+
+	unlink(tmpfile);
+	if (db_open(tmpfile, DB_CREATE, &dbh)) {
+		puts("mmap: create failed");
+		return 1;
+	}
+	/* Every 10th value is on overflow pages */
+	for (i = 0; i < 1000; ++i) {
+		strfmt(key, sizeof(key), "key%c%c%d", i % 10 ? 's' : 'b', 'a' + i % 26, i);
+		memset(big, key[4], sizeof(big));
+		rc |= db_put_raw(dbh, key, strlen(key), big, i % 10 ? 20 : 3000, 0);
+	}
+	db_close(dbh);
+
+	if (db_open(tmpfile, DB_CREATE | DB_MMAP, &dbh) != EINVAL) {
+		puts("mmap: read write allowed");
+		rc = 1;
+	}
+
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh)) {
+		puts("mmap: open failed");
+		return 1;
+	}
+	for (i = 0; i < 1000; ++i) {
+		strfmt(key, sizeof(key), "key%c%c%d", i % 10 ? 's' : 'b', 'a' + i % 26, i);
+		len = db_get_ptr(dbh, key, strlen(key), &vals[i]);
+		rc |= check_val(key, vals[i], len);
+	}
+	/* Still good after all the other gets */
+	for (i = 0; i < 1000; ++i) {
+		strfmt(key, sizeof(key), "key%c%c%d", i % 10 ? 's' : 'b', 'a' + i % 26, i);
+		rc |= check_val(key, vals[i], i % 10 ? 20 : 3000);
+	}
+	if (db_get_ptr(dbh, "nokey", 5, &vals[0]) != -1) {
+		puts("mmap: found nokey");
+		rc = 1;
+	}
+	if (db_put_str(dbh, "new", "val") == 0) {
+		puts("mmap: put worked");
+		rc = 1;
+	}
+	db_close(dbh);
+	unlink(tmpfile);
+
+	return rc;
+}
+
+/* The big value copies stop at 16M */
+static int test_mmap_limit(const char *tmpfile)
+{
+	static char big[64 * 1024], raw[64 * 1024];
+	const void *val, *first = NULL;
+	char key[32];
+	void *dbh;
+	int i, len, nobufs = 0, rc = 0;
+
+	unlink(tmpfile);
+	if (db_open(tmpfile, DB_CREATE, &dbh)) {
+		puts("mmap limit: create failed");
+		return 1;
+	}
+	for (i = 0; i < 300; ++i) {
+		strfmt(key, sizeof(key), "big%d", i);
+		memset(big, 'a' + i % 26, sizeof(big));
+		rc |= db_put_raw(dbh, key, strlen(key), big, sizeof(big), 0);
+	}
+	db_close(dbh);
+
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh)) {
+		puts("mmap limit: open failed");
+		return 1;
+	}
+	for (i = 0; i < 300; ++i) {
+		strfmt(key, sizeof(key), "big%d", i);
+		len = db_get_ptr(dbh, key, strlen(key), &val);
+		if (len < 0) {
+			if (errno == ENOBUFS &&
+				db_get_raw(dbh, key, strlen(key), raw, sizeof(raw)) == sizeof(raw) &&
+				raw[0] == 'a' + i % 26)
+				++nobufs;
+			else {
+				printf("mmap limit: %s failed\n", key);
+				rc = 1;
+			}
+		} else if (len != sizeof(big) || *(char *)val != 'a' + i % 26) {
+			printf("mmap limit: %s bad value\n", key);
+			rc = 1;
+		} else if (i == 0)
+			first = val;
+	}
+	/* 16M of 64k values is 256 of them */
+	if (nobufs != 300 - 256 || !first || *(char *)first != 'a') {
+		printf("mmap limit: %d ENOBUFS\n", nobufs);
+		rc = 1;
+	}
+	db_close(dbh);
+	unlink(tmpfile);
+
+	return rc;
+}
+
+/* Every 50th key and every 10th value is on overflow pages */
+#define MT_KEYS 20000
+
+static int mt_key(char *key, int i)
+{
+	int len = strfmt(key, 32, "%08d", i);
+
+	if (i % 50 == 0) {
+		memset(key + len, 'k', 2500 - len);
+		len = 2500;
+	}
+	return len;
+}
+
+struct mt_reader {
+	void *dbh;
+	int seed, ngets, errors;
+	unsigned long usecs;
+};
+
+static int mt_reader(void *arg)
+{
+	struct mt_reader *r = arg;
+	struct timeval start;
+	const void *val;
+	const char *p;
+	char key[2500];
+	unsigned seed = r->seed;
+	int i, n, j, len;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; n < r->ngets; ++n) {
+		seed = seed * 1103515245 + 12345;
+		i = (seed >> 8) % MT_KEYS;
+		len = db_get_ptr(r->dbh, key, mt_key(key, i), &val);
+		if (len != (i % 10 ? 20 : 3000)) {
+			++r->errors;
+			continue;
+		}
+		for (p = val, j = 0; j < len; ++j)
+			if (p[j] != 'a' + i % 26) {
+				++r->errors;
+				break;
+			}
+	}
+	r->usecs = delta_timeval_now(&start);
+	return 0;
+}
+
+static void mt_create(const char *tmpfile)
+{
+	char key[2500], val[3000];
+	void *dbh;
+	int i;
+
+	unlink(tmpfile);
+	db_open(tmpfile, DB_CREATE, &dbh);
+	for (i = 0; i < MT_KEYS; ++i) {
+		memset(val, 'a' + i % 26, sizeof(val));
+		db_put_raw(dbh, key, mt_key(key, i), val, i % 10 ? 20 : 3000, 0);
+	}
+	db_close(dbh);
+}
+
+/* Returns total errors, sets usecs to the slowest reader */
+static int mt_run(void *dbh, int nthreads, int ngets, unsigned long *usecs)
+{
+	struct mt_reader r[16];
+	samthread_t tids[16];
+	int i, errors = 0;
+
+	*usecs = 0;
+	for (i = 0; i < nthreads; ++i) {
+		memset(&r[i], 0, sizeof(r[i]));
+		r[i].dbh = dbh;
+		r[i].seed = i + 1;
+		r[i].ngets = ngets;
+		tids[i] = samthread_create(mt_reader, &r[i]);
+		if (tids[i] == (samthread_t)-1)
+			return -1;
+	}
+	for (i = 0; i < nthreads; ++i) {
+		samthread_join(tids[i]);
+		errors += r[i].errors;
+		if (r[i].usecs > *usecs)
+			*usecs = r[i].usecs;
+	}
+	return errors;
+}
+
+static int test_mt(const char *tmpfile)
+{
+	unsigned long usecs;
+	void *dbh;
+	int errors;
+
+	mt_create(tmpfile);
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh)) {
+		puts("mt: open failed");
+		return 1;
+	}
+	errors = mt_run(dbh, 8, 20000, &usecs);
+	db_close(dbh);
+	unlink(tmpfile);
+
+	if (errors) {
+		printf("mt: %d errors\n", errors);
+		return 1;
+	}
+	return 0;
+}
+
+static int bulk_walk_n, bulk_walk_bad;
+
+static int bulk_walk(const char *key, void *data, int len)
+{
+	char want[2500];
+
+	mt_key(want, bulk_walk_n);
+	if (memcmp(key, want, 8) || len != (bulk_walk_n % 10 ? 20 : 3000))
+		++bulk_walk_bad;
+	++bulk_walk_n;
+	return 0;
+}
+
+static int bulk_check(void *dbh, int nkeys, const char *what)
+{
+	char key[2500], val[3000];
+	int i, len, rc = 0;
+
+	for (i = 0; i < nkeys; ++i) {
+		len = db_get_raw(dbh, key, mt_key(key, i), val, sizeof(val));
+		if (len != (i % 10 ? 20 : 3000) || val[len - 1] != 'a' + i % 26) {
+			printf("bulk %s: key %d len %d\n", what, i, len);
+			rc = 1;
+			break;
+		}
+	}
+	bulk_walk_n = bulk_walk_bad = 0;
+	db_walk(dbh, bulk_walk);
+	if (bulk_walk_n != nkeys || bulk_walk_bad) {
+		printf("bulk %s: walk %d keys %d bad\n", what, bulk_walk_n, bulk_walk_bad);
+		rc = 1;
+	}
+	return rc;
+}
+
+static int bulk_build(const char *tmpfile, int nkeys, int fill)
+{
+	char key[2500], val[3000];
+	void *bh;
+	int i, rc;
+
+	rc = db_bulk_open(tmpfile, NULL, fill, &bh);
+	if (rc)
+		return rc;
+	for (i = 0; i < nkeys; ++i) {
+		memset(val, 'a' + i % 26, sizeof(val));
+		if ((rc = db_bulk_put(bh, key, mt_key(key, i), val, i % 10 ? 20 : 3000)))
+			break;
+	}
+	if (nkeys > 0) {
+		/* Out of order and duplicates are skipped */
+		if (db_bulk_put(bh, "00000000", 8, "x", 1) != EINVAL ||
+			db_bulk_put(bh, key, mt_key(key, nkeys - 1), "x", 1) != EINVAL)
+			rc = 1;
+	}
+	i = db_bulk_close(bh);
+	return rc ? rc : i;
+}
+
+static int test_bulk(const char *tmpfile)
+{
+	struct db_stats stats;
+	unsigned long full, half;
+	char key[2500], val[3000];
+	void *dbh;
+	int i, rc = 0;
+
+	/* Empty and one page trees */
+	if (bulk_build(tmpfile, 0, 0) || db_open(tmpfile, O_RDWR, &dbh)) {
+		puts("bulk: empty build failed");
+		return 1;
+	}
+	rc |= bulk_check(dbh, 0, "empty");
+	db_close(dbh);
+	if (bulk_build(tmpfile, 3, 0) || db_open(tmpfile, O_RDWR, &dbh)) {
+		puts("bulk: small build failed");
+		return 1;
+	}
+	rc |= bulk_check(dbh, 3, "small");
+	db_close(dbh);
+
+	if (bulk_build(tmpfile, MT_KEYS, 50) || db_open(tmpfile, O_RDONLY, &dbh)) {
+		puts("bulk: half build failed");
+		return 1;
+	}
+	db_stats(dbh, &stats);
+	half = stats.npages;
+	db_close(dbh);
+
+	if (bulk_build(tmpfile, MT_KEYS, 0) || db_open(tmpfile, O_RDWR, &dbh)) {
+		puts("bulk: build failed");
+		return 1;
+	}
+	db_stats(dbh, &stats);
+	full = stats.npages;
+	if (full >= half) {
+		printf("bulk: full %lu pages half %lu pages\n", full, half);
+		rc = 1;
+	}
+	rc |= bulk_check(dbh, MT_KEYS, "full");
+
+	/* Still a normal tree, the puts split the full pages */
+	for (i = MT_KEYS; i < MT_KEYS + 2000; ++i) {
+		memset(val, 'a' + i % 26, sizeof(val));
+		rc |= db_put_raw(dbh, key, mt_key(key, i), val, i % 10 ? 20 : 3000, 0);
+	}
+	rc |= bulk_check(dbh, MT_KEYS + 2000, "puts");
+	db_close(dbh);
+
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh)) {
+		puts("bulk: mmap open failed");
+		return 1;
+	}
+	rc |= bulk_check(dbh, MT_KEYS + 2000, "mmap");
+	db_close(dbh);
+
+	unlink(tmpfile);
+	return rc;
+}
+
+static int batch_check(void *dbh, int nkeys, const char *what)
+{
+	char key[16], val[64];
+	int i, len, want, rc = 0;
+
+	for (i = 0; i < nkeys; ++i) {
+		strfmt(key, sizeof(key), "%06d", i);
+		len = db_get_raw(dbh, key, 6, val, sizeof(val));
+		/* odd keys were deleted, every 4th was put twice */
+		want = i & 1 ? -1 : i % 4 ? 20 : 40;
+		if (len != want || (len > 0 && val[len - 1] != 'a' + i % 26)) {
+			printf("batch %s: key %d len %d want %d\n", what, i, len, want);
+			rc = 1;
+			break;
+		}
+	}
+	return rc;
+}
+
+static int batch_fill(void *dbh, int nkeys)
+{
+	char key[16], val[64];
+	void *batch;
+	int i, rc;
+
+	if ((rc = db_batch_begin(dbh, &batch)))
+		return rc;
+	/* Descending so the commit has to sort */
+	for (i = nkeys - 1; i >= 0; --i) {
+		strfmt(key, sizeof(key), "%06d", i);
+		memset(val, 'a' + i % 26, sizeof(val));
+		rc |= db_batch_put(batch, key, 6, val, 20);
+		if (i & 1)
+			rc |= db_batch_del(batch, key, 6);
+		else if (i % 4 == 0)
+			rc |= db_batch_put(batch, key, 6, val, 40);
+	}
+	if (rc) {
+		db_batch_abort(batch);
+		return rc;
+	}
+	return db_batch_commit(batch);
+}
+
+static int test_batch(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	void *dbh, *batch;
+	char val[8];
+	int rc = 0;
+
+	/* Big endian so the sync has to swap the pages and swap them back */
+	memset(&info, 0, sizeof(info));
+	info.lorder = DB_BIG_ENDIAN;
+	unlink(tmpfile);
+	if (db_open_info(tmpfile, DB_CREATE, &info, &dbh)) {
+		puts("batch: open failed");
+		return 1;
+	}
+
+	/* Abort leaves the db alone */
+	db_batch_begin(dbh, &batch);
+	db_batch_put(batch, "000001", 6, "x", 1);
+	db_batch_abort(batch);
+	if (db_get_raw(dbh, "000001", 6, NULL, 0) != -1) {
+		puts("batch: abort applied");
+		rc = 1;
+	}
+
+	if (batch_fill(dbh, 20000)) {
+		puts("batch: commit failed");
+		rc = 1;
+	}
+	db_stats(dbh, &stats);
+	if (stats.pagewrite == 0) {
+		puts("batch: commit did not write");
+		rc = 1;
+	}
+	rc |= batch_check(dbh, 20000, "commit");
+
+	/* The cached pages are still good after the write */
+	if (db_put(dbh, "zzz", "z", 1) || db_sync(dbh)) {
+		puts("batch: sync failed");
+		rc = 1;
+	}
+	rc |= batch_check(dbh, 20000, "after sync");
+	db_close(dbh);
+
+	if (db_open(tmpfile, O_RDONLY, &dbh)) {
+		puts("batch: reopen failed");
+		return 1;
+	}
+	rc |= batch_check(dbh, 20000, "reopen");
+	if (db_get(dbh, "zzz", val, sizeof(val)) != 1) {
+		puts("batch: zzz missing");
+		rc = 1;
+	}
+	db_close(dbh);
+
+	unlink(tmpfile);
+	return rc;
+}
+
+/* Walk a cursor checking the order, returns the count or -1 */
+static int cursor_walk(void *dbh, const char *start, const char *end, unsigned flags,
+					   const char *first)
+{
+	const void *key, *val;
+	char last[3000];
+	int n = 0, klen, len, llen = 0, rc;
+	void *c;
+
+	if (db_cursor_open(dbh, start, start ? strlen(start) : 0, end, end ? strlen(end) : 0,
+					   flags, &c))
+		return -1;
+	while ((rc = db_cursor_next(c, &key, &klen, &val, &len)) > 0) {
+		if (n == 0 && first && strncmp(key, first, strlen(first))) {
+			printf("cursor: first %.20s want %s\n", (char *)key, first);
+			n = -1;
+			break;
+		}
+		if (n > 0) {
+			int cmp = memcmp(last, key, llen < klen ? llen : klen);
+			if (cmp == 0)
+				cmp = llen - klen;
+			if ((flags & DB_CURSOR_PREV) ? cmp <= 0 : cmp >= 0) {
+				printf("cursor: %s out of order\n", (char *)key);
+				n = -1;
+				break;
+			}
+		}
+		/* The value is the first char of the key */
+		if (len < 1 || *(char *)val != *(char *)key) {
+			printf("cursor: %s bad value\n", (char *)key);
+			n = -1;
+			break;
+		}
+		memcpy(last, key, klen);
+		llen = klen;
+		++n;
+	}
+	if (rc < 0)
+		n = -1;
+	db_cursor_close(c);
+	return n;
+}
+
+static int cursor_check(void *dbh, const char *start, const char *end, unsigned flags,
+						int want, const char *first)
+{
+	unsigned long count = 0;
+	int n, rc = 0;
+
+	n = cursor_walk(dbh, start, end, flags, first);
+	if (n != want) {
+		printf("cursor %s %s %x: %d keys want %d\n", start, end, flags, n, want);
+		rc = 1;
+	}
+	if (db_count_range(dbh, start, start ? strlen(start) : 0, end, end ? strlen(end) : 0,
+					   flags, &count) || count != want) {
+		printf("count %s %s %x: %lu keys want %d\n", start, end, flags, count, want);
+		rc = 1;
+	}
+	return rc;
+}
+
+static int test_cursor(const char *tmpfile)
+{
+	char key[2500], val[3000];
+	const void *k;
+	void *dbh, *c;
+	int i, klen, rc = 0;
+
+	unlink(tmpfile);
+	if (db_open(tmpfile, DB_CREATE, &dbh)) {
+		puts("cursor: open failed");
+		return 1;
+	}
+
+	rc |= cursor_check(dbh, NULL, NULL, 0, 0, NULL);
+	rc |= cursor_check(dbh, "a", NULL, DB_CURSOR_PREFIX | DB_CURSOR_PREV, 0, NULL);
+
+	/* a/ 10000 keys, b/ 3, c/ 5000 with every 100th key and value big */
+	for (i = 0; i < 10000; ++i) {
+		strfmt(key, sizeof(key), "a/%05d", i);
+		db_put(dbh, key, "a", 1);
+	}
+	for (i = 0; i < 3; ++i) {
+		strfmt(key, sizeof(key), "b/%d", i);
+		db_put(dbh, key, "b", 1);
+	}
+	memset(val, 'c', sizeof(val));
+	for (i = 0; i < 5000; ++i) {
+		klen = strfmt(key, sizeof(key), "c/%05d", i);
+		if (i % 100 == 0) {
+			memset(key + klen, 'x', sizeof(key) - klen - 1);
+			key[sizeof(key) - 1] = 0;
+		}
+		db_put(dbh, key, val, i % 100 ? 10 : sizeof(val));
+	}
+	db_put_raw(dbh, "\xff\xff", 2, "\xff", 1, 0);
+
+	rc |= cursor_check(dbh, NULL, NULL, 0, 15004, "a/00000");
+	rc |= cursor_check(dbh, "a/", NULL, DB_CURSOR_PREFIX, 10000, "a/00000");
+	rc |= cursor_check(dbh, "a/", NULL, DB_CURSOR_PREFIX | DB_CURSOR_PREV, 10000, "a/09999");
+	rc |= cursor_check(dbh, "b", NULL, DB_CURSOR_PREFIX | DB_CURSOR_PREV, 3, "b/2");
+	rc |= cursor_check(dbh, "c/00", NULL, DB_CURSOR_PREFIX, 1000, "c/00000");
+	rc |= cursor_check(dbh, "c/", NULL, DB_CURSOR_PREFIX, 5000, NULL);
+	rc |= cursor_check(dbh, "a/01000", "a/02500", 0, 1500, "a/01000");
+	rc |= cursor_check(dbh, "a/01000", "a/02500", DB_CURSOR_PREV, 1500, "a/02499");
+	rc |= cursor_check(dbh, "a/09990", "c/00003", 0, 16, "a/09990");
+	rc |= cursor_check(dbh, "a/5", "a/4", 0, 0, NULL);
+	rc |= cursor_check(dbh, "d", NULL, DB_CURSOR_PREFIX, 0, NULL);
+	rc |= cursor_check(dbh, "b/3", NULL, 0, 5001, "c/00000");
+	rc |= cursor_check(dbh, NULL, "a/00010", DB_CURSOR_PREV, 10, "a/00009");
+
+	/* Prefix of 0xff has no end */
+	if (db_cursor_open(dbh, "\xff", 1, NULL, 0, DB_CURSOR_PREFIX, &c) ||
+		db_cursor_next(c, &k, &klen, NULL, NULL) != 1 || klen != 2 ||
+		db_cursor_next(c, &k, &klen, NULL, NULL) != 0) {
+		puts("cursor: 0xff prefix failed");
+		rc = 1;
+	}
+	db_cursor_close(c);
+
+	db_close(dbh);
+
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh)) {
+		puts("cursor: mmap open failed");
+		return 1;
+	}
+	rc |= cursor_check(dbh, "c/", NULL, DB_CURSOR_PREFIX | DB_CURSOR_PREV, 5000, NULL);
+	rc |= cursor_check(dbh, "a/00500", "b/1", 0, 9501, "a/00500");
+	db_close(dbh);
+
+	unlink(tmpfile);
+	return rc;
+}
+
+/* Copy the db and log as a crash would leave them, less cut bytes of log */
+static int wal_snap(const char *tmpfile, const char *to, int cut)
+{
+	char from_wal[256], to_wal[256];
+	struct stat sbuf;
+
+	strfmt(from_wal, sizeof(from_wal), "%s-wal", tmpfile);
+	strfmt(to_wal, sizeof(to_wal), "%s-wal", to);
+	if (copy_file(tmpfile, to) < 0 || copy_file(from_wal, to_wal) < 0 ||
+		stat(to_wal, &sbuf))
+		return 1;
+	if (cut)
+		return truncate(to_wal, sbuf.st_size - cut);
+	return 0;
+}
+
+static void wal_unlink(const char *fname)
+{
+	char wal[256];
+
+	strfmt(wal, sizeof(wal), "%s-wal", fname);
+	unlink(fname);
+	unlink(wal);
+}
+
+static int wal_puts(void *dbh, int from, int to)
+{
+	char key[16], val[100];
+	int i, rc = 0;
+
+	for (i = from; i < to; ++i) {
+		strfmt(key, sizeof(key), "%06d", i);
+		memset(val, 'a' + i % 26, sizeof(val));
+		rc |= db_put(dbh, key, val, sizeof(val));
+	}
+	return rc;
+}
+
+/* Open fname with the log and check it has exactly nkeys */
+static int wal_check(const char *fname, int nkeys, const char *what)
+{
+	char key[16], val[100];
+	unsigned long count;
+	void *dbh;
+	int i, rc = 0;
+
+	if (db_open(fname, O_RDWR | DB_WAL, &dbh)) {
+		printf("wal %s: open failed\n", what);
+		return 1;
+	}
+	if (db_count_range(dbh, NULL, 0, NULL, 0, 0, &count) || count != nkeys) {
+		printf("wal %s: %lu keys want %d\n", what, count, nkeys);
+		rc = 1;
+	}
+	for (i = 0; i < nkeys && rc == 0; ++i) {
+		strfmt(key, sizeof(key), "%06d", i);
+		if (db_get(dbh, key, val, sizeof(val)) != sizeof(val) ||
+			val[99] != 'a' + i % 26) {
+			printf("wal %s: bad key %d\n", what, i);
+			rc = 1;
+		}
+	}
+	db_close(dbh);
+	return rc;
+}
+
+static int test_wal(const char *tmpfile)
+{
+	char crash[3][256], wal[256];
+	struct db_stats before, stats;
+	struct db_info info;
+	struct stat sbuf;
+	void *dbh;
+	int i, rc = 0;
+
+	for (i = 0; i < 3; ++i) {
+		strfmt(crash[i], sizeof(crash[i]), "%s.crash%d", tmpfile, i);
+		wal_unlink(crash[i]);
+	}
+	strfmt(wal, sizeof(wal), "%s-wal", tmpfile);
+	wal_unlink(tmpfile);
+
+	/* Byte swapped so the log gets the file images */
+	memset(&info, 0, sizeof(info));
+	info.lorder = DB_BIG_ENDIAN;
+	if (db_open_info(tmpfile, DB_CREATE | DB_WAL, &info, &dbh)) {
+		puts("wal: open failed");
+		return 1;
+	}
+
+	rc |= db_stats(dbh, &before);
+	rc |= wal_puts(dbh, 0, 3000);
+	rc |= db_sync(dbh);
+	/* A big commit raises the max, the commit puts it back */
+	rc |= db_stats(dbh, &stats);
+	if (stats.maxcache != before.maxcache) {
+		printf("wal: maxcache %lu after commit, was %lu\n",
+			   stats.maxcache, before.maxcache);
+		rc = 1;
+	}
+	rc |= wal_puts(dbh, 3000, 6000);
+	rc |= db_sync(dbh);
+	/* Second commit torn */
+	rc |= wal_snap(tmpfile, crash[0], 10);
+	rc |= wal_snap(tmpfile, crash[1], 0);
+
+	/* Not committed, the file must not have any of it */
+	rc |= wal_puts(dbh, 6000, 9000);
+	rc |= wal_snap(tmpfile, crash[2], 0);
+	if (rc)
+		puts("wal: puts failed");
+
+	db_close(dbh);
+	if (stat(wal, &sbuf) || sbuf.st_size) {
+		puts("wal: log not empty after close");
+		rc = 1;
+	}
+
+	rc |= wal_check(tmpfile, 9000, "close");
+	if (db_open(tmpfile, O_RDONLY | DB_WAL, &dbh) != EINVAL) {
+		puts("wal: read only open worked");
+		rc = 1;
+	}
+	rc |= wal_check(crash[0], 3000, "torn");
+	rc |= wal_check(crash[1], 6000, "crash");
+	rc |= wal_check(crash[2], 6000, "uncommitted");
+
+	/* A truncate throws away the log */
+	rc |= wal_snap(crash[2], crash[0], 0);
+	if (db_open(crash[0], DB_CREATE | O_TRUNC | DB_WAL, &dbh) == 0)
+		db_close(dbh);
+	rc |= wal_check(crash[0], 0, "truncate");
+
+	for (i = 0; i < 3; ++i)
+		wal_unlink(crash[i]);
+	wal_unlink(tmpfile);
+	return rc;
+}
+
+static void bloom_unlink(const char *fname)
+{
+	char bloom[256];
+
+	strfmt(bloom, sizeof(bloom), "%s-bloom", fname);
+	unlink(fname);
+	unlink(bloom);
+}
+
+/* Every even key from 0 to 2 * nkeys is there, no odd key is */
+static int bloom_check(void *dbh, int nkeys, const char *what)
+{
+	char key[16], val[8];
+	int i;
+
+	for (i = 0; i < nkeys * 2; ++i) {
+		strfmt(key, sizeof(key), "%07d", i);
+		if (db_get(dbh, key, val, sizeof(val)) != (i & 1 ? -1 : 4) ||
+			db_peek(dbh, key) != (i & 1)) {
+			printf("bloom %s: key %d wrong\n", what, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int test_bloom(const char *tmpfile)
+{
+	char key[16], bloom[256];
+	struct db_info info;
+	struct stat sbuf;
+	void *dbh;
+	int i, rc = 0;
+
+	strfmt(bloom, sizeof(bloom), "%s-bloom", tmpfile);
+	bloom_unlink(tmpfile);
+
+	/* Grows past the first build */
+	memset(&info, 0, sizeof(info));
+	info.bloombits = 8;
+	if (db_open_info(tmpfile, DB_CREATE | DB_BLOOM, &info, &dbh)) {
+		puts("bloom: open failed");
+		return 1;
+	}
+	for (i = 0; i < 20000; i += 2) {
+		strfmt(key, sizeof(key), "%07d", i);
+		rc |= db_put(dbh, key, "val", 4);
+	}
+	rc |= bloom_check(dbh, 10000, "put");
+	if (db_del(dbh, "0000001") != 1 || db_del(dbh, "0000000")) {
+		puts("bloom: delete failed");
+		rc = 1;
+	}
+	rc |= db_put(dbh, "0000000", "val", 4);
+	rc |= bloom_check(dbh, 10000, "delete");
+	db_close(dbh);
+	if (stat(bloom, &sbuf)) {
+		puts("bloom: no filter file");
+		rc = 1;
+	}
+
+	/* Loaded, then read only and mapped */
+	if (db_open(tmpfile, O_RDWR | DB_BLOOM, &dbh) == 0) {
+		rc |= bloom_check(dbh, 10000, "reopen");
+		db_close(dbh);
+	} else
+		rc = 1;
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP | DB_BLOOM, &dbh) == 0) {
+		rc |= bloom_check(dbh, 10000, "mmap");
+		db_close(dbh);
+	} else
+		rc = 1;
+
+	/* Changed behind its back, the filter must be rebuilt */
+	if (db_open(tmpfile, O_RDWR, &dbh) == 0) {
+		for (i = 20000; i < 24000; i += 2) {
+			strfmt(key, sizeof(key), "%07d", i);
+			rc |= db_put(dbh, key, "val", 4);
+		}
+		db_close(dbh);
+	} else
+		rc = 1;
+	if (db_open(tmpfile, O_RDWR | DB_BLOOM, &dbh) == 0) {
+		rc |= bloom_check(dbh, 12000, "stale");
+		db_close(dbh);
+	} else
+		rc = 1;
+
+	/* In memory */
+	if (db_open(NULL, DB_CREATE | DB_BLOOM, &dbh) == 0) {
+		for (i = 0; i < 2000; i += 2) {
+			strfmt(key, sizeof(key), "%07d", i);
+			rc |= db_put(dbh, key, "val", 4);
+		}
+		rc |= bloom_check(dbh, 1000, "memory");
+		db_close(dbh);
+	} else
+		rc = 1;
+
+	info.bloombits = 65;
+	if (db_open_info(tmpfile, O_RDWR | DB_BLOOM, &info, &dbh) != EINVAL) {
+		puts("bloom: 65 bits per key worked");
+		rc = 1;
+	}
+
+	bloom_unlink(tmpfile);
+	return rc;
+}
+
+#define PFX_NKEYS 20000
+
+/* Keys with long shared prefixes, like paths, and some big keys. The
+ * keys are in order of i. Returns the length with the nul.
+ */
+static int pfx_key(char *key, int i)
+{
+	int len = strfmt(key, 64, "/usr/share/doc/package-%04d/changelog.%05d", i / 50, i);
+
+	if (i % 97 == 0) {
+		memset(key + len, 'x', 600);
+		len += 600;
+		key[len] = 0;
+	}
+	return len + 1;
+}
+
+/* Every key i with i % del != 1 is there with value i */
+static int pfx_check(void *dbh, int del, const char *what)
+{
+	char key[700], last[700], val[16];
+	const void *k;
+	int i, n, len, klen, lastlen = 0, want = 0;
+	void *c;
+
+	for (i = 0; i < PFX_NKEYS; ++i) {
+		len = pfx_key(key, i);
+		n = db_get_raw(dbh, key, len, val, sizeof(val) - 1);
+		if (del && i % del == 1) {
+			if (n != -1) {
+				printf("prefix %s: deleted key %d found\n", what, i);
+				return 1;
+			}
+			continue;
+		}
+		++want;
+		if (n < 0 || (val[n] = 0, strtol(val, NULL, 10) != i)) {
+			printf("prefix %s: key %d got %d\n", what, i, n);
+			return 1;
+		}
+	}
+
+	/* In order, and each key is whole */
+	if (db_cursor_open(dbh, NULL, 0, NULL, 0, 0, &c))
+		return 1;
+	for (n = 0; db_cursor_next(c, &k, &klen, NULL, NULL) > 0; ++n) {
+		if (klen < 40 || klen >= sizeof(key) || memcmp(k, "/usr/share/doc/package-", 23) ||
+			(n && memcmp(last, k, klen < lastlen ? klen : lastlen) >= 0)) {
+			printf("prefix %s: cursor key %d wrong\n", what, n);
+			db_cursor_close(c);
+			return 1;
+		}
+		memcpy(last, k, klen);
+		lastlen = klen;
+	}
+	db_cursor_close(c);
+	if (n != want) {
+		printf("prefix %s: cursor saw %d of %d\n", what, n, want);
+		return 1;
+	}
+	return 0;
+}
+
+/* All the keys in a scattered order */
+static int pfx_puts(void *dbh)
+{
+	char key[700], val[16];
+	int i, j, rc = 0;
+
+	for (j = 0; j < PFX_NKEYS; ++j) {
+		i = (int)((j * 7919L) % PFX_NKEYS);
+		pfx_key(key, i);
+		rc |= db_put(dbh, key, val, strfmt(val, sizeof(val), "%d", i));
+	}
+	return rc;
+}
+
+/* Flip a bit in the file, twice puts it back */
+static void pfx_flip(const char *fname, off_t off)
+{
+	char c;
+	int fd = open(fname, O_RDWR);
+
+	if (fd >= 0 && pread(fd, &c, 1, off) == 1) {
+		c ^= 0x10;
+		if (pwrite(fd, &c, 1, off) != 1)
+			puts("prefix: flip failed");
+	}
+	close(fd);
+}
+
+static int test_prefix(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	unsigned long npages[3];
+	char key[700], val[16];
+	void *dbh;
+	int i, v, len, rc = 0;
+
+	memset(&info, 0, sizeof(info));
+	info.psize = 1024;
+	info.cachesize = 16 * 1024; /* lots of page ins and outs */
+
+	info.version = 5;
+	if (db_open_info(tmpfile, DB_CREATE | O_TRUNC, &info, &dbh) != EINVAL) {
+		puts("prefix: version 5 accepted");
+		rc = 1;
+	}
+
+	/* The same keys without and with, byte swapped for the checksums */
+	for (v = 3; v <= 4; ++v) {
+		info.version = v;
+		info.lorder = v == 4 ? DB_BIG_ENDIAN : 0;
+		if (db_open_info(tmpfile, DB_CREATE | O_TRUNC, &info, &dbh)) {
+			printf("prefix: version %d open failed\n", v);
+			return 1;
+		}
+		if (pfx_puts(dbh)) {
+			printf("prefix: version %d puts failed\n", v);
+			rc = 1;
+		}
+		rc |= pfx_check(dbh, 0, v == 3 ? "v3" : "put");
+		db_stats(dbh, &stats);
+		npages[v - 3] = stats.npages;
+		db_close(dbh);
+	}
+	if (npages[1] * 4 > npages[0] * 3) {
+		printf("prefix: %lu pages, %lu without\n", npages[1], npages[0]);
+		rc = 1;
+	}
+
+	/* The format comes from the file, then deletes and puts back */
+	if (db_open(tmpfile, O_RDWR, &dbh)) {
+		puts("prefix: reopen failed");
+		return 1;
+	}
+	for (i = 1; i < PFX_NKEYS; i += 3) {
+		pfx_key(key, i);
+		rc |= db_del(dbh, key);
+	}
+	rc |= pfx_check(dbh, 3, "delete");
+	rc |= pfx_puts(dbh);
+	rc |= pfx_check(dbh, 0, "put back");
+	db_close(dbh);
+
+	/* A bad root page is EIO, a bad meta page fails the open */
+	pfx_flip(tmpfile, info.psize + 100);
+	if (db_open(tmpfile, O_RDONLY, &dbh) == 0) {
+		len = pfx_key(key, 42);
+		errno = 0;
+		if (db_get_raw(dbh, key, len, val, sizeof(val)) != -1 || errno != EIO) {
+			puts("prefix: bad page not caught");
+			rc = 1;
+		}
+		db_close(dbh);
+	} else
+		rc = 1;
+	pfx_flip(tmpfile, info.psize + 100);
+	pfx_flip(tmpfile, 10);
+	if (db_open(tmpfile, O_RDONLY, &dbh) != EIO) {
+		puts("prefix: bad meta page not caught");
+		rc = 1;
+	}
+	pfx_flip(tmpfile, 10);
+	if (db_open(tmpfile, O_RDONLY, &dbh) == 0) {
+		rc |= pfx_check(dbh, 0, "fixed");
+		db_close(dbh);
+	} else
+		rc = 1;
+
+	/* Bulk loaded and mapped */
+	info.lorder = 0;
+	if (db_bulk_open(tmpfile, &info, 0, &dbh) == 0) {
+		for (i = 0; i < PFX_NKEYS; ++i) {
+			len = pfx_key(key, i);
+			rc |= db_bulk_put(dbh, key, len, val, strfmt(val, sizeof(val), "%d", i));
+		}
+		rc |= db_bulk_close(dbh);
+	} else
+		rc = 1;
+	if (db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh) == 0) {
+		rc |= pfx_check(dbh, 0, "bulk");
+		db_stats(dbh, &stats);
+		npages[2] = stats.npages;
+		db_close(dbh);
+		if (npages[2] > npages[1]) {
+			printf("prefix: bulk %lu pages, puts %lu\n", npages[2], npages[1]);
+			rc = 1;
+		}
+	} else
+		rc = 1;
+
+	/* In memory */
+	if (db_open_info(NULL, DB_CREATE, &info, &dbh) == 0) {
+		rc |= pfx_puts(dbh);
+		rc |= pfx_check(dbh, 0, "memory");
+		db_close(dbh);
+	} else
+		rc = 1;
+
+	unlink(tmpfile);
+	return rc;
+}
+
+#ifndef TESTALL
+/* Random gets against a tree bigger than most of the caches */
+static void bench_cache(const char *tmpfile)
+{
+	static const unsigned sizes[] = {
+		0, 64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20, 64 << 20
+	};
+	struct db_info info;
+	struct db_stats stats;
+	struct timeval start;
+	char key[32], val[64];
+	unsigned long delta;
+	void *dbh;
+	int i, s, nkeys = 200000;
+
+	unlink(tmpfile);
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 16 << 20;
+	if (db_open_info(tmpfile, DB_CREATE, &info, &dbh)) {
+		puts("bench open failed");
+		return;
+	}
+	memset(val, 'v', sizeof(val));
+	for (i = 0; i < nkeys; ++i) {
+		strfmt(key, sizeof(key), "%08x", (unsigned)(i * 2654435761u));
+		db_put(dbh, key, val, sizeof(val));
+	}
+	db_stats(dbh, &stats);
+	printf("%d keys, %lu pages of %lu\n", nkeys, stats.npages, stats.psize);
+	db_close(dbh);
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+		info.cachesize = sizes[s];
+		if (db_open_info(tmpfile, DB_CREATE, &info, &dbh)) {
+			puts("bench open failed");
+			return;
+		}
+
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nkeys; ++i) {
+			unsigned n = xorshift128plus() % nkeys;
+
+			strfmt(key, sizeof(key), "%08x", (unsigned)(n * 2654435761u));
+			db_get(dbh, key, val, sizeof(val));
+		}
+		delta = delta_timeval_now(&start);
+
+		db_stats(dbh, &stats);
+		printf("cache %6uK: %.2fus/get %5.1f%% hits %lu reads\n",
+			   sizes[s] >> 10, (double)delta / nkeys,
+			   stats.cachehit * 100.0 / (stats.cachehit + stats.cachemiss),
+			   stats.pageread);
+		db_close(dbh);
+	}
+
+	unlink(tmpfile);
+}
+/* Lookup only, copying gets vs in place */
+static void bench_mmap(const char *tmpfile)
+{
+	struct db_info info;
+	struct timeval start;
+	char key[32], val[64];
+	const void *ptr;
+	unsigned long delta;
+	void *dbh;
+	int i, nkeys = 200000;
+
+	unlink(tmpfile);
+	if (db_open(tmpfile, DB_CREATE, &dbh)) {
+		puts("bench open failed");
+		return;
+	}
+	memset(val, 'v', sizeof(val));
+	for (i = 0; i < nkeys; ++i) {
+		strfmt(key, sizeof(key), "%08x", (unsigned)(i * 2654435761u));
+		db_put(dbh, key, val, sizeof(val));
+	}
+	db_close(dbh);
+
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 64 << 20;
+	db_open_info(tmpfile, O_RDONLY, &info, &dbh);
+	for (int pass = 0; pass < 2; ++pass) {
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nkeys; ++i) {
+			unsigned n = xorshift128plus() % nkeys;
+
+			strfmt(key, sizeof(key), "%08x", (unsigned)(n * 2654435761u));
+			db_get(dbh, key, val, sizeof(val));
+		}
+		delta = delta_timeval_now(&start);
+	}
+	printf("mpool 64M get  %.2fus\n", (double)delta / nkeys);
+	db_close(dbh);
+
+	db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh);
+	for (int pass = 0; pass < 2; ++pass) {
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nkeys; ++i) {
+			unsigned n = xorshift128plus() % nkeys;
+
+			strfmt(key, sizeof(key), "%08x", (unsigned)(n * 2654435761u));
+			db_get_ptr(dbh, key, strlen(key) + 1, &ptr);
+		}
+		delta = delta_timeval_now(&start);
+	}
+	printf("mmap get_ptr   %.2fus\n", (double)delta / nkeys);
+	db_close(dbh);
+
+	unlink(tmpfile);
+}
+/* Total gets per second from one mapped handle */
+static void bench_mt(const char *tmpfile)
+{
+	unsigned long usecs;
+	void *dbh;
+	int n;
+
+	mt_create(tmpfile);
+	db_open(tmpfile, O_RDONLY | DB_MMAP, &dbh);
+	for (n = 1; n <= 16; n *= 2) {
+		if (mt_run(dbh, n, 200000, &usecs))
+			puts("mt: errors");
+		printf("%2d threads %5.2fM gets/sec\n", n, n * 200000.0 / usecs);
+	}
+	db_close(dbh);
+	unlink(tmpfile);
+}
+/* Sorted load, puts vs bulk */
+static void bench_bulk(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	struct timeval start;
+	char key[32], val[64];
+	unsigned long delta;
+	void *dbh;
+	int i, len, nkeys = 1000000;
+
+	memset(val, 'v', sizeof(val));
+
+	unlink(tmpfile);
+	gettimeofday(&start, NULL);
+	db_open(tmpfile, DB_CREATE, &dbh);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%010d", i);
+		db_put_raw(dbh, key, len, val, sizeof(val), 0);
+	}
+	db_stats(dbh, &stats);
+	db_close(dbh);
+	delta = delta_timeval_now(&start);
+	printf("sorted puts  %.2fus/key %lu pages\n", (double)delta / nkeys, stats.npages);
+
+	/* Rebuilding from unsorted keys */
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 128 << 20;
+	unlink(tmpfile);
+	gettimeofday(&start, NULL);
+	db_open_info(tmpfile, DB_CREATE, &info, &dbh);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%010d", (int)((i * 7919L) % nkeys));
+		db_put_raw(dbh, key, len, val, sizeof(val), 0);
+	}
+	db_stats(dbh, &stats);
+	db_close(dbh);
+	delta = delta_timeval_now(&start);
+	printf("random puts  %.2fus/key %lu pages\n", (double)delta / nkeys, stats.npages);
+
+	gettimeofday(&start, NULL);
+	db_bulk_open(tmpfile, NULL, 0, &dbh);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%010d", i);
+		db_bulk_put(dbh, key, len, val, sizeof(val));
+	}
+	db_bulk_close(dbh);
+	delta = delta_timeval_now(&start);
+	db_open(tmpfile, O_RDONLY, &dbh);
+	db_stats(dbh, &stats);
+	db_close(dbh);
+	printf("bulk         %.2fus/key %lu pages\n", (double)delta / nkeys, stats.npages);
+
+	unlink(tmpfile);
+}
+/* A sync per put vs one sync per batch */
+static void bench_batch(const char *tmpfile)
+{
+	struct db_stats stats;
+	struct timeval start;
+	char key[32], val[64];
+	unsigned long delta;
+	void *dbh, *batch;
+	int i, j, len, nkeys = 2000, nbatch = 10000;
+
+	memset(val, 'v', sizeof(val));
+
+	unlink(tmpfile);
+	db_open(tmpfile, DB_CREATE, &dbh);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%010d", (int)((i * 7919L) % nkeys));
+		db_put_raw(dbh, key, len, val, sizeof(val), 0);
+		db_sync(dbh);
+	}
+	delta = delta_timeval_now(&start);
+	db_stats(dbh, &stats);
+	db_close(dbh);
+	printf("put+sync     %.2fus/key %.2f writes/key\n",
+		   (double)delta / nkeys, (double)stats.pagewrite / nkeys);
+
+	unlink(tmpfile);
+	db_open(tmpfile, DB_CREATE, &dbh);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 10; ++i) {
+		db_batch_begin(dbh, &batch);
+		for (j = 0; j < nbatch; ++j) {
+			len = strfmt(key, sizeof(key), "%010d", (int)((j * 7919L + i) % (nbatch * 10)));
+			db_batch_put(batch, key, len, val, sizeof(val));
+		}
+		db_batch_commit(batch);
+	}
+	delta = delta_timeval_now(&start);
+	db_stats(dbh, &stats);
+	db_close(dbh);
+	printf("batch        %.2fus/key %.2f writes/key\n",
+		   (double)delta / (nbatch * 10), (double)stats.pagewrite / (nbatch * 10));
+
+	unlink(tmpfile);
+}
+/* Prefix scan and count vs walking the whole db */
+static void bench_cursor(const char *tmpfile)
+{
+	struct timeval start;
+	unsigned long count = 0;
+	unsigned long delta;
+	char key[32];
+	const void *k;
+	void *dbh, *c;
+	int i, klen, len, nkeys = 1000000;
+
+	unlink(tmpfile);
+	db_bulk_open(tmpfile, NULL, 0, &dbh);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%03d/%06d", i / 10000, i);
+		db_bulk_put(dbh, key, len + 1, "value", 6);
+	}
+	db_bulk_close(dbh);
+	db_open(tmpfile, O_RDONLY, &dbh);
+
+	bulk_walk_n = 0;
+	gettimeofday(&start, NULL);
+	db_walk(dbh, bulk_walk);
+	delta = delta_timeval_now(&start);
+	printf("walk all     %6luus %d keys\n", delta, bulk_walk_n);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 100; ++i) {
+		len = strfmt(key, sizeof(key), "%03d/", i);
+		db_cursor_open(dbh, key, len, NULL, 0, DB_CURSOR_PREFIX, &c);
+		while (db_cursor_next(c, &k, &klen, NULL, NULL) > 0)
+			++count;
+		db_cursor_close(c);
+	}
+	delta = delta_timeval_now(&start);
+	printf("cursor       %6.1fus/prefix %lu keys\n", delta / 100.0, count / 100);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 100; ++i) {
+		len = strfmt(key, sizeof(key), "%03d/", i);
+		db_count_range(dbh, key, len, NULL, 0, DB_CURSOR_PREFIX, &count);
+	}
+	delta = delta_timeval_now(&start);
+	printf("count        %6.1fus/prefix %lu keys\n", delta / 100.0, count);
+
+	db_close(dbh);
+	unlink(tmpfile);
+}
+/* Commits of 100 scattered puts, in place vs the log */
+static void bench_wal(const char *tmpfile)
+{
+	struct db_info info;
+	struct timeval start;
+	char key[32], val[64];
+	unsigned long delta;
+	void *dbh;
+	int i, j, w, len, nkeys = 200000;
+
+	memset(val, 'v', sizeof(val));
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 64 << 20;
+
+	for (w = 0; w < 2; ++w) {
+		wal_unlink(tmpfile);
+		db_bulk_open(tmpfile, NULL, 0, &dbh);
+		for (i = 0; i < nkeys; ++i) {
+			len = strfmt(key, sizeof(key), "%010d", i);
+			db_bulk_put(dbh, key, len, val, sizeof(val));
+		}
+		db_bulk_close(dbh);
+
+		db_open_info(tmpfile, O_RDWR | (w ? DB_WAL : 0), &info, &dbh);
+		gettimeofday(&start, NULL);
+		for (j = 0; j < 200; ++j) {
+			for (i = 0; i < 100; ++i) {
+				len = strfmt(key, sizeof(key), "%010d",
+							 (int)(((j * 100 + i) * 7919L) % nkeys));
+				db_put_raw(dbh, key, len, val, 60, 0);
+			}
+			db_sync(dbh);
+		}
+		delta = delta_timeval_now(&start);
+		db_close(dbh);
+		printf("%s %.0fus/commit of 100 puts\n", w ? "wal     " : "in place", delta / 200.0);
+	}
+
+	wal_unlink(tmpfile);
+}
+
+/* Gets of missing keys with and without the filter */
+static void bench_bloom(const char *tmpfile)
+{
+	struct db_info info;
+	struct timeval start;
+	char key[32], val[64];
+	unsigned long delta;
+	void *dbh;
+	int i, b, len, found, nkeys = 1000000;
+
+	memset(val, 'v', sizeof(val));
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 4 << 20;
+
+	bloom_unlink(tmpfile);
+	db_bulk_open(tmpfile, NULL, 0, &dbh);
+	for (i = 0; i < nkeys; ++i) {
+		len = strfmt(key, sizeof(key), "%010d", i * 2);
+		db_bulk_put(dbh, key, len, val, sizeof(val));
+	}
+	db_bulk_close(dbh);
+
+	for (b = 0; b < 2; ++b) {
+		db_open_info(tmpfile, O_RDONLY | (b ? DB_BLOOM : 0), &info, &dbh);
+		found = 0;
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nkeys; ++i) {
+			len = strfmt(key, sizeof(key), "%010d",
+						 (int)((i * 7919L) % nkeys) * 2 + 1);
+			if (db_get_raw(dbh, key, len, val, sizeof(val)) > 0)
+				++found;
+		}
+		delta = delta_timeval_now(&start);
+		db_close(dbh);
+		printf("%s %.0fns/miss%s\n", b ? "bloom   " : "no bloom",
+			   delta * 1000.0 / nkeys, found ? " FOUND" : "");
+	}
+
+	bloom_unlink(tmpfile);
+}
+
+/* Pages and random gets for path like keys */
+static void bench_prefix(const char *tmpfile)
+{
+	struct db_info info;
+	struct db_stats stats;
+	struct timeval start;
+	char key[64], val[16];
+	unsigned long delta;
+	void *dbh;
+	int i, v, len, nkeys = 1000000;
+
+	memset(&info, 0, sizeof(info));
+	info.cachesize = 4 << 20;
+
+	for (v = 3; v <= 4; ++v) {
+		info.version = v;
+		db_bulk_open(tmpfile, &info, 0, &dbh);
+		for (i = 0; i < nkeys; ++i) {
+			len = strfmt(key, sizeof(key), "/home/user/src/project%03d/file%07d.c", i / 5000, i);
+			db_bulk_put(dbh, key, len, val, strfmt(val, sizeof(val), "%d", i));
+		}
+		db_bulk_close(dbh);
+
+		db_open_info(tmpfile, O_RDONLY, &info, &dbh);
+		gettimeofday(&start, NULL);
+		for (i = 0; i < nkeys; ++i) {
+			int k = (int)((i * 7919L) % nkeys);
+			len = strfmt(key, sizeof(key), "/home/user/src/project%03d/file%07d.c", k / 5000, k);
+			db_get_raw(dbh, key, len, val, sizeof(val));
+		}
+		delta = delta_timeval_now(&start);
+		db_stats(dbh, &stats);
+		db_close(dbh);
+		printf("version %d %6lu pages %.0fns/get\n", v, stats.npages,
+			   delta * 1000.0 / nkeys);
+	}
+
+	unlink(tmpfile);
+}
+#endif
+
 #ifdef TESTALL
 int db_main(void)
 #else
@@ -69,6 +1626,30 @@ int main(int argc, char *argv[])
 
 	db_close(NULL);
 
+	rc |= test_info(tmpfile);
+	rc |= test_evict(tmpfile);
+	rc |= test_mmap(tmpfile);
+	rc |= test_mmap_limit(tmpfile);
+	rc |= test_mt(tmpfile);
+	rc |= test_bulk(tmpfile);
+	rc |= test_batch(tmpfile);
+	rc |= test_cursor(tmpfile);
+	rc |= test_wal(tmpfile);
+	rc |= test_bloom(tmpfile);
+	rc |= test_prefix(tmpfile);
+
+#ifndef TESTALL
+	bench_cache(tmpfile);
+	bench_mmap(tmpfile);
+	bench_mt(tmpfile);
+	bench_bulk(tmpfile);
+	bench_batch(tmpfile);
+	bench_cursor(tmpfile);
+	bench_wal(tmpfile);
+	bench_bloom(tmpfile);
+	bench_prefix(tmpfile);
+#endif
+
 	unlink(tmpfile);
 	free(tmpfile);
 
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "../samlib.h"
+
+static const char *cmd_expected[] = { "one", "two", "", "four" };
+
+static int cur_line;
+
+static int cmd_line(char *line, void *data)
+{
+	if (cur_line >= 4 || strcmp(line, cmd_expected[cur_line])) {
+		printf("readcmd: line %d '%s'\n", cur_line, line);
+		return 1;
+	}
+	++cur_line;
+	return 0;
+}
+
+static int cmd_span(char *line, int len, void *data)
+{
+	if (cur_line >= 4 || strcmp(line, cmd_expected[cur_line]) ||
+		len != strlen(cmd_expected[cur_line])) {
+		printf("readcmd_argv: line %d '%s' %d\n", cur_line, line, len);
+		return 1;
+	}
+	++cur_line;
+	return 0;
+}
+
+static int cmd_stop(char *line, int len, void *data)
+{
+	return 1;
+}
+
+static int cmd_count(char *line, int len, void *data)
+{
+	++*(int *)data;
+	return 0;
+}
+
+static int test_multi(void)
+{
+	char *seq_cmd[] = { "seq", "1", "10000", NULL };
+	char *printf_cmd[] = { "printf", "one\ntwo\n\nfour", NULL };
+	char *false_cmd[] = { "false", NULL };
+	char *bogus_cmd[] = { "/does/not/exist", NULL };
+	struct readcmd_job jobs[8];
+	int counts[8];
+	int i, rc = 0;
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < 8; ++i) {
+		counts[i] = 0;
+		jobs[i].line_func = cmd_count;
+		jobs[i].data = &counts[i];
+		jobs[i].argv = (i & 1) ? seq_cmd : printf_cmd;
+	}
+	jobs[5].argv = false_cmd;
+	jobs[6].argv = bogus_cmd;
+
+	/* Limit to 3 so we reuse slots */
+	if (readcmd_multi(jobs, 8, 3)) {
+		printf("readcmd_multi failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < 8; ++i) {
+		int expect_count = (i & 1) ? 10000 : 4;
+		int expect_status = 0;
+
+		if (i == 5) {
+			expect_count = 0;
+			expect_status = 1;
+		} else if (i == 6) {
+			expect_count = 0;
+			if (jobs[i].status == 127)
+				expect_status = 127; /* older libcs */
+			else
+				expect_status = -1;
+		}
+
+		if (counts[i] != expect_count || jobs[i].status != expect_status) {
+			printf("readcmd_multi job %d: count %d status %d\n",
+				   i, counts[i], jobs[i].status);
+			rc = 1;
+		}
+	}
+
+	return rc;
+}
+
+/* More jobs than the fd limit allows at once all still run */
+static int test_multi_limit(void)
+{
+	char *cmd[] = { "echo", "hi", NULL };
+	struct readcmd_job jobs[12];
+	struct rlimit old, rl;
+	int i, n, rc = 0, counts[12];
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < 12; ++i) {
+		jobs[i].argv = cmd;
+		jobs[i].line_func = cmd_count;
+		jobs[i].data = &counts[i];
+		counts[i] = 0;
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &old))
+		return 0;
+	rl = old;
+	rl.rlim_cur = 8;
+	if (setrlimit(RLIMIT_NOFILE, &rl))
+		return 0;
+	n = readcmd_multi(jobs, 12, 0);
+	setrlimit(RLIMIT_NOFILE, &old);
+
+	if (n) {
+		printf("readcmd_multi fd limit: %d errno %d\n", n, errno);
+		return 1;
+	}
+	for (i = 0; i < 12; ++i)
+		if (jobs[i].status || counts[i] != 1) {
+			printf("readcmd_multi fd limit job %d: status %d err %d count %d\n",
+				   i, jobs[i].status, jobs[i].err, counts[i]);
+			rc = 1;
+		}
+
+	return rc;
+}
+
+#ifndef TESTALL
+static int cmd_null_line(char *line, void *data) { return 0; }
+static int cmd_null_span(char *line, int len, void *data) { return 0; }
+
+static void benchmark(void)
+{
+	char *argv[] = { "/bin/echo", "hello", NULL };
+	struct timeval start;
+	unsigned long delta;
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; ++i)
+		readcmd(cmd_null_line, NULL, "/bin/echo hello");
+	delta = delta_timeval_now(&start);
+	printf("popen  %luus (%luus per cmd)\n", delta, delta / 1000);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000; ++i)
+		readcmd_argv(cmd_null_span, NULL, argv);
+	delta = delta_timeval_now(&start);
+	printf("spawn  %luus (%luus per cmd)\n", delta, delta / 1000);
+
+	char *sleep_cmd[] = { "sleep", "0.1", NULL };
+	struct readcmd_job jobs[20];
+
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < 20; ++i) {
+		jobs[i].argv = sleep_cmd;
+		jobs[i].line_func = cmd_null_span;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20; ++i)
+		readcmd_argv(cmd_null_span, NULL, sleep_cmd);
+	delta = delta_timeval_now(&start);
+	printf("serial %luus for 20 sleeps\n", delta);
+
+	gettimeofday(&start, NULL);
+	readcmd_multi(jobs, 20, 0);
+	delta = delta_timeval_now(&start);
+	printf("multi  %luus for 20 sleeps\n", delta);
+}
+#endif
+
+#ifdef TESTALL
+int readcmd_main(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	char *cmd[] = { "printf", "one\\ntwo\\n\\nfour", NULL };
+	char *false_cmd[] = { "false", NULL };
+	char *bogus_cmd[] = { "/does/not/exist", NULL };
+	int rc = 0, n;
+
+	cur_line = 0;
+	n = readcmd(cmd_line, NULL, "printf 'one\\ntwo\\n\\nfour'");
+	if (n || cur_line != 4) {
+		printf("readcmd failed: %d lines %d\n", n, cur_line);
+		rc = 1;
+	}
+
+	cur_line = 0;
+	n = readcmd_argv(cmd_span, NULL, cmd);
+	if (n || cur_line != 4) {
+		printf("readcmd_argv failed: %d lines %d\n", n, cur_line);
+		rc = 1;
+	}
+
+	n = readcmd_argv(cmd_stop, NULL, cmd);
+	if (n != -1 || errno != EINTR) {
+		printf("readcmd_argv stop: %d\n", n);
+		rc = 1;
+	}
+
+	n = readcmd_argv(cmd_span, NULL, false_cmd);
+	if (n != 1) {
+		printf("readcmd_argv false: %d\n", n);
+		rc = 1;
+	}
+
+	/* Older libcs report the exec failure as exit status 127 */
+	n = readcmd_argv(cmd_span, NULL, bogus_cmd);
+	if (n != -1 && n != 127) {
+		printf("readcmd_argv bogus command did not fail\n");
+		rc = 1;
+	}
+
+	if (do_system_argv(false_cmd) != 1) {
+		printf("do_system_argv false failed\n");
+		rc = 1;
+	}
+
+	rc |= test_multi();
+	rc |= test_multi_limit();
+
+#ifndef TESTALL
+	benchmark();
+#endif
+
+	return rc;
+}
@@ -0,0 +1,72 @@
+/* Build strfmt.c the way an editor embeds it: with -DBUFFERED and
+ * without samlib.h, writing into the embedder's own buffer.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct buff {
+	char text[256];
+	int len;
+};
+
+static void binsert(struct buff *buff, char c)
+{
+	if (buff->len < sizeof(buff->text) - 1)
+		buff->text[buff->len++] = c;
+}
+
+#define BUFFERED
+#include "../strfmt.c"
+
+static int bfmt(struct buff *buff, const char *fmt, ...)
+{
+	struct outbuff out = { .buff = buff };
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = __strfmt(&out, fmt, ap);
+	va_end(ap);
+	buff->text[buff->len] = 0;
+	return n;
+}
+
+static int check(const char *fmt, const char *expected, int n)
+{
+	if (n != strlen(expected)) {
+		printf("%s: n %d expected %d\n", fmt, n, (int)strlen(expected));
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct buff buff = { .len = 0 };
+	char str[64], num[32];
+	int rc = 0, n;
+
+	n = bfmt(&buff, "%s=%d %5u|%-4x|%ld", "a", -42, 7u, 0xbeef, -9223372036854775807L - 1);
+	rc |= check("bfmt", "a=-42     7|beef|-9223372036854775808", n);
+	if (strcmp(buff.text, "a=-42     7|beef|-9223372036854775808")) {
+		printf("buff '%s'\n", buff.text);
+		rc = 1;
+	}
+
+	n = strfmt(str, sizeof(str), "%03d%c", 5, '!');
+	rc |= check("strfmt", "005!", n);
+	if (strcmp(str, "005!")) {
+		printf("strfmt '%s'\n", str);
+		rc = 1;
+	}
+
+	int2str(-123, num);
+	if (strcmp(num, "-123")) {
+		printf("int2str '%s'\n", num);
+		rc = 1;
+	}
+
+	return rc;
+}
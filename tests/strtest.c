@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <assert.h>
+#include <limits.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <fcntl.h>
 #include "../samlib.h"
 
 #define STR "hello world"
@@ -237,6 +241,480 @@ static void test_strfmt(void)
 #endif
 }
 
+static int check_num(long val)
+{
+	char str1[32], str2[32];
+	int rc = 0;
+
+	snprintf(str2, sizeof(str2), "%ld", val);
+	if (strcmp(int2str(val, str1), str2) ||
+		_int2str(val, str1) != str1 + strlen(str2)) {
+		printf("int2str %s != %s\n", str1, str2);
+		rc = 1;
+	}
+
+	snprintf(str2, sizeof(str2), "%lu", (unsigned long)val);
+	if (strcmp(uint2str(val, str1), str2) ||
+		_uint2str(val, str1) != str1 + strlen(str2)) {
+		printf("uint2str %s != %s\n", str1, str2);
+		rc = 1;
+	}
+
+	snprintf(str2, sizeof(str2), "%lx", (unsigned long)val);
+	if (strcmp(hex2str(val, str1), str2) ||
+		_hex2str(val, str1) != str1 + strlen(str2)) {
+		printf("hex2str %s != %s\n", str1, str2);
+		rc = 1;
+	}
+
+	return rc;
+}
+
+static int test_int2str(void)
+{
+	unsigned long p;
+	int i, rc = 0;
+
+	rc |= check_num(0);
+	rc |= check_num(LONG_MAX);
+	rc |= check_num(LONG_MIN);
+	rc |= check_num(-1);
+
+	/* Every digit count boundary */
+	for (p = 1; p <= ULONG_MAX / 10; p *= 10) {
+		rc |= check_num(p - 1);
+		rc |= check_num(p);
+		rc |= check_num(p + 1);
+		rc |= check_num(-(long)p);
+	}
+	for (i = 0; i < 64; ++i)
+		rc |= check_num(1L << i);
+
+	for (i = 0; i < 100000; ++i)
+		rc |= check_num(xorshift128plus() >> (i & 63));
+
+	return rc;
+}
+
+#ifdef WANT_FLOATS
+static int check_float(const char *fmt, double val)
+{
+	char str1[1024], str2[1024];
+	int n1, n2;
+
+	n1 = strfmt(str1, sizeof(str1), fmt, val);
+	n2 = snprintf(str2, sizeof(str2), fmt, val);
+	if (n1 != n2 || strcmp(str1, str2)) {
+		printf("strfmt '%s': '%s' != '%s'\n", fmt, str1, str2);
+		return 1;
+	}
+	return 0;
+}
+
+/* Significant digits in a %e or double2str string */
+static int count_sig(const char *str)
+{
+	int n = 0, zeros = 0, leading = 1;
+
+	for (; *str && *str != 'e'; ++str)
+		if (*str == '0') {
+			if (!leading)
+				++zeros;
+		} else if (isdigit(*str)) {
+			n += zeros + 1;
+			zeros = 0;
+			leading = 0;
+		}
+	return n;
+}
+
+static int check_shortest(double val)
+{
+	char str[32], str2[32];
+	int p;
+
+	_double2str(val, str);
+	if (strtod(str, NULL) != val) {
+		printf("double2str %.17g: %s\n", val, str);
+		return 1;
+	}
+
+	/* Find the fewest correctly rounded digits that round trip. Can
+	 * be one more than shortest, e.g. 2^-24.
+	 */
+	for (p = 0; p < 17; ++p) {
+		snprintf(str2, sizeof(str2), "%.*e", p, val);
+		if (strtod(str2, NULL) == val)
+			break;
+	}
+	if (count_sig(str) > count_sig(str2)) {
+		printf("double2str %.17g: %s not shortest %s\n", val, str, str2);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int test_floats(void)
+{
+	static const char *fmts[] = {
+		"%f", "%.0f", "%.1f", "%.3f", "%.17f", "%.40f", "%e", "%.0e", "%.3e",
+		"%.16e", "%12.3f", "%-12.3f|", "%012.3f", "%lf", "%12e",
+	};
+	static const double vals[] = {
+		0.0, -0.0, 1.0, -1.0, 0.5, 1.5, 2.5, 0.125, 0.375, 1e-7, 123.456,
+		-123.456, 0.1, 0.2, 0.3, 1.0 / 3.0, 2.0 / 3.0, 9.5, 99.5, 999.9999999,
+		0.05, 0.15, 0.25, 0.35, 1e15, 1e16, 1e17, 1e21, 1e22, 1e23,
+		0.000244140625, 1234565.0, 1234575.0, 12345650.0, 99999995.0,
+		9999999.5, 0.00099999995, 18446744073709547520.0,
+		1.7976931348623157e308, 2.2250738585072014e-308, 4.9406564584124654e-324,
+		123456789012345678.0, 18446744073709549568.0, 9007199254740993.0,
+		5e-324, 1e-300, 1e300, 3.14159265358979, 6.02214076e23, 1.602176634e-19,
+	};
+	int nfmts = sizeof(fmts) / sizeof(char *);
+	int nvals = sizeof(vals) / sizeof(double);
+	union { double d; uint64_t u; } bits;
+	char str[32];
+	int i, j, rc = 0;
+
+	for (i = 0; i < nvals; ++i) {
+		for (j = 0; j < nfmts; ++j)
+			rc |= check_float(fmts[j], vals[i]);
+		if (vals[i] != 0)
+			rc |= check_shortest(vals[i]);
+	}
+
+	rc |= check_float("%f", 1.0 / 0.0);
+	rc |= check_float("%e", -1.0 / 0.0);
+	rc |= check_float("%5.1f", 0.0 / 0.0);
+
+	for (i = 0; i < 100000; ++i) {
+		do
+			bits.u = xorshift128plus();
+		while ((bits.u >> 52 & 0x7ff) == 0x7ff);
+		rc |= check_float("%.3e", bits.d);
+		rc |= check_float("%.17e", bits.d);
+		rc |= check_shortest(bits.d);
+		/* Reasonable sized numbers */
+		bits.d = (double)(xorshift128plus() >> (i & 63)) / (1 << (i & 31));
+		rc |= check_float("%f", bits.d);
+		rc |= check_float("%.2f", -bits.d);
+		rc |= check_float("%e", bits.d);
+		rc |= check_float("%.0e", bits.d);
+		rc |= check_float("%.20e", -bits.d);
+		rc |= check_shortest(bits.d);
+		if (rc)
+			break;
+	}
+
+	if (strcmp(double2str(0.1, str), "0.1") ||
+		strcmp(double2str(1e100, str), "1e+100") ||
+		strcmp(double2str(-1234.5, str), "-1234.5") ||
+		strcmp(double2str(0.0001, str), "0.0001") ||
+		strcmp(double2str(100, str), "100")) {
+		printf("double2str format %s\n", str);
+		rc = 1;
+	}
+
+	return rc;
+}
+#endif
+
+static int test_strbuf(void)
+{
+	char tmp[256], big[100000], *str, *file, *p;
+	struct strbuf sb;
+	int i, fd, len, rc = 0;
+
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = 0;
+
+	/* Growable string */
+	strbuf_init(&sb, -1);
+	for (len = i = 0; i < 1000; ++i) {
+		p = big + sizeof(big) - 1 - i % 200;
+		snprintf(tmp, sizeof(tmp), "%d %-8s|%08x|%s|\n", i, "abc", i * 7, p);
+		len += strlen(tmp);
+		if (strbuf_fmt(&sb, "%d %-8s|%08x|%s|\n", i, "abc", i * 7, p) != strlen(tmp)) {
+			printf("strbuf_fmt %d\n", i);
+			rc = 1;
+		}
+	}
+	if (sb.len != len || strlen(sb.str) != len || strncmp(sb.str + len - strlen(tmp), tmp, strlen(tmp))) {
+		printf("strbuf string %d != %d\n", sb.len, len);
+		rc = 1;
+	}
+	strbuf_free(&sb);
+
+	str = strfmt_alloc("%s%d", big, 42);
+	if (strlen(str) != sizeof(big) + 1 || strcmp(str + sizeof(big) - 1, "42")) {
+		printf("strfmt_alloc\n");
+		rc = 1;
+	}
+	free(str);
+
+	/* Batched fd, with records that do and do not fit */
+	fd = open("/tmp/strbuf.test", O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("/tmp/strbuf.test");
+		return 1;
+	}
+	strbuf_init(&sb, fd);
+	for (len = i = 0; i < 10000; ++i) {
+		int size = i % 100 == 0 ? sizeof(big) - 1 - i : 10;
+
+		len += strbuf_fmt(&sb, "%d:%s\n", i, big + sizeof(big) - 1 - size);
+	}
+	len += strbuf_fmt(&sb, "%070d\n", 0);
+	if (strbuf_flush(&sb)) {
+		perror("strbuf_flush");
+		rc = 1;
+	}
+	strbuf_free(&sb);
+
+	file = must_alloc(len + 1);
+	if (pread(fd, file, len + 1, 0) != len) {
+		printf("strbuf fd: bad length\n");
+		rc = 1;
+	}
+	close(fd);
+	unlink("/tmp/strbuf.test");
+
+	for (p = file, i = 0; i < 10000 && rc == 0; ++i) {
+		int size = i % 100 == 0 ? sizeof(big) - 1 - i : 10;
+
+		snprintf(tmp, sizeof(tmp), "%d:", i);
+		if (strncmp(p, tmp, strlen(tmp)) || p[strlen(tmp) + size] != '\n') {
+			printf("strbuf fd: record %d\n", i);
+			rc = 1;
+		}
+		p += strlen(tmp) + size + 1;
+	}
+	free(file);
+
+	return rc;
+}
+
+static int check_compiled(const char *fmt, long a, const char *b, unsigned long c)
+{
+	struct strfmt_compiled *cf = strfmt_compile(fmt);
+	char str1[128], str2[128];
+	int n1, n2, len, rc = 0;
+
+	for (len = 1; len < sizeof(str1); len += 31) {
+		n1 = strfmt(str1, len, fmt, a, b, c);
+		n2 = strfmt_exec(str2, len, cf, a, b, c);
+		if (n1 != n2 || strcmp(str1, str2)) {
+			printf("strfmt_exec '%s': '%s' != '%s'\n", fmt, str2, str1);
+			rc = 1;
+		}
+	}
+
+	free(cf);
+	return rc;
+}
+
+static int test_compiled(void)
+{
+	struct strfmt_compiled *cf;
+	struct strbuf sb1, sb2;
+	union strfmt_arg args[300];
+	int i, n, rc = 0;
+
+	rc |= check_compiled("", 1, "x", 2);
+	rc |= check_compiled("plain", 1, "x", 2);
+	rc |= check_compiled("%ld %s %lu", -12345, "hello", 99);
+	rc |= check_compiled("[%-8ld] [%10s] [%08lx]", 42, "abc", 0xbeef);
+	rc |= check_compiled("%ld%s%lx trailing", -1, "", 0xffffffffUL);
+	rc |= check_compiled("100%% %q %ld%%%s %lu%", 7, "x", 8);
+	rc |= check_compiled("%lo %.2s %lu", 8, "abcdef", 0);
+
+	/* The vectored form matches one call per record */
+	cf = strfmt_compile("%d: %-6s %08x\n");
+	strbuf_init(&sb1, -1);
+	strbuf_init(&sb2, -1);
+	for (i = 0; i < 100; ++i) {
+		args[i * 3].l = i - 50;
+		args[i * 3 + 1].s = i & 1 ? "odd" : "even";
+		args[i * 3 + 2].u = i * 1234567;
+		strbuf_exec(&sb1, cf, i - 50, i & 1 ? "odd" : "even", i * 1234567);
+	}
+	n = strbuf_exec_v(&sb2, cf, args, 100);
+	if (n != sb1.len || sb1.len != sb2.len || strcmp(sb1.str, sb2.str)) {
+		printf("strbuf_exec_v %d %d %d\n", n, sb1.len, sb2.len);
+		rc = 1;
+	}
+	strbuf_free(&sb1);
+	strbuf_free(&sb2);
+	free(cf);
+
+	return rc;
+}
+
+#ifndef TESTALL
+static void bench_int2str(void)
+{
+	struct timeval start;
+	unsigned long delta;
+	char str[32];
+	int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20000000; ++i)
+		snprintf(str, sizeof(str), "%u", i * 2654435761u);
+	delta = delta_timeval_now(&start);
+	printf("snprintf %%u  %fns\n", (double)delta / 20000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20000000; ++i)
+		uint2str(i * 2654435761u, str);
+	delta = delta_timeval_now(&start);
+	printf("uint2str     %fns\n", (double)delta / 20000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20000000; ++i)
+		snprintf(str, sizeof(str), "%x", i * 2654435761u);
+	delta = delta_timeval_now(&start);
+	printf("snprintf %%x  %fns\n", (double)delta / 20000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 20000000; ++i)
+		hex2str(i * 2654435761u, str);
+	delta = delta_timeval_now(&start);
+	printf("hex2str      %fns\n", (double)delta / 20000000.0 * 1000.0);
+
+#ifdef WANT_FLOATS
+	double vals[1024];
+
+	for (i = 0; i < 1024; ++i)
+		vals[i] = (double)(xorshift128plus() >> 40) / 1000.0;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		snprintf(str, sizeof(str), "%.3f", vals[i & 1023]);
+	delta = delta_timeval_now(&start);
+	printf("snprintf %%.3f %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		strfmt(str, sizeof(str), "%.3f", vals[i & 1023]);
+	delta = delta_timeval_now(&start);
+	printf("strfmt %%.3f   %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		snprintf(str, sizeof(str), "%.17g", vals[i & 1023]);
+	delta = delta_timeval_now(&start);
+	printf("snprintf %%.17g %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		double2str(vals[i & 1023], str);
+	delta = delta_timeval_now(&start);
+	printf("double2str    %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		snprintf(str, sizeof(str), "%e", vals[i & 1023]);
+	delta = delta_timeval_now(&start);
+	printf("snprintf %%e   %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		strfmt(str, sizeof(str), "%e", vals[i & 1023]);
+	delta = delta_timeval_now(&start);
+	printf("strfmt %%e     %fns\n", (double)delta / 5000000.0 * 1000.0);
+#endif
+}
+static void bench_strbuf(void)
+{
+	struct timeval start;
+	struct strbuf sb;
+	char str[256];
+	unsigned long delta;
+	int i, n, fd = open("/dev/null", O_WRONLY);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 2000000; ++i) {
+		n = strfmt(str, sizeof(str), "%d %s %08x %s\n", i, "GET", i, "/index.html");
+		if (write(fd, str, n) != n)
+			break;
+	}
+	delta = delta_timeval_now(&start);
+	printf("strfmt+write %fns\n", (double)delta / 2000000.0 * 1000.0);
+
+	strbuf_init(&sb, fd);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 2000000; ++i)
+		strbuf_fmt(&sb, "%d %s %08x %s\n", i, "GET", i, "/index.html");
+	strbuf_flush(&sb);
+	delta = delta_timeval_now(&start);
+	printf("strbuf fd     %fns\n", (double)delta / 2000000.0 * 1000.0);
+	strbuf_free(&sb);
+
+	strbuf_init(&sb, -1);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 2000000; ++i)
+		strbuf_fmt(&sb, "%d %s %08x %s\n", i, "GET", i, "/index.html");
+	delta = delta_timeval_now(&start);
+	printf("strbuf string %fns (%dM)\n", (double)delta / 2000000.0 * 1000.0, sb.len >> 20);
+	strbuf_free(&sb);
+
+	close(fd);
+}
+static void bench_compiled(void)
+{
+	const char *fmt = "%s %5d %-8s %08x %lu\n";
+	struct strfmt_compiled *cf = strfmt_compile(fmt);
+	union strfmt_arg args[5 * 64];
+	struct timeval start;
+	struct strbuf sb;
+	char str[256];
+	unsigned long delta;
+	int i, j;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		strfmt(str, sizeof(str), fmt, "INFO", i, "conn", i, 12345678UL);
+	delta = delta_timeval_now(&start);
+	printf("strfmt        %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; ++i)
+		strfmt_exec(str, sizeof(str), cf, "INFO", i, "conn", i, 12345678UL);
+	delta = delta_timeval_now(&start);
+	printf("strfmt_exec   %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	for (i = 0; i < 64; ++i) {
+		args[i * 5].s = "INFO";
+		args[i * 5 + 1].l = i;
+		args[i * 5 + 2].s = "conn";
+		args[i * 5 + 3].u = i;
+		args[i * 5 + 4].u = 12345678;
+	}
+	strbuf_init(&sb, -1);
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; i += 64) {
+		sb.len = 0;
+		for (j = 0; j < 64; ++j)
+			strbuf_fmt(&sb, fmt, "INFO", j, "conn", j, 12345678UL);
+	}
+	delta = delta_timeval_now(&start);
+	printf("strbuf_fmt    %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 5000000; i += 64) {
+		sb.len = 0;
+		strbuf_exec_v(&sb, cf, args, 64);
+	}
+	delta = delta_timeval_now(&start);
+	printf("strbuf_exec_v %fns\n", (double)delta / 5000000.0 * 1000.0);
+
+	strbuf_free(&sb);
+	free(cf);
+}
+#endif
+
 #ifdef TESTALL
 int str_main(void)
 #else
@@ -256,9 +734,19 @@ int main(int argc, char *argv[])
 	test_strconcat();
 
 	test_strfmt();
+
+	rc |= test_int2str();
+	rc |= test_strbuf();
+	rc |= test_compiled();
+#ifdef WANT_FLOATS
+	rc |= test_floats();
+#endif
 #endif
 
 #ifndef TESTALL
+	bench_int2str();
+	bench_strbuf();
+	bench_compiled();
 #if 0
 	char dst[256], src[256];
 	struct timeval start;
@@ -9,6 +9,7 @@
 #include "md5test.c"
 #include "readfile.c"
 #include "readproctest.c"
+#include "readcmdtest.c"
 #include "sha256test.c"
 #include "tsctest.c"
 #include "threadtest.c"
@@ -17,6 +18,7 @@
 #include "aes-test.c"
 #include "aes-stress.c"
 #include "strtest.c"
+#include "walktest.c"
 
 
 int main(int argc, char *argv[])
@@ -35,12 +37,14 @@ int main(int argc, char *argv[])
 	rc |= md5_main();
 	rc |= readfile_main();
 	rc |= readproc_main();
+	rc |= readcmd_main();
 	rc |= sha256_main();
 	rc |= tsc_main();
 	rc |= spinlock_main();
 	rc |= thread_main();
 	rc |= time_main();
 	rc |= str_main();
+	rc |= walk_main();
 
 	if (rc == 0)
 		puts("Success");
@@ -1,21 +1,94 @@
+#include <stdio.h>
+#include <getopt.h>
 #include "../samlib.h"
 
+static unsigned long nfiles;
+static int cold;
+
+static int count_files(const char *path, struct stat *sbuf)
+{
+	__sync_add_and_fetch(&nfiles, 1);
+	return 0;
+}
+
+/* Needs root */
+static void drop_caches(void)
+{
+	if (cold) {
+		sync();
+		if (do_system("echo 3 > /proc/sys/vm/drop_caches"))
+			puts("Unable to drop caches");
+	}
+}
+
+static void bench_one(const char *what, const char *dir, int flags, int nthreads)
+{
+	struct walkfile_struct walk;
+	struct timeval start;
+	unsigned long delta;
+
+	drop_caches();
+	memset(&walk, 0, sizeof(walk));
+	nfiles = 0;
+	gettimeofday(&start, NULL);
+	if (nthreads)
+		walkfiles_mt(&walk, dir, count_files, WALK_DOTFILES | flags, nthreads);
+	else
+		walkfiles(&walk, dir, count_files, WALK_DOTFILES | flags);
+	delta = delta_timeval_now(&start);
+	printf("%-9s %8lu files %10luus %10.0f files/s\n",
+		   what, nfiles, delta, (double)nfiles * 1000000.0 / delta);
+}
+
+/* Walk the tree with the different walkers and report files/s. Use -c
+ * to drop the caches before each walk, otherwise run it twice to
+ * compare with a warm cache.
+ */
+static void benchmark(const char *dir, int nthreads)
+{
+	bench_one("serial", dir, 0, 0);
+	bench_one("no stat", dir, WALK_NO_STAT, 0);
+	bench_one("batch", dir, WALK_BATCH_STAT, 0);
+	bench_one("parallel", dir, 0, nthreads ? nthreads : -1);
+	bench_one("par batch", dir, WALK_BATCH_STAT, nthreads ? nthreads : -1);
+}
+
 int main(int argc, char *argv[])
 {
 	char *dir;
+	int c, bench = 0, nthreads = 0;
 
-	if (argc == 1)
+	while ((c = getopt(argc, argv, "bct:")) != EOF)
+		switch (c) {
+		case 'b':
+			bench = 1;
+			break;
+		case 'c':
+			cold = 1;
+			break;
+		case 't':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		default:
+			puts("usage: walkies [-b] [-c] [-t threads] [dir]");
+			return 1;
+		}
+
+	if (optind == argc)
 		dir = ".";
 	else
-		dir = argv[1];
+		dir = argv[optind];
 
-	walkfiles(NULL, dir, NULL, WALK_DOTFILES);
+	if (bench)
+		benchmark(dir, nthreads);
+	else
+		walkfiles(NULL, dir, NULL, WALK_DOTFILES);
 
 	return 0;
 }
 
 /*
  * Local Variables:
- * compile-command: "gcc -O2 -Wall walkies.c -o walkies ../x86_64/libsamlib.a"
+ * compile-command: "gcc -O2 -Wall walkies.c -o walkies ../x86_64/libsamlib.a ../x86_64/libsamthread.a"
  * End:
  */
@@ -0,0 +1,5 @@
+/* walktest with WALK_BATCH_STAT and no ring. The tests are not built
+ * with HAVE_IO_URING, so walkfiles.c falls back to plain stats.
+ */
+#include "../walkfiles.c"
+#include "walktest.c"
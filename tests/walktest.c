@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include "../samlib.h"
+#include "../samthread.h"
+
+#define WALK_MAX_FILES 1024
+
+static char *walk_paths[WALK_MAX_FILES];
+static int walk_count;
+static DEFINE_SPINLOCK(walk_lock);
+
+static int walk_collect(const char *path, struct stat *sbuf)
+{
+	spin_lock(&walk_lock);
+	if (walk_count < WALK_MAX_FILES)
+		walk_paths[walk_count] = must_strdup(path);
+	++walk_count;
+	spin_unlock(&walk_lock);
+	return 0;
+}
+
+static int walk_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+static void walk_reset(void)
+{
+	for (int i = 0; i < walk_count && i < WALK_MAX_FILES; ++i)
+		free(walk_paths[i]);
+	walk_count = 0;
+}
+
+/* Returns the number of files or -1 on error */
+static int walk_create_tree(const char *top)
+{
+	char path[256];
+	int i, j, count = 0;
+
+	for (i = 0; i < 8; ++i)
+		for (j = 0; j < 8; ++j) {
+			strfmt(path, sizeof(path), "%s/d%d/e%d", top, i, j);
+			if (mkdir_p(path, 0755))
+				return -1;
+			strfmt(path, sizeof(path), "%s/d%d/e%d/file%d.c", top, i, j, j);
+			if (create_file(path, 0, 0))
+				return -1;
+			strfmt(path, sizeof(path), "%s/d%d/e%d/file%d.o", top, i, j, j);
+			if (create_file(path, 0, 0))
+				return -1;
+			count += 2;
+		}
+
+	strfmt(path, sizeof(path), "%s/top.c", top);
+	if (create_file(path, 0, 0))
+		return -1;
+	strfmt(path, sizeof(path), "%s/.hidden.c", top);
+	if (create_file(path, 0, 0))
+		return -1;
+
+	return count + 1;
+}
+
+/* Compare a serial walk to a parallel walk */
+static int walk_compare(const char *top, int flags, const char *filter,
+						int expected, const char *what)
+{
+	struct walkfile_struct walk;
+	char *serial[WALK_MAX_FILES];
+	int i, n, rc = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	if (filter)
+		add_filter(&walk, filter);
+	walk_reset();
+	if (walkfiles(&walk, top, walk_collect, flags)) {
+		printf("%s: walkfiles failed\n", what);
+		return 1;
+	}
+	n = walk_count;
+	if (n != expected) {
+		printf("%s: expected %d files got %d\n", what, expected, n);
+		return 1;
+	}
+	memcpy(serial, walk_paths, n * sizeof(char *));
+	walk_count = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	if (filter)
+		add_filter(&walk, filter);
+	if (walkfiles_mt(&walk, top, walk_collect, flags, 4)) {
+		printf("%s: walkfiles_mt failed\n", what);
+		rc = 1;
+	} else if (walk_count != n) {
+		printf("%s: walkfiles_mt %d != %d\n", what, walk_count, n);
+		rc = 1;
+	} else {
+		qsort(serial, n, sizeof(char *), walk_cmp);
+		qsort(walk_paths, n, sizeof(char *), walk_cmp);
+		for (i = 0; i < n; ++i)
+			if (strcmp(serial[i], walk_paths[i])) {
+				printf("%s: %s != %s\n", what, serial[i], walk_paths[i]);
+				rc = 1;
+				break;
+			}
+	}
+
+	for (i = 0; i < n; ++i)
+		free(serial[i]);
+	walk_reset();
+
+	return rc;
+}
+
+/* The walk used to be limited to 1k paths */
+static int walk_long_path(const char *top)
+{
+	char path[2048];
+	int i, n, rc = 0;
+
+	n = strconcat(path, sizeof(path), top, "/long", NULL);
+	for (i = 0; i < 20; ++i)
+		n += strconcat(path + n, sizeof(path) - n,
+					   "/abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz", NULL);
+	if (mkdir_p(path, 0755)) {
+		perror("mkdir long");
+		return 1;
+	}
+	strconcat(path + n, sizeof(path) - n, "/file", NULL);
+	if (create_file(path, 0, 0)) {
+		perror("create long");
+		return 1;
+	}
+
+	walk_reset();
+	strconcat(path, sizeof(path), top, "/long", NULL);
+	if (walkfiles(NULL, path, walk_collect, 0) || walk_count != 1) {
+		printf("long path: walk failed %d\n", walk_count);
+		rc = 1;
+	} else if (strlen(walk_paths[0]) <= 1024) {
+		printf("long path: too short %ld\n", strlen(walk_paths[0]));
+		rc = 1;
+	}
+	walk_reset();
+
+	return rc;
+}
+
+static int index_counts[4], index_digests;
+
+static int index_change(const char *path, struct stat *sbuf,
+						const uint8_t *digest, int what)
+{
+	++index_counts[what];
+	if (digest)
+		++index_digests;
+	return 0;
+}
+
+static int index_check(const char *top, const char *db, int flags,
+					   int added, int changed, int deleted, const char *what)
+{
+	memset(index_counts, 0, sizeof(index_counts));
+	index_digests = 0;
+	if (walkindex(NULL, top, db, index_change, flags)) {
+		printf("walkindex %s: failed\n", what);
+		return 1;
+	}
+	if (index_counts[WALKINDEX_ADDED] != added ||
+		index_counts[WALKINDEX_CHANGED] != changed ||
+		index_counts[WALKINDEX_DELETED] != deleted) {
+		printf("walkindex %s: added %d changed %d deleted %d\n", what,
+			   index_counts[WALKINDEX_ADDED], index_counts[WALKINDEX_CHANGED],
+			   index_counts[WALKINDEX_DELETED]);
+		return 1;
+	}
+	return 0;
+}
+
+static int walk_index(const char *top, int n)
+{
+	char db[256], path[256];
+	int rc = 0;
+
+	strconcat(db, sizeof(db), top, ".db", NULL);
+	unlink(db);
+
+	rc |= index_check(top, db, 0, n, 0, 0, "first");
+	/* Adding a digest hashes the unchanged files */
+	rc |= index_check(top, db, WALKINDEX_MD5, 0, n, 0, "add md5");
+	if (index_digests != n) {
+		printf("walkindex add md5: %d digests\n", index_digests);
+		rc = 1;
+	}
+	rc |= index_check(top, db, WALKINDEX_MD5, 0, 0, 0, "second");
+
+	/* Only the records under the root are swept */
+	strfmt(path, sizeof(path), "%s/d1", top);
+	rc |= index_check(path, db, WALKINDEX_MD5, 0, 0, 0, "subdir");
+	rc |= index_check(top, db, WALKINDEX_MD5, 0, 0, 0, "after subdir");
+
+	strfmt(path, sizeof(path), "%s/d1/e1/file1.c", top);
+	create_file(path, 0, 0);
+	do_system("echo hello > %s", path);
+	strfmt(path, sizeof(path), "%s/d2/e2/file2.c", top);
+	unlink(path);
+	strfmt(path, sizeof(path), "%s/d3/new.c", top);
+	create_file(path, 0, 0);
+	/* Same contents, new mtime */
+	strfmt(path, sizeof(path), "%s/d4/e4/file4.c", top);
+	unlink(path);
+	create_file(path, 0, 0);
+	rc |= index_check(top, db, WALKINDEX_MD5, 1, 1, 1, "changes");
+
+	rc |= index_check(top, db, WALKINDEX_DIR_MTIME, 0, 0, 0, "dir mtime");
+	strfmt(path, sizeof(path), "%s/d5/e5/new.c", top);
+	create_file(path, 0, 0);
+	rc |= index_check(top, db, WALKINDEX_DIR_MTIME, 1, 0, 0, "dir mtime add");
+
+	/* Put the tree back */
+	unlink(path);
+	strfmt(path, sizeof(path), "%s/d3/new.c", top);
+	unlink(path);
+	strfmt(path, sizeof(path), "%s/d2/e2/file2.c", top);
+	create_file(path, 0, 0);
+	strfmt(path, sizeof(path), "%s/d1/e1/file1.c", top);
+	create_file(path, 0, 0);
+	truncate(path, 0);
+
+	unlink(db);
+	return rc;
+}
+
+/* Check the compiled matcher against regexec and fnmatch */
+static int walk_match(void)
+{
+	static const char *regexes[] = {
+		"\\.o$", "^/usr/lib/", "/CVS/", "^/etc/passwd$", "\\.git\\/",
+		"[0-9]+\\.tmp$", "a\\$b", "^x", "(foo|bar)\\.c$",
+	};
+	static const char *globs[] = {
+		"*.c", "Makefile", "lib*", "*.[ch]", "*core*", "\\*star", "x?z",
+	};
+	static const char *paths[] = {
+		"foo.o", "foo.oo", "/usr/lib/libc.so", "/usr/lib64/libc.so",
+		"/src/CVS/Root", "/etc/passwd", "/etc/passwd-", "/src/.git/HEAD",
+		"/tmp/123.tmp", "/tmp/abc.tmp", "a$b", "xyz", "/src/foo.c",
+		"bar.c", "Makefile", "Makefile.am", "libfoo.a", "hello.h",
+		"core", "mycore.1", "*star", "star", "", ".c",
+	};
+	int nregexes = sizeof(regexes) / sizeof(char *);
+	int nglobs = sizeof(globs) / sizeof(char *);
+	int npaths = sizeof(paths) / sizeof(char *);
+	struct walkfile_struct walk;
+	regex_t regex[nregexes];
+	regmatch_t pmatch[1];
+	int i, j, expect, rc = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	for (i = 0; i < nregexes; ++i) {
+		add_ignore(&walk, regexes[i]);
+		regcomp(&regex[i], regexes[i], REG_EXTENDED);
+	}
+	for (i = 0; i < nglobs; ++i)
+		add_filter(&walk, globs[i]);
+	add_filter_re(&walk, "^[a-z]+\\.a$");
+
+	for (i = 0; i < npaths; ++i) {
+		for (expect = j = 0; j < nregexes; ++j)
+			if (regexec(&regex[j], paths[i], 1, pmatch, 0) == 0)
+				expect = 1;
+		if (check_ignores(&walk, paths[i]) != expect) {
+			printf("check_ignores %s: expected %d\n", paths[i], expect);
+			rc = 1;
+		}
+
+		for (expect = j = 0; j < nglobs; ++j)
+			if (fnmatch(globs[j], paths[i], 0) == 0)
+				expect = 1;
+		if (strcmp(paths[i], "libfoo.a") == 0)
+			expect = 1;
+		if (check_filters(&walk, paths[i]) != expect) {
+			printf("check_filters %s: expected %d\n", paths[i], expect);
+			rc = 1;
+		}
+	}
+
+	/* Adding after a check must recompile */
+	add_ignore(&walk, "\\.tmp$");
+	if (!check_ignores(&walk, "/tmp/abc.tmp")) {
+		printf("check_ignores: not recompiled\n");
+		rc = 1;
+	}
+
+	for (i = 0; i < nregexes; ++i)
+		regfree(&regex[i]);
+
+	return rc;
+}
+
+#ifndef TESTALL
+/* A large ignore list, mostly extensions and directories */
+static void benchmark(void)
+{
+	struct walkfile_struct walk;
+	regex_t regex[200];
+	regmatch_t pmatch[1];
+	char pat[32], path[128];
+	struct timeval start;
+	unsigned long delta;
+	int i, j, n = 0, hits = 0;
+
+	memset(&walk, 0, sizeof(walk));
+	for (i = 0; i < 200; ++i) {
+		if (i < 160)
+			strfmt(pat, sizeof(pat), "\\.ext%d$", i);
+		else if (i < 190)
+			strfmt(pat, sizeof(pat), "/dir%d/", i);
+		else
+			strfmt(pat, sizeof(pat), "[0-9]+\\.tmp%d$", i);
+		add_ignore(&walk, pat);
+		regcomp(&regex[i], pat, REG_EXTENDED);
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 10000; ++i) {
+		strfmt(path, sizeof(path), "/usr/src/project/sub%d/file%d.ext%d", i & 7, i, i & 255);
+		for (j = 0; j < 200; ++j)
+			if (regexec(&regex[j], path, 1, pmatch, 0) == 0) {
+				++hits;
+				break;
+			}
+		++n;
+	}
+	delta = delta_timeval_now(&start);
+	printf("regexec  %10.0f paths/s (%d)\n", (double)n * 1000000.0 / delta, hits);
+
+	n = hits = 0;
+	gettimeofday(&start, NULL);
+	for (i = 0; i < 1000000; ++i) {
+		strfmt(path, sizeof(path), "/usr/src/project/sub%d/file%d.ext%d", i & 7, i, i & 255);
+		hits += check_ignores(&walk, path);
+		++n;
+	}
+	delta = delta_timeval_now(&start);
+	printf("compiled %10.0f paths/s (%d)\n", (double)n * 1000000.0 / delta, hits);
+
+	for (i = 0; i < 200; ++i)
+		regfree(&regex[i]);
+}
+#endif
+
+#ifdef TESTALL
+int walk_main(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	int n, rc = 0;
+
+	char *top = tmpfilename("walktest");
+	if (!top) {
+		puts("walktest: Out of memory!");
+		return 1;
+	}
+
+	do_system("rm -rf %s", top);
+	n = walk_create_tree(top);
+	if (n < 0) {
+		perror(top);
+		return 1;
+	}
+
+	rc |= walk_compare(top, 0, NULL, n, "all");
+	rc |= walk_compare(top, WALK_DOTFILES, NULL, n + 1, "dotfiles");
+	rc |= walk_compare(top, 0, "*.c", n / 2 + 1, "filter");
+	rc |= walk_compare(top, WALK_INCLUDE_DIRS, NULL, n + 8 + 64, "dirs");
+	rc |= walk_compare(top, WALK_ONE_DIR, NULL, 9, "one dir");
+	rc |= walk_compare(top, WALK_NO_STAT, NULL, n, "no stat");
+	rc |= walk_compare(top, WALK_BATCH_STAT, NULL, n, "batch");
+	rc |= walk_compare(top, WALK_BATCH_STAT | WALK_INCLUDE_DIRS, "*.o",
+					   n / 2 + 8 + 64, "batch dirs");
+	rc |= walk_index(top, n);
+	rc |= walk_long_path(top);
+	rc |= walk_match();
+
+	do_system("rm -rf %s", top);
+	free(top);
+
+#ifndef TESTALL
+	benchmark();
+#endif
+
+	return rc;
+}
@@ -0,0 +1,236 @@
+#include "samthread.h"
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "samlib.h"
+
+/* Parallel walkfiles. Every worker has its own deque of directories
+ * to walk. A worker pushes new subdirectories on the bottom of its own
+ * deque and pops them from the bottom, so it walks depth first like
+ * walkfiles(). An idle worker steals from the top of another worker's
+ * deque, which tends to be the largest remaining subtree. An idle
+ * worker with nothing to steal sleeps until a directory is queued.
+ *
+ * The workers are pthreads, not samthreads, since they call malloc,
+ * opendir, and perror, which need their own errno and malloc arenas.
+ */
+
+/* \cond skip */
+struct walk_dir {
+	char *path;
+	struct stat sbuf;
+};
+
+struct walk_sched;
+
+struct walk_worker {
+	struct walkfile_struct walk; /* must be first */
+	struct walk_sched *sched;
+	spinlock_t lock;
+	struct walk_dir *dirs;
+	int top, bottom, size;
+	int error;
+};
+
+struct walk_sched {
+	struct walk_worker *workers;
+	int nworkers;
+	int pending; /* dirs queued or being walked */
+	int idle;    /* workers waiting on wake */
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+};
+
+static void push_dir(struct walk_worker *w, const char *path, struct stat *sbuf)
+{
+	spin_lock(&w->lock);
+	if (w->bottom == w->size) {
+		if (w->top > 0) {
+			/* slide down */
+			memmove(w->dirs, w->dirs + w->top,
+					(w->bottom - w->top) * sizeof(struct walk_dir));
+			w->bottom -= w->top;
+			w->top = 0;
+		}
+		if (w->bottom == w->size) {
+			w->size = w->size ? w->size * 2 : 64;
+			w->dirs = must_realloc(w->dirs, w->size * sizeof(struct walk_dir));
+		}
+	}
+	w->dirs[w->bottom].path = must_strdup(path);
+	w->dirs[w->bottom].sbuf = *sbuf;
+	++w->bottom;
+	spin_unlock(&w->lock);
+}
+
+/* Owner pops from the bottom */
+static int pop_dir(struct walk_worker *w, struct walk_dir *dir)
+{
+	int rc = 0;
+
+	spin_lock(&w->lock);
+	if (w->bottom > w->top) {
+		*dir = w->dirs[--w->bottom];
+		rc = 1;
+	}
+	spin_unlock(&w->lock);
+	return rc;
+}
+
+/* Thieves steal from the top */
+static int steal_dir(struct walk_worker *w, struct walk_dir *dir)
+{
+	int rc = 0;
+
+	if (w->bottom == w->top)
+		return 0; /* racy but saves the lock */
+
+	spin_lock(&w->lock);
+	if (w->bottom > w->top) {
+		*dir = w->dirs[w->top++];
+		rc = 1;
+	}
+	spin_unlock(&w->lock);
+	return rc;
+}
+
+static int queue_dir(struct walkfile_struct *walk, const char *path, struct stat *sbuf)
+{
+	struct walk_worker *w = (struct walk_worker *)walk;
+	struct walk_sched *sched = w->sched;
+
+	__sync_add_and_fetch(&sched->pending, 1);
+	push_dir(w, path, sbuf);
+
+	/* Pairs with the idle increment in walk_worker() */
+	__sync_synchronize();
+	if (__atomic_load_n(&sched->idle, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&sched->lock);
+		pthread_cond_signal(&sched->wake);
+		pthread_mutex_unlock(&sched->lock);
+	}
+	return 0;
+}
+
+static int find_dir(struct walk_worker *w, struct walk_dir *dir)
+{
+	struct walk_sched *sched = w->sched;
+	int i, me = w - sched->workers;
+
+	if (pop_dir(w, dir))
+		return 1;
+
+	for (i = 1; i < sched->nworkers; ++i)
+		if (steal_dir(&sched->workers[(me + i) % sched->nworkers], dir))
+			return 1;
+
+	return 0;
+}
+
+/* Sleep until we find a directory or the walk is done */
+static int wait_dir(struct walk_worker *w, struct walk_dir *dir)
+{
+	struct walk_sched *sched = w->sched;
+	int found;
+
+	pthread_mutex_lock(&sched->lock);
+	__sync_add_and_fetch(&sched->idle, 1);
+	while (!(found = find_dir(w, dir)) && sched->pending)
+		pthread_cond_wait(&sched->wake, &sched->lock);
+	__sync_sub_and_fetch(&sched->idle, 1);
+	pthread_mutex_unlock(&sched->lock);
+
+	return found;
+}
+
+static void *walk_worker(void *arg)
+{
+	struct walk_worker *w = arg;
+	struct walk_sched *sched = w->sched;
+	struct walk_dir dir;
+
+	while (find_dir(w, &dir) || wait_dir(w, &dir)) {
+		w->error |= _walkdir(&w->walk, dir.path, &dir.sbuf, queue_dir);
+		free(dir.path);
+		if (__sync_sub_and_fetch(&sched->pending, 1) == 0) {
+			/* All done, wake everybody up to exit */
+			pthread_mutex_lock(&sched->lock);
+			pthread_cond_broadcast(&sched->wake);
+			pthread_mutex_unlock(&sched->lock);
+		}
+	}
+
+	return NULL;
+}
+/* \endcond */
+
+/* Parallel version of walkfiles() using nthreads workers. If nthreads
+ * is 0, uses the number of online cpus. The file_func() is called
+ * concurrently from all the workers. Each worker has its own copy of
+ * the walkfile_struct.
+ */
+int walkfiles_mt(struct walkfile_struct *walk, const char *path,
+				 int (*file_func)(const char *path, struct stat *sbuf),
+				 int flags, int nthreads)
+{
+	struct walk_sched sched;
+	pthread_t *tids;
+	int *started;
+	struct stat sbuf;
+	int i, error = 0;
+
+	walk = _walkfiles_init(walk, path, &sbuf, file_func, flags);
+	if (!walk)
+		return -1;
+
+	if (!S_ISDIR(sbuf.st_mode))
+		return walk->file_func(path, &sbuf);
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0)
+			nthreads = 1;
+	}
+
+	memset(&sched, 0, sizeof(sched));
+	sched.nworkers = nthreads;
+	sched.workers = must_calloc(nthreads, sizeof(struct walk_worker));
+	pthread_mutex_init(&sched.lock, NULL);
+	pthread_cond_init(&sched.wake, NULL);
+	for (i = 0; i < nthreads; ++i) {
+		sched.workers[i].walk = *walk;
+		sched.workers[i].sched = &sched;
+	}
+
+	queue_dir(&sched.workers[0].walk, path, &sbuf);
+
+	/* We are worker 0 */
+	tids = must_calloc(nthreads, sizeof(pthread_t));
+	started = must_calloc(nthreads, sizeof(int));
+	for (i = 1; i < nthreads; ++i) {
+		started[i] = pthread_create(&tids[i], NULL, walk_worker, &sched.workers[i]) == 0;
+		if (!started[i])
+			error = 1; /* the other workers pick up the slack */
+	}
+
+	walk_worker(&sched.workers[0]);
+
+	for (i = 1; i < nthreads; ++i)
+		if (started[i])
+			pthread_join(tids[i], NULL);
+
+	for (i = 0; i < nthreads; ++i) {
+		error |= sched.workers[i].error;
+		_walkfiles_done(&sched.workers[i].walk);
+		free(sched.workers[i].dirs);
+	}
+
+	free(tids);
+	free(started);
+	free(sched.workers);
+	pthread_mutex_destroy(&sched.lock);
+	pthread_cond_destroy(&sched.wake);
+
+	return error;
+}
@@ -1,5 +1,7 @@
+#define _GNU_SOURCE /* for statx */
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
 #ifndef WIN32
 #include <dirent.h>
 #include <regex.h>
@@ -8,208 +10,1101 @@
 
 #include "samlib.h"
 
-struct ignore {
-	regex_t regex;
-	struct ignore *next;
-};
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+/* The ignores and filters are compiled the first time they are
+ * checked. Patterns that are really literals, like "*.o" or "\.o$",
+ * go in one of three tries: anchored at the start, anchored at the
+ * end (walked backwards), or unanchored. A check then costs about the
+ * length of the path no matter how many patterns there are. Anything
+ * else falls back to regexec() or fnmatch().
+ */
 
+/* \cond skip */
 struct filter {
 	char *pat;
+	int is_regex;
 	regex_t regex;
 	struct filter *next;
 };
 
+#define TRIE_PREFIX 0
+#define TRIE_SUFFIX 1
+#define TRIE_ANY    2
+
+#define MATCH_HERE 1 /* matches as soon as we get here */
+#define MATCH_END  2 /* matches if we get here at the end of the string */
+
+struct match_node {
+	int child;
+	int next;
+	unsigned char c;
+	unsigned char flags;
+};
+
+struct match_set {
+	struct filter *list;
+	int compiled;
+	int root[3][256]; /* first level of each trie */
+	int root_flags[3];
+	int nany;
+	struct match_node *nodes;
+	int nnodes, size;
+	struct filter **slow;
+	int nslow, slow_size;
+};
+
 static struct walkfile_struct global_walkfiles;
 
 #define walk_verbose (walk->flags & WALK_VERBOSE)
 
-#define walk_ignores							\
-	struct ignore *ignores;						\
-	if (walk)									\
-		ignores = walk->ignores;				\
-	else										\
-		ignores = global_walkfiles.ignores
+/* Only the add functions create a set: the checks must not allocate
+ * since walkfiles_mt() workers check from copies of the walk.
+ */
+static struct match_set *get_set(struct walkfile_struct *walk, int ignores, int create)
+{
+	void **set;
 
-#define walk_filters							\
-	struct filter *filters;						\
-	if (walk)									\
-		filters = walk->filters;				\
-	else										\
-		filters = global_walkfiles.filters
+	if (walk == NULL)
+		walk = &global_walkfiles;
+	set = ignores ? &walk->ignores : &walk->filters;
+	if (*set == NULL && create)
+		*set = must_calloc(1, sizeof(struct match_set));
+	return *set;
+}
 
-void add_ignore(struct walkfile_struct *walk, const char *str)
+static struct filter *new_filter(struct match_set *set, const char *pat, int is_regex)
 {
-	walk_ignores;
+	struct filter *f = must_calloc(1, sizeof(struct filter));
 
-	struct ignore *ignore = must_calloc(1, sizeof(struct ignore));
-
-	if (regcomp(&ignore->regex, str, REG_EXTENDED)) {
-		fprintf(stderr, "Invalid regex '%s'\n", str);
+	if (is_regex && regcomp(&f->regex, pat, REG_EXTENDED)) {
+		fprintf(stderr, "Invalid regex '%s'\n", pat);
 		exit(1);
 	}
 
-	ignore->next = ignores;
-	if (walk)
-		walk->ignores = ignore;
-	else
-		global_walkfiles.ignores = ignore;
+	f->pat = must_strdup(pat);
+	f->is_regex = is_regex;
+	f->next = set->list;
+	set->list = f;
+	set->compiled = 0;
+	return f;
 }
 
-int check_ignores(struct walkfile_struct *walk, const char *path)
+static int new_node(struct match_set *set, unsigned char c)
+{
+	if (set->nnodes >= set->size) {
+		set->size = set->size ? set->size * 2 : 64;
+		set->nodes = must_realloc(set->nodes, set->size * sizeof(struct match_node));
+	}
+	memset(&set->nodes[set->nnodes], 0, sizeof(struct match_node));
+	set->nodes[set->nnodes].c = c;
+	return set->nnodes++;
+}
+
+static void trie_add(struct match_set *set, int trie, const char *str, int len, int flags)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	int i, n, child, dir = 1;
+
+	if (len == 0) {
+		set->root_flags[trie] |= flags;
+		return;
+	}
+
+	if (trie == TRIE_SUFFIX) {
+		s += len - 1;
+		dir = -1;
+	} else if (trie == TRIE_ANY)
+		++set->nany;
+
+	n = set->root[trie][*s];
+	if (n == 0) {
+		n = new_node(set, *s);
+		set->root[trie][*s] = n;
+	}
+
+	for (i = 1; i < len; ++i) {
+		s += dir;
+		for (child = set->nodes[n].child; child; child = set->nodes[child].next)
+			if (set->nodes[child].c == *s)
+				break;
+		if (child == 0) {
+			child = new_node(set, *s);
+			set->nodes[child].next = set->nodes[n].child;
+			set->nodes[n].child = child;
+		}
+		n = child;
+	}
+
+	set->nodes[n].flags |= flags;
+}
+
+/* Returns the length of the literal or -1 if the extended regex is not
+ * a literal. The anchors are returned in start and end.
+ */
+static int regex_literal(const char *re, char *out, int *start, int *end)
+{
+	int len = 0;
+
+	*start = *end = 0;
+	if (*re == '^') {
+		*start = 1;
+		++re;
+	}
+
+	for (; *re; ++re)
+		if (*re == '\\') {
+			++re;
+			if (*re == 0 || !strchr("^.[]$()|*+?{}\\", *re))
+				return -1;
+			out[len++] = *re;
+		} else if (*re == '$' && *(re + 1) == 0)
+			*end = 1;
+		else if (strchr("^.[]$()|*+?{}", *re))
+			return -1;
+		else
+			out[len++] = *re;
+
+	return len;
+}
+
+/* Same as regex_literal() but for fnmatch() patterns with no flags. */
+static int glob_literal(const char *pat, char *out, int *start, int *end)
 {
-	walk_ignores;
-	if (!ignores) return 0;
+	int len = 0;
 
-	struct ignore *ignore;
+	*start = *end = 1;
+	if (*pat == '*') {
+		*start = 0;
+		++pat;
+	}
+
+	for (; *pat; ++pat)
+		if (*pat == '\\') {
+			++pat;
+			if (*pat == 0)
+				return -1;
+			out[len++] = *pat;
+		} else if (*pat == '*' && *(pat + 1) == 0)
+			*end = 0;
+		else if (strchr("*?[", *pat))
+			return -1;
+		else
+			out[len++] = *pat;
+
+	return len;
+}
+
+static void compile_set(struct match_set *set)
+{
+	struct filter *f;
+	int start, end, len;
+
+	set->nnodes = 1; /* node 0 means none */
+	set->nslow = set->nany = 0;
+	memset(set->root, 0, sizeof(set->root));
+	memset(set->root_flags, 0, sizeof(set->root_flags));
+
+	for (f = set->list; f; f = f->next) {
+		char lit[strlen(f->pat) + 1];
+
+		if (f->is_regex)
+			len = regex_literal(f->pat, lit, &start, &end);
+		else
+			len = glob_literal(f->pat, lit, &start, &end);
+
+		if (len < 0) {
+			if (set->nslow == set->slow_size) {
+				set->slow_size += 16;
+				set->slow = must_realloc(set->slow, set->slow_size * sizeof(struct filter *));
+			}
+			set->slow[set->nslow++] = f;
+		} else if (start && end)
+			trie_add(set, TRIE_PREFIX, lit, len, MATCH_END);
+		else if (start)
+			trie_add(set, TRIE_PREFIX, lit, len, MATCH_HERE);
+		else if (end)
+			trie_add(set, TRIE_SUFFIX, lit, len, MATCH_HERE);
+		else
+			trie_add(set, TRIE_ANY, lit, len, MATCH_HERE);
+	}
+
+	set->compiled = 1;
+}
+
+/* Walks len chars of s forwards (dir 1) or backwards (dir -1) */
+static int trie_walk(struct match_set *set, int trie, const unsigned char *s, int len, int dir)
+{
+	int n = set->root[trie][*s];
+
+	while (n) {
+		if (set->nodes[n].flags & MATCH_HERE)
+			return 1;
+		if (--len == 0)
+			return set->nodes[n].flags & MATCH_END;
+		s += dir;
+		for (n = set->nodes[n].child; n; n = set->nodes[n].next)
+			if (set->nodes[n].c == *s)
+				break;
+	}
+
+	return 0;
+}
+
+static int match_set(struct match_set *set, const char *str)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	int i, len = strlen(str);
 	regmatch_t pmatch[1];
-	for (ignore = ignores; ignore; ignore = ignore->next)
-		if (regexec(&ignore->regex, path, 1, pmatch, 0) == 0)
+
+	if (!set->compiled)
+		compile_set(set);
+
+	for (i = 0; i < 3; ++i)
+		if ((set->root_flags[i] & MATCH_HERE) ||
+			((set->root_flags[i] & MATCH_END) && len == 0))
+			return 1;
+
+	if (len) {
+		if (trie_walk(set, TRIE_PREFIX, s, len, 1))
+			return 1;
+		if (trie_walk(set, TRIE_SUFFIX, s + len - 1, len, -1))
+			return 1;
+		if (set->nany)
+			for (i = 0; i < len; ++i)
+				if (trie_walk(set, TRIE_ANY, s + i, len - i, 1))
+					return 1;
+	}
+
+	for (i = 0; i < set->nslow; ++i)
+		if (set->slow[i]->is_regex) {
+			if (regexec(&set->slow[i]->regex, str, 1, pmatch, 0) == 0)
+				return 1;
+		} else if (fnmatch(set->slow[i]->pat, str, 0) == 0)
 			return 1;
 
 	return 0;
 }
+/* \endcond */
+
+void add_ignore(struct walkfile_struct *walk, const char *str)
+{
+	new_filter(get_set(walk, 1, 1), str, 1);
+}
+
+int check_ignores(struct walkfile_struct *walk, const char *path)
+{
+	struct match_set *set = get_set(walk, 1, 0);
+
+	if (set == NULL || set->list == NULL)
+		return 0;
+
+	return match_set(set, path);
+}
 
 void add_filter(struct walkfile_struct *walk, const char *pat)
 {
+	struct match_set *set = get_set(walk, 0, 1);
 	struct filter *f;
-	walk_filters;
 
-	for (f = filters; f; f = f->next)
-		if (strcmp(f->pat, pat) == 0)
+	for (f = set->list; f; f = f->next)
+		if (!f->is_regex && strcmp(f->pat, pat) == 0)
 			return;
 
-	f = must_calloc(1, sizeof(struct filter));
-	f->pat = must_strdup(pat);
-
-	f->next = filters;
-	if (walk)
-		walk->filters = f;
-	else
-		global_walkfiles.filters = f;
+	new_filter(set, pat, 0);
 }
 
 void add_filter_re(struct walkfile_struct *walk, const char *regex)
 {
-	struct filter *f;
-	walk_filters;
+	new_filter(get_set(walk, 0, 1), regex, 1);
+}
 
-	f = must_calloc(1, sizeof(struct filter));
+int check_filters(struct walkfile_struct *walk, const char *fname)
+{
+	struct match_set *set = get_set(walk, 0, 0);
 
-	if (regcomp(&f->regex, regex, REG_EXTENDED)) {
-		fprintf(stderr, "Invalid regex '%s'\n", regex);
-		exit(1);
+	if (set == NULL || set->list == NULL)
+		return 1;
+
+	return match_set(set, fname);
+}
+
+/* \cond skip */
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#define DT_DIR 4
+#define DT_REG 8
+#endif
+#ifndef DTTOIF
+#define DTTOIF(type) ((type) << 12)
+#endif
+
+#ifdef __linux__
+/* Read the directory with large getdents64 batches. glibc readdir()
+ * only asks for 32k at a time.
+ */
+#define WALK_DIRBUF (64 * 1024)
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct walkdir {
+	int fd;
+	int pos, len;
+	char *buf;
+};
+
+/* fd is the directory if we already opened it, else -1 */
+static int walkdir_open(struct walkdir *d, const char *dname, int fd)
+{
+	d->fd = fd >= 0 ? fd : open(dname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (d->fd < 0)
+		return -1;
+	d->pos = d->len = 0;
+	d->buf = must_alloc(WALK_DIRBUF);
+	return 0;
+}
+
+static const char *walkdir_next(struct walkdir *d, unsigned char *type)
+{
+	struct linux_dirent64 *ent;
+
+	if (d->pos >= d->len) {
+		d->len = syscall(SYS_getdents64, d->fd, d->buf, WALK_DIRBUF);
+		if (d->len <= 0)
+			return NULL;
+		d->pos = 0;
 	}
 
-	f->next = filters;
-	if (walk)
-		walk->filters = f;
-	else
-		global_walkfiles.filters = f;
+	ent = (struct linux_dirent64 *)(d->buf + d->pos);
+	d->pos += ent->d_reclen;
+	*type = ent->d_type;
+	return ent->d_name;
 }
 
-int check_filters(struct walkfile_struct *walk, const char *fname)
+static void walkdir_close(struct walkdir *d)
 {
-	walk_filters;
-	if (!filters) return 1;
+	close(d->fd);
+	free(d->buf);
+}
+#else
+struct walkdir {
+	int fd;
+	DIR *dir;
+};
 
-	regmatch_t pmatch[1];
-	for (struct filter *f = filters; f; f = f->next)
-		if (f->pat) {
-			if (fnmatch(f->pat, fname, 0) == 0)
-				return 1;
-		} else {
-			if (regexec(&f->regex, fname, 1, pmatch, 0) == 0)
-				return 1;
+static int walkdir_open(struct walkdir *d, const char *dname, int fd)
+{
+	d->dir = opendir(dname);
+	if (!d->dir)
+		return -1;
+#ifdef WIN32
+	d->fd = -1;
+#else
+	d->fd = dirfd(d->dir);
+#endif
+	return 0;
+}
+
+static const char *walkdir_next(struct walkdir *d, unsigned char *type)
+{
+	struct dirent *ent = readdir(d->dir);
+	if (!ent)
+		return NULL;
+#if defined(WIN32) || !defined(_DIRENT_HAVE_D_TYPE) && !defined(DT_WHT)
+	*type = DT_UNKNOWN;
+#else
+	*type = ent->d_type;
+#endif
+	return ent->d_name;
+}
+
+static void walkdir_close(struct walkdir *d)
+{
+	closedir(d->dir);
+}
+#endif
+
+/* Stat relative to the directory so the kernel does not have to walk
+ * the full path for every entry.
+ */
+static inline int walkdir_stat(struct walkdir *d, const char *path, const char *name,
+							   struct stat *sbuf)
+{
+#ifdef WIN32
+	return lstat(path, sbuf);
+#else
+	return fstatat(d->fd, name, sbuf, AT_SYMLINK_NOFOLLOW);
+#endif
+}
+/* \endcond */
+
+/* The path is dname/name. We only copy dname once. */
+struct walkpath {
+	char *path;
+	int dlen, size;
+};
+
+static void walkpath_set(struct walkpath *wp, const char *name)
+{
+	int nlen = strlen(name);
+	if (wp->dlen + nlen >= wp->size) {
+		wp->size = wp->dlen + nlen + 256;
+		wp->path = must_realloc(wp->path, wp->size);
+	}
+	memcpy(wp->path + wp->dlen, name, nlen + 1);
+}
+
+/* Everything we can do before the stat. Returns -1 to skip the
+ * entry, 0 if sbuf is already filled in, or 1 if it needs a stat.
+ */
+static int walk_prestat(struct walkfile_struct *walk, struct walkpath *wp,
+						const char *name, unsigned char type,
+						struct stat *sbuf, int *filtered)
+{
+	if (*name == '.') {
+		if (walk->flags & WALK_DOTFILES) {
+			if (name[1] == 0 || strcmp(name, "..") == 0)
+				return -1;
+		} else
+			return -1;
+	}
+
+	walkpath_set(wp, name);
+
+	if (check_ignores(walk, wp->path)) {
+		if (walk_verbose) fprintf(stderr, "Ignoring: %s\n", wp->path);
+		return -1;
+	}
+
+	*filtered = 0;
+	if (type == DT_UNKNOWN ||
+		(type == DT_DIR && (walk->flags & WALK_XDEV)) ||
+		!(walk->flags & WALK_NO_STAT)) {
+		/* Don't bother with the stat if we are going to skip it */
+		if (type == DT_REG) {
+			if (!check_filters(walk, name)) {
+				if (walk_verbose)
+					fprintf(stderr, "Skipping %s\n", name);
+				return -1;
+			}
+			*filtered = 1;
+		}
+		if (type != DT_UNKNOWN && type != DT_DIR && type != DT_REG &&
+			(DTTOIF(type) & walk->flags & S_IFMT) != DTTOIF(type)) {
+			if (walk_verbose)
+				fprintf(stderr, "Special %s (0%o)\n", wp->path, DTTOIF(type));
+			return -1;
 		}
+		return 1;
+	}
 
+	/* WALK_NO_STAT: only the type is valid */
+	memset(sbuf, 0, sizeof(struct stat));
+	sbuf->st_mode = DTTOIF(type);
 	return 0;
 }
 
-static int do_dir(struct walkfile_struct *walk, const char *dname, struct stat *dbuf)
+/* Everything after the stat. wp->path must be set for this entry. */
+static int walk_entry(struct walkfile_struct *walk, struct walkpath *wp,
+					  const char *name, struct stat *sbuf, int filtered,
+					  struct stat *dbuf,
+					  int (*dir_func)(struct walkfile_struct *walk, const char *path, struct stat *sbuf))
 {
-	/* 2016/5/30 Largest path on zonker is 260 */
-	char path[1024];
-	int n, error = 0;
-	mode_t match;
+	char *path = wp->path;
+	mode_t match = sbuf->st_mode & S_IFMT;
+	int error = 0;
 
-	DIR *dir = opendir(dname);
-	if (!dir) {
-		perror(dname);
-		return 1;
+	if (walk->flags & WALK_ONE_DIR) {
+		if (match == S_IFDIR)
+			// treat directories as normal files
+			match = S_IFREG;
+	}
+	switch (match) {
+	case S_IFDIR:
+		if (!(walk->flags & WALK_NO_SUBDIRS)) {
+			if (walk->flags & WALK_XDEV)
+				if (dbuf->st_dev != sbuf->st_dev) {
+					if (walk_verbose)
+						fprintf(stderr, "Skipping dir %s\n", path);
+					break;
+				}
+			if (walk->flags & WALK_INCLUDE_DIRS)
+				error |= walk->file_func(path, sbuf);
+			error |= dir_func(walk, path, sbuf);
+		}
+		break;
+	default:
+		if ((match & walk->flags & S_IFMT) != match) {
+			if (walk_verbose)
+				fprintf(stderr, "Special %s (0%o)\n", path, match);
+			break;
+		}
+		/* fall thru */
+	case S_IFREG:
+		if (filtered || check_filters(walk, name))
+			error |= walk->file_func(path, sbuf);
+		else if (walk_verbose)
+			fprintf(stderr, "Skipping %s\n", name);
 	}
 
-	struct dirent *ent;
-	while ((ent = readdir(dir))) {
-		if (*ent->d_name == '.') {
-			if (walk->flags & WALK_DOTFILES) {
-				if (ent->d_name[1] == 0 || strcmp(ent->d_name, "..") == 0)
-					continue;
-			} else
-				continue;
+	return error;
+}
+
+#ifdef __linux__
+/* WALK_BATCH_STAT: the stats for a directory are submitted as a batch
+ * and the subdirectories we are about to walk are opened as a batch,
+ * the fds being handed down to _walkdir(). One io_uring is set up per
+ * walk and reused by every directory. Without a ring that can do
+ * statx and openat the stats are done one at a time as usual.
+ */
+#define WALK_BATCH_SIZE 64
+/* Not worth a batch for less than this many stats */
+#define WALK_BATCH_MIN 8
+/* Subdirectories opened ahead per directory, and for the whole walk */
+#define WALK_OPEN_BATCH 16
+#define WALK_OPEN_MAX 64
+
+#define WALK_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+#define WALK_OP_STAT	0
+#define WALK_OP_OPEN	1
+
+#define WALK_SLOT_PENDING	0
+#define WALK_SLOT_DONE		1
+#define WALK_SLOT_DIR		2
+
+struct walk_slot {
+	const char *name;
+	int filtered;
+	int state;
+	int res; /* -errno, or the fd for WALK_OP_OPEN */
+	struct statx stx;
+};
+
+#ifdef HAVE_IO_URING
+/* A minimal io_uring, just enough to batch statx and openat calls. We
+ * do not use liburing since it may not be installed.
+ */
+struct walk_ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_len, cq_len, sqes_len;
+};
+#endif
+
+#define WALK_BACKEND_NONE	0 /* not set up yet */
+#define WALK_BACKEND_RING	1
+#define WALK_BACKEND_SYNC	2 /* no batching */
+
+struct walk_batch {
+	int backend;
+#ifdef HAVE_IO_URING
+	struct walk_ring ring;
+	int submitted, broken;
+#endif
+
+	/* The current batch */
+	int op, dfd, n;
+	struct walk_slot *slots;
+
+	int dirfd;   /* pre-opened fd for the next _walkdir() */
+	int nopen;   /* pre-opened fds not walked yet */
+	int no_open; /* the dir_func does not walk right away */
+};
+
+#ifdef HAVE_IO_URING
+static void walk_ring_close(struct walk_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	close(ring->fd);
+}
+
+/* Returns 0 if the ring can do statx and openat. Kernels without
+ * IORING_REGISTER_PROBE are too old for either.
+ */
+static int walk_ring_probe(struct walk_ring *ring)
+{
+	int len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = must_calloc(1, len);
+	int rc = -1;
+
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+		probe->ops_len > IORING_OP_STATX && probe->ops_len > IORING_OP_OPENAT &&
+		(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED))
+		rc = 0;
+
+	free(probe);
+	return rc;
+}
+
+static int walk_ring_open(struct walk_ring *ring)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	memset(ring, 0, sizeof(*ring));
+
+	ring->fd = syscall(__NR_io_uring_setup, WALK_BATCH_SIZE, &p);
+	if (ring->fd < 0)
+		return -1;
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		goto failed;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ring->cq_ptr = ring->sq_ptr;
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			goto failed;
 		}
+	}
 
-		if (strcmp(dname, "/"))
-			n = strconcat(path, sizeof(path), dname, "/", ent->d_name, NULL);
-		else
-			n = strconcat(path, sizeof(path), "/", ent->d_name, NULL);
-		if (n >= sizeof(path)) {
-			fprintf(stderr, "PATH TRUNCATED: %s/%s\n", dname, ent->d_name);
-			error = 1;
-			continue;
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto failed;
+	}
+
+	ring->sq_head = ring->sq_ptr + p.sq_off.head;
+	ring->sq_tail = ring->sq_ptr + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ptr + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ptr + p.sq_off.array;
+	ring->cq_head = ring->cq_ptr + p.cq_off.head;
+	ring->cq_tail = ring->cq_ptr + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ptr + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ptr + p.cq_off.cqes;
+
+	/* statx and openat came in 5.6, rings before that fail them */
+	if (walk_ring_probe(ring))
+		goto failed;
+
+	return 0;
+
+failed:
+	walk_ring_close(ring);
+	return -1;
+}
+
+static void walk_ring_start(struct walk_batch *b)
+{
+	struct walk_ring *ring = &b->ring;
+	unsigned tail = *ring->sq_tail;
+	int i;
+
+	for (i = 0; i < b->n; ++i) {
+		unsigned idx = tail & *ring->sq_mask;
+		struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->fd = b->dfd;
+		sqe->addr = (unsigned long)b->slots[i].name;
+		if (b->op == WALK_OP_OPEN) {
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->open_flags = WALK_OPEN_FLAGS;
+		} else {
+			sqe->opcode = IORING_OP_STATX;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (unsigned long)&b->slots[i].stx;
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
 		}
+		sqe->user_data = i;
+		ring->sq_array[idx] = idx;
+		++tail;
+	}
+	__atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
 
-		if (check_ignores(walk, path)) {
-			if (walk_verbose) fprintf(stderr, "Ignoring: %s\n", path);
-			continue;
+	b->submitted = b->broken = 0;
+}
+
+/* If the ring breaks we wait for what was submitted and return NULL.
+ * The rest are left in WALK_SLOT_PENDING.
+ */
+static struct walk_slot *walk_ring_next(struct walk_batch *b, int completed)
+{
+	struct walk_ring *ring = &b->ring;
+	int rc;
+
+	while (1) {
+		unsigned head = *ring->cq_head;
+
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			struct walk_slot *slot = &b->slots[cqe->user_data];
+
+			slot->res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return slot;
 		}
 
-		struct stat sbuf;
-		if (lstat(path, &sbuf)) {
-			perror(path);
-			error = 1;
+		if (completed == b->n || (b->broken && completed == b->submitted))
+			return NULL;
+
+		rc = syscall(__NR_io_uring_enter, ring->fd, b->broken ? 0 : b->n - b->submitted, 1,
+					 IORING_ENTER_GETEVENTS, NULL, 0);
+		if (rc < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			if (b->broken)
+				return NULL;
+			b->broken = 1;
+		} else if (!b->broken)
+			b->submitted += rc;
+	}
+}
+#endif
+
+/* Returns 0 if we cannot batch */
+static int walk_batch_setup(struct walk_batch *b)
+{
+#ifdef HAVE_IO_URING
+	if (b->backend == WALK_BACKEND_NONE)
+		b->backend = walk_ring_open(&b->ring) == 0 ?
+			WALK_BACKEND_RING : WALK_BACKEND_SYNC;
+#else
+	b->backend = WALK_BACKEND_SYNC;
+#endif
+	return b->backend != WALK_BACKEND_SYNC;
+}
+
+/* Start op on all n slots. The slots must stay put until
+ * walk_batch_next() returns NULL.
+ */
+static void walk_batch_start(struct walk_batch *b, int op, int dfd,
+							 struct walk_slot *slots, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		slots[i].state = WALK_SLOT_PENDING;
+		slots[i].res = -EAGAIN;
+	}
+
+	b->op = op;
+	b->dfd = dfd;
+	b->slots = slots;
+	b->n = n;
+#ifdef HAVE_IO_URING
+	walk_ring_start(b);
+#endif
+}
+
+/* Returns the slots in the order they complete, then NULL. Slots
+ * still in WALK_SLOT_PENDING after that must be done synchronously.
+ */
+static struct walk_slot *walk_batch_next(struct walk_batch *b, int completed)
+{
+	struct walk_slot *slot = NULL;
+
+#ifdef HAVE_IO_URING
+	slot = walk_ring_next(b, completed);
+	if (!slot && b->broken) {
+		/* No batching for the rest of the walk */
+		walk_ring_close(&b->ring);
+		b->backend = WALK_BACKEND_SYNC;
+	}
+#endif
+
+	if (slot)
+		slot->state = WALK_SLOT_DONE;
+	return slot;
+}
+
+/* Called by _walkdir() to pick up the fd we opened for it, if any. */
+static int walk_dirfd(struct walkfile_struct *walk)
+{
+	struct walk_batch *b = walk->batch;
+	int fd;
+
+	if (!b || b->dirfd < 0)
+		return -1;
+	fd = b->dirfd;
+	b->dirfd = -1;
+	return fd;
+}
+
+/* Will walk_entry() descend into this directory? */
+static int walk_descend(struct walkfile_struct *walk, struct walk_slot *slot, struct stat *dbuf)
+{
+	if (walk->flags & WALK_NO_SUBDIRS)
+		return 0;
+	if ((walk->flags & WALK_XDEV) &&
+		dbuf->st_dev != makedev(slot->stx.stx_dev_major, slot->stx.stx_dev_minor))
+		return 0;
+	return 1;
+}
+
+static void statx_to_stat(struct statx *stx, struct stat *sbuf)
+{
+	memset(sbuf, 0, sizeof(struct stat));
+	sbuf->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	sbuf->st_ino = stx->stx_ino;
+	sbuf->st_mode = stx->stx_mode;
+	sbuf->st_nlink = stx->stx_nlink;
+	sbuf->st_uid = stx->stx_uid;
+	sbuf->st_gid = stx->stx_gid;
+	sbuf->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	sbuf->st_size = stx->stx_size;
+	sbuf->st_blksize = stx->stx_blksize;
+	sbuf->st_blocks = stx->stx_blocks;
+	sbuf->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	sbuf->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	sbuf->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	sbuf->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	sbuf->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	sbuf->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/* Walk the subdirectories found by a stat batch. The ones we will
+ * descend into are opened WALK_OPEN_BATCH at a time, and the fd
+ * handed to _walkdir() through b->dirfd. The batch is idle while we
+ * recurse so the deeper directories reuse it.
+ */
+static int walk_subdirs(struct walkfile_struct *walk, struct walk_batch *b,
+						struct walkdir *dir, struct walkpath *wp,
+						struct walk_slot *slots, int n, struct stat *dbuf,
+						int (*dir_func)(struct walkfile_struct *walk, const char *path, struct stat *sbuf))
+{
+	struct stat sbuf;
+	int i, j, m, ndirs = 0, error = 0;
+
+	/* Pack the dirs to descend at the front, in directory order */
+	for (i = 0; i < n; ++i) {
+		if (slots[i].state != WALK_SLOT_DIR)
+			continue;
+		if (walk_descend(walk, &slots[i], dbuf)) {
+			if (i != ndirs)
+				slots[ndirs] = slots[i];
+			++ndirs;
 			continue;
 		}
+		/* Let walk_entry() skip it */
+		walkpath_set(wp, slots[i].name);
+		statx_to_stat(&slots[i].stx, &sbuf);
+		error |= walk_entry(walk, wp, slots[i].name, &sbuf, slots[i].filtered,
+							dbuf, dir_func);
+	}
 
-		match = sbuf.st_mode & S_IFMT;
-		if (walk->flags & WALK_ONE_DIR) {
-			if (match == S_IFDIR)
-				// treat directories as normal files
-				match = S_IFREG;
+	for (i = 0; i < ndirs; i += m) {
+		m = ndirs - i;
+		if (m > WALK_OPEN_BATCH)
+			m = WALK_OPEN_BATCH;
+		if (m > WALK_OPEN_MAX - b->nopen)
+			m = WALK_OPEN_MAX - b->nopen;
+
+		if (m >= 2 && !b->no_open && walk_batch_setup(b)) {
+			walk_batch_start(b, WALK_OP_OPEN, dir->fd, slots + i, m);
+			for (j = 0; walk_batch_next(b, j); ++j)
+				;
+			b->nopen += m;
+		} else {
+			m = 1;
+			slots[i].res = -1;
 		}
-		switch (match) {
-		case S_IFDIR:
-			if (!(walk->flags & WALK_NO_SUBDIRS)) {
-				if (walk->flags & WALK_XDEV)
-					if (dbuf->st_dev != sbuf.st_dev) {
-						if (walk_verbose)
-							fprintf(stderr, "Skipping dir %s\n", path);
-						break;
-					}
-				if (walk->flags & WALK_INCLUDE_DIRS)
-					error |= walk->file_func(path, &sbuf);
-				error |= do_dir(walk, path, &sbuf);
+
+		for (j = i; j < i + m; ++j) {
+			b->dirfd = slots[j].res >= 0 ? slots[j].res : -1;
+
+			walkpath_set(wp, slots[j].name);
+			statx_to_stat(&slots[j].stx, &sbuf);
+			error |= walk_entry(walk, wp, slots[j].name, &sbuf, slots[j].filtered,
+								dbuf, dir_func);
+
+			if (b->dirfd >= 0) {
+				/* The dir_func did not walk it */
+				close(b->dirfd);
+				b->dirfd = -1;
+				b->no_open = 1;
 			}
-			break;
-		default:
-			if ((match & walk->flags & S_IFMT) != match) {
-				if (walk_verbose)
-					fprintf(stderr, "Special %s (0%o)\n", path, match);
-				break;
+		}
+		if (m > 1)
+			b->nopen -= m;
+	}
+
+	return error;
+}
+
+/* The names point into the getdents buffer so we must finish a batch
+ * before the buffer is refilled.
+ */
+static int walk_batched(struct walkfile_struct *walk, struct walkdir *dir,
+						struct walkpath *wp, struct stat *dbuf,
+						int (*dir_func)(struct walkfile_struct *walk, const char *path, struct stat *sbuf))
+{
+	struct walk_slot *slots = must_alloc(WALK_BATCH_SIZE * sizeof(struct walk_slot));
+	struct walk_slot *slot;
+	struct walk_batch *b = walk->batch;
+	int i, n, rc, ndirs, error = 0;
+	const char *name;
+	unsigned char type;
+	struct stat sbuf;
+
+	if (!b) {
+		b = walk->batch = must_calloc(1, sizeof(struct walk_batch));
+		b->dirfd = -1;
+	}
+
+	do {
+		n = 0;
+		while (n < WALK_BATCH_SIZE && (name = walkdir_next(dir, &type))) {
+			rc = walk_prestat(walk, wp, name, type, &sbuf, &slots[n].filtered);
+			if (rc == 0)
+				error |= walk_entry(walk, wp, name, &sbuf, 0, dbuf, dir_func);
+			else if (rc > 0)
+				slots[n++].name = name;
+			if (dir->pos >= dir->len)
+				break; /* end of this getdents buffer */
+		}
+
+		for (i = 0; i < n; ++i)
+			slots[i].state = WALK_SLOT_PENDING;
+
+		/* The files are passed to file_func() as the stats complete,
+		 * the directories after the batch.
+		 */
+		ndirs = 0;
+		if (n >= WALK_BATCH_MIN && walk_batch_setup(b)) {
+			walk_batch_start(b, WALK_OP_STAT, dir->fd, slots, n);
+			for (i = 0; (slot = walk_batch_next(b, i)); ++i) {
+				walkpath_set(wp, slot->name);
+				if (slot->res < 0) {
+					errno = -slot->res;
+					perror(wp->path);
+					error = 1;
+				} else if (S_ISDIR(slot->stx.stx_mode) && !(walk->flags & WALK_ONE_DIR)) {
+					slot->state = WALK_SLOT_DIR;
+					++ndirs;
+				} else {
+					statx_to_stat(&slot->stx, &sbuf);
+					error |= walk_entry(walk, wp, slot->name, &sbuf, slot->filtered,
+										dbuf, dir_func);
+				}
 			}
-			/* fall thru */
-		case S_IFREG:
-			if (check_filters(walk, ent->d_name))
-				error |= walk->file_func(path, &sbuf);
-			else if (walk_verbose)
-				fprintf(stderr, "Skipping %s\n", ent->d_name);
 		}
+
+		for (i = 0; i < n; ++i) {
+			if (slots[i].state != WALK_SLOT_PENDING)
+				continue;
+			walkpath_set(wp, slots[i].name);
+			if (walkdir_stat(dir, wp->path, slots[i].name, &sbuf)) {
+				perror(wp->path);
+				error = 1;
+			} else
+				error |= walk_entry(walk, wp, slots[i].name, &sbuf, slots[i].filtered,
+									dbuf, dir_func);
+		}
+
+		if (ndirs)
+			error |= walk_subdirs(walk, b, dir, wp, slots, n, dbuf, dir_func);
+	} while (dir->len > 0);
+
+	free(slots);
+
+	return error;
+}
+#else
+static inline int walk_dirfd(struct walkfile_struct *walk) { return -1; }
+#endif
+
+/* Walk one directory calling the file_func() for every file and
+ * dir_func() for every subdirectory that should be descended into.
+ */
+int _walkdir(struct walkfile_struct *walk, const char *dname, struct stat *dbuf,
+			 int (*dir_func)(struct walkfile_struct *walk, const char *path, struct stat *sbuf))
+{
+	struct walkdir dir;
+	struct walkpath wp;
+	const char *name;
+	unsigned char type;
+	int rc, filtered, error = 0;
+
+	if (walkdir_open(&dir, dname, walk_dirfd(walk))) {
+		perror(dname);
+		return 1;
+	}
+
+	wp.dlen = strlen(dname);
+	wp.size = wp.dlen + 256;
+	wp.path = must_alloc(wp.size);
+	memcpy(wp.path, dname, wp.dlen);
+	if (wp.dlen == 0 || wp.path[wp.dlen - 1] != '/')
+		wp.path[wp.dlen++] = '/';
+
+#ifdef __linux__
+	if (walk->flags & WALK_BATCH_STAT) {
+		error = walk_batched(walk, &dir, &wp, dbuf, dir_func);
+		goto done;
+	}
+#endif
+
+	while ((name = walkdir_next(&dir, &type))) {
+		struct stat sbuf;
+
+		rc = walk_prestat(walk, &wp, name, type, &sbuf, &filtered);
+		if (rc < 0)
+			continue;
+		if (rc > 0 && walkdir_stat(&dir, wp.path, name, &sbuf)) {
+			perror(wp.path);
+			error = 1;
+			continue;
+		}
+
+		error |= walk_entry(walk, &wp, name, &sbuf, filtered, dbuf, dir_func);
 	}
 
-	closedir(dir);
+#ifdef __linux__
+done:
+#endif
+	walkdir_close(&dir);
+	free(wp.path);
 
 	return error;
 }
 
+static int do_dir(struct walkfile_struct *walk, const char *dname, struct stat *dbuf)
+{
+	return _walkdir(walk, dname, dbuf, do_dir);
+}
+
 /* The default file_func. Mainly for debugging. */
 static int out_files(const char *path, struct stat *sbuf)
 {
@@ -217,17 +1112,17 @@ static int out_files(const char *path, struct stat *sbuf)
 	return 0;
 }
 
-/* Path can be a directory or a file.
- * Note: directories ignore .(dot) files!
+/* Common setup for walkfiles() and walkfiles_mt(). Returns the walk
+ * to use or NULL if path does not exist.
  */
-int walkfiles(struct walkfile_struct *walk, const char *path,
-			  int (*file_func)(const char *path, struct stat *sbuf),
-			  int flags)
+struct walkfile_struct *_walkfiles_init(struct walkfile_struct *walk, const char *path,
+										struct stat *sbuf,
+										int (*file_func)(const char *path, struct stat *sbuf),
+										int flags)
 {
-	struct stat sbuf;
-	if (lstat(path, &sbuf)) {
+	if (lstat(path, sbuf)) {
 		perror(path);
-		return -1;
+		return NULL;
 	}
 
 	if (walk == NULL)
@@ -239,11 +1134,59 @@ int walkfiles(struct walkfile_struct *walk, const char *path,
 		walk->file_func = out_files;
 
 	walk->flags |= flags; /* add in user flags */
+
+	/* Compile now so walkfiles_mt() workers can share them */
+	if (walk->ignores)
+		compile_set(walk->ignores);
+	if (walk->filters)
+		compile_set(walk->filters);
+
 	if (walk_verbose)
 		fprintf(stderr, "walk flags 0%o\n", walk->flags);
 
-	if (S_ISDIR(sbuf.st_mode))
-		return do_dir(walk, path, &sbuf);
-	else
+	return walk;
+}
+
+/* Release what the walk set up, like the WALK_BATCH_STAT ring.
+ * Called at the end of walkfiles() and by every
+ * walkfiles_mt() worker.
+ */
+void _walkfiles_done(struct walkfile_struct *walk)
+{
+#ifdef __linux__
+	struct walk_batch *b = walk->batch;
+
+	if (!b)
+		return;
+#ifdef HAVE_IO_URING
+	if (b->backend == WALK_BACKEND_RING)
+		walk_ring_close(&b->ring);
+#endif
+	if (b->dirfd >= 0)
+		close(b->dirfd);
+	free(b);
+	walk->batch = NULL;
+#endif
+}
+
+/* Path can be a directory or a file.
+ * Note: directories ignore .(dot) files!
+ */
+int walkfiles(struct walkfile_struct *walk, const char *path,
+			  int (*file_func)(const char *path, struct stat *sbuf),
+			  int flags)
+{
+	struct stat sbuf;
+	int rc;
+
+	walk = _walkfiles_init(walk, path, &sbuf, file_func, flags);
+	if (!walk)
+		return -1;
+
+	if (S_ISDIR(sbuf.st_mode)) {
+		rc = do_dir(walk, path, &sbuf);
+		_walkfiles_done(walk);
+		return rc;
+	} else
 		return walk->file_func(path, &sbuf);
 }
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "samlib.h"
+
+/* Incremental walkfiles. The stat info of every file (and directory)
+ * is kept in a samdb keyed by path. A walk compares each file to its
+ * record and only reports the differences. Every walk gets a new
+ * generation and each record visited is stamped with it. Records
+ * under the root left with an old generation were not seen, so they
+ * are reported as deleted and removed from the index.
+ */
+
+/* \cond skip */
+struct walkindex_rec {
+	uint64_t dev, ino, size;
+	uint64_t mtime, ctime; /* ns */
+	uint32_t mode;
+	uint32_t digest_len;
+	uint8_t digest[32];
+	uint64_t gen; /* last walk that saw it */
+};
+
+/* Records written before the gen was added */
+#define WALKINDEX_OLD_REC offsetof(struct walkindex_rec, gen)
+
+/* The generation is kept under the empty key, which no path can be */
+#define WALKINDEX_GEN_KEY ""
+
+/* Enough for the upper levels of a big tree */
+#define WALKINDEX_CACHESIZE (8 << 20)
+
+static struct walkindex_state {
+	void *dbh;
+	int flags;
+	int trusted; /* current directory is unchanged */
+	int (*change_func)(const char *path, struct stat *sbuf,
+					   const uint8_t *digest, int what);
+	const char *root;
+	int rlen;
+	uint64_t gen;
+	char **deleted;
+	int ndeleted, deleted_size;
+	int error;
+} wi;
+
+#ifdef __linux__
+#define ST_NSEC(ts) ((uint64_t)(ts).tv_sec * 1000000000ULL + (ts).tv_nsec)
+#define ST_MTIME(s) ST_NSEC((s)->st_mtim)
+#define ST_CTIME(s) ST_NSEC((s)->st_ctim)
+#else
+#define ST_MTIME(s) ((uint64_t)(s)->st_mtime * 1000000000ULL)
+#define ST_CTIME(s) ((uint64_t)(s)->st_ctime * 1000000000ULL)
+#endif
+
+static void rec_init(struct walkindex_rec *rec, struct stat *sbuf)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->dev = sbuf->st_dev;
+	rec->ino = sbuf->st_ino;
+	rec->size = sbuf->st_size;
+	rec->mtime = ST_MTIME(sbuf);
+	rec->ctime = ST_CTIME(sbuf);
+	rec->mode = sbuf->st_mode;
+}
+
+static int rec_same(struct walkindex_rec *a, struct walkindex_rec *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime == b->mtime && a->ctime == b->ctime && a->mode == b->mode;
+}
+
+/* Returns 1 if path has a record */
+static int rec_get(const char *path, struct walkindex_rec *rec)
+{
+	int len = db_get(wi.dbh, path, rec, sizeof(*rec));
+
+	if (len == WALKINDEX_OLD_REC)
+		rec->gen = 0;
+	else if (len != sizeof(*rec))
+		return 0;
+	return 1;
+}
+
+static int rec_put(const char *path, struct walkindex_rec *rec)
+{
+	rec->gen = wi.gen;
+	if (db_put(wi.dbh, path, rec, sizeof(*rec))) {
+		fprintf(stderr, "%s: unable to update index\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+/* A regular file needs hashing if the record has no digest or the
+ * other kind, e.g. WALKINDEX_MD5 was just added to an old index.
+ */
+static int need_digest(struct walkindex_rec *old)
+{
+	if (wi.flags & WALKINDEX_SHA256)
+		return old->digest_len != 32;
+	if (wi.flags & WALKINDEX_MD5)
+		return old->digest_len != MD5_DIGEST_LEN;
+	return 0;
+}
+
+/* One pass for either digest */
+static int rec_digest(struct walkindex_rec *rec, const char *path)
+{
+	char buf[64 * 1024];
+	sha256ctx sha;
+	md5ctx md5;
+	int fd, n;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (wi.flags & WALKINDEX_SHA256)
+		sha256_init(&sha);
+	else
+		md5_init(&md5);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		if (wi.flags & WALKINDEX_SHA256)
+			sha256_update(&sha, (uint8_t *)buf, n);
+		else
+			md5_update(&md5, buf, n);
+
+	close(fd);
+	if (n) {
+		errno = EIO;
+		return -1;
+	}
+
+	if (wi.flags & WALKINDEX_SHA256) {
+		sha256_final(&sha, rec->digest);
+		rec->digest_len = 32;
+	} else {
+		md5_final(&md5, rec->digest);
+		rec->digest_len = MD5_DIGEST_LEN;
+	}
+
+	return 0;
+}
+
+static int report(const char *path, struct stat *sbuf, struct walkindex_rec *rec, int what)
+{
+	if (!wi.change_func)
+		return 0;
+	return wi.change_func(path, sbuf, rec && rec->digest_len ? rec->digest : NULL, what);
+}
+
+static int index_file(const char *path, struct stat *sbuf)
+{
+	struct walkindex_rec rec, old;
+	struct stat fbuf;
+	int what, have_old;
+
+	have_old = rec_get(path, &old) && !S_ISDIR(old.mode);
+
+	if (wi.trusted && !S_ISDIR(sbuf->st_mode)) {
+		if (have_old && !need_digest(&old))
+			return rec_put(path, &old);
+		/* WALK_NO_STAT */
+		if (lstat(path, &fbuf)) {
+			perror(path);
+			return 1;
+		}
+		sbuf = &fbuf;
+	}
+
+	rec_init(&rec, sbuf);
+	if (!have_old)
+		what = WALKINDEX_ADDED;
+	else if (!rec_same(&rec, &old))
+		what = WALKINDEX_CHANGED;
+	else if (S_ISREG(sbuf->st_mode) && need_digest(&old))
+		/* Report it so change_func() sees the first digest */
+		what = WALKINDEX_CHANGED;
+	else
+		return rec_put(path, &old);
+
+	if ((wi.flags & (WALKINDEX_MD5 | WALKINDEX_SHA256)) && S_ISREG(sbuf->st_mode)) {
+		if (rec_digest(&rec, path)) {
+			perror(path);
+			return 1; /* leave the old record */
+		}
+		/* Only the metadata changed */
+		if (what == WALKINDEX_CHANGED && rec.digest_len == old.digest_len &&
+			memcmp(rec.digest, old.digest, rec.digest_len) == 0)
+			what = 0;
+	}
+
+	if (rec_put(path, &rec))
+		return 1;
+
+	return what ? report(path, sbuf, &rec, what) : 0;
+}
+
+static int index_dir(struct walkfile_struct *walk, const char *path, struct stat *sbuf)
+{
+	struct walkindex_rec rec, old;
+	struct stat dbuf;
+	int rc, have_old, saved_flags = walk->flags, saved_trusted = wi.trusted;
+
+	if (sbuf->st_ino == 0) { /* WALK_NO_STAT */
+		if (lstat(path, &dbuf)) {
+			perror(path);
+			return 1;
+		}
+		sbuf = &dbuf;
+	}
+
+	rec_init(&rec, sbuf);
+	have_old = rec_get(path, &old);
+	if (have_old && !S_ISDIR(old.mode))
+		/* A file became a directory */
+		report(path, NULL, NULL, WALKINDEX_DELETED);
+
+	/* If the directory has not changed then no entries were added,
+	 * deleted, or renamed. It does not tell us about files
+	 * modified in place.
+	 */
+	wi.trusted = (wi.flags & WALKINDEX_DIR_MTIME) && have_old && rec_same(&rec, &old);
+	if (wi.trusted)
+		walk->flags |= WALK_NO_STAT;
+	else
+		walk->flags &= ~WALK_NO_STAT;
+
+	rc = _walkdir(walk, path, sbuf, index_dir);
+
+	walk->flags = saved_flags;
+	wi.trusted = saved_trusted;
+
+	/* Only update after a good walk so a partial walk is not
+	 * trusted. There is no sweep after a bad walk, so the old gen
+	 * does not matter.
+	 */
+	if (rc == 0)
+		rc = rec_put(path, &rec);
+
+	return rc;
+}
+
+/* Is key the root of the walk or under it? */
+static int under_root(const char *key)
+{
+	if (strncmp(key, wi.root, wi.rlen))
+		return 0;
+	return key[wi.rlen] == 0 || key[wi.rlen] == '/' || wi.root[wi.rlen - 1] == '/';
+}
+
+/* Only the keys under the root are read. The deletes wait until the
+ * cursor is closed.
+ */
+static int index_sweep(void)
+{
+	struct walkindex_rec rec;
+	const void *key, *val;
+	void *cursor;
+	int i, rc, klen, len, is_rec;
+
+	if ((rc = db_cursor_open(wi.dbh, wi.root, wi.rlen, NULL, 0, DB_CURSOR_PREFIX, &cursor))) {
+		errno = rc;
+		perror("walkindex sweep");
+		return 1;
+	}
+
+	while ((rc = db_cursor_next(cursor, &key, &klen, &val, &len)) > 0) {
+		if (klen == 0 || ((const char *)key)[klen - 1] || !under_root(key))
+			continue;
+
+		/* val may not be aligned */
+		is_rec = len == sizeof(rec) || len == WALKINDEX_OLD_REC;
+		if (is_rec) {
+			memset(&rec, 0, sizeof(rec));
+			memcpy(&rec, val, len);
+			if (rec.gen == wi.gen)
+				continue;
+		}
+
+		if (wi.ndeleted == wi.deleted_size) {
+			wi.deleted_size += 1024;
+			wi.deleted = must_realloc(wi.deleted, wi.deleted_size * sizeof(char *));
+		}
+		wi.deleted[wi.ndeleted] = must_strdup(key);
+
+		if (is_rec && !S_ISDIR(rec.mode))
+			wi.error |= report(wi.deleted[wi.ndeleted], NULL, NULL, WALKINDEX_DELETED);
+		++wi.ndeleted;
+	}
+	db_cursor_close(cursor);
+	if (rc < 0) {
+		perror("walkindex sweep");
+		wi.error = 1;
+	}
+
+	for (i = 0; i < wi.ndeleted; ++i) {
+		db_del(wi.dbh, wi.deleted[i]);
+		free(wi.deleted[i]);
+	}
+
+	return wi.error;
+}
+
+/* Each walk gets the next generation. Returns db_put(). */
+static int index_gen(void)
+{
+	uint64_t gen;
+
+	if (db_get(wi.dbh, WALKINDEX_GEN_KEY, &gen, sizeof(gen)) != sizeof(gen))
+		gen = 0;
+	wi.gen = gen + 1;
+	return db_put(wi.dbh, WALKINDEX_GEN_KEY, &wi.gen, sizeof(wi.gen));
+}
+/* \endcond */
+
+/* Walk path, comparing every file against the index in dbname, and
+ * call change_func() for files that were added, changed, or
+ * deleted since the last walk. The index is created if it does not
+ * exist, in which case every file is added. The sbuf is NULL for
+ * deleted files. The digest is only set if WALKINDEX_MD5 or
+ * WALKINDEX_SHA256 is in flags. Adding a digest flag to an index built
+ * without it reports each unchanged file as changed once, so
+ * change_func() gets every digest.
+ *
+ * The flags are the walkfiles() flags plus the WALKINDEX_* flags.
+ * Returns 0 on success. Not reentrant.
+ */
+int walkindex(struct walkfile_struct *walk, const char *path, const char *dbname,
+			  int (*change_func)(const char *path, struct stat *sbuf,
+								 const uint8_t *digest, int what),
+			  int flags)
+{
+	struct walkfile_struct local;
+	struct db_info info;
+	struct stat sbuf;
+	int rc;
+
+	if (walk == NULL) {
+		memset(&local, 0, sizeof(local));
+		walk = &local;
+	}
+
+	memset(&wi, 0, sizeof(wi));
+	wi.flags = flags;
+	wi.change_func = change_func;
+	wi.root = path;
+	wi.rlen = strlen(path);
+
+	memset(&info, 0, sizeof(info));
+	info.cachesize = WALKINDEX_CACHESIZE;
+	rc = db_open_info(dbname, DB_CREATE, &info, &wi.dbh);
+	if (rc) {
+		errno = rc;
+		perror(dbname);
+		return -1;
+	}
+	if (index_gen()) {
+		perror(dbname);
+		db_close(wi.dbh);
+		return -1;
+	}
+
+	flags &= ~(WALKINDEX_MD5 | WALKINDEX_SHA256 | WALKINDEX_DIR_MTIME);
+	walk = _walkfiles_init(walk, path, &sbuf, index_file, flags);
+	if (!walk)
+		rc = -1;
+	else if (walk->flags & (WALK_INCLUDE_DIRS | WALK_ONE_DIR)) {
+		fprintf(stderr, "walkindex: directories are always indexed\n");
+		rc = -1;
+	}
+	else if (S_ISDIR(sbuf.st_mode))
+		rc = index_dir(walk, path, &sbuf);
+	else
+		rc = index_file(path, &sbuf);
+	if (walk)
+		_walkfiles_done(walk);
+
+	/* We can only trust the deletes if the walk was clean */
+	if (rc == 0)
+		rc = index_sweep();
+
+	free(wi.deleted);
+	db_close(wi.dbh);
+
+	return rc;
+}
@@ -61,6 +61,6 @@ uint64_t xorshift128plus_r(xorshift_seed_t *seed)
 uint64_t xorshift128plus(void)
 {
 	if (!seeded)
-		xorshift_seed(&global_seed);
+		xorshift_seed(NULL);
 	return xorshift128plus_r(&global_seed);
 }